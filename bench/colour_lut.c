@@ -0,0 +1,196 @@
+/* Time the colouring of true colour pixels from the lookup table sampled by
+ * initialiseColourScheme against the per-pixel conversion from HSV through
+ * the scheme functions that the table replaced
+ *
+ * Usage: bench/colour_lut [PIXELS [REPEATS]]
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "colour.h"
+
+
+/* Defaults - about as many pixels as a 2000x2000 image */
+#define PIXELS_DEFAULT 4000000
+#define REPEATS_DEFAULT 5
+
+/* Smoothed iteration counts are spread over this many, and one sample in this
+ * many is inside the set
+ */
+#define SAMPLE_RANGE 2000.0
+#define INSIDE_RATE 10
+
+
+typedef struct Samples
+{
+    double *n;
+    EscapeStatus *status;
+    RGB *pixels;
+    size_t count;
+} Samples;
+
+
+static int createSamples(Samples *samples, size_t count);
+static void freeSamples(Samples *samples);
+static double timePixels(Samples *samples, const ColourScheme *scheme, int table, unsigned int repeats);
+static unsigned int compareColours(const Samples *samples, const ColourScheme *scheme);
+static double getTime(void);
+
+
+int main(int argc, char **argv)
+{
+    size_t count = (argc > 1) ? strtoul(argv[1], NULL, 10) : PIXELS_DEFAULT;
+    unsigned int repeats = (argc > 2) ? (unsigned int) strtoul(argv[2], NULL, 10) : REPEATS_DEFAULT;
+
+    Samples samples;
+
+    if (count < 1 || repeats < 1)
+    {
+        fprintf(stderr, "Usage: %s [PIXELS [REPEATS]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (createSamples(&samples, count))
+    {
+        fprintf(stderr, "%s: Memory allocation failed\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%zu pixels, best of %u runs\n\n", count, repeats);
+    printf("%-16s %12s %12s %8s %10s\n", "Scheme", "HSV (ns/px)", "LUT (ns/px)", "Speedup", "Max diff");
+
+    for (ColourSchemeType type = COLOUR_SCHEME_TYPE_RAINBOW; type <= COLOUR_SCHEME_TYPE_MATRIX; ++type)
+    {
+        ColourScheme scheme;
+        char name[32];
+        double direct, table;
+
+        if (initialiseColourScheme(&scheme, type) || getColourString(name, type, sizeof(name)))
+            continue;
+
+        direct = timePixels(&samples, &scheme, 0, repeats);
+        table = timePixels(&samples, &scheme, 1, repeats);
+
+        printf("%-16s %12.2f %12.2f %7.2fx %10u\n", name, direct, table, direct / table,
+               compareColours(&samples, &scheme));
+    }
+
+    freeSamples(&samples);
+
+    return EXIT_SUCCESS;
+}
+
+
+/* Generate the same pseudo-random smoothed iteration counts on every run */
+static int createSamples(Samples *samples, size_t count)
+{
+    uint64_t state = 88172645463325252ULL;
+
+    samples->count = count;
+    samples->n = malloc(count * sizeof(*(samples->n)));
+    samples->status = malloc(count * sizeof(*(samples->status)));
+    samples->pixels = malloc(count * sizeof(*(samples->pixels)));
+
+    if (!samples->n || !samples->status || !samples->pixels)
+    {
+        freeSamples(samples);
+        return 1;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        /* xorshift64 */
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        samples->n[i] = SAMPLE_RANGE * (double) (state >> 11) / (double) (1ULL << 53);
+        samples->status[i] = (state % INSIDE_RATE) ? ESCAPED : UNESCAPED;
+    }
+
+    return 0;
+}
+
+
+static void freeSamples(Samples *samples)
+{
+    free(samples->n);
+    free(samples->status);
+    free(samples->pixels);
+}
+
+
+/* Colour every sample, either through the scheme function or from the table,
+ * and return the best time per pixel (ns)
+ */
+static double timePixels(Samples *samples, const ColourScheme *scheme, int table, unsigned int repeats)
+{
+    double best = 0.0;
+
+    for (unsigned int r = 0; r < repeats; ++r)
+    {
+        double start = getTime();
+        double elapsed;
+
+        if (table)
+        {
+            for (size_t i = 0; i < samples->count; ++i)
+                mapSmoothedColour(&(samples->pixels[i]), samples->n[i], samples->status[i], 0, scheme);
+        }
+        else
+        {
+            for (size_t i = 0; i < samples->count; ++i)
+                scheme->mapColour.trueColour(&(samples->pixels[i]), samples->n[i], samples->status[i]);
+        }
+
+        elapsed = getTime() - start;
+
+        if (r == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    return best * 1e9 / (double) samples->count;
+}
+
+
+/* Largest difference in any channel between the two ways of colouring */
+static unsigned int compareColours(const Samples *samples, const ColourScheme *scheme)
+{
+    unsigned int max = 0;
+
+    for (size_t i = 0; i < samples->count; ++i)
+    {
+        RGB direct, table;
+        int diff[3];
+
+        scheme->mapColour.trueColour(&direct, samples->n[i], samples->status[i]);
+        mapSmoothedColour(&table, samples->n[i], samples->status[i], 0, scheme);
+
+        diff[0] = abs(direct.r - table.r);
+        diff[1] = abs(direct.g - table.g);
+        diff[2] = abs(direct.b - table.b);
+
+        for (int c = 0; c < 3; ++c)
+        {
+            if ((unsigned int) diff[c] > max)
+                max = (unsigned int) diff[c];
+        }
+    }
+
+    return max;
+}
+
+
+/* Monotonic time (seconds) */
+static double getTime(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
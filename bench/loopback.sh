@@ -0,0 +1,104 @@
+#!/bin/sh
+#
+# Loopback benchmark of a master and its workers. A master and WORKERS workers
+# are started on 127.0.0.1, the master renders one image with them, and the
+# rows per second it collected are reported. Rows are cheap to calculate by
+# default, so the time goes on handing them out and taking them in rather
+# than on the workers. Run it on two builds to compare their masters, such as
+# the epoll master against the thread-per-worker master it replaced:
+#
+#     bench/loopback.sh -b ./mandelbrot -n 16
+#     bench/loopback.sh -b /path/to/old/mandelbrot -n 16
+#
+# Usage: bench/loopback.sh [-b BINARY] [-n WORKERS] [-p PORT] [-t THREADS] [-k RUNS] [-- PLOT OPTION...]
+#
+#   -b BINARY   Program to run as master and workers (default ./mandelbrot)
+#   -n WORKERS  Number of workers (default 8)
+#   -p PORT     Port the master listens on (default 7941)
+#   -t THREADS  Processing threads of each worker (default 1)
+#   -k RUNS     Report the best of RUNS renders (default 3)
+#
+# Options after -- are passed to the master as the plot to render (default
+# -r 4000 -s 4000 -i 8). The image is written as a PNM file and discarded.
+
+
+BINARY=./mandelbrot
+WORKERS=8
+PORT=7941
+THREADS=1
+RUNS=3
+
+while getopts b:n:p:t:k: opt
+do
+    case $opt in
+        b) BINARY=$OPTARG ;;
+        n) WORKERS=$OPTARG ;;
+        p) PORT=$OPTARG ;;
+        t) THREADS=$OPTARG ;;
+        k) RUNS=$OPTARG ;;
+        *) sed -n 's/^# Usage: /Usage: /p' "$0" >&2; exit 1 ;;
+    esac
+done
+
+shift $((OPTIND - 1))
+
+if [ $# -eq 0 ]
+then
+    set -- -r 4000 -s 4000 -i 8
+fi
+
+OUT=$(mktemp)
+trap 'rm -f "$OUT"' EXIT
+
+# Seconds since the epoch, to the nanosecond
+now()
+{
+    date +%s.%N
+}
+
+best=
+run=0
+
+while [ $run -lt "$RUNS" ]
+do
+    "$BINARY" -G "$WORKERS" -p "$PORT" "$@" -o "$OUT" -l 1 &
+    master=$!
+
+    # Give the master time to start listening before the clock starts
+    sleep 0.5
+
+    start=$(now)
+    i=0
+
+    while [ $i -lt "$WORKERS" ]
+    do
+        "$BINARY" -g 127.0.0.1 -p "$PORT" -T "$THREADS" -l 1 > /dev/null &
+        i=$((i + 1))
+    done
+
+    if ! wait $master
+    then
+        echo "Master failed" >&2
+        wait
+        exit 1
+    fi
+
+    end=$(now)
+    wait
+
+    # Image height, the third field of the PNM header
+    rows=$(head -c 32 "$OUT" | tr -s ' \t\n' '\n' | sed -n 3p)
+    elapsed=$(awk -v s="$start" -v e="$end" 'BEGIN { printf "%.3f", e - s }')
+
+    echo "Run $((run + 1)): $rows rows in $elapsed s"
+
+    if [ -z "$best" ] || awk -v a="$elapsed" -v b="$best" 'BEGIN { exit !(a < b) }'
+    then
+        best=$elapsed
+    fi
+
+    run=$((run + 1))
+done
+
+awk -v r="$rows" -v t="$best" -v n="$WORKERS" \
+    'BEGIN { printf "%d workers: %.0f rows/s (best %.3f s)\n", n, r / t, t }'
@@ -46,6 +46,14 @@ extern const uint16_t PORT_MAX;
 extern const int WORKERS_MIN;
 extern const int WORKERS_MAX;
 
+extern const unsigned int WORK_UNITS_MIN;
+
+extern const double SPECULATION_MIN;
+extern const double SPECULATION_MAX;
+
+extern const double TIMEOUT_MIN;
+extern const double TIMEOUT_MAX;
+
 #ifdef MP_PREC
 const mpfr_prec_t MP_BITS_DEFAULT;
 const mpfr_prec_t MP_BITS_MIN;
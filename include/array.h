@@ -22,7 +22,12 @@ typedef struct Block
     size_t rowSize;            /* Size of each row */
     size_t blockSize;          /* Size of full-size block */
     size_t remainderBlockSize; /* Size of remainder block */
+    unsigned int stride;       /* Pixel spacing of samples in the current pass */
+    bool refining;             /* Whether the samples of the preceding, coarser pass are already calculated */
+    bool *rowComplete;         /* Rows of the block that have been fully calculated */
+    char *map;                 /* Pixel data of a memory-mapped image (NULL if not mapped) */
     char *array;               /* Full-size block array */
+    size_t arrayLength;        /* Length of the anonymous mapping holding the array (0 if not mapped) */
 } Block;
 
 typedef struct Thread
@@ -30,6 +35,8 @@ typedef struct Thread
     pthread_t pid;
     unsigned int tid;
     unsigned int tCount;
+    size_t progress;           /* Work units completed in the current pass */
+    pthread_mutex_t lock;      /* Guards progress, which checkpoints read while the thread runs */
     Block *block;
 } Thread;
 
@@ -39,8 +46,18 @@ extern const unsigned int FREE_MEMORY_ALLOCATION;
 
 Block * createBlock(void);
 int initialiseBlock(Block *block, PlotCTX *p, size_t mem);
-int initialiseBlockAsRow(Block *block, PlotCTX *p);
+int initialiseBlocks(Block **blocks, unsigned int *n, PlotCTX *p, size_t mem);
+int initialiseBlockAsRows(Block *block, PlotCTX *p, size_t n, size_t mem);
+int initialiseBlockAsRowView(Block *block, PlotCTX *p, size_t n, size_t mem);
+void setBlockRows(Block *block, size_t first, size_t n);
 Thread * createThreads(Block *block, unsigned int n);
+unsigned int getThreadCount(void);
+
+void getRowSegments(size_t *segments, size_t *width, const Block *block, unsigned int tCount);
+size_t getCompletedRows(Block *block, Thread *threads);
+size_t findCompletedRows(bool *complete, const Block *block, Thread *threads);
+void resetProgress(Thread *threads);
+void advanceProgress(Thread *t);
 
 void freeBlock(Block *block);
 void freeThreads(Thread *threads);
@@ -0,0 +1,16 @@
+#ifndef CANCELLATION_H
+#define CANCELLATION_H
+
+
+#include <stdbool.h>
+
+
+extern const double DEADLINE_MIN;
+extern const double DEADLINE_MAX;
+
+
+int initialiseCancellation(double deadline);
+bool renderCancelled(void);
+
+
+#endif
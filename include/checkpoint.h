@@ -0,0 +1,59 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "array.h"
+#include "parameters.h"
+
+
+#define JOURNAL_FILEPATH_LEN_MAX (PLOT_FILEPATH_LEN_MAX + 8)
+
+
+/* Record of the image rows that have been written, kept beside the image */
+typedef struct Journal
+{
+    char filepath[JOURNAL_FILEPATH_LEN_MAX];
+    FILE *file;
+    const PlotCTX *parameters; /* Parameters of the image the journal belongs to */
+    uint64_t hash;             /* Hash of the plot parameters */
+    size_t height;             /* Number of rows in the image */
+    unsigned char *bitmap;     /* One bit per row, set once the row is in the image */
+    long bitmapOffset;         /* Offset of the bitmap in the journal file */
+    size_t dataOffset;         /* Offset of the pixel data in the image file */
+    time_t synced;             /* Time of the last sync */
+} Journal;
+
+/* Thread that records the rows of a block as they are completed, while the
+ * processing threads calculate it
+ */
+typedef struct Checkpointer
+{
+    pthread_t pid;
+    Journal *journal;
+    Thread *threads;           /* Processing threads calculating the block */
+    bool *complete;            /* Rows of the block found complete at the last checkpoint */
+    bool stop;                 /* Set once the threads have finished the block */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Checkpointer;
+
+
+Journal * openJournal(PlotCTX *p, bool resume);
+int restoreBlock(size_t *restored, Journal *journal, Block *block);
+void checkpointBlock(Journal *journal, const Block *block);
+bool checkpointDue(const Journal *journal);
+void checkpointRows(Journal *journal, const Block *block, const bool *complete);
+Checkpointer * startCheckpoints(Journal *journal, Thread *threads);
+void stopCheckpoints(Checkpointer *checkpointer);
+void closeJournal(Journal *journal, bool complete);
+
+
+#endif
@@ -11,6 +11,15 @@
 #endif
 
 
+/* Entries in the lookup table of a true colour scheme, over one period (a
+ * power of two)
+ */
+#define COLOUR_LUT_SIZE 4096
+
+/* Quantiles of the smoothed iteration count held for histogram colouring */
+#define COLOUR_HISTOGRAM_SIZE 129
+
+
 typedef enum EscapeStatus
 {
     UNESCAPED,
@@ -29,7 +38,8 @@ typedef enum ColourSchemeType
     COLOUR_SCHEME_TYPE_RED_WHITE,
     COLOUR_SCHEME_TYPE_FIRE,
     COLOUR_SCHEME_TYPE_RED_HOT,
-    COLOUR_SCHEME_TYPE_MATRIX
+    COLOUR_SCHEME_TYPE_MATRIX,
+    COLOUR_SCHEME_TYPE_RAW      /* Raw iteration data (not a user-selectable scheme) */
 } ColourSchemeType;
 
 typedef enum BitDepth
@@ -37,7 +47,9 @@ typedef enum BitDepth
     BIT_DEPTH_ASCII = 0,
     BIT_DEPTH_1 = 1,
     BIT_DEPTH_8 = 8,
-    BIT_DEPTH_24 = 24
+    BIT_DEPTH_16 = 16,
+    BIT_DEPTH_24 = 24,
+    BIT_DEPTH_RAW = 40
 } BitDepth;
 
 typedef struct ColourRGB
@@ -63,6 +75,18 @@ typedef struct ColourScheme
     ColourSchemeType scheme;
     BitDepth depth;
     ColourMapFunction mapColour;
+    double period;              /* Smoothed iteration count over which a true colour scheme repeats */
+    double lutScale;            /* Lookup table entries per unit of smoothed iteration count */
+    /* Colours over one period of a true colour scheme, the last repeating the first */
+    RGB lut[COLOUR_LUT_SIZE + 1];
+    RGB inside;                 /* Colour of the inside of the set */
+    RGB *palette;               /* Colour of each pixel value of an indexed image (NULL if not indexed) */
+    size_t paletteSize;
+    /* Smoothed iteration counts at evenly spaced quantiles of the plot, which
+     * spread its colours evenly over one period (NULL if not histogram-coloured)
+     */
+    double *histogram;
+    size_t histogramSize;
 } ColourScheme;
 
 
@@ -71,7 +95,12 @@ extern const ColourSchemeType COLOUR_SCHEME_MAX;
 
 
 int initialiseColourScheme(ColourScheme *scheme, ColourSchemeType colour);
+int initialisePalette(ColourScheme *scheme, unsigned int bits);
+void freePalette(ColourScheme *scheme);
+int initialiseHistogram(ColourScheme *scheme, double *samples, size_t n);
+void freeHistogram(ColourScheme *scheme);
 
+void mapSmoothedColour(void *pixel, double n, EscapeStatus status, int offset, const ColourScheme *scheme);
 void mapColour(void *pixel, unsigned long n, complex z, int offset, unsigned long max, const ColourScheme *scheme);
 void mapColourExt(void *pixel, unsigned long n, long double complex z, int offset, unsigned long max,
                   const ColourScheme *scheme);
@@ -80,6 +109,9 @@ void mapColourExt(void *pixel, unsigned long n, long double complex z, int offse
 void mapColourMP(void *pixel, unsigned long n, mpfr_t norm, int offset, unsigned long max, const ColourScheme *scheme);
 #endif
 
+void mapColourRun(char *pixels, const unsigned long *n, double *norm, size_t count, unsigned long max,
+                  const ColourScheme *scheme);
+
 int getColourString(char *dest, ColourSchemeType colour, size_t n);
 
 
@@ -8,8 +8,18 @@
 #include <time.h>
 
 #include <netinet/in.h>
+#include <pthread.h>
 
 #include "array.h"
+#include "checkpoint.h"
+#include "request_handler.h"
+
+
+/* Most work units a worker may have requested or allocated at once */
+#define WORK_UNITS_MAX 16
+
+/* Blocks the master hands out rows of at once */
+#define WINDOW_BLOCKS 2
 
 
 typedef enum LANStatus
@@ -19,26 +29,107 @@ typedef enum LANStatus
     LAN_WORKER
 } LANStatus;
 
+typedef enum ClientState
+{
+    CLIENT_HANDSHAKE,        /* Waiting for the worker's protocol version */
+    CLIENT_READY             /* Parameters sent; the worker requests and returns rows */
+} ClientState;
+
+typedef struct WorkUnit
+{
+    size_t first;            /* Image row number of the first row */
+    size_t count;            /* Number of rows */
+    uint32_t job;            /* Block the rows belong to */
+    struct timespec sent;    /* When the rows were allocated */
+    bool copy;               /* Copied from another worker's overdue unit */
+    bool copied;             /* An idle worker has been sent a copy */
+    bool stale;              /* Rows already in (or their block closed), so are discarded when they arrive */
+} WorkUnit;
+
+/* Sockets to workers are nonblocking, so each client keeps how far it has got
+ * through the frame being read and the frames queued for sending
+ */
 typedef struct Client
 {
-    int s;                   /* Local socket connected to client */
-    struct sockaddr_in addr; /* Address structure for client */
-    bool rowAllocated;       /* True if worker has been allocated row */
-    size_t row;              /* Row number allocated to the worker */
-    size_t n;                /* Receive buffer allocated size */
-    size_t read;             /* Bytes of data present in the buffer */
-    char *buffer;            /* Receive buffer */
+    int s;                          /* Local socket connected to client */
+    struct sockaddr_in addr;        /* Address structure for client */
+    ClientState state;              /* Stage of the connection */
+    unsigned char header[FRAME_HEADER_SIZE]; /* Header of the frame being read */
+    size_t headerBytes;             /* Bytes of the header read so far */
+    Frame frame;                    /* Frame being read, once its header is complete */
+    char *payload;                  /* Where the frame's payload is read to (NULL to discard it) */
+    size_t payloadBytes;            /* Bytes of the payload read so far */
+    size_t unit;                    /* Work unit of the row data being read */
+    unsigned char version[HANDSHAKE_SIZE]; /* Payload of the worker's handshake */
+    unsigned char *out;             /* Frames waiting to be sent */
+    size_t outSize;                 /* Send queue allocated size */
+    size_t outLength;               /* Bytes in the send queue */
+    size_t outSent;                 /* Bytes of the send queue already sent */
+    bool writing;                   /* Waiting for the socket to become writable */
+    uint32_t features;              /* Features used with the worker (FEATURE_*) */
+    uint64_t rowBytes;              /* Bytes of rows received from the worker */
+    uint64_t wireBytes;             /* Bytes of row data payloads they arrived in */
+    size_t requests;                /* Requests for rows not yet answered because none were left */
+    size_t capacity;                /* Most rows the worker takes at once */
+    WorkUnit units[WORK_UNITS_MAX]; /* Rows allocated to the worker, oldest first */
+    size_t unitCount;               /* Number of work units allocated */
+    struct timespec received;       /* When the worker last returned rows */
+    double rate;                    /* Measured rows calculated per second (0 until measured) */
+    size_t n;                       /* Receive buffer allocated size */
+    char *buffer;                   /* Receive buffer for packed rows (row data is read into its block) */
 } Client;
 
+/* Calculate rows [first, first + n) of the image to dest. Return non-zero if
+ * they were not all calculated
+ */
+typedef int (*RowRenderer)(void *arg, char *dest, size_t first, size_t n);
+
+/* The master's own threads, allocated work units by the listener as though
+ * they were a worker but without a socket between them
+ */
+typedef struct LocalWorker
+{
+    pthread_t pid;
+    int wake[2];                    /* Pipe written to when a work unit is calculated */
+    RowRenderer render;             /* Calculates the rows of a work unit */
+    void *arg;                      /* Argument to the renderer */
+    Client client;                  /* Work units and rate, kept as for a worker */
+    char *dest;                     /* Where the rows of the work unit go */
+    bool assigned;                  /* Whether a work unit is being calculated */
+    bool finished;                  /* Whether a calculated work unit is waiting to be collected */
+    int ret;                        /* Renderer's return for the finished work unit */
+    bool stop;                      /* Exit once no work unit is assigned */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} LocalWorker;
+
 typedef struct NetworkCTX
 {
     LANStatus mode;          /* Whether master, worker, or standalone */
     struct sockaddr_in addr; /* IP address connected to/listening on */
     int s;                   /* Connected socket */
+    int epoll;               /* Master's epoll instance watching the sockets (-1 if none) */
     int n;                   /* Number of workers */
+    int connected;           /* Number of workers connected */
     Client *workers;         /* Array of sockets connected to workers */
+    unsigned int units;      /* Work units a worker keeps requested from the master */
+    bool compress;           /* Whether rows are packed for sending (master: if the worker can) */
+    unsigned int localThreads; /* Threads the master calculates rows on itself (0 for none) */
+    LocalWorker *local;      /* The master's own threads, while they run */
+    double speculate;        /* Copy work units to idle workers once this many times overdue (0 never) */
+    size_t copies;           /* Work units copied to idle workers */
+    size_t copyWins;         /* Copies that came in before the work unit they copied */
+    double timeout;          /* Least seconds before an overdue work unit is requeued (0 never) */
 } NetworkCTX;
 
+/* Blocks of the image whose rows are being handed out */
+typedef struct Window Window;
+
+
+extern const unsigned int WORK_UNITS_DEFAULT;
+extern const double SPECULATION_DEFAULT;
+extern const double TIMEOUT_DEFAULT;
+
 
 NetworkCTX * createNetworkCTX(int n);
 int createClientReceiveBuffer(Client *client, size_t n);
@@ -52,7 +143,18 @@ int initialiseAsWorker(NetworkCTX *network, PlotCTX **p);
 
 int acceptConnection(NetworkCTX *network);
 
-int listener(NetworkCTX *network, const Block *block);
+Window * createWindow(const Block *block, Journal *journal);
+int openBlock(Window *window, Block *block);
+void closeBlock(NetworkCTX *network, Window *window);
+void freeWindow(Window *window);
+
+int listener(NetworkCTX *network, Window *window);
+
+int startLocalWorker(NetworkCTX *network, RowRenderer render, void *arg, size_t capacity);
+void stopLocalWorker(NetworkCTX *network);
+
+void logCompression(const Client *worker);
+void logSpeculation(const NetworkCTX *network);
 
 
 #endif
\ No newline at end of file
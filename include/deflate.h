@@ -0,0 +1,41 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Initial value of an Adler-32 checksum */
+#define ADLER32_INIT 1U
+
+
+typedef struct DeflateSymbol
+{
+    uint16_t litlen;           /* Literal byte, or match length if dist is non-zero */
+    uint16_t dist;             /* Match distance (0 for a literal) */
+} DeflateSymbol;
+
+typedef struct Deflater
+{
+    size_t *head;              /* Latest position (plus one) of each hash of three bytes */
+    size_t *prev;              /* Previous position (plus one) with the same hash, per window slot */
+    DeflateSymbol *symbols;    /* Symbols of the deflate block being built */
+    size_t symbolCount;
+    unsigned char *out;        /* Compressed output */
+    size_t length;             /* Bytes of compressed output */
+    size_t size;               /* Allocated size of the output */
+    uint64_t bits;             /* Bits not yet written to the output */
+    unsigned int bitCount;
+} Deflater;
+
+
+Deflater * createDeflater(void);
+int deflateSync(Deflater *d, const unsigned char *in, size_t n);
+void freeDeflater(Deflater *d);
+
+uint32_t adler32(uint32_t adler, const unsigned char *data, size_t n);
+uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t n2);
+
+
+#endif
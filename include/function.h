@@ -2,13 +2,10 @@
 #define FUNCTION_H
 
 
-void * generateFractalRow(void *threadInfo);
-void * generateFractalRowExt(void *threadInfo);
-void * generateFractalRowMP(void *threadInfo);
-
 void * generateFractal(void *threadInfo);
 void * generateFractalExt(void *threadInfo);
 void * generateFractalMP(void *threadInfo);
+void * recolourFractal(void *threadInfo);
 
 
 #endif
\ No newline at end of file
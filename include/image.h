@@ -15,12 +15,16 @@ extern const size_t MEMORY_MAX;
 extern const unsigned int THREAD_COUNT_MIN;
 extern const unsigned int THREAD_COUNT_MAX;
 
+extern const unsigned int HISTOGRAM_STRIDE;
 
-int initialiseImage(PlotCTX *p);
+
+int initialiseImage(PlotCTX *p, const ProgramCTX *ctx);
 int imageOutput(PlotCTX *p, ProgramCTX *ctx);
 int imageOutputMaster(PlotCTX *p, NetworkCTX *network, ProgramCTX *ctx);
 int imageRowOutput(PlotCTX *p, NetworkCTX *network, ProgramCTX *ctx);
 int closeImage(PlotCTX *p);
 
+int equaliseColours(PlotCTX *p, const ProgramCTX *ctx);
+
 
 #endif
\ No newline at end of file
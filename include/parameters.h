@@ -13,6 +13,9 @@
 
 #define PLOT_FILEPATH_LEN_MAX 4096
 #define PLOT_FILEPATH_DEFAULT "var/mandelbrot.pnm"
+#define PLOT_FILEPATH_DEFAULT_PNG "var/mandelbrot.png"
+#define PLOT_FILEPATH_DEFAULT_TIFF "var/mandelbrot.tif"
+#define PLOT_FILEPATH_DEFAULT_DZI "var/mandelbrot.dzi"
 
 
 typedef enum PlotType
@@ -26,9 +29,20 @@ typedef enum OutputType
 {
     OUTPUT_NONE,
     OUTPUT_PNM,
-    OUTPUT_TERMINAL
+    OUTPUT_TERMINAL,
+    OUTPUT_RAW,
+    OUTPUT_PNG,
+    OUTPUT_TIFF,
+    OUTPUT_DZI
 } OutputType;
 
+typedef enum TIFFCodec
+{
+    TIFF_CODEC_NONE,
+    TIFF_CODEC_PACKBITS,
+    TIFF_CODEC_DEFLATE
+} TIFFCodec;
+
 typedef struct PlotCTX
 {
     PrecisionMode precision;
@@ -38,6 +52,16 @@ typedef struct PlotCTX
     OutputType output;
     char plotFilepath[PLOT_FILEPATH_LEN_MAX];
     FILE *file;
+    char *map;                /* Memory-mapped image file (NULL if not mapped) */
+    size_t mapSize;           /* Size of the mapping */
+    size_t mapOffset;         /* Offset of the pixel data in the mapping */
+    char *source;             /* Memory-mapped raw iteration data being recoloured (NULL if calculating) */
+    size_t sourceSize;        /* Size of the source mapping */
+    size_t sourceOffset;      /* Offset of the pixel data in the source mapping */
+    struct PNGEncoder *png;   /* Encoder of a PNG image (NULL for other outputs) */
+    struct TIFFWriter *tiff;  /* Writer of a tiled TIFF image (NULL for other outputs) */
+    TIFFCodec tiffCodec;      /* Compression of each TIFF tile */
+    struct Pyramid *pyramid;  /* Writer of a Deep Zoom image pyramid (NULL for other outputs) */
     size_t width, height;
     ColourScheme colour;
 } PlotCTX;
@@ -0,0 +1,64 @@
+#ifndef PNG_H
+#define PNG_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <pthread.h>
+
+#include "colour.h"
+#include "deflate.h"
+
+
+#define PNG_EXTENSION ".png"
+
+
+struct PNGEncoder;
+
+/* A run of rows filtered and compressed by one thread */
+typedef struct PNGStrip
+{
+    pthread_t pid;
+    const struct PNGEncoder *png;
+    const unsigned char *rows;   /* First row of the strip */
+    const unsigned char *prior;  /* Row above the first row */
+    size_t n;                    /* Number of rows */
+    unsigned char *filtered;     /* Filter type byte and filtered row, for each row */
+    size_t filteredSize;
+    unsigned char *scratch;      /* One row for each filter type */
+    Deflater *deflater;
+    uint32_t adler;              /* Adler-32 of the filtered rows */
+    uint32_t *crc;               /* CRC-32 of each IDAT chunk of the compressed strip */
+    size_t crcCount;
+    int ret;
+} PNGStrip;
+
+typedef struct PNGEncoder
+{
+    FILE *file;
+    size_t width, height;
+    size_t rowSize;
+    size_t bpp;                  /* Bytes per complete pixel (rounded up to 1) */
+    bool adaptive;               /* Whether rows are filtered (palette indices are not) */
+    unsigned int stripCount;
+    PNGStrip *strips;
+    unsigned char *prior;        /* Last row written, or zeros before the first row */
+    uint32_t adler;              /* Adler-32 of every filtered row written so far */
+    size_t rows;                 /* Rows written so far */
+    bool failed;
+} PNGEncoder;
+
+
+PNGEncoder * createPNGEncoder(FILE *file, size_t width, size_t height, BitDepth depth, const RGB *palette,
+                              size_t paletteSize, unsigned int threads);
+int writePNGRows(PNGEncoder *png, const char *rows, size_t n);
+int finishPNG(PNGEncoder *png);
+void freePNGEncoder(PNGEncoder *png);
+
+size_t getPNGRowCost(size_t rowSize);
+
+
+#endif
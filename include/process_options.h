@@ -15,6 +15,7 @@ int validateOptions(int argc, char **argv);
 
 int processProgramOptions(ProgramCTX *ctx, NetworkCTX **network, int argc, char **argv);
 PlotCTX * processPlotOptions(int argc, char **argv);
+PlotCTX * processRecolourOptions(const char *filepath, int argc, char **argv);
 
 
 #endif
\ No newline at end of file
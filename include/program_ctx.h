@@ -9,6 +9,8 @@
 #define LOG_FILEPATH_LEN_MAX 4096
 #define LOG_FILEPATH_DEFAULT "var/mandelbrot.log"
 
+#define RECOLOUR_FILEPATH_LEN_MAX 4096
+
 
 typedef struct ProgramCTX
 {
@@ -16,6 +18,13 @@ typedef struct ProgramCTX
     bool logToFile;
     size_t mem;
     unsigned int threads;
+    double deadline;
+    bool progressive;
+    bool histogram;
+    bool mapOutput;
+    bool resume;
+    char recolourFilepath[RECOLOUR_FILEPATH_LEN_MAX];
+    bool recolour;
 } ProgramCTX;
 
 
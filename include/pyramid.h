@@ -0,0 +1,66 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <pthread.h>
+
+#include "colour.h"
+#include "parameters.h"
+
+
+#define DZI_EXTENSION ".dzi"
+
+/* Width and height of every full tile in pixels */
+#define DZI_TILE_SIZE 256
+
+
+/* One level of the pyramid, holding the rows of its current row of tiles */
+typedef struct PyramidLevel
+{
+    unsigned int level;
+    size_t width, height;
+    BitDepth depth;
+    size_t rowSize;
+    unsigned char *rows;         /* Rows of the current row of tiles */
+    size_t rowCount;             /* Rows held */
+    size_t rowsAdded;            /* Rows of the level received so far */
+} PyramidLevel;
+
+struct Pyramid;
+
+/* A thread that encodes its share of the tiles of a row of tiles */
+typedef struct PyramidThread
+{
+    pthread_t pid;
+    unsigned int tid;
+    struct Pyramid *pyramid;
+    unsigned char *tile;         /* Pixels of the tile being written */
+    int ret;
+} PyramidThread;
+
+typedef struct Pyramid
+{
+    FILE *file;                  /* Descriptor of the pyramid */
+    size_t width, height;
+    char *base;                  /* Image path without the .dzi extension */
+    unsigned int levelCount;
+    PyramidLevel *levels;        /* Levels by number, with the full image last */
+    unsigned int threadCount;
+    PyramidThread *threads;
+    const PyramidLevel *current; /* Level whose tiles are being written */
+    unsigned int active;         /* Threads writing its tiles */
+    bool failed;
+} Pyramid;
+
+
+Pyramid * createPyramid(FILE *file, const PlotCTX *p, unsigned int threads);
+int writePyramidRows(Pyramid *pyramid, const char *rows, size_t n);
+int finishPyramid(Pyramid *pyramid);
+void freePyramid(Pyramid *pyramid);
+
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef RAW_H
+#define RAW_H
+
+
+#include <limits.h>
+#include <stdio.h>
+
+#include "colour.h"
+#include "parameters.h"
+
+
+/* Size of each pixel of raw iteration data - a 32-bit smoothed iteration count
+ * followed by the escape flag
+ */
+#define RAW_PIXEL_SIZE (BIT_DEPTH_RAW / CHAR_BIT)
+
+
+int writeRawHeader(FILE *file, const PlotCTX *p);
+int openRawFile(PlotCTX *p, const char *filepath);
+
+void encodeRawPixel(char *pixel, double n, EscapeStatus status);
+void decodeRawPixel(double *n, EscapeStatus *status, const char *pixel);
+
+
+#endif
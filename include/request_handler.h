@@ -3,9 +3,11 @@
 
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include <sys/types.h>
 
+#include "colour.h"
 #include "ext_precision.h"
 #include "parameters.h"
 
@@ -16,18 +18,60 @@
 
 #define PARAMETERS_BUFFER_SIZE 4096
 
-#define NETWORK_BUFFER_SIZE 16
+/* Most bytes of a FRAME_PARAMETERS payload - precision, plot, and histogram */
+#define PARAMETERS_FRAME_SIZE (3 * PARAMETERS_BUFFER_SIZE)
 
+/* Version of the master/worker protocol, checked when a worker connects */
+#define PROTOCOL_VERSION 3
 
-extern const char *ROW_REQUEST;
-extern const char *ROW_RESPONSE;
-extern const char *ACK_RESPONSE;
-extern const char *ERR_RESPONSE;
+/* Bytes of a frame header on the wire */
+#define FRAME_HEADER_SIZE 32
+
+/* Bytes of a FRAME_HELLO payload - the protocol version and a feature mask */
+#define HANDSHAKE_SIZE 8
+
+/* Features a peer offers in its handshake. The master answers with those it
+ * uses with the worker
+ */
+#define FEATURE_PACKED_ROWS 0x1U
+
+/* Most rows, and bytes of rows, a worker accepts in one work unit */
+#define WORK_UNIT_ROWS_MAX 256
+#define WORK_UNIT_SIZE_MAX (16 * 1024 * 1024)
+
+
+/* Every message is a frame: a fixed-size header followed by `length` bytes of
+ * payload. The header is sent in network byte order
+ */
+typedef enum FrameType
+{
+    FRAME_HELLO = 1,  /* Protocol version handshake */
+    FRAME_PARAMETERS, /* Serialised precision, plot parameters, and histogram */
+    FRAME_REQUEST,    /* Worker asks for up to rowCount rows to calculate */
+    FRAME_ROWS,       /* Master allocates a range of rows */
+    FRAME_DATA,       /* Worker returns the pixels of a range of rows */
+    FRAME_PACKED,     /* Worker returns the pixels of a range of rows, packed */
+    FRAME_ERROR       /* Malformed or unexpected frame */
+} FrameType;
+
+typedef struct Frame
+{
+    FrameType type;
+    uint32_t job;      /* Block the rows belong to */
+    uint64_t firstRow; /* Image row number of the first row */
+    uint64_t rowCount;
+    uint64_t length;   /* Bytes of payload following the header */
+} Frame;
 
 
 ssize_t writeSocket(const void *src, int s, size_t n);
 ssize_t readSocket(void *dest, int s, size_t n);
 
+int sendFrame(int s, const Frame *frame, const void *payload);
+int readFrame(Frame *frame, int s);
+void packFrameHeader(unsigned char *dest, const Frame *frame);
+int unpackFrameHeader(Frame *frame, const unsigned char *src);
+
 #ifndef MP_PREC
 int serialisePrecision(char *dest, size_t n, PrecisionMode prec);
 #else
@@ -54,14 +98,21 @@ int deserialisePlotCTXExt(PlotCTX *p, char *src);
 int deserialisePlotCTXMP(PlotCTX *p, char *src);
 #endif
 
-int sendAcknowledgement(int s);
-int sendError(int s);
+int serialiseHistogram(char *dest, size_t n, const ColourScheme *scheme);
+int deserialiseHistogram(ColourScheme *scheme, char *src);
+
+int sendHandshake(int s, uint32_t features);
+int readHandshake(int s, uint32_t *features);
+void packHandshake(unsigned char *dest, uint32_t features);
+int unpackHandshake(uint32_t *features, const unsigned char *src);
 
 int readParameters(PlotCTX **p, int s);
-int sendParameters(int s, const PlotCTX *p);
+int serialiseParameters(char *dest, const PlotCTX *p);
 
-int requestRowNumber(size_t *n, int s, const PlotCTX *p);
-int sendRowData(int s, void *row, size_t n);
+int requestRows(int s, size_t max);
+int readAllocation(Frame *job, int s, const PlotCTX *p, size_t max);
+int sendRowData(int s, const Frame *job, const void *rows, size_t n);
+int sendPackedRowData(int s, const Frame *job, const void *packed, size_t n);
 
 
 #endif
\ No newline at end of file
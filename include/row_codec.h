@@ -0,0 +1,27 @@
+#ifndef ROW_CODEC_H
+#define ROW_CODEC_H
+
+
+#include <stddef.h>
+
+
+/* Packs rows of pixels for the wire: runs of identical pixels and repeats of
+ * earlier bytes become back-references, and everything else is copied as is
+ */
+typedef struct RowPacker
+{
+    size_t *head;              /* Latest position (plus one) of each hash of four bytes */
+    unsigned char *out;        /* Packed output */
+    size_t length;             /* Bytes of packed output */
+    size_t size;               /* Allocated size of the output */
+} RowPacker;
+
+
+RowPacker * createRowPacker(void);
+int packRows(RowPacker *packer, const unsigned char *in, size_t n, size_t pixelSize);
+void freeRowPacker(RowPacker *packer);
+
+int unpackRows(unsigned char *dest, size_t n, const unsigned char *src, size_t length);
+
+
+#endif
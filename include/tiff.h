@@ -0,0 +1,71 @@
+#ifndef TIFF_H
+#define TIFF_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <pthread.h>
+
+#include "deflate.h"
+#include "parameters.h"
+
+
+#define TIFF_EXTENSION ".tif"
+#define TIFF_EXTENSION_LONG ".tiff"
+
+/* Width and height of every tile in pixels (a multiple of 16, as TIFF requires) */
+#define TIFF_TILE_SIZE 256
+
+
+struct TIFFWriter;
+
+/* A thread that encodes and writes its share of the tiles of each block */
+typedef struct TIFFTileThread
+{
+    pthread_t pid;
+    unsigned int tid;
+    struct TIFFWriter *tiff;
+    unsigned char *tile;         /* Pixels of the tile being written */
+    unsigned char *packed;       /* PackBits-compressed tile */
+    Deflater *deflater;
+    int ret;
+} TIFFTileThread;
+
+typedef struct TIFFWriter
+{
+    int fd;
+    TIFFCodec codec;
+    size_t width, height;
+    unsigned int depth;          /* Bits per pixel */
+    const RGB *palette;          /* Colours of the pixel values of an indexed image (NULL if not indexed) */
+    size_t paletteSize;
+    size_t rowSize;
+    size_t tileRowSize;          /* Bytes in one row of a tile */
+    size_t tileBytes;            /* Bytes in an uncompressed tile */
+    size_t tilesAcross, tilesDown;
+    uint64_t *offsets;           /* File offset of each tile (0 until written) */
+    uint64_t *byteCounts;        /* Stored size of each tile */
+    uint64_t end;                /* End of the file written so far */
+    pthread_mutex_t lock;        /* Guards end while compressed tiles claim space */
+    unsigned int threadCount;
+    TIFFTileThread *threads;
+    const unsigned char *rows;   /* Rows being written, starting on a row of tiles */
+    size_t firstRow;             /* Image row of the first of those rows */
+    size_t rowCount;
+    unsigned int active;         /* Threads writing the current rows */
+    bool failed;
+} TIFFWriter;
+
+
+TIFFWriter * createTIFFWriter(FILE *file, const PlotCTX *p, unsigned int threads);
+int writeTIFFTiles(TIFFWriter *tiff, const char *rows, size_t firstRow, size_t n);
+int finishTIFF(TIFFWriter *tiff);
+void freeTIFFWriter(TIFFWriter *tiff);
+
+int getTIFFCodec(TIFFCodec *codec, const char *name);
+
+
+#endif
@@ -60,7 +60,18 @@ const uint16_t PORT_MIN = 1024;
 const uint16_t PORT_MAX = 65534;
 
 const int WORKERS_MIN = 1;
-const int WORKERS_MAX = 32;
+const int WORKERS_MAX = 4096;
+
+/* The most is WORK_UNITS_MAX */
+const unsigned int WORK_UNITS_MIN = 1;
+
+/* Times overdue a work unit must be before it is copied (0 never copies) */
+const double SPECULATION_MIN = 0.0;
+const double SPECULATION_MAX = 1000.0;
+
+/* Least seconds before an overdue work unit is requeued (0 never requeues) */
+const double TIMEOUT_MIN = 0.0;
+const double TIMEOUT_MAX = 86400.0;
 
 #ifdef MP_PREC
 /* Range of permissible precisions (multiple-precision) */
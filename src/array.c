@@ -1,8 +1,16 @@
+/* Anonymous and huge-page mappings are outside of POSIX.1-2008 */
+#define _DEFAULT_SOURCE
+
+
 #include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "libgroot/include/log.h"
@@ -10,16 +18,29 @@
 #include "array.h"
 
 #include "parameters.h"
+#include "png.h"
+#include "tiff.h"
 
 
-/* Percentage of free physical memory that can be allocated by the program */
+/* Percentage of available physical memory that can be allocated by the program */
 const unsigned int FREE_MEMORY_ALLOCATION = 80;
 
+/* Where Linux reports available memory and the default huge page size */
+static const char *MEMINFO_PATH = "/proc/meminfo";
 
-static int allocateImageBlock(Block *block, size_t mem);
+
+static int setUpBlock(Block *block, PlotCTX *p);
+static int setUpRows(Block *block, PlotCTX *p, size_t n, size_t mem);
+static int allocateBlock(Block *block, size_t budget);
+static int allocateImageBlock(Block *block, size_t budget);
+static size_t getMemoryBudget(size_t mem);
+static int planImageBlocks(Block *block, size_t budget);
+static bool holdsBlock(const Block *block, size_t budget);
+static size_t getRowCost(const Block *block);
+static char * allocateArray(size_t *length, size_t size, size_t budget);
 
 static size_t getFreeMemory(void);
-static unsigned int getThreadCount(void);
+static size_t readMemInfo(const char *field);
 
 
 /* Create array metadata structure */
@@ -28,7 +49,12 @@ Block * createBlock(void)
     Block *block = malloc(sizeof(Block));
 
     if (block)
+    {
+        block->rowComplete = NULL;
+        block->map = NULL;
         block->array = NULL;
+        block->arrayLength = 0;
+    }
     
     return block;
 }
@@ -36,54 +62,167 @@ Block * createBlock(void)
 
 int initialiseBlock(Block *block, PlotCTX *p, size_t mem)
 {
-    if (!block || !p)
+    unsigned int n = 1;
+
+    return initialiseBlocks(&block, &n, p, mem);
+}
+
+
+/* Initialise up to n blocks that are held in memory at once, each with an
+ * equal share of the memory budget. Fewer are initialised if a share would not
+ * hold the smallest block the image divides into, and n is set to how many
+ */
+int initialiseBlocks(Block **blocks, unsigned int *n, PlotCTX *p, size_t mem)
+{
+    size_t budget;
+
+    if (!blocks || !n || !p || *n < 1)
+        return 1;
+
+    budget = getMemoryBudget(mem);
+
+    if (!budget)
+        return 1;
+
+    for (unsigned int k = 0; k < *n; ++k)
+    {
+        if (setUpBlock(blocks[k], p))
+            return 1;
+    }
+
+    while (*n > 1 && !holdsBlock(blocks[0], budget / *n))
+        --(*n);
+
+    for (unsigned int k = 0; k < *n; ++k)
+    {
+        if (allocateBlock(blocks[k], budget / *n))
+            return 1;
+    }
+
+    return 0;
+}
+
+
+static int setUpBlock(Block *block, PlotCTX *p)
+{
+    if (!block)
         return 1;
 
     block->id = 0;
     block->parameters = p;
     block->remainder = false;
+    block->stride = 1;
+    block->refining = false;
+
+    /* Blocks of a memory-mapped image are calculated in place */
+    block->map = (p->map) ? p->map + p->mapOffset : NULL;
 
     block->memSize = (block->parameters->colour.depth <= CHAR_BIT || block->parameters->colour.depth == BIT_DEPTH_ASCII)
                      ? sizeof(char)
                      : block->parameters->colour.depth / CHAR_BIT;
 
+    /* Rows of 1-bit pixels are padded to a whole byte */
     block->rowSize = (block->parameters->colour.depth == BIT_DEPTH_ASCII)
                      ? block->parameters->width
-                     : (block->parameters->width * block->parameters->colour.depth) / CHAR_BIT;
+                     : (block->parameters->width * block->parameters->colour.depth + CHAR_BIT - 1) / CHAR_BIT;
+
+    return 0;
+}
 
+
+static int allocateBlock(Block *block, size_t budget)
+{
     /* Allocate memory to the block */
-    if (allocateImageBlock(block, mem))
+    if (allocateImageBlock(block, budget))
         return 1;
 
+    /* The remainder block is never larger than a regular block */
+    block->rowComplete = malloc(block->rows * sizeof(*(block->rowComplete)));
+
+    if (!block->rowComplete)
+    {
+        logMessage(ERROR, "Memory allocation failed");
+        return 1;
+    }
+
     return 0;
 }
 
 
-int initialiseBlockAsRow(Block *block, PlotCTX *p)
+/* A worker's block is a run of up to n consecutive rows from anywhere in the
+ * image, limited to mem bytes but at least one row. Its full-size block is a
+ * single row, so the block ID is the image row number of the first row of the
+ * run, and the run itself is the remainder
+ */
+int initialiseBlockAsRows(Block *block, PlotCTX *p, size_t n, size_t mem)
 {
-    if (!block || !p)
+    if (setUpRows(block, p, n, mem))
+        return 1;
+
+    block->array = malloc(block->remainderBlockSize);
+
+    return (block->array) ? 0 : 1;
+}
+
+
+/* Set up a block of rows as initialiseBlockAsRows() does, but without an array
+ * of its own. Its array is pointed at the rows of another block to calculate
+ * them in place, and must be cleared before the block is freed
+ */
+int initialiseBlockAsRowView(Block *block, PlotCTX *p, size_t n, size_t mem)
+{
+    return setUpRows(block, p, n, mem);
+}
+
+
+/* Fill in the metadata of a block of rows, and its completion flags */
+static int setUpRows(Block *block, PlotCTX *p, size_t n, size_t mem)
+{
+    if (!block || !p || n < 1)
         return 1;
 
     block->id = 0;
     block->parameters = p;
     block->rows = 1;
-    block->remainderRows = 0;
-    block->remainder = false;
+    block->remainder = true;
+    block->stride = 1;
+    block->refining = false;
+    block->map = NULL;
+    block->arrayLength = 0;
 
     block->memSize = (block->parameters->colour.depth <= CHAR_BIT || block->parameters->colour.depth == BIT_DEPTH_ASCII)
                      ? sizeof(char)
                      : block->parameters->colour.depth / CHAR_BIT;
 
+    /* Rows of 1-bit pixels are padded to a whole byte */
     block->rowSize = (block->parameters->colour.depth == BIT_DEPTH_ASCII)
                      ? block->parameters->width
-                     : (block->parameters->width * block->parameters->colour.depth) / CHAR_BIT;
+                     : (block->parameters->width * block->parameters->colour.depth + CHAR_BIT - 1) / CHAR_BIT;
+
+    if (n > mem / block->rowSize)
+        n = (mem < block->rowSize) ? 1 : mem / block->rowSize;
 
+    block->remainderRows = n;
     block->blockSize = block->rowSize;
-    block->remainderBlockSize = 0;
+    block->remainderBlockSize = n * block->rowSize;
 
-    block->array = malloc(block->blockSize);
+    /* The rows are always calculated in full */
+    block->rowComplete = calloc(n, sizeof(*(block->rowComplete)));
 
-    return (block->array) ? 0 : 1;
+    return (block->rowComplete) ? 0 : 1;
+}
+
+
+/* Move a block made by initialiseBlockAsRows() to the n rows from row first.
+ * n must not exceed the number of rows it was made for
+ */
+void setBlockRows(Block *block, size_t first, size_t n)
+{
+    block->id = first;
+    block->remainderRows = n;
+    block->remainderBlockSize = n * block->rowSize;
+
+    memset(block->rowComplete, false, n * sizeof(*(block->rowComplete)));
 }
 
 
@@ -119,7 +258,19 @@ Thread * createThreads(Block *block, unsigned int n)
         /* Consecutive IDs allow threads to work on different array rows */
         threads[i].tid = i;
         threads[i].tCount = n;
+        threads[i].progress = 0;
         threads[i].block = block;
+
+        if (pthread_mutex_init(&(threads[i].lock), NULL))
+        {
+            logMessage(ERROR, "Could not initialise thread lock");
+
+            while (i-- > 0)
+                pthread_mutex_destroy(&(threads[i].lock));
+
+            free(threads);
+            return NULL;
+        }
     }
 
     logMessage(DEBUG, "Thread array generated");
@@ -128,14 +279,135 @@ Thread * createThreads(Block *block, unsigned int n)
 }
 
 
+/* Divide each row of the block into contiguous column segments, which are the
+ * work units handed to threads. Threads take whole rows when there are enough
+ * of them; otherwise every row is split so that each thread still receives
+ * work. Segments start on a sample of the current pass and are byte-aligned so
+ * that no two threads ever write to the same byte of a 1-bit image
+ */
+void getRowSegments(size_t *segments, size_t *width, const Block *block, unsigned int tCount)
+{
+    size_t rows = (block->remainder) ? block->remainderRows : block->rows;
+    size_t columns = block->parameters->width;
+
+    /* Refining passes skip every other sample of alternate rows, so segments
+     * must start on an even sample
+     */
+    size_t align = (block->refining) ? 2 * block->stride : block->stride;
+
+    if (block->parameters->colour.depth == BIT_DEPTH_1 && align < CHAR_BIT)
+        align = CHAR_BIT;
+
+    /* Each work unit covers `stride` rows of the block */
+    rows = (rows + block->stride - 1) / block->stride;
+
+    *segments = (rows >= tCount || rows == 0) ? 1 : (tCount + rows - 1) / rows;
+
+    if (*segments > columns)
+        *segments = columns;
+
+    *width = (columns + *segments - 1) / *segments;
+
+    if (*width % align != 0)
+        *width += align - (*width % align);
+
+    /* Rounding up the width may have made trailing segments redundant */
+    *segments = (columns + *width - 1) / *width;
+}
+
+
+/* Mark the rows whose every work unit was finished in the last full pass and
+ * return how many there are
+ */
+size_t getCompletedRows(Block *block, Thread *threads)
+{
+    return findCompletedRows(block->rowComplete, block, threads);
+}
+
+
+/* Flag the rows whose every work unit has been finished in the current full
+ * pass and return how many there are. The block is left alone, so this can be
+ * called while the threads are still running
+ */
+size_t findCompletedRows(bool *complete, const Block *block, Thread *threads)
+{
+    size_t rows = (block->remainder) ? block->remainderRows : block->rows;
+    unsigned int tCount = threads->tCount;
+
+    size_t segments, width;
+    size_t completed = 0;
+
+    getRowSegments(&segments, &width, block, tCount);
+
+    for (size_t y = 0; y < rows; ++y)
+    {
+        bool done = true;
+
+        /* Rows restored from a checkpoint were not recalculated. Threads work
+         * through units in order, so unit i is done if its thread has got past
+         * it
+         */
+        for (size_t i = y * segments; i < (y + 1) * segments && done && !block->rowComplete[y]; ++i)
+        {
+            Thread *t = &(threads[i % tCount]);
+
+            pthread_mutex_lock(&(t->lock));
+            done = t->progress > i / tCount;
+            pthread_mutex_unlock(&(t->lock));
+        }
+
+        complete[y] = done;
+
+        if (done)
+            ++completed;
+    }
+
+    return completed;
+}
+
+
+/* Start a pass with no work units completed */
+void resetProgress(Thread *threads)
+{
+    for (unsigned int i = 0; i < threads->tCount; ++i)
+    {
+        pthread_mutex_lock(&(threads[i].lock));
+        threads[i].progress = 0;
+        pthread_mutex_unlock(&(threads[i].lock));
+    }
+}
+
+
+/* Count a work unit as finished. Its pixels are in the block before anyone
+ * reading the progress under the lock sees it
+ */
+void advanceProgress(Thread *t)
+{
+    pthread_mutex_lock(&(t->lock));
+    ++(t->progress);
+    pthread_mutex_unlock(&(t->lock));
+}
+
+
 /* Free Block object */
 void freeBlock(Block *block)
 {
     if (block)
     {
-        if (block->array)
+        if (block->rowComplete)
         {
-            free(block->array);
+            free(block->rowComplete);
+            block->rowComplete = NULL;
+        }
+
+        /* Mapped blocks point into the image file */
+        if (block->array && !block->map)
+        {
+            if (block->arrayLength)
+                munmap(block->array, block->arrayLength);
+            else
+                free(block->array);
+
             block->array = NULL;
         }
 
@@ -150,108 +422,249 @@ void freeThreads(Thread *threads)
 {
     if (threads)
     {
+        for (unsigned int i = 0; i < threads->tCount; ++i)
+            pthread_mutex_destroy(&(threads[i].lock));
+
         free(threads);
         logMessage(DEBUG, "Thread array freed");
     }
 }
 
 
-/* To prevent memory overcommitment, the array must be divided into blocks */
-static int allocateImageBlock(Block *block, size_t mem)
+/* Get number of online processors on the system (hence number of threads to
+ * use)
+ */
+unsigned int getThreadCount(void)
 {
-    /* Maximum number of blocks the array should be divided into */
-    const unsigned int BLOCK_COUNT_MAX = 64;
+    long procs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (procs < 1)
+    {
+        procs = 1;
+        logMessage(WARNING, "Could not get number of online processors - limiting to %ld thread(s)", procs);
+    }
+    else if (procs > UINT_MAX)
+    {
+        procs = UINT_MAX;
+    }
+
+    return (unsigned int) procs;
+}
+
+
+/* To prevent memory overcommitment, the array is divided into blocks that
+ * each fit in the memory budget
+ */
+static int allocateImageBlock(Block *block, size_t budget)
+{
+    if (planImageBlocks(block, budget))
+        return 1;
+
+    /* A mapped image needs no allocation, and its blocks only bound how much
+     * of it is resident before being written back
+     */
+    if (block->map)
+    {
+        block->array = block->map;
+        return 0;
+    }
+
+    block->array = allocateArray(&(block->arrayLength), block->blockSize,
+                                 budget - block->rows * sizeof(*(block->rowComplete)));
+
+    if (!block->array)
+    {
+        logMessage(ERROR, "Memory allocation failed");
+        return 1;
+    }
 
+    return 0;
+}
+
+
+/* Get the number of bytes the image array and its bookkeeping may occupy */
+static size_t getMemoryBudget(size_t mem)
+{
     size_t freeMemory;
 
-    logMessage(DEBUG, "Getting amount of free memory");
+    logMessage(DEBUG, "Getting amount of available memory");
 
     freeMemory = getFreeMemory();
 
     if (!freeMemory)
     {
-        logMessage(ERROR, "Failed to calculate amount of free memory");
-        return 1;
+        logMessage(ERROR, "Failed to calculate amount of available memory");
+        return 0;
     }
 
-    logMessage(DEBUG, "%zu bytes of physical memory is free", freeMemory);
+    logMessage(DEBUG, "%zu bytes of physical memory is available", freeMemory);
 
     /* If caller has specified max memory usage */
     if (mem > 0)
     {
         if (mem > freeMemory)
         {
-            logMessage(WARNING, "Memory maximum of %zu bytes is greater than the amount of free physical memory (%zu"
+            logMessage(WARNING, "Memory maximum of %zu bytes is greater than the amount of available physical memory (%zu"
                        " bytes). It is recommended to only allow allocation of physical memory for efficiency",
                        mem, freeMemory);
         }
 
-        freeMemory = mem;
-        logMessage(DEBUG, "Memory allocation will be limited to %zu bytes", freeMemory);
+        logMessage(DEBUG, "Memory allocation will be limited to %zu bytes", mem);
+        return mem;
     }
-    else
+
+    freeMemory = freeMemory * (FREE_MEMORY_ALLOCATION / 100.0);
+    logMessage(DEBUG, "Memory allocation will be limited to %u%% of available physical memory (%zu bytes)",
+               FREE_MEMORY_ALLOCATION, freeMemory);
+
+    return freeMemory;
+}
+
+
+/* Work out the block dimensions. A block takes as many rows as the budget
+ * holds (counting the completion flag kept for each row), then the rows are
+ * spread evenly over that many blocks so that the remainder block is not left
+ * with a sliver of rows too thin to keep every thread busy. The blocks of a
+ * tiled image hold whole rows of tiles
+ */
+static int planImageBlocks(Block *block, size_t budget)
+{
+    size_t height = block->parameters->height;
+    size_t rowCost = getRowCost(block);
+    size_t unit = (block->parameters->output == OUTPUT_TIFF) ? TIFF_TILE_SIZE : 1;
+    size_t rows, blocks;
+
+    logMessage(DEBUG, "Full image is %zu bytes", height * block->rowSize);
+
+    if (!holdsBlock(block, budget))
     {
-        freeMemory = freeMemory * (FREE_MEMORY_ALLOCATION / 100.0);
-        logMessage(DEBUG, "Memory allocation will be limited to %u%% of free physical memory (%zu bytes)",
-                   FREE_MEMORY_ALLOCATION, freeMemory);
+        logMessage(ERROR, "Memory limit of %zu bytes cannot hold %zu row(s) of the image (%zu bytes)",
+                   budget, unit, rowCost * unit);
+        return 1;
     }
 
-    block->blockSize = block->parameters->height * block->rowSize;
+    rows = budget / rowCost;
+
+    if (rows > height)
+        rows = height;
+    else
+        rows -= rows % unit;
+
+    blocks = (height + rows - 1) / rows;
+    rows = (height + blocks - 1) / blocks;
 
-    logMessage(DEBUG, "Full image is %zu bytes", block->blockSize);
+    if (blocks > 1 && rows % unit)
+        rows += unit - rows % unit;
 
-    /* Try to malloc the array, with each iteration decreasing the array size */
-    for (block->bCount = 1; block->bCount <= BLOCK_COUNT_MAX; ++(block->bCount))
+    /* Block IDs run one past the number of full-size blocks */
+    if (height / rows >= UINT_MAX)
     {
-        block->rows = block->parameters->height / block->bCount;
-        block->remainderRows = block->parameters->height % block->bCount;
+        logMessage(ERROR, "Memory limit of %zu bytes would split the image into too many blocks", budget);
+        return 1;
+    }
 
-        /* To fix the issue where the remainder block may be larger than the
-         * regular ones
-         */
-        if (block->remainderRows > block->rows)
-            continue;
+    block->bCount = (unsigned int) (height / rows);
+    block->rows = rows;
+    block->remainderRows = height % rows;
+    block->blockSize = block->rows * block->rowSize;
+    block->remainderBlockSize = block->remainderRows * block->rowSize;
 
-        block->blockSize = block->rows * block->rowSize;
-        block->remainderBlockSize = block->remainderRows * block->rowSize;
+    logMessage(INFO, "Memory plan: %zu-byte budget, %u block(s) of %zu rows (%zu bytes)%s, remainder block of %zu"
+               " rows (%zu bytes)", budget, block->bCount, block->rows, block->blockSize,
+               (block->map) ? " mapped from the image file" : "", block->remainderRows, block->remainderBlockSize);
 
-        if (block->blockSize <= freeMemory)
-        {
-            logMessage(DEBUG, "Splitting array into %u blocks (%zu bytes each)", block->bCount, block->blockSize);
+    return 0;
+}
 
-            block->array = malloc(block->blockSize);
 
-            if (block->array)
-                break;
-            
-            if (block->bCount != BLOCK_COUNT_MAX)
-                logMessage(DEBUG, "Memory allocation attempt failed. Retrying...");
-        }
-    }
+/* Whether a budget holds a block of the smallest number of rows the image can
+ * be divided by
+ */
+static bool holdsBlock(const Block *block, size_t budget)
+{
+    size_t height = block->parameters->height;
+    size_t rowCost = getRowCost(block);
+    size_t unit = (block->parameters->output == OUTPUT_TIFF) ? TIFF_TILE_SIZE : 1;
 
-    if (!block->array || block->blockSize == 0)
+    return budget / unit >= rowCost || height <= budget / rowCost;
+}
+
+
+/* Bytes each row of a block takes, counting its completion flag */
+static size_t getRowCost(const Block *block)
+{
+    size_t rowCost = block->rowSize + sizeof(*(block->rowComplete));
+
+    /* A PNG image is also filtered and compressed a block at a time */
+    if (block->parameters->output == OUTPUT_PNG)
+        rowCost += getPNGRowCost(block->rowSize);
+
+    return rowCost;
+}
+
+
+/* Back a block array with an anonymous mapping, preferring huge pages to cut
+ * TLB misses over multi-gigabyte arrays. Explicit huge pages are only used if
+ * the mapping, rounded up to the system's default huge page size, stays within
+ * the budget; otherwise transparent huge pages are requested for a regular
+ * mapping
+ */
+static char * allocateArray(size_t *length, size_t size, size_t budget)
+{
+    void *array;
+
+    #ifdef MAP_HUGETLB
+    size_t hugePageSize = readMemInfo("Hugepagesize");
+    size_t hugeLength = (hugePageSize) ? (size + hugePageSize - 1) / hugePageSize * hugePageSize : 0;
+
+    if (hugePageSize && size >= hugePageSize && hugeLength <= budget)
     {
-        /* If too many malloc() calls have failed */
-        logMessage(ERROR, "Memory allocation failed");
+        array = mmap(NULL, hugeLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
 
-        if (block->array)
-            free(block->array);
+        if (array != MAP_FAILED)
+        {
+            logMessage(INFO, "Allocated %zu bytes of huge pages for the image array", hugeLength);
+            *length = hugeLength;
+            return array;
+        }
 
-        return 1;
+        logMessage(DEBUG, "No huge pages reserved for the image array - using regular pages");
     }
+    #else
+    (void) budget;
+    #endif
 
-    logMessage(DEBUG, "Image array split into %u blocks (%zu bytes - block: %zu rows, remainder block: %zu rows)",
-               block->bCount, block->blockSize, block->rows, block->remainderRows);
-    
-    return 0;
+    array = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (array == MAP_FAILED)
+        return NULL;
+
+    #ifdef MADV_HUGEPAGE
+    if (madvise(array, size, MADV_HUGEPAGE))
+        logMessage(DEBUG, "Transparent huge pages unavailable for the image array");
+    #endif
+
+    logMessage(INFO, "Allocated %zu bytes for the image array", size);
+    *length = size;
+
+    return array;
 }
 
 
-/* Calculate amount of free physical memory on the system */
+/* Calculate amount of physical memory available on the system. This counts
+ * page cache that can be reclaimed, which free pages alone leave out
+ */
 static size_t getFreeMemory(void)
 {
-    long availablePages = sysconf(_SC_AVPHYS_PAGES);
-    long pageSize = sysconf(_SC_PAGE_SIZE);
+    size_t available = readMemInfo("MemAvailable");
+    long availablePages, pageSize;
+
+    if (available)
+        return available;
+
+    /* Without /proc/meminfo only the free pages are known */
+    availablePages = sysconf(_SC_AVPHYS_PAGES);
+    pageSize = sysconf(_SC_PAGE_SIZE);
 
     if (availablePages < 1 || pageSize < 1)
         return 0;
@@ -260,22 +673,31 @@ static size_t getFreeMemory(void)
 }
 
 
-/* Get number of online processors on the system (hence number of threads to
- * use)
- */
-static unsigned int getThreadCount(void)
+/* Read a field of /proc/meminfo in bytes, or 0 if it is not reported */
+static size_t readMemInfo(const char *field)
 {
-    long procs = sysconf(_SC_NPROCESSORS_ONLN);
+    FILE *f = fopen(MEMINFO_PATH, "r");
+    size_t length = strlen(field);
+    size_t bytes = 0;
+    char line[128];
 
-    if (procs < 1)
-    {
-        procs = 1;
-        logMessage(WARNING, "Could not get number of online processors - limiting to %ld thread(s)", procs);
-    }
-    else if (procs > UINT_MAX)
+    if (!f)
+        return 0;
+
+    while (fgets(line, sizeof(line), f))
     {
-        procs = UINT_MAX;
+        unsigned long long kB;
+
+        if (strncmp(line, field, length) || line[length] != ':')
+            continue;
+
+        if (sscanf(line + length + 1, "%llu kB", &kB) == 1)
+            bytes = (kB > SIZE_MAX / 1024) ? SIZE_MAX : (size_t) kB * 1024;
+
+        break;
     }
 
-    return (unsigned int) procs;
+    fclose(f);
+
+    return bytes;
 }
\ No newline at end of file
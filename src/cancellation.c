@@ -0,0 +1,83 @@
+#include <signal.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+#include "libgroot/include/log.h"
+
+#include "cancellation.h"
+
+
+/* Minimum/maximum render deadline (seconds) */
+const double DEADLINE_MIN = 0.001;
+const double DEADLINE_MAX = 31536000.0;
+
+
+/* Set asynchronously by the signal handler and polled by the processing
+ * threads between work units
+ */
+static volatile sig_atomic_t cancelled = 0;
+
+
+static void cancelRender(int sig);
+
+
+/* Cancel the render on SIGINT/SIGTERM or once the deadline (seconds, if
+ * non-zero) has passed. A second SIGINT/SIGTERM terminates the program as
+ * normal
+ */
+int initialiseCancellation(double deadline)
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = cancelRender;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = (int) SA_RESETHAND;
+
+    if (sigaction(SIGINT, &action, NULL) || sigaction(SIGTERM, &action, NULL))
+    {
+        logMessage(ERROR, "Could not install signal handlers");
+        return 1;
+    }
+
+    if (deadline > 0.0)
+    {
+        struct itimerval timer =
+        {
+            .it_interval = {0, 0},
+            .it_value =
+            {
+                .tv_sec = (time_t) deadline,
+                .tv_usec = (suseconds_t) ((deadline - (time_t) deadline) * 1000000.0)
+            }
+        };
+
+        action.sa_flags = 0;
+
+        if (sigaction(SIGALRM, &action, NULL) || setitimer(ITIMER_REAL, &timer, NULL))
+        {
+            logMessage(ERROR, "Could not set render deadline");
+            return 1;
+        }
+
+        logMessage(INFO, "Render deadline set to %g seconds", deadline);
+    }
+
+    return 0;
+}
+
+
+/* Whether the render should stop at the end of the current work unit */
+bool renderCancelled(void)
+{
+    return cancelled != 0;
+}
+
+
+static void cancelRender(int sig)
+{
+    (void) sig;
+    cancelled = 1;
+}
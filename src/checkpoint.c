@@ -0,0 +1,521 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libgroot/include/log.h"
+
+#include "checkpoint.h"
+
+#include "array.h"
+#include "ext_precision.h"
+#include "parameters.h"
+#include "request_handler.h"
+
+
+/* First line of the journal, including the format version */
+#define JOURNAL_MAGIC "MBJOURNAL 1"
+
+
+/* Minimum time between syncs of the image and journal (seconds) */
+static const double CHECKPOINT_INTERVAL = 60.0;
+
+/* 64-bit FNV-1a parameters */
+static const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+
+static void * takeCheckpoints(void *arg);
+static int syncJournal(Journal *journal, bool image);
+static void freeJournal(Journal *journal);
+static size_t countRows(const Journal *journal);
+static int hashParameters(uint64_t *hash, const PlotCTX *p);
+
+
+/* Create the journal of a new image, or load the journal of the partial image
+ * being resumed. The image file must already be open and positioned at the
+ * start of its pixel data
+ */
+Journal * openJournal(PlotCTX *p, bool resume)
+{
+    Journal *journal = malloc(sizeof(*journal));
+    size_t bitmapSize = (p->height + CHAR_BIT - 1) / CHAR_BIT;
+
+    if (!journal)
+    {
+        logMessage(ERROR, "Memory allocation failed");
+        return NULL;
+    }
+
+    journal->parameters = p;
+    journal->file = NULL;
+    journal->height = p->height;
+    journal->bitmap = calloc(bitmapSize, 1);
+    journal->synced = time(NULL);
+
+    snprintf(journal->filepath, sizeof(journal->filepath), "%s.journal", p->plotFilepath);
+
+    if (!journal->bitmap || hashParameters(&(journal->hash), p))
+    {
+        logMessage(ERROR, "Could not initialise checkpoint journal");
+        freeJournal(journal);
+        return NULL;
+    }
+
+    if (p->map)
+    {
+        journal->dataOffset = p->mapOffset;
+    }
+    else
+    {
+        long offset = ftell(p->file);
+
+        if (offset < 0)
+        {
+            logMessage(ERROR, "Could not get image header size");
+            freeJournal(journal);
+            return NULL;
+        }
+
+        journal->dataOffset = (size_t) offset;
+    }
+
+    if (resume)
+    {
+        uint64_t hash;
+        size_t height;
+
+        journal->file = fopen(journal->filepath, "r+b");
+
+        if (!journal->file)
+        {
+            logMessage(ERROR, "No checkpoint journal \'%s\' to resume from", journal->filepath);
+            freeJournal(journal);
+            return NULL;
+        }
+
+        if (fscanf(journal->file, JOURNAL_MAGIC " %" SCNx64 " %zu", &hash, &height) != 2
+            || fgetc(journal->file) != '\n'
+            || (journal->bitmapOffset = ftell(journal->file)) < 0
+            || fread(journal->bitmap, 1, bitmapSize, journal->file) != bitmapSize)
+        {
+            logMessage(ERROR, "Checkpoint journal \'%s\' is corrupt", journal->filepath);
+            freeJournal(journal);
+            return NULL;
+        }
+
+        /* The journal is left in place so the render can be resumed with the
+         * right parameters
+         */
+        if (hash != journal->hash || height != journal->height)
+        {
+            logMessage(ERROR, "Checkpoint journal \'%s\' was written for different plot parameters",
+                       journal->filepath);
+            freeJournal(journal);
+            return NULL;
+        }
+
+        logMessage(INFO, "Resuming render - %zu of %zu rows already in image", countRows(journal), journal->height);
+    }
+    else
+    {
+        journal->file = fopen(journal->filepath, "w+b");
+
+        if (!journal->file)
+        {
+            logMessage(ERROR, "File \'%s\' could not be opened", journal->filepath);
+            freeJournal(journal);
+            return NULL;
+        }
+
+        fprintf(journal->file, JOURNAL_MAGIC "\n%016" PRIx64 " %zu\n", journal->hash, journal->height);
+        journal->bitmapOffset = ftell(journal->file);
+
+        if (journal->bitmapOffset < 0 || syncJournal(journal, false))
+        {
+            logMessage(ERROR, "Could not write checkpoint journal \'%s\'", journal->filepath);
+            remove(journal->filepath);
+            freeJournal(journal);
+            return NULL;
+        }
+    }
+
+    logMessage(DEBUG, "Checkpoint journal \'%s\' opened", journal->filepath);
+
+    return journal;
+}
+
+
+/* Mark the rows of the block that are already in the image as complete and
+ * read them back into the block. Without a journal, every row is incomplete
+ */
+int restoreBlock(size_t *restored, Journal *journal, Block *block)
+{
+    PlotCTX *p = block->parameters;
+    size_t rows = (block->remainder) ? block->remainderRows : block->rows;
+    size_t blockOffset = block->id * block->rows;
+
+    *restored = 0;
+
+    memset(block->rowComplete, 0, rows * sizeof(*(block->rowComplete)));
+
+    if (!journal)
+        return 0;
+
+    for (size_t y = 0; y < rows; ++y)
+    {
+        size_t row = blockOffset + y;
+
+        if (journal->bitmap[row / CHAR_BIT] & (1 << (row % CHAR_BIT)))
+        {
+            block->rowComplete[y] = true;
+            ++(*restored);
+        }
+    }
+
+    /* A mapped block is already in place, and a complete block is skipped */
+    if (!(*restored) || *restored == rows || block->map)
+        return 0;
+
+    if (fflush(p->file))
+        return 1;
+
+    for (size_t y = 0; y < rows; ++y)
+    {
+        off_t offset = (off_t) (journal->dataOffset + (blockOffset + y) * block->rowSize);
+
+        if (!block->rowComplete[y])
+            continue;
+
+        if (pread(fileno(p->file), block->array + y * block->rowSize, block->rowSize, offset)
+            != (ssize_t) block->rowSize)
+        {
+            logMessage(ERROR, "Could not read row %zu back from the image", blockOffset + y);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Record the completed rows of a block that has been written to the image,
+ * syncing the image and journal if the last sync was long enough ago
+ */
+void checkpointBlock(Journal *journal, const Block *block)
+{
+    size_t rows = (block->remainder) ? block->remainderRows : block->rows;
+    size_t blockOffset = block->id * block->rows;
+
+    if (!journal)
+        return;
+
+    for (size_t y = 0; y < rows; ++y)
+    {
+        size_t row = blockOffset + y;
+
+        if (block->rowComplete[y])
+            journal->bitmap[row / CHAR_BIT] |= (unsigned char) (1 << (row % CHAR_BIT));
+    }
+
+    if (difftime(time(NULL), journal->synced) >= CHECKPOINT_INTERVAL)
+        syncJournal(journal, true);
+}
+
+
+/* Whether the last sync was long enough ago to checkpoint the rows completed
+ * since
+ */
+bool checkpointDue(const Journal *journal)
+{
+    return journal && difftime(time(NULL), journal->synced) >= CHECKPOINT_INTERVAL;
+}
+
+
+/* Record the rows of a block that are complete so far, before the block is
+ * written, and sync them. Rows of a mapped block are already in place in the
+ * image; others are written to it ahead of the block
+ */
+void checkpointRows(Journal *journal, const Block *block, const bool *complete)
+{
+    PlotCTX *p = block->parameters;
+    size_t rows = (block->remainder) ? block->remainderRows : block->rows;
+    size_t blockOffset = block->id * block->rows;
+
+    if (!journal)
+        return;
+
+    if (!block->map && fflush(p->file))
+    {
+        logMessage(WARNING, "Image \'%s\' could not be flushed for the checkpoint", p->plotFilepath);
+        return;
+    }
+
+    for (size_t y = 0; y < rows; ++y)
+    {
+        size_t row = blockOffset + y;
+
+        if (!complete[y] || journal->bitmap[row / CHAR_BIT] & (1 << (row % CHAR_BIT)))
+            continue;
+
+        if (!block->map && pwrite(fileno(p->file), block->array + y * block->rowSize, block->rowSize,
+                                  (off_t) (journal->dataOffset + row * block->rowSize)) != (ssize_t) block->rowSize)
+        {
+            logMessage(WARNING, "Row %zu could not be written for the checkpoint", row);
+            break;
+        }
+
+        journal->bitmap[row / CHAR_BIT] |= (unsigned char) (1 << (row % CHAR_BIT));
+    }
+
+    syncJournal(journal, true);
+}
+
+
+/* Start a thread that records the rows of the threads' block as they are
+ * completed. Without a journal there is nothing to record, and NULL is
+ * returned as it is if the thread cannot be started
+ */
+Checkpointer * startCheckpoints(Journal *journal, Thread *threads)
+{
+    const Block *block = threads->block;
+    size_t rows = (block->remainder) ? block->remainderRows : block->rows;
+    Checkpointer *checkpointer;
+
+    if (!journal)
+        return NULL;
+
+    checkpointer = malloc(sizeof(*checkpointer));
+
+    if (!checkpointer)
+    {
+        logMessage(WARNING, "Memory allocation failed - rows are only checkpointed once the block is complete");
+        return NULL;
+    }
+
+    checkpointer->journal = journal;
+    checkpointer->threads = threads;
+    checkpointer->complete = malloc(rows * sizeof(*(checkpointer->complete)));
+    checkpointer->stop = false;
+
+    if (!checkpointer->complete)
+    {
+        logMessage(WARNING, "Memory allocation failed - rows are only checkpointed once the block is complete");
+        free(checkpointer);
+        return NULL;
+    }
+
+    pthread_mutex_init(&(checkpointer->lock), NULL);
+    pthread_cond_init(&(checkpointer->cond), NULL);
+
+    if (pthread_create(&(checkpointer->pid), NULL, takeCheckpoints, checkpointer))
+    {
+        logMessage(WARNING, "Checkpoint thread could not be created - rows are only checkpointed once the block is"
+                   " complete");
+        pthread_mutex_destroy(&(checkpointer->lock));
+        pthread_cond_destroy(&(checkpointer->cond));
+        free(checkpointer->complete);
+        free(checkpointer);
+        return NULL;
+    }
+
+    return checkpointer;
+}
+
+
+/* Stop the checkpoint thread once the processing threads have finished */
+void stopCheckpoints(Checkpointer *checkpointer)
+{
+    if (!checkpointer)
+        return;
+
+    pthread_mutex_lock(&(checkpointer->lock));
+    checkpointer->stop = true;
+    pthread_cond_signal(&(checkpointer->cond));
+    pthread_mutex_unlock(&(checkpointer->lock));
+
+    pthread_join(checkpointer->pid, NULL);
+
+    pthread_mutex_destroy(&(checkpointer->lock));
+    pthread_cond_destroy(&(checkpointer->cond));
+    free(checkpointer->complete);
+    free(checkpointer);
+}
+
+
+/* Close the journal. It is synced one last time so that an incomplete render
+ * can be resumed, and deleted once the image is complete
+ */
+void closeJournal(Journal *journal, bool complete)
+{
+    if (!journal)
+        return;
+
+    if (journal->file)
+    {
+        /* The image must be on disk before the record of it is removed */
+        if (!syncJournal(journal, true) && complete)
+        {
+            if (remove(journal->filepath))
+                logMessage(WARNING, "Checkpoint journal \'%s\' could not be removed", journal->filepath);
+        }
+        else
+        {
+            logMessage(INFO, "Checkpoint of %zu of %zu rows kept in \'%s\' - continue the render with --resume",
+                       countRows(journal), journal->height, journal->filepath);
+        }
+    }
+
+    freeJournal(journal);
+}
+
+
+/* Checkpoint the completed rows of the block each time a sync is due, until
+ * stopped
+ */
+static void * takeCheckpoints(void *arg)
+{
+    Checkpointer *checkpointer = arg;
+    Journal *journal = checkpointer->journal;
+    const Block *block = checkpointer->threads->block;
+
+    pthread_mutex_lock(&(checkpointer->lock));
+
+    while (!checkpointer->stop)
+    {
+        time_t now = time(NULL);
+        time_t due = journal->synced + (time_t) CHECKPOINT_INTERVAL;
+
+        /* A sync that failed is not retried until an interval later */
+        struct timespec wake = {.tv_sec = (due > now) ? due : now + (time_t) CHECKPOINT_INTERVAL, .tv_nsec = 0};
+
+        if (pthread_cond_timedwait(&(checkpointer->cond), &(checkpointer->lock), &wake) != ETIMEDOUT)
+            continue;
+
+        pthread_mutex_unlock(&(checkpointer->lock));
+
+        findCompletedRows(checkpointer->complete, block, checkpointer->threads);
+        checkpointRows(journal, block, checkpointer->complete);
+
+        pthread_mutex_lock(&(checkpointer->lock));
+    }
+
+    pthread_mutex_unlock(&(checkpointer->lock));
+
+    return NULL;
+}
+
+
+/* Make the image durable, then the journal, so the journal never lists a row
+ * that is not yet on disk
+ */
+static int syncJournal(Journal *journal, bool image)
+{
+    const PlotCTX *p = journal->parameters;
+    size_t bitmapSize = (journal->height + CHAR_BIT - 1) / CHAR_BIT;
+
+    if (image && ((p->map) ? msync(p->map, p->mapSize, MS_SYNC) : fflush(p->file) || fsync(fileno(p->file))))
+    {
+        logMessage(WARNING, "Image \'%s\' could not be synced for the checkpoint", p->plotFilepath);
+        return 1;
+    }
+
+    if (fseek(journal->file, journal->bitmapOffset, SEEK_SET)
+        || fwrite(journal->bitmap, 1, bitmapSize, journal->file) != bitmapSize
+        || fflush(journal->file)
+        || fsync(fileno(journal->file)))
+    {
+        logMessage(WARNING, "Checkpoint journal \'%s\' could not be written", journal->filepath);
+        return 1;
+    }
+
+    journal->synced = time(NULL);
+
+    logMessage(DEBUG, "Checkpoint synced - %zu of %zu rows", countRows(journal), journal->height);
+
+    return 0;
+}
+
+
+/* Free the journal without syncing it */
+static void freeJournal(Journal *journal)
+{
+    if (journal->file)
+        fclose(journal->file);
+
+    free(journal->bitmap);
+    free(journal);
+}
+
+
+/* Count the rows marked complete in the journal */
+static size_t countRows(const Journal *journal)
+{
+    size_t n = 0;
+
+    for (size_t row = 0; row < journal->height; ++row)
+    {
+        if (journal->bitmap[row / CHAR_BIT] & (1 << (row % CHAR_BIT)))
+            ++n;
+    }
+
+    return n;
+}
+
+
+/* Hash the plot parameters as they are sent to workers, along with the output
+ * format
+ */
+static int hashParameters(uint64_t *hash, const PlotCTX *p)
+{
+    char buffer[PARAMETERS_BUFFER_SIZE];
+    int ret;
+    size_t n;
+
+    switch (p->precision)
+    {
+        case STD_PRECISION:
+            ret = serialisePlotCTX(buffer, sizeof(buffer), p);
+            break;
+        case EXT_PRECISION:
+            ret = serialisePlotCTXExt(buffer, sizeof(buffer), p);
+            break;
+
+        #ifdef MP_PREC
+        case MUL_PRECISION:
+            ret = serialisePlotCTXMP(buffer, sizeof(buffer), p);
+            break;
+        #endif
+
+        default:
+            return 1;
+    }
+
+    if (ret < 0 || (size_t) ret >= sizeof(buffer))
+        return 1;
+
+    n = (size_t) ret;
+    ret = snprintf(buffer + n, sizeof(buffer) - n, " %u %u", (unsigned int) p->precision, (unsigned int) p->output);
+
+    if (ret < 0 || (size_t) ret >= sizeof(buffer) - n)
+        return 1;
+
+    *hash = FNV_OFFSET_BASIS;
+
+    for (const char *c = buffer; *c; ++c)
+    {
+        *hash ^= (unsigned char) *c;
+        *hash *= FNV_PRIME;
+    }
+
+    return 0;
+}
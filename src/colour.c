@@ -3,6 +3,7 @@
 #include <math.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "colour.h"
@@ -12,6 +13,7 @@
 #endif
 
 #include "mandelbrot_parameters.h"
+#include "raw.h"
 
 #ifdef MP_PREC
 #include <mpfr.h>
@@ -36,6 +38,14 @@ static const double CHAR_SCALE_MULTIPLIER = 0.3;
 
 
 static void hsvToRGB(RGB *rgb, HSV *hsv);
+static double fastLog2(double x);
+static void packEscapeFlags(char *pixels, const unsigned long *n, size_t count, unsigned long max,
+                            const ColourScheme *scheme);
+static size_t getPaletteIndex(double n, EscapeStatus status, const ColourScheme *scheme);
+static int compareCounts(const void *a, const void *b);
+static double equaliseCount(double n, const ColourScheme *scheme);
+static void initialiseLUT(ColourScheme *scheme);
+static void lookupColour(RGB *rgb, double n, EscapeStatus status, const ColourScheme *scheme);
 
 static char mapColourSchemeASCII(double n, EscapeStatus status);
 
@@ -78,59 +88,165 @@ int initialiseColourScheme(ColourScheme *scheme, ColourSchemeType colour)
         case COLOUR_SCHEME_TYPE_RAINBOW:
             scheme->depth = BIT_DEPTH_24;
             scheme->mapColour.trueColour = mapColourSchemeRainbow;
+            scheme->period = 360.0 / COLOUR_SCALE_MULTIPLIER;
             break;
         case COLOUR_SCHEME_TYPE_RAINBOW_VIBRANT:
             scheme->depth = BIT_DEPTH_24;
             scheme->mapColour.trueColour = mapColourSchemeRainbowVibrant;
+            scheme->period = 360.0 / COLOUR_SCALE_MULTIPLIER;
             break;
         case COLOUR_SCHEME_TYPE_RED_WHITE:
             scheme->depth = BIT_DEPTH_24;
             scheme->mapColour.trueColour = mapColourSchemeRedWhite;
+            scheme->period = 28.0;
             break;
         case COLOUR_SCHEME_TYPE_FIRE:
             scheme->depth = BIT_DEPTH_24;
             scheme->mapColour.trueColour = mapColourSchemeFire;
+            scheme->period = 50.0;
             break;
         case COLOUR_SCHEME_TYPE_RED_HOT:
             scheme->depth = BIT_DEPTH_24;
             scheme->mapColour.trueColour = mapColourSchemeRedHot;
+            scheme->period = 90.0;
             break;
         case COLOUR_SCHEME_TYPE_MATRIX:
             scheme->depth = BIT_DEPTH_24;
             scheme->mapColour.trueColour = mapColourSchemeMatrix;
+            scheme->period = 90.0;
+            break;
+        case COLOUR_SCHEME_TYPE_RAW:
+            /* Smoothed iteration counts are stored as they are */
+            scheme->depth = BIT_DEPTH_RAW;
             break;
         default:
             return 1;
     }
 
+    if (scheme->depth == BIT_DEPTH_24)
+        initialiseLUT(scheme);
+
     return 0;
 }
 
 
-/* Smooth the iteration count then map it to an RGB value */
-void mapColour(void *pixel, unsigned long n, complex z, int offset, unsigned long max, const ColourScheme *scheme)
+/* Sample one period of a true colour scheme into a palette of 2^bits colours,
+ * so that pixels are stored as indices into it. Index 0 is the inside of the
+ * set
+ */
+int initialisePalette(ColourScheme *scheme, unsigned int bits)
 {
-    EscapeStatus status = (n < max) ? ESCAPED : UNESCAPED;
-    double nSmooth = 0.0;
+    size_t size, steps;
 
-    /* Makes discrete iteration count a continuous value */
-    if (status == ESCAPED && scheme->depth != BIT_DEPTH_1)
-        nSmooth = n + 1.0 - log2(log2(cabs(z)));
+    if (scheme->depth != BIT_DEPTH_24 || (bits != BIT_DEPTH_8 && bits != BIT_DEPTH_16))
+        return 1;
+
+    size = (size_t) 1 << bits;
+    steps = size - 1;
+
+    scheme->palette = malloc(size * sizeof(*(scheme->palette)));
+
+    if (!scheme->palette)
+        return 1;
+
+    scheme->mapColour.trueColour(&(scheme->palette[0]), 0.0, UNESCAPED);
+
+    for (size_t i = 1; i < size; ++i)
+    {
+        double n = scheme->period * (double) (i - 1) / (double) steps;
+
+        scheme->mapColour.trueColour(&(scheme->palette[i]), n, ESCAPED);
+    }
+
+    scheme->paletteSize = size;
+    scheme->depth = (BitDepth) bits;
+
+    return 0;
+}
+
+
+void freePalette(ColourScheme *scheme)
+{
+    free(scheme->palette);
+    scheme->palette = NULL;
+    scheme->paletteSize = 0;
+}
+
+
+/* Take the quantiles of histogram colouring from the smoothed iteration counts
+ * of the escaped points of a sample of the plot, which are sorted in place.
+ * Quantiles passed back in as the sample are kept as they are
+ */
+int initialiseHistogram(ColourScheme *scheme, double *samples, size_t n)
+{
+    if (scheme->depth != BIT_DEPTH_24 && !scheme->palette)
+        return 1;
+
+    if (n == 0)
+        return 1;
+
+    free(scheme->histogram);
+    scheme->histogram = malloc(COLOUR_HISTOGRAM_SIZE * sizeof(*(scheme->histogram)));
+
+    if (!scheme->histogram)
+    {
+        scheme->histogramSize = 0;
+        return 1;
+    }
+
+    qsort(samples, n, sizeof(*samples), compareCounts);
+
+    for (size_t i = 0; i < COLOUR_HISTOGRAM_SIZE; ++i)
+        scheme->histogram[i] = samples[i * (n - 1) / (COLOUR_HISTOGRAM_SIZE - 1)];
+
+    scheme->histogramSize = COLOUR_HISTOGRAM_SIZE;
+
+    return 0;
+}
+
+
+void freeHistogram(ColourScheme *scheme)
+{
+    free(scheme->histogram);
+    scheme->histogram = NULL;
+    scheme->histogramSize = 0;
+}
+
+
+/* Map a smoothed iteration count to a pixel value */
+void mapSmoothedColour(void *pixel, double n, EscapeStatus status, int offset, const ColourScheme *scheme)
+{
+    /* 16-bit indices are stored little-endian */
+    if (scheme->palette)
+    {
+        size_t index = getPaletteIndex(n, status, scheme);
+        uint8_t *bytes = pixel;
+
+        bytes[0] = (uint8_t) index;
+
+        if (scheme->depth == BIT_DEPTH_16)
+            bytes[1] = (uint8_t) (index >> CHAR_BIT);
+
+        return;
+    }
 
     switch (scheme->depth)
     {
         case BIT_DEPTH_ASCII:
-            *((char *) pixel) = scheme->mapColour.ascii(nSmooth, status);
+            *((char *) pixel) = scheme->mapColour.ascii(n, status);
             break;
         case BIT_DEPTH_1:
             /* Only write every byte */
             scheme->mapColour.monochrome(pixel, offset, status);
             break;
         case BIT_DEPTH_8:
-            *((uint8_t *) pixel) = scheme->mapColour.greyscale(nSmooth, status);
+            *((uint8_t *) pixel) = scheme->mapColour.greyscale(n, status);
             break;
         case BIT_DEPTH_24:
-            scheme->mapColour.trueColour(pixel, nSmooth, status);
+            lookupColour(pixel, n, status, scheme);
+            break;
+        case BIT_DEPTH_RAW:
+            encodeRawPixel(pixel, n, status);
             break;
         default:
             return;
@@ -140,6 +256,20 @@ void mapColour(void *pixel, unsigned long n, complex z, int offset, unsigned lon
 }
 
 
+/* Smooth the iteration count then map it to an RGB value */
+void mapColour(void *pixel, unsigned long n, complex z, int offset, unsigned long max, const ColourScheme *scheme)
+{
+    EscapeStatus status = (n < max) ? ESCAPED : UNESCAPED;
+    double nSmooth = 0.0;
+
+    /* Makes discrete iteration count a continuous value */
+    if (status == ESCAPED && scheme->depth != BIT_DEPTH_1)
+        nSmooth = n + 1.0 - log2(log2(cabs(z)));
+
+    mapSmoothedColour(pixel, nSmooth, status, offset, scheme);
+}
+
+
 /* Smooth the iteration count then map it to an RGB value (extended-precision) */
 void mapColourExt(void *pixel, unsigned long n, long double complex z, int offset, unsigned long max,
                   const ColourScheme *scheme)
@@ -151,26 +281,7 @@ void mapColourExt(void *pixel, unsigned long n, long double complex z, int offse
     if (status == ESCAPED && scheme->depth != BIT_DEPTH_1)
         nSmooth = n + 1.0L - log2l(log2l(cabsl(z)));
 
-    switch (scheme->depth)
-    {
-        case BIT_DEPTH_ASCII:
-            *((char *) pixel) = scheme->mapColour.ascii(nSmooth, status);
-            break;
-        case BIT_DEPTH_1:
-            /* Only write every byte */
-            scheme->mapColour.monochrome(pixel, offset, status);
-            break;
-        case BIT_DEPTH_8:
-            *((uint8_t *) pixel) = scheme->mapColour.greyscale(nSmooth, status);
-            break;
-        case BIT_DEPTH_24:
-            scheme->mapColour.trueColour(pixel, nSmooth, status);
-            break;
-        default:
-            return;
-    }
-
-    return;
+    mapSmoothedColour(pixel, nSmooth, status, offset, scheme);
 }
 
 
@@ -188,28 +299,50 @@ void mapColourMP(void *pixel, unsigned long n, mpfr_t norm, int offset, unsigned
         nSmooth = n + 2.0 - log2(mpfr_get_d(norm, MP_REAL_RND));
     }
 
-    switch (scheme->depth)
+    mapSmoothedColour(pixel, nSmooth, status, offset, scheme);
+}
+#endif
+
+
+/* Colour a run of consecutive pixels of a row from the iteration counts and
+ * squared magnitudes of z on escape that the fractal function left for them,
+ * overwriting the magnitudes with the smoothed iteration counts. A 1-bit run
+ * must start on a byte boundary
+ */
+void mapColourRun(char *pixels, const unsigned long *n, double *norm, size_t count, unsigned long max,
+                  const ColourScheme *scheme)
+{
+    size_t nmemb = (scheme->depth == BIT_DEPTH_ASCII || scheme->depth == BIT_DEPTH_1)
+                   ? 1
+                   : scheme->depth / CHAR_BIT;
+
+    /* Free of branches and library calls, so that the compiler vectorises it.
+     * With |z|^2 in place of |z|, the n + 1 of mapColour() becomes n + 2
+     */
+    if (scheme->depth != BIT_DEPTH_1)
     {
-        case BIT_DEPTH_ASCII:
-            *((char *) pixel) = scheme->mapColour.ascii(nSmooth, status);
-            break;
-        case BIT_DEPTH_1:
-            /* Only write every byte */
-            scheme->mapColour.monochrome(pixel, offset, status);
-            break;
-        case BIT_DEPTH_8:
-            *((uint8_t *) pixel) = scheme->mapColour.greyscale(nSmooth, status);
-            break;
-        case BIT_DEPTH_24:
-            scheme->mapColour.trueColour(pixel, nSmooth, status);
-            break;
-        default:
-            return;
+        for (size_t i = 0; i < count; ++i)
+        {
+            double nSmooth = (double) n[i] + 2.0 - fastLog2(fastLog2(norm[i]));
+            norm[i] = (n[i] < max) ? nSmooth : 0.0;
+        }
     }
 
-    return;
+    if (scheme->depth == BIT_DEPTH_24 && !scheme->palette)
+    {
+        for (size_t i = 0; i < count; ++i)
+            lookupColour((RGB *) (pixels + i * nmemb), norm[i], (n[i] < max) ? ESCAPED : UNESCAPED, scheme);
+    }
+    else if (scheme->depth == BIT_DEPTH_1)
+    {
+        packEscapeFlags(pixels, n, count, max, scheme);
+    }
+    else
+    {
+        for (size_t i = 0; i < count; ++i)
+            mapSmoothedColour(pixels + i * nmemb, norm[i], (n[i] < max) ? ESCAPED : UNESCAPED, 0, scheme);
+    }
 }
-#endif
 
 
 /* Convert colour scheme enum to a string */
@@ -249,6 +382,9 @@ int getColourString(char *dest, ColourSchemeType colour, size_t n)
         case COLOUR_SCHEME_TYPE_MATRIX:
             colourString = "Matrix";
             break;
+        case COLOUR_SCHEME_TYPE_RAW:
+            colourString = "Raw iteration data";
+            break;
         default:
             return 1;
     }
@@ -260,6 +396,206 @@ int getColourString(char *dest, ColourSchemeType colour, size_t n)
 }
 
 
+/* Get the palette entry nearest to a smoothed iteration count's place in the
+ * scheme's period
+ */
+static size_t getPaletteIndex(double n, EscapeStatus status, const ColourScheme *scheme)
+{
+    size_t steps = scheme->paletteSize - 1;
+    double phase;
+    size_t i;
+
+    if (status != ESCAPED)
+        return 0;
+
+    if (scheme->histogram)
+        n = equaliseCount(n, scheme);
+
+    phase = fmod(n, scheme->period) / scheme->period;
+
+    if (phase < 0.0)
+        phase += 1.0;
+
+    i = (size_t) (phase * (double) steps + 0.5);
+
+    /* The end of the period wraps round to its start */
+    return (i < steps) ? i + 1 : 1;
+}
+
+
+static int compareCounts(const void *a, const void *b)
+{
+    double x = *((const double *) a);
+    double y = *((const double *) b);
+
+    return (x > y) - (x < y);
+}
+
+
+/* Replace a smoothed iteration count with its place in the distribution of
+ * the plot's counts, as a fraction of the scheme's period
+ */
+static double equaliseCount(double n, const ColourScheme *scheme)
+{
+    const double *q = scheme->histogram;
+    size_t low = 0;
+    size_t high = scheme->histogramSize - 1;
+
+    if (n <= q[low])
+        return 0.0;
+    else if (n >= q[high])
+        return scheme->period;
+
+    /* Find the quantiles either side of the count */
+    while (high - low > 1)
+    {
+        size_t mid = low + (high - low) / 2;
+
+        if (n < q[mid])
+            high = mid;
+        else
+            low = mid;
+    }
+
+    return scheme->period * ((double) low + (n - q[low]) / (q[high] - q[low]))
+           / (double) (scheme->histogramSize - 1);
+}
+
+
+/* Sample one period of a true colour scheme into its lookup table, so that
+ * pixels are coloured without converting from HSV
+ */
+static void initialiseLUT(ColourScheme *scheme)
+{
+    scheme->lutScale = COLOUR_LUT_SIZE / scheme->period;
+    scheme->mapColour.trueColour(&(scheme->inside), 0.0, UNESCAPED);
+
+    for (size_t i = 0; i < COLOUR_LUT_SIZE; ++i)
+        scheme->mapColour.trueColour(&(scheme->lut[i]), (double) i / scheme->lutScale, ESCAPED);
+
+    scheme->lut[COLOUR_LUT_SIZE] = scheme->lut[0];
+}
+
+
+/* Interpolate the colour of a smoothed iteration count between the two
+ * nearest lookup table entries
+ */
+static void lookupColour(RGB *rgb, double n, EscapeStatus status, const ColourScheme *scheme)
+{
+    double x, fraction;
+    int64_t entry;
+    const RGB *a, *b;
+
+    if (status != ESCAPED)
+    {
+        *rgb = scheme->inside;
+        return;
+    }
+
+    if (scheme->histogram)
+        n = equaliseCount(n, scheme);
+
+    x = n * scheme->lutScale;
+
+    /* Round down rather than towards zero. The table size is a power of two,
+     * so the entry is wrapped into the period with a mask
+     */
+    entry = (int64_t) x;
+
+    if (x < (double) entry)
+        --entry;
+
+    fraction = x - (double) entry;
+    a = &(scheme->lut[entry & (COLOUR_LUT_SIZE - 1)]);
+    b = a + 1;
+
+    rgb->r = (uint8_t) (a->r + (b->r - a->r) * fraction + 0.5);
+    rgb->g = (uint8_t) (a->g + (b->g - a->g) * fraction + 0.5);
+    rgb->b = (uint8_t) (a->b + (b->b - a->b) * fraction + 0.5);
+}
+
+
+/* Set the bits of a run of 1-bit pixels 64 at a time, storing whole bytes
+ * rather than setting each bit through the scheme's function. A run only ends
+ * part way through a byte at the end of a row, where the rest of the byte is
+ * padding
+ */
+static void packEscapeFlags(char *pixels, const unsigned long *n, size_t count, unsigned long max,
+                            const ColourScheme *scheme)
+{
+    const unsigned int WORD_BITS = 64;
+
+    uint64_t invert;
+    size_t i = 0;
+    char probe = 0;
+
+    /* Whether the scheme sets the bit of an escaped point or of one in the set */
+    scheme->mapColour.monochrome(&probe, 0, ESCAPED);
+    invert = (probe) ? 0 : UINT64_MAX;
+
+    for (; i < count; i += WORD_BITS)
+    {
+        size_t bits = (count - i < WORD_BITS) ? count - i : WORD_BITS;
+        size_t bytes = (bits + CHAR_BIT - 1) / CHAR_BIT;
+        uint64_t word = 0;
+
+        /* The first pixel is the most significant bit */
+        for (size_t j = 0; j < bits; ++j)
+            word |= (uint64_t) (n[i + j] < max) << (WORD_BITS - 1 - j);
+
+        word ^= invert;
+
+        /* Padding bits are left clear */
+        if (bits < WORD_BITS)
+            word &= ~(UINT64_MAX >> bits);
+
+        for (size_t j = 0; j < bytes; ++j)
+            pixels[i / CHAR_BIT + j] = (char) (word >> (WORD_BITS - CHAR_BIT * (j + 1)));
+    }
+}
+
+
+/* Base-2 logarithm of a positive, normal double, accurate to about 1e-7. The
+ * exponent is read from the representation, and the logarithm of the mantissa
+ * (brought into [sqrt(2)/2, sqrt(2)]) is a short series in (m - 1) / (m + 1)
+ */
+static double fastLog2(double x)
+{
+    const uint64_t MANTISSA_MASK = 0x000FFFFFFFFFFFFF;
+    const uint64_t EXPONENT_ONE = 0x3FF0000000000000;
+    const uint64_t EXPONENT_MAGIC = 0x4330000000000000;
+    const double SQRT_2 = 1.4142135623730951;
+
+    uint64_t bits, magic;
+    double m, e, t, t2;
+
+    memcpy(&bits, &x, sizeof(bits));
+
+    /* The biased exponent is converted to a double without an integer
+     * conversion instruction, by placing it in the mantissa of 2^52
+     */
+    magic = (bits >> 52) | EXPONENT_MAGIC;
+    memcpy(&e, &magic, sizeof(e));
+    e -= 4503599627370496.0 + 1023.0;
+
+    bits = (bits & MANTISSA_MASK) | EXPONENT_ONE;
+    memcpy(&m, &bits, sizeof(m));
+
+    if (m > SQRT_2)
+    {
+        m *= 0.5;
+        e += 1.0;
+    }
+
+    t = (m - 1.0) / (m + 1.0);
+    t2 = t * t;
+
+    /* 2 / ln(2) * (t + t^3 / 3 + t^5 / 5 + t^7 / 7) */
+    return e + t * (2.8853900817779268 + t2 * (0.9617966939259756 + t2 * (0.5770780163555854
+                                                                        + t2 * 0.4121985831111324)));
+}
+
+
 /* Map HSV colour values to RGB */
 static void hsvToRGB(RGB *rgb, HSV *hsv)
 {
@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -9,8 +10,10 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -23,27 +26,142 @@
 
 #include "arg_ranges.h"
 #include "array.h"
+#include "cancellation.h"
+#include "checkpoint.h"
 #include "request_handler.h"
+#include "row_codec.h"
 
 
+typedef struct Range
+{
+    size_t first;  /* Image row number of the first row */
+    size_t n;      /* Number of rows */
+} Range;
+
 typedef struct Queue
 {
     size_t size;   /* Memory size of queue */
     size_t n;      /* Number of items in queue */
-    size_t *queue; /* Queue */
+    size_t rows;   /* Number of rows in all the items */
+    Range *queue;  /* Queue */
+    bool lost;     /* Whether rows could not be put back in the full queue */
 } Queue;
 
+/* A work unit out with a worker for longer than expected */
+typedef struct Overdue
+{
+    WorkUnit *unit;
+    int worker;    /* Index of the worker it is out with */
+} Overdue;
+
+/* Blocks of the image whose rows are being handed out, oldest first. Rows of
+ * the newer blocks are handed out while the last of the oldest are still being
+ * calculated, so that workers are not left idle while it is finished and
+ * written
+ */
+struct Window
+{
+    Block *blocks[WINDOW_BLOCKS];
+    size_t wroteRows[WINDOW_BLOCKS]; /* Rows of each block calculated so far */
+    size_t n;                        /* Number of blocks in the window */
+    Queue *rows;                     /* Rows of the blocks yet to be handed out */
+    Journal *journal;                /* Record of the rows in the image (NULL if not kept) */
+};
+
+
+const unsigned int WORK_UNITS_DEFAULT = 2;
+
+/* A work unit is copied to an idle worker once it is this many times overdue */
+const double SPECULATION_DEFAULT = 2.0;
 
-static void closeSocket(fd_set *set, int *highestFD, NetworkCTX *network, int i, Queue *rows);
-static int getHighestFD(const Client *clients, int n);
+/* Time each work unit should take a worker to calculate and return */
+static const double WORK_UNIT_TIME = 0.1;
+
+/* Milliseconds between looks for overdue work units while workers are idle */
+static const int SPECULATION_INTERVAL = 50;
+
+/* A work unit's rows are requeued once it is out this many times its expected
+ * time, and at least network->timeout seconds. Units are looked over every
+ * RECLAIM_INTERVAL milliseconds
+ */
+const double TIMEOUT_DEFAULT = 30.0;
+static const double RECLAIM_FACTOR = 10.0;
+static const int RECLAIM_INTERVAL = 1000;
+
+/* Seconds a connection is quiet before the kernel probes it, seconds between
+ * probes, and probes unanswered before the connection fails
+ */
+static const int KEEPALIVE_IDLE = 10;
+static const int KEEPALIVE_INTERVAL = 5;
+static const int KEEPALIVE_PROBES = 3;
+
+/* Most socket events handled per wait */
+#define EPOLL_EVENTS_MAX 64
+
+/* Payloads of rows already in are read into this in pieces and dropped */
+#define DISCARD_SIZE 65536
+
+/* File descriptors the master needs besides one per worker */
+static const rlim_t FILE_DESCRIPTORS_RESERVED = 64;
+
+
+static int setNoDelay(int s);
+static int setKeepAlive(int s);
+static int setNonblocking(int s);
+static void raiseFileLimit(int n);
+static void resetClient(Client *client, int s);
+
+static int readClient(NetworkCTX *network, int i, Window *window);
+static int beginFrame(NetworkCTX *network, int i, const Window *window);
+static int endFrame(NetworkCTX *network, int i, Window *window);
+static int acceptWorker(NetworkCTX *network, int i, const Block *block);
+static int queueFrame(Client *client, const Frame *frame, const void *payload);
+static int flushClient(NetworkCTX *network, Client *client);
+static int watchClient(NetworkCTX *network, Client *client, bool writable);
+static bool wouldBlock(int error);
+
+static int allocateRows(NetworkCTX *network, int i, const Window *window);
+static int sendUnit(Client *worker, size_t rowSize, size_t first, size_t n, uint32_t job);
+static size_t getWorkUnitSize(const NetworkCTX *network, const Client *worker, const Queue *rows);
+static int findRows(const Client *worker, const Window *window, const Frame *frame);
+static int receiveRows(NetworkCTX *network, int i, const Window *window);
+static int completeRows(Window *window, const WorkUnit *unit);
+static void removeUnit(Client *worker, size_t j);
+static void markStale(Client *worker, size_t j);
+static void updateRate(Client *worker, const WorkUnit *unit);
+static double getUnitTime(const Client *worker, const WorkUnit *unit, const struct timespec *now);
+static double getExpectedTime(const Client *worker, size_t rows, size_t units);
+static double getElapsed(const struct timespec *start, const struct timespec *end);
+static size_t closeClient(NetworkCTX *network, int i, Queue *rows);
+
+static size_t copyRows(NetworkCTX *network, const Window *window, struct timespec *checked, bool *idle);
+static Overdue * findOverdueUnits(size_t *count, NetworkCTX *network, const struct timespec *now);
+static int compareOverdue(const void *a, const void *b);
+static void settleCopies(NetworkCTX *network, int i, const WorkUnit *unit);
+static bool keepCopy(NetworkCTX *network, int i, const WorkUnit *unit);
+static size_t reclaimRows(NetworkCTX *network, struct timespec *checked, Queue *rows);
+
+static int findBlock(const Window *window, size_t row);
+static bool isInBlock(const Block *block, size_t row);
+static void forgetUnits(Client *worker, const Block *block);
+
+static void * runLocalWorker(void *arg);
+static void allocateLocalRows(NetworkCTX *network, const Window *window);
+static int collectLocalRows(NetworkCTX *network, Window *window);
+static void finishLocalRows(NetworkCTX *network, Window *window);
 
-static Queue * createRowQueue(const Block *block);
 static Queue * createQueue(size_t n);
-static int pushToQueue(Queue *q, size_t n);
-static int popFromQueue(size_t *n, Queue *q);
+static int queueBlock(Queue *q, const Block *block);
+static void dropBlock(Queue *q, const Block *block);
+static void pushToQueue(Queue *q, size_t first, size_t n);
+static int popFromQueue(size_t *first, size_t *n, Queue *q, size_t max);
 static void freeQueue(Queue *q);
 
 
+/* Only the listener reads from workers, so one discard space serves them all */
+static char discard[DISCARD_SIZE];
+
+
 /* Allocate NetworkCTX object */
 NetworkCTX * createNetworkCTX(int n)
 {
@@ -53,6 +171,16 @@ NetworkCTX * createNetworkCTX(int n)
         return NULL;
     
     ctx->n = (n < 0) ? 0 : n;
+    ctx->epoll = -1;
+    ctx->connected = 0;
+    ctx->units = WORK_UNITS_DEFAULT;
+    ctx->compress = false;
+    ctx->localThreads = 0;
+    ctx->local = NULL;
+    ctx->speculate = SPECULATION_DEFAULT;
+    ctx->copies = 0;
+    ctx->copyWins = 0;
+    ctx->timeout = TIMEOUT_DEFAULT;
     ctx->workers = malloc((size_t) ctx->n * sizeof(*(ctx->workers)));
 
     if (!ctx->workers)
@@ -62,14 +190,7 @@ NetworkCTX * createNetworkCTX(int n)
     }
 
     for (int i = 0; i < ctx->n; ++i)
-    {
-        ctx->workers[i].s = -1;
-        ctx->workers[i].rowAllocated = false;
-        ctx->workers[i].row = 0;
-        ctx->workers[i].n = 0;
-        ctx->workers[i].read = 0;
-        ctx->workers[i].buffer = NULL;
-    }
+        resetClient(&(ctx->workers[i]), -1);
 
     return ctx;
 }
@@ -84,7 +205,6 @@ int createClientReceiveBuffer(Client *client, size_t n)
         if (client->buffer)
         {
             client->n = n;
-            client->read = 0;
             return 0;
         }
     }
@@ -99,7 +219,6 @@ void freeClientReceiveBuffer(Client *client)
     {
         free(client->buffer);
         client->n = 0;
-        client->read = 0;
         client->buffer = NULL;
     }
 }
@@ -110,14 +229,22 @@ void freeNetworkCTX(NetworkCTX *ctx)
 {
     if (ctx)
     {
+        stopLocalWorker(ctx);
+
         if (ctx->workers)
         {
             for (int i = 0; i < ctx->n; ++i)
+            {
                 freeClientReceiveBuffer(&(ctx->workers[i]));
+                free(ctx->workers[i].out);
+            }
 
             free(ctx->workers);
         }
 
+        if (ctx->epoll >= 0)
+            close(ctx->epoll);
+
         free(ctx);
     }
 }
@@ -162,6 +289,7 @@ int initialiseNetworkConnection(NetworkCTX *network, PlotCTX **p)
 int initialiseAsMaster(NetworkCTX *network)
 {
     const int SOCK_OPT = 1;
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
 
     logMessage(DEBUG, "Creating socket");
 
@@ -185,17 +313,14 @@ int initialiseAsMaster(NetworkCTX *network)
 		return 1;
 	}
 
-    /* TODO: Sort this out */
-    /* Set socket to be nonblocking */
-    /*
+    /* A connection request withdrawn before it is accepted must not block */
     logMessage(DEBUG, "Changing socket mode to nonblocking");
 
-	if (ioctl(network->s, FIONBIO, (const void *) &SOCK_OPT) < 0)
+	if (setNonblocking(network->s))
 	{
-        logMessage(DEBUG, "Socket mode could not be changed");
 		close(network->s);
 		return 1;
-	}*/
+	}
 
     logMessage(DEBUG, "Binding %s:%" PRIu16 " to socket",
                inet_ntoa(network->addr.sin_addr),
@@ -217,6 +342,20 @@ int initialiseAsMaster(NetworkCTX *network)
         return 1;
     }
 
+    raiseFileLimit(network->n);
+
+    logMessage(DEBUG, "Creating epoll instance");
+
+    network->epoll = epoll_create1(0);
+
+    /* The listening socket is told apart from the workers by its NULL pointer */
+    if (network->epoll < 0 || epoll_ctl(network->epoll, EPOLL_CTL_ADD, network->s, &event))
+    {
+        logMessage(ERROR, "Could not create epoll instance");
+        close(network->s);
+        return 1;
+    }
+
     return 0;
 }
 
@@ -224,24 +363,20 @@ int initialiseAsMaster(NetworkCTX *network)
 /* Accept connection request and return index in Client array */
 int acceptConnection(NetworkCTX *network)
 {
-    Client worker;
-    socklen_t addrLength = sizeof(worker.addr);
+    int s;
+    struct sockaddr_in addr;
+    socklen_t addrLength = sizeof(addr);
 
     logMessage(INFO, "Accepting incoming connection request");
 
     errno = 0;
-    worker.s = accept(network->s, (struct sockaddr *) &(worker.addr), &addrLength);
+    s = accept(network->s, (struct sockaddr *) &addr, &addrLength);
 
-    if (worker.s < 0)
+    if (s < 0)
     {   
-        /* If all requests have been accepted.
-         * EAGAIN and EWOULDBLOCK may be equal macros, so separate conditionals
-         * will silence a -Wlogical-op warning if they are
-         */
-        if (errno == EAGAIN)
-            logMessage(WARNING, "Too many connections have already been accepted");
-        else if (errno == EWOULDBLOCK)
-            logMessage(WARNING, "Too many connections have already been accepted");
+        /* If the request was withdrawn before it could be accepted */
+        if (wouldBlock(errno))
+            logMessage(DEBUG, "No connection request to accept");
         else
             logMessage(ERROR, "Could not accept connection request");
         
@@ -249,22 +384,38 @@ int acceptConnection(NetworkCTX *network)
     }
 
     logMessage(INFO, "Connected to worker at %s:%" PRIu16 " on socket %d",
-                        inet_ntoa(worker.addr.sin_addr),
-                        ntohs(worker.addr.sin_port),
-                        worker.s);
+                        inet_ntoa(addr.sin_addr),
+                        ntohs(addr.sin_port),
+                        s);
 
     for (int i = 0; i < network->n; ++i)
     {
+        Client *worker = &(network->workers[i]);
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = worker};
+
         /* If space for the new connection */
-        if (network->workers[i].s < 0)
+        if (worker->s >= 0)
+            continue;
+
+        setNoDelay(s);
+        setKeepAlive(s);
+
+        if (setNonblocking(s) || epoll_ctl(network->epoll, EPOLL_CTL_ADD, s, &event))
         {
-            network->workers[i] = worker;
-            return i;
+            logMessage(ERROR, "Could not watch socket %d, closing connection", s);
+            close(s);
+            return -1;
         }
+
+        resetClient(worker, s);
+        worker->addr = addr;
+        network->connected++;
+
+        return i;
     }
 
     logMessage(WARNING, "Too many connections have already been accepted, closing connection");
-    close(worker.s);
+    close(s);
 
     return -1;
 }
@@ -273,6 +424,8 @@ int acceptConnection(NetworkCTX *network)
 /* Initialise machine as worker - connect to a master and read parameters */
 int initialiseAsWorker(NetworkCTX *network, PlotCTX **p)
 {
+    uint32_t features;
+
     logMessage(DEBUG, "Creating socket");
 
     network->s = socket(AF_INET, SOCK_STREAM, 0);
@@ -294,6 +447,20 @@ int initialiseAsWorker(NetworkCTX *network, PlotCTX **p)
 		return 1;
 	}
 
+    setNoDelay(network->s);
+    setKeepAlive(network->s);
+
+    logMessage(DEBUG, "Exchanging protocol version with master");
+
+    /* Workers can always pack their rows, but only do if the master asks */
+    if (sendHandshake(network->s, FEATURE_PACKED_ROWS) || readHandshake(network->s, &features))
+    {
+        close(network->s);
+        return 1;
+    }
+
+    network->compress = (features & FEATURE_PACKED_ROWS) != 0;
+
     logMessage(DEBUG, "Getting program parameters from master");
 
     if (readParameters(p, network->s))
@@ -306,308 +473,1748 @@ int initialiseAsWorker(NetworkCTX *network, PlotCTX **p)
 }
 
 
-/* Listener */
-int listener(NetworkCTX *network, const Block *block)
+/* Create a window with room for the rows of WINDOW_BLOCKS blocks the size of
+ * block. The rows that come in are checkpointed in the journal, if there is
+ * one
+ */
+Window * createWindow(const Block *block, Journal *journal)
 {
-    /* Set of socket file descriptors */
-    fd_set set;
+    Window *window = malloc(sizeof(*window));
 
-    /* Stores the highest file descriptor in fd_set */
-    int highestFD = getHighestFD(network->workers, network->n);
+    if (!window)
+        return NULL;
+
+    window->n = 0;
+    window->journal = journal;
+    window->rows = createQueue(WINDOW_BLOCKS * block->rows);
+
+    if (!window->rows)
+    {
+        free(window);
+        return NULL;
+    }
+
+    return window;
+}
 
-    /* Lists of socket file descriptors */
-    Client *workersTemp = malloc((size_t) network->n * sizeof(*(network->workers)));
 
-    Queue *rowQueue = createRowQueue(block);
+/* Add a block to the window once the rows restored from a checkpoint are
+ * marked. Its other rows are queued behind those of the blocks before it
+ */
+int openBlock(Window *window, Block *block)
+{
+    size_t rows = (block->remainder) ? block->remainderRows : block->rows;
     size_t wroteRows = 0;
 
-    if (!workersTemp)
+    if (window->n == WINDOW_BLOCKS)
+        return 1;
+
+    for (size_t y = 0; y < rows; ++y)
+    {
+        if (block->rowComplete[y])
+            ++wroteRows;
+    }
+
+    if (queueBlock(window->rows, block))
         return 1;
 
-    /* Clear set */
-    FD_ZERO(&set);
+    window->blocks[window->n] = block;
+    window->wroteRows[window->n] = wroteRows;
+    window->n++;
 
-    /* Add master socket to set for connection requests */
-    FD_SET(network->s, &set);
+    return 0;
+}
+
+
+/* Remove the oldest block from the window once it has been written. Its rows
+ * are only still queued if the render was cancelled, in which case they are
+ * forgotten. Units of it still out with workers - the losing copies of
+ * speculated units, or any at all if the render was cancelled - are discarded
+ * when they arrive
+ */
+void closeBlock(NetworkCTX *network, Window *window)
+{
+    const Block *block;
+
+    if (window->n == 0)
+        return;
+
+    block = window->blocks[0];
 
-    if (network->s > highestFD)
-        highestFD = network->s;
+    dropBlock(window->rows, block);
 
     for (int i = 0; i < network->n; ++i)
     {
-        if (network->workers[i].s == -1)
-            continue;
-
-        FD_SET(network->workers[i].s, &set);
+        if (network->workers[i].s >= 0)
+            forgetUnits(&(network->workers[i]), block);
     }
 
-    while (1)
+    window->n--;
+
+    memmove(window->blocks, window->blocks + 1, window->n * sizeof(*(window->blocks)));
+    memmove(window->wroteRows, window->wroteRows + 1, window->n * sizeof(*(window->wroteRows)));
+}
+
+
+void freeWindow(Window *window)
+{
+    if (window)
     {
-        fd_set setTemp;
+        freeQueue(window->rows);
+        free(window);
+    }
+}
 
-        int activeSockCount;
 
-        if (highestFD == -1)
-            logMessage(WARNING, "Premature disconnect from all worker machines");
+/* Listener. Every socket is nonblocking, so a worker that sends or reads its
+ * frames slowly only holds up itself - each is read and written as far as it
+ * can be whenever epoll reports it ready. Returns once the oldest block of the
+ * window is complete, leaving the rows of the newer blocks out with workers
+ */
+int listener(NetworkCTX *network, Window *window)
+{
+    struct epoll_event events[EPOLL_EVENTS_MAX];
+
+    const Block *block;
+    size_t rows;
 
-        /* Initialise working set and array */
-        memcpy(&setTemp, &set, sizeof(set));
-        memcpy(workersTemp, network->workers, (size_t) network->n * sizeof(*(network->workers)));
+    /* Whether rows have been queued since idle workers were last served */
+    bool queued = true;
 
-        /* Wait for a socket to become active. On return, the set is modified to
-         * only contain the active sockets (hence the reinitialisation of sets
-         * at the top of the loop)
-         */
-        activeSockCount = select(highestFD + 1, &setTemp, NULL, NULL, NULL);
+    /* Whether workers are waiting for rows after the queue has run dry, and
+     * when overdue work units were last looked for to copy to them
+     */
+    bool idle = false;
+    struct timespec checked = {.tv_sec = 0, .tv_nsec = 0};
+
+    /* When work units were last looked over for any to reclaim */
+    struct timespec swept = {.tv_sec = 0, .tv_nsec = 0};
+
+    if (window->n == 0)
+        return 1;
+
+    block = window->blocks[0];
+    rows = (block->remainder) ? block->remainderRows : block->rows;
+
+    while (1)
+    {
+        int activeSockCount;
 
-        if (activeSockCount <= 0)
+        /* Rows still outstanding are left for the caller to fill in */
+        if (renderCancelled())
         {
-            logMessage(ERROR, "Failed to poll sockets");
-            free(workersTemp);
-            return 1;
+            finishLocalRows(network, window);
+            logMessage(WARNING, "Render cancelled - %zu of %zu rows received", window->wroteRows[0], rows);
+            return 2;
         }
 
-        /* If data to be read on master socket, there is a connection request */
-        if (FD_ISSET(network->s, &setTemp))
+        /* The rows may have arrived while an older block was finished */
+        if (window->wroteRows[0] >= rows)
         {
-            int i = acceptConnection(network);
-
-            if (i >= 0)
-            {
-                int ret;
+            logMessage(INFO, "All rows wrote to image");
+            return 0;
+        }
 
-                int s = network->workers[i].s;
+        /* Rows that could not be requeued would never come in */
+        if (window->rows->lost)
+        {
+            logMessage(ERROR, "Rows were lost from the work queue - abandoning the render");
+            finishLocalRows(network, window);
+            return 1;
+        }
 
-                FD_SET(s, &set);
+        /* Rows that have come in are recorded before their blocks are complete */
+        if (checkpointDue(window->journal))
+        {
+            for (size_t j = 0; j < window->n; ++j)
+                checkpointRows(window->journal, window->blocks[j], window->blocks[j]->rowComplete);
+        }
 
-                if (s > highestFD)
-                    highestFD = s;
+        /* A hung worker's rows go to the others */
+        if (network->timeout > 0.0 && reclaimRows(network, &swept, window->rows))
+            queued = true;
 
-                ret = sendParameters(s, block->parameters);
+        /* Hand requeued rows, or those of a new block, to idle workers */
+        while (queued && window->rows->n > 0)
+        {
+            queued = false;
 
-                if (ret == -2)
-                {
-                    logMessage(INFO, "Worker shutdown connection, closing connection");
-                    closeSocket(&set, &highestFD, network, i, rowQueue);
-                }
-                else if (ret)
-                {
-                    logMessage(ERROR, "Sending parameters to worker failed, closing connection");
-                    closeSocket(&set, &highestFD, network, i, rowQueue);
-                }
-                else if (createClientReceiveBuffer(&(network->workers[i]), block->rowSize))
-                {
-                    closeSocket(&set, &highestFD, network, i, rowQueue);
-                }
+            for (int i = 0; i < network->n && window->rows->n > 0; ++i)
+            {
+                if (network->workers[i].s >= 0 && network->workers[i].requests > 0
+                    && allocateRows(network, i, window)
+                    && closeClient(network, i, window->rows))
+                    queued = true;
             }
 
-            if (--activeSockCount <= 0)
-                continue;
+            allocateLocalRows(network, window);
         }
 
-        for (int i = 0; i < network->n && activeSockCount > 0; ++i)
-        {
-            ssize_t readBytes;
+        /* Copy overdue work units to workers left idle by the empty queue,
+         * waking every so often to look for more while any are waiting, and
+         * otherwise to look for work units to reclaim
+         */
+        idle = false;
 
-            char buffer[NETWORK_BUFFER_SIZE] = {'\0'};
+        if (network->speculate > 0.0 && window->rows->n == 0 && copyRows(network, window, &checked, &idle))
+        {
+            queued = true;
+            continue;
+        }
 
-            int activeSock = workersTemp[i].s;
+        activeSockCount = epoll_wait(network->epoll, events, EPOLL_EVENTS_MAX,
+                                     (idle) ? SPECULATION_INTERVAL : (network->timeout > 0.0) ? RECLAIM_INTERVAL : -1);
 
-            if (!FD_ISSET(activeSock, &setTemp))
-                continue;
+        /* Interrupted by a cancellation signal */
+        if (activeSockCount < 0 && errno == EINTR)
+            continue;
 
-            /* If socket is active */
-            activeSockCount--;
+        if (activeSockCount < 0)
+        {
+            logMessage(ERROR, "Failed to poll sockets");
+            finishLocalRows(network, window);
+            return 1;
+        }
 
-            /* Read request into buffer */
-            readBytes = readSocket(buffer, activeSock, sizeof(buffer));
+        for (int e = 0; e < activeSockCount; ++e)
+        {
+            Client *worker = events[e].data.ptr;
+            int i, ret = 0;
 
-            /* Client issued shutdown or error */
-            if (readBytes <= 0)
-            {
-                closeSocket(&set, &highestFD, network, i, rowQueue);
-                continue;
-            }
-            else if (readBytes != sizeof(buffer))
+            /* If data to be read on master socket, there is a connection request */
+            if (!worker)
             {
+                acceptConnection(network);
                 continue;
             }
 
-            buffer[sizeof(buffer) - 1] = '\0';
-
-            if (!strcmp(buffer, ROW_REQUEST)) /* New row request */
+            /* The master's own threads have calculated their work unit */
+            if (network->local && events[e].data.ptr == network->local)
             {
-                size_t nextRow = 0;
+                ret = collectLocalRows(network, window);
 
-                /* If popFromQueue fails, the queue is empty and we ignore */
-                if (!popFromQueue(&nextRow, rowQueue))
+                if (ret == 1)
                 {
-                    memset(buffer, '\0', sizeof(buffer));
-                    snprintf(buffer, sizeof(buffer), "%zu", nextRow);
-                    logMessage(DEBUG, "Allocating row %s to worker on socket %d", buffer, activeSock);
-
-                    /* Client issued shutdown or error */
-                    if (writeSocket(buffer, activeSock, sizeof(buffer)) <= 0)
-                        closeSocket(&set, &highestFD, network, i, rowQueue);
-
-                    network->workers[i].row = nextRow;
-                    network->workers[i].rowAllocated = true;
+                    logMessage(INFO, "All rows wrote to image");
+                    return 0;
                 }
-            }
-            else if (!strcmp(buffer, ROW_RESPONSE)) /* Row data */
-            {
-                /* Read row data into buffer */
-                readBytes = readSocket(workersTemp[i].buffer + workersTemp[i].read, activeSock, workersTemp[i].n - workersTemp[i].read);
-
-                /* Client issued shutdown or error */
-                if (readBytes <= 0)
+                else if (ret)
                 {
-                    closeSocket(&set, &highestFD, network, i, rowQueue);
+                    queued = true;
                 }
-                else if ((size_t) readBytes == workersTemp[i].n - workersTemp[i].read)
-                {       
-                    size_t rows = (block->remainder) ? block->remainderRows : block->rows;
 
-                    memcpy(block->array + workersTemp[i].row * workersTemp[i].n, workersTemp[i].buffer, workersTemp[i].n);
+                allocateLocalRows(network, window);
+                continue;
+            }
 
-                    network->workers[i].rowAllocated = false;
-                    network->workers[i].row = 0;
-                    network->workers[i].read = 0;
-                    memset(network->workers[i].buffer, '\0', network->workers[i].n);
+            i = (int) (worker - network->workers);
 
-                    logMessage(INFO, "Row %zu from socket %d wrote to array", workersTemp[i].row, activeSock);
+            /* Closed earlier in this batch of events */
+            if (worker->s < 0)
+                continue;
 
-                    if (++wroteRows >= rows)
-                    {
-                        logMessage(INFO, "All rows wrote to image");
-                        free(workersTemp);
-                        return 0;
-                    }
-                }
-                else
-                {
-                    network->workers[i].read += (size_t) readBytes;
-                }
+            if (events[e].events & EPOLLOUT)
+                ret = flushClient(network, worker);
+
+            if (!ret && (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                ret = readClient(network, i, window);
+
+            if (ret == 1)
+            {
+                logMessage(INFO, "All rows wrote to image");
+                return 0;
             }
-            else
+            else if (ret == -2)
             {
-                sendError(activeSock);
+                logMessage(INFO, "Worker shutdown connection, closing connection");
             }
-            
+
+            if (ret && closeClient(network, i, window->rows))
+                queued = true;
         }
     }
 }
 
 
-/* Close socket connection and modify fd_set and NetworkCTX socket array */
-static void closeSocket(fd_set *set, int *highestFD, NetworkCTX *network, int i, Queue *rows)
+/* Start the master's own threads on rows from the same queue as the workers.
+ * The listener allocates and collects their work units itself, and is woken by
+ * a pipe when one is calculated, so the queue and the count of rows received
+ * are only ever touched by the listener
+ */
+int startLocalWorker(NetworkCTX *network, RowRenderer render, void *arg, size_t capacity)
 {
-    int s = network->workers[i].s;
-
-    logMessage(INFO, "Closing connection with socket %d", s);
+    LocalWorker *local = malloc(sizeof(*local));
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = local};
 
-    close(s);
-    FD_CLR(s, set);
-    network->workers[i].s = -1;
+    if (!local)
+        return 1;
 
-    if (network->workers[i].rowAllocated)
+    resetClient(&(local->client), -1);
+    local->client.capacity = (capacity > 1) ? capacity : 1;
+    local->render = render;
+    local->arg = arg;
+    local->dest = NULL;
+    local->assigned = false;
+    local->finished = false;
+    local->ret = 0;
+    local->stop = false;
+
+    if (pipe(local->wake))
     {
-        pushToQueue(rows, network->workers[i].row);
-        network->workers[i].rowAllocated = false;
+        logMessage(ERROR, "Could not create pipe to the master's threads");
+        free(local);
+        return 1;
     }
-    
-    freeClientReceiveBuffer(&(network->workers[i]));
 
-    /* Recalculate highest FD in set (if needed) */
-    if (s == *highestFD)
+    if (setNonblocking(local->wake[0]) || epoll_ctl(network->epoll, EPOLL_CTL_ADD, local->wake[0], &event))
     {
-        *highestFD = getHighestFD(network->workers, network->n);
+        logMessage(ERROR, "Could not watch pipe to the master's threads");
+        close(local->wake[0]);
+        close(local->wake[1]);
+        free(local);
+        return 1;
+    }
 
-        if (network->s > *highestFD)
-            *highestFD = network->s;
+    pthread_mutex_init(&(local->lock), NULL);
+    pthread_cond_init(&(local->cond), NULL);
+
+    if (pthread_create(&(local->pid), NULL, runLocalWorker, local))
+    {
+        logMessage(ERROR, "Thread could not be created");
+        pthread_mutex_destroy(&(local->lock));
+        pthread_cond_destroy(&(local->cond));
+        close(local->wake[0]);
+        close(local->wake[1]);
+        free(local);
+        return 1;
     }
+
+    network->local = local;
+
+    return 0;
 }
 
 
-/* Calculate the highest FD in set */
-static int getHighestFD(const Client *clients, int n)
+/* Stop the master's own threads. The listener has always collected their last
+ * work unit by the time it returns
+ */
+void stopLocalWorker(NetworkCTX *network)
 {
-    int highestFD = -1;
+    LocalWorker *local = network->local;
 
-    for (int i = 0; i < n; ++i)
-    {
-        if (clients[i].s > highestFD)
-            highestFD = clients[i].s;
-    }
+    if (!local)
+        return;
+
+    pthread_mutex_lock(&(local->lock));
+    local->stop = true;
+    pthread_cond_broadcast(&(local->cond));
+    pthread_mutex_unlock(&(local->lock));
 
-    return highestFD;
+    pthread_join(local->pid, NULL);
+
+    /* Closing the pipe also removes it from the epoll instance */
+    close(local->wake[0]);
+    close(local->wake[1]);
+
+    pthread_mutex_destroy(&(local->lock));
+    pthread_cond_destroy(&(local->cond));
+
+    free(local);
+    network->local = NULL;
 }
 
 
-static Queue * createRowQueue(const Block *block)
+/* Log how many work units were copied to idle workers, and how many of the
+ * copies came in first
+ */
+void logSpeculation(const NetworkCTX *network)
 {
-    size_t rows = (block->remainder) ? block->remainderRows : block->rows;
-    Queue *q = createQueue(rows);
+    if (network->copies == 0)
+        return;
 
-    size_t blockOffset = block->id * block->rows;
+    logMessage(INFO, "%zu work units copied to idle workers, %zu of the copies came in first",
+               network->copies, network->copyWins);
+}
 
-    if (!q)
-        return NULL;
-    
-    for (size_t i = blockOffset; i < blockOffset + rows; ++i)
-    {
-        if (pushToQueue(q, i))
-        {
-            freeQueue(q);
-            return NULL;
-        }
-    }
 
-    return q;
+/* Log how small a worker's packed rows were against the rows themselves */
+void logCompression(const Client *worker)
+{
+    if (!(worker->features & FEATURE_PACKED_ROWS) || worker->wireBytes == 0)
+        return;
+
+    logMessage(INFO, "Socket %d sent %" PRIu64 " bytes of rows in %" PRIu64 " bytes (compression ratio %.2f)",
+               worker->s, worker->rowBytes, worker->wireBytes,
+               (double) worker->rowBytes / (double) worker->wireBytes);
 }
 
 
-/* Create and allocate memory to the queue object */
-static Queue * createQueue(size_t n)
+/* Disable Nagle's algorithm so that small requests are not held back */
+static int setNoDelay(int s)
 {
-    Queue *q = malloc(sizeof(*q));
+    const int SOCK_OPT = 1;
 
-    if (!q)
-        return NULL;
+    if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const void *) &SOCK_OPT, (socklen_t) sizeof(SOCK_OPT)))
+    {
+        logMessage(WARNING, "Could not disable Nagle's algorithm on socket %d", s);
+        return 1;
+    }
 
-    q->queue = malloc(n * sizeof(*(q->queue)));
+    return 0;
+}
 
-    if (!q->queue)
+
+/* Have the kernel probe a quiet connection, so that one to a machine that has
+ * gone away or been cut off fails rather than waiting forever. Data left
+ * unacknowledged for as long fails it too
+ */
+static int setKeepAlive(int s)
+{
+    const int SOCK_OPT = 1;
+    const int USER_TIMEOUT = (KEEPALIVE_IDLE + KEEPALIVE_INTERVAL * KEEPALIVE_PROBES) * 1000;
+
+    if (setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, (const void *) &SOCK_OPT, (socklen_t) sizeof(SOCK_OPT))
+        || setsockopt(s, IPPROTO_TCP, TCP_KEEPIDLE, (const void *) &KEEPALIVE_IDLE, (socklen_t) sizeof(KEEPALIVE_IDLE))
+        || setsockopt(s, IPPROTO_TCP, TCP_KEEPINTVL, (const void *) &KEEPALIVE_INTERVAL,
+                      (socklen_t) sizeof(KEEPALIVE_INTERVAL))
+        || setsockopt(s, IPPROTO_TCP, TCP_KEEPCNT, (const void *) &KEEPALIVE_PROBES,
+                      (socklen_t) sizeof(KEEPALIVE_PROBES)))
     {
-        free(q);
-        return NULL;
+        logMessage(WARNING, "Could not enable keepalive probes on socket %d", s);
+        return 1;
     }
 
-    q->size = n;
-    q->n = 0;
+    #ifdef TCP_USER_TIMEOUT
+    if (setsockopt(s, IPPROTO_TCP, TCP_USER_TIMEOUT, (const void *) &USER_TIMEOUT, (socklen_t) sizeof(USER_TIMEOUT)))
+    {
+        logMessage(WARNING, "Could not limit unacknowledged data on socket %d", s);
+        return 1;
+    }
+    #else
+    (void) USER_TIMEOUT;
+    #endif
 
-    return q;
+    return 0;
 }
 
 
-/* Add item to queue */
-static int pushToQueue(Queue *q, size_t n)
+static int setNonblocking(int s)
 {
-    if (q->n == q->size)
-        return 1;
-    
-    q->queue[(q->n)++] = n;
+    int SOCK_OPT = 1;
+
+	if (ioctl(s, FIONBIO, &SOCK_OPT) < 0)
+	{
+        logMessage(ERROR, "Could not change socket %d to nonblocking", s);
+		return 1;
+	}
+
     return 0;
 }
 
 
-/* Remove item from queue */
-static int popFromQueue(size_t *n, Queue *q)
+/* Every worker holds a file descriptor, so raise the soft limit on them as far
+ * as the hard limit allows
+ */
+static void raiseFileLimit(int n)
 {
-    if (q->n == 0)
-        return 1;
-    
-    *n = q->queue[--(q->n)];
+    struct rlimit limit;
+    rlim_t needed = (rlim_t) n + FILE_DESCRIPTORS_RESERVED;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur >= needed)
+        return;
+
+    limit.rlim_cur = (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) ? limit.rlim_max : needed;
+
+    if (setrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur < needed)
+    {
+        logMessage(WARNING, "Open file limit of %ju may not allow %d workers to connect",
+                   (uintmax_t) limit.rlim_cur, n);
+    }
+}
+
+
+static void resetClient(Client *client, int s)
+{
+    client->s = s;
+    client->state = CLIENT_HANDSHAKE;
+    client->headerBytes = 0;
+    client->payload = NULL;
+    client->payloadBytes = 0;
+    client->unit = 0;
+    client->out = NULL;
+    client->outSize = 0;
+    client->outLength = 0;
+    client->outSent = 0;
+    client->writing = false;
+    client->features = 0;
+    client->rowBytes = 0;
+    client->wireBytes = 0;
+    client->requests = 0;
+    client->capacity = 1;
+    client->unitCount = 0;
+    client->received.tv_sec = 0;
+    client->received.tv_nsec = 0;
+    client->rate = 0.0;
+    client->n = 0;
+    client->buffer = NULL;
+}
+
+
+/* Read from a worker until its socket runs dry, acting on each frame as it is
+ * completed. Return 1 once the oldest block is complete, or negative if the
+ * worker is to be closed (-2 if it closed the connection itself)
+ */
+static int readClient(NetworkCTX *network, int i, Window *window)
+{
+    Client *worker = &(network->workers[i]);
+
+    while (1)
+    {
+        ssize_t readBytes;
+        int ret = 0;
+
+        if (worker->headerBytes < FRAME_HEADER_SIZE)
+        {
+            readBytes = recv(worker->s, worker->header + worker->headerBytes,
+                             FRAME_HEADER_SIZE - worker->headerBytes, 0);
+        }
+        else if (!worker->payload)
+        {
+            size_t remaining = (size_t) worker->frame.length - worker->payloadBytes;
+
+            readBytes = recv(worker->s, discard, (remaining < sizeof(discard)) ? remaining : sizeof(discard), 0);
+        }
+        else
+        {
+            readBytes = recv(worker->s, worker->payload + worker->payloadBytes,
+                             (size_t) worker->frame.length - worker->payloadBytes, 0);
+        }
+
+        if (readBytes == 0)
+        {
+            return -2;
+        }
+        else if (readBytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            else if (wouldBlock(errno))
+                return 0;
+            else if (errno == ECONNRESET)
+                return -2;
+
+            logMessage(ERROR, "Could not read from socket %d", worker->s);
+            return -1;
+        }
+
+        if (worker->headerBytes < FRAME_HEADER_SIZE)
+        {
+            worker->headerBytes += (size_t) readBytes;
+
+            if (worker->headerBytes < FRAME_HEADER_SIZE)
+                continue;
+
+            ret = unpackFrameHeader(&(worker->frame), worker->header);
+
+            if (!ret)
+                ret = beginFrame(network, i, window);
+        }
+        else
+        {
+            worker->payloadBytes += (size_t) readBytes;
+        }
+
+        /* Once the whole payload is in */
+        if (!ret && worker->payloadBytes == worker->frame.length)
+        {
+            worker->headerBytes = 0;
+            worker->payloadBytes = 0;
+
+            ret = endFrame(network, i, window);
+        }
+
+        if (ret == -3)
+        {
+            Frame error = {.type = FRAME_ERROR, .job = 0, .firstRow = 0, .rowCount = 0, .length = 0};
+
+            /* Best effort - the connection is closed either way */
+            if (!queueFrame(worker, &error, NULL))
+                flushClient(network, worker);
+
+            return -1;
+        }
+        else if (ret)
+        {
+            return ret;
+        }
+    }
+}
+
+
+/* Check a frame header from a worker and decide where its payload goes. Every
+ * payload has a bounded size, known before any of it is read. Row data is read
+ * straight into its place in the block, and packed rows into the worker's
+ * receive buffer to be unpacked there once complete
+ */
+static int beginFrame(NetworkCTX *network, int i, const Window *window)
+{
+    Client *worker = &(network->workers[i]);
+    const Frame *frame = &(worker->frame);
+    const WorkUnit *unit;
+    const Block *block;
+    int j;
+
+    if (worker->state == CLIENT_HANDSHAKE)
+    {
+        if (frame->type != FRAME_HELLO || frame->length != sizeof(worker->version))
+        {
+            logMessage(ERROR, "Expected a handshake from socket %d", worker->s);
+            return -3;
+        }
+
+        worker->payload = (char *) worker->version;
+        return 0;
+    }
+
+    switch (frame->type)
+    {
+        case FRAME_REQUEST: /* New row request */
+            if (frame->length)
+                break;
+
+            return 0;
+        case FRAME_DATA: /* Row data */
+        case FRAME_PACKED:
+            j = findRows(worker, window, frame);
+
+            if (j < 0)
+            {
+                logMessage(ERROR, "Unexpected row data from socket %d", worker->s);
+                return -3;
+            }
+
+            worker->unit = (size_t) j;
+            unit = &(worker->units[j]);
+
+            /* Rows already in from another copy, or of a closed block */
+            if (unit->stale)
+            {
+                worker->payload = NULL;
+                return 0;
+            }
+            else if (frame->type == FRAME_PACKED)
+            {
+                worker->payload = worker->buffer;
+                return 0;
+            }
+
+            /* Row numbers are relative to the image, not the block */
+            block = window->blocks[findBlock(window, unit->first)];
+            worker->payload = block->array + (unit->first - block->id * block->rows) * block->rowSize;
+            return 0;
+        default:
+            break;
+    }
+
+    logMessage(ERROR, "Unexpected frame from socket %d", worker->s);
+
+    return -3;
+}
+
+
+/* Act on a complete frame from a worker */
+static int endFrame(NetworkCTX *network, int i, Window *window)
+{
+    Client *worker = &(network->workers[i]);
+    const Frame *frame = &(worker->frame);
+    WorkUnit unit;
+
+    switch (frame->type)
+    {
+        case FRAME_HELLO:
+            return acceptWorker(network, i, window->blocks[0]);
+        case FRAME_REQUEST:
+            if (worker->requests + worker->unitCount >= WORK_UNITS_MAX)
+            {
+                logMessage(ERROR, "Too many work units requested by socket %d", worker->s);
+                return -3;
+            }
+
+            worker->capacity = (frame->rowCount > 1) ? (size_t) frame->rowCount : 1;
+            worker->requests++;
+
+            return allocateRows(network, i, window);
+        case FRAME_DATA:
+        case FRAME_PACKED:
+            unit = worker->units[worker->unit];
+
+            /* Another copy of the rows came in first */
+            if (unit.stale)
+            {
+                logMessage(DEBUG, "Rows %zu to %zu from socket %d already in, discarding",
+                           unit.first, unit.first + unit.count - 1, worker->s);
+                removeUnit(worker, worker->unit);
+                updateRate(worker, &unit);
+                return 0;
+            }
+
+            /* Rows that could not be unpacked are requeued with the worker's others */
+            if (receiveRows(network, i, window))
+                return -3;
+
+            if (unit.copy || unit.copied)
+                settleCopies(network, i, &unit);
+
+            return completeRows(window, &unit);
+        default:
+            return -3;
+    }
+}
+
+
+/* Answer a worker's handshake with the master's own and the plot parameters */
+static int acceptWorker(NetworkCTX *network, int i, const Block *block)
+{
+    Client *worker = &(network->workers[i]);
+
+    unsigned char version[HANDSHAKE_SIZE];
+    char parameters[PARAMETERS_FRAME_SIZE] = {'\0'};
+    int length;
+
+    uint32_t features;
+
+    Frame hello = {.type = FRAME_HELLO, .job = 0, .firstRow = 0, .rowCount = 0, .length = sizeof(version)};
+    Frame frame = {.type = FRAME_PARAMETERS, .job = 0, .firstRow = 0, .rowCount = 0, .length = 0};
+
+    if (unpackHandshake(&features, worker->version))
+        return -3;
+
+    /* Only features both sides want are used */
+    worker->features = (network->compress) ? features & FEATURE_PACKED_ROWS : 0;
+
+    packHandshake(version, worker->features);
+    length = serialiseParameters(parameters, block->parameters);
+
+    if (length < 0)
+    {
+        logMessage(ERROR, "Setting up worker failed, closing connection");
+        return -1;
+    }
+
+    frame.length = (uint64_t) length;
+
+    logMessage(DEBUG, "Sending plot parameters to socket %d", worker->s);
+
+    if (queueFrame(worker, &hello, version) || queueFrame(worker, &frame, parameters)
+        || ((worker->features & FEATURE_PACKED_ROWS) && createClientReceiveBuffer(worker, block->rowSize)))
+    {
+        logMessage(ERROR, "Memory allocation failed");
+        return -1;
+    }
+
+    worker->state = CLIENT_READY;
+
+    return flushClient(network, worker);
+}
+
+
+/* Append a frame to a worker's send queue */
+static int queueFrame(Client *client, const Frame *frame, const void *payload)
+{
+    size_t n = FRAME_HEADER_SIZE + (size_t) frame->length;
+
+    if (client->outLength + n > client->outSize)
+    {
+        unsigned char *out;
+        size_t size = 2 * client->outSize;
+
+        /* Discard what has been sent before growing the queue */
+        if (client->outSent)
+        {
+            memmove(client->out, client->out + client->outSent, client->outLength - client->outSent);
+            client->outLength -= client->outSent;
+            client->outSent = 0;
+        }
+
+        if (size < client->outLength + n)
+            size = client->outLength + n;
+
+        if (client->outLength + n > client->outSize)
+        {
+            out = realloc(client->out, size);
+
+            if (!out)
+                return -1;
+
+            client->out = out;
+            client->outSize = size;
+        }
+    }
+
+    packFrameHeader(client->out + client->outLength, frame);
+
+    if (frame->length)
+        memcpy(client->out + client->outLength + FRAME_HEADER_SIZE, payload, (size_t) frame->length);
+
+    client->outLength += n;
+
+    return 0;
+}
+
+
+/* Send as much of a worker's send queue as its socket takes. Whatever is left
+ * is sent once epoll reports the socket writable
+ */
+static int flushClient(NetworkCTX *network, Client *client)
+{
+    while (client->outSent < client->outLength)
+    {
+        ssize_t sentBytes = send(client->s, client->out + client->outSent, client->outLength - client->outSent, 0);
+
+        if (sentBytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            else if (wouldBlock(errno))
+                return (client->writing) ? 0 : watchClient(network, client, true);
+            else if (errno == ECONNRESET || errno == EPIPE)
+                return -2;
+
+            logMessage(ERROR, "Could not write to socket %d", client->s);
+            return -1;
+        }
+
+        client->outSent += (size_t) sentBytes;
+    }
+
+    client->outLength = 0;
+    client->outSent = 0;
+
+    return (client->writing) ? watchClient(network, client, false) : 0;
+}
+
+
+/* Change whether epoll reports a worker's socket as writable */
+static int watchClient(NetworkCTX *network, Client *client, bool writable)
+{
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+
+    if (writable)
+        event.events |= EPOLLOUT;
+
+    if (epoll_ctl(network->epoll, EPOLL_CTL_MOD, client->s, &event))
+    {
+        logMessage(ERROR, "Could not watch socket %d", client->s);
+        return -1;
+    }
+
+    client->writing = writable;
+
+    return 0;
+}
+
+
+/* EAGAIN and EWOULDBLOCK may be equal macros, so separate conditionals will
+ * silence a -Wlogical-op warning if they are
+ */
+static bool wouldBlock(int error)
+{
+    if (error == EAGAIN)
+        return true;
+    else if (error == EWOULDBLOCK)
+        return true;
+
+    return false;
+}
+
+
+/* Answer a worker's outstanding requests with the next rows in the queue. Any
+ * left unanswered are answered once rows are requeued or another block is opened
+ */
+static int allocateRows(NetworkCTX *network, int i, const Window *window)
+{
+    Client *worker = &(network->workers[i]);
+    Queue *rows = window->rows;
+    size_t rowSize = window->blocks[0]->rowSize;
+
+    while (worker->requests > 0)
+    {
+        size_t first, n;
+
+        if (popFromQueue(&first, &n, rows, getWorkUnitSize(network, worker, rows)))
+            break;
+
+        /* The job is the block the rows belong to */
+        if (sendUnit(worker, rowSize, first, n, (uint32_t) window->blocks[findBlock(window, first)]->id))
+        {
+            pushToQueue(rows, first, n);
+            return -1;
+        }
+
+        logMessage(DEBUG, "Allocating rows %zu to %zu to worker on socket %d", first, first + n - 1, worker->s);
+    }
+
+    return flushClient(network, worker);
+}
+
+
+/* Queue a frame allocating rows to a worker in answer to one of its requests,
+ * and record them as its newest work unit
+ */
+static int sendUnit(Client *worker, size_t rowSize, size_t first, size_t n, uint32_t job)
+{
+    WorkUnit *unit = &(worker->units[worker->unitCount]);
+    Frame frame = {.type = FRAME_ROWS, .job = job, .firstRow = first, .rowCount = n, .length = 0};
+
+    /* Make room for the rows to be returned packed */
+    if ((worker->features & FEATURE_PACKED_ROWS) && n * rowSize > worker->n)
+    {
+        freeClientReceiveBuffer(worker);
+
+        if (createClientReceiveBuffer(worker, n * rowSize))
+        {
+            logMessage(ERROR, "Memory allocation failed");
+            return -1;
+        }
+    }
+
+    if (queueFrame(worker, &frame, NULL))
+    {
+        logMessage(ERROR, "Memory allocation failed");
+        return -1;
+    }
+
+    unit->first = first;
+    unit->count = n;
+    unit->job = job;
+    clock_gettime(CLOCK_MONOTONIC, &(unit->sent));
+    unit->copy = false;
+    unit->copied = false;
+    unit->stale = false;
+
+    worker->unitCount++;
+    worker->requests--;
+
+    return 0;
+}
+
+
+/* Size a worker's next work unit so that it takes about WORK_UNIT_TIME at the
+ * worker's measured rate. Towards the end of the image, units shrink to a share
+ * of the remaining rows so that no worker is left with a long unit on its own
+ */
+static size_t getWorkUnitSize(const NetworkCTX *network, const Client *worker, const Queue *rows)
+{
+    size_t n = worker->capacity;
+    size_t share;
+    int workers = network->connected + ((network->local) ? 1 : 0);
+
+    /* A new worker is sent one row to measure its rate */
+    if (worker->rate <= 0.0)
+        return 1;
+
+    if (worker->rate * WORK_UNIT_TIME < (double) n)
+        n = (size_t) (worker->rate * WORK_UNIT_TIME);
+
+    share = rows->rows / (2 * (size_t) ((workers > 0) ? workers : 1));
+
+    if (n > share)
+        n = share;
+
+    return (n < 1) ? 1 : n;
+}
+
+
+/* Find the work unit of a worker that a frame of row data belongs to. Packed
+ * rows must be smaller than the rows themselves
+ */
+static int findRows(const Client *worker, const Window *window, const Frame *frame)
+{
+    for (size_t j = 0; j < worker->unitCount; ++j)
+    {
+        const WorkUnit *unit = &(worker->units[j]);
+        size_t size = unit->count * window->blocks[0]->rowSize;
+
+        if (unit->first != frame->firstRow || unit->count != frame->rowCount || unit->job != frame->job)
+            continue;
+
+        if (frame->type == FRAME_DATA && frame->length == size)
+            return (int) j;
+        else if (frame->type == FRAME_PACKED && (worker->features & FEATURE_PACKED_ROWS)
+                 && frame->length > 0 && frame->length < size)
+            return (int) j;
+    }
+
+    return -1;
+}
+
+
+/* Unpack the pixels of the work unit just read from a worker into its block if
+ * they were packed. Otherwise they were read straight into it
+ */
+static int receiveRows(NetworkCTX *network, int i, const Window *window)
+{
+    Client *worker = &(network->workers[i]);
+    WorkUnit unit = worker->units[worker->unit];
+    size_t j = worker->unit;
+
+    const Block *block = window->blocks[findBlock(window, unit.first)];
+
+    /* Row numbers are relative to the image, not the block */
+    size_t y = unit.first - block->id * block->rows;
+    size_t size = unit.count * block->rowSize;
+
+    if (worker->frame.type == FRAME_PACKED
+        && unpackRows((unsigned char *) block->array + y * block->rowSize, size,
+                      (const unsigned char *) worker->buffer, (size_t) worker->frame.length))
+    {
+        logMessage(ERROR, "Could not unpack rows %zu to %zu from socket %d",
+                   unit.first, unit.first + unit.count - 1, worker->s);
+        return -1;
+    }
+
+    worker->rowBytes += size;
+    worker->wireBytes += worker->frame.length;
+
+    removeUnit(worker, j);
+
+    updateRate(worker, &unit);
+
+    logMessage(INFO, "Rows %zu to %zu from socket %d wrote to array",
+               unit.first, unit.first + unit.count - 1, worker->s);
+
+    return 0;
+}
+
+
+/* Mark the rows of a returned work unit complete. Return 1 once the oldest
+ * block of the window is complete
+ */
+static int completeRows(Window *window, const WorkUnit *unit)
+{
+    int j = findBlock(window, unit->first);
+    const Block *block = window->blocks[j];
+    size_t y = unit->first - block->id * block->rows;
+
+    for (size_t k = 0; k < unit->count; ++k)
+        block->rowComplete[y + k] = true;
+
+    window->wroteRows[j] += unit->count;
+
+    block = window->blocks[0];
+
+    return (window->wroteRows[0] >= ((block->remainder) ? block->remainderRows : block->rows)) ? 1 : 0;
+}
+
+
+/* Mark a worker's work unit stale, so that its rows are discarded when they
+ * arrive. If they are being read into the block right now, the rest of them
+ * are discarded - the block may be reused by the time they are all in
+ */
+static void markStale(Client *worker, size_t j)
+{
+    worker->units[j].stale = true;
+
+    if (worker->headerBytes == FRAME_HEADER_SIZE && worker->unit == j && worker->frame.type == FRAME_DATA)
+        worker->payload = NULL;
+}
+
+
+/* Remove a returned work unit from those a worker holds */
+static void removeUnit(Client *worker, size_t j)
+{
+    memmove(&(worker->units[j]), &(worker->units[j + 1]), (worker->unitCount - j - 1) * sizeof(*(worker->units)));
+    worker->unitCount--;
+}
+
+
+/* Update a worker's rate with the work unit it has just returned */
+static void updateRate(Client *worker, const WorkUnit *unit)
+{
+    struct timespec now;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    elapsed = getUnitTime(worker, unit, &now);
+    worker->received = now;
+
+    /* Average the rate over the last few units so that a single cheap or
+     * expensive unit does not swing the next unit's size too far
+     */
+    if (elapsed > 0.0)
+    {
+        double rate = (double) unit->count / elapsed;
+        worker->rate = (worker->rate > 0.0) ? (worker->rate + rate) / 2.0 : rate;
+    }
+}
+
+
+/* Time a worker has had to calculate a work unit by now. A worker with several
+ * units in flight calculates one while the others wait, so the time is
+ * measured from when the worker could start on it - the later of its
+ * allocation and the worker's last returned unit
+ */
+static double getUnitTime(const Client *worker, const WorkUnit *unit, const struct timespec *now)
+{
+    const struct timespec *start;
+
+    start = (worker->received.tv_sec > unit->sent.tv_sec
+             || (worker->received.tv_sec == unit->sent.tv_sec && worker->received.tv_nsec > unit->sent.tv_nsec))
+            ? &(worker->received)
+            : &(unit->sent);
+
+    return getElapsed(start, now);
+}
+
+
+/* Time a worker is expected to take over rows spread across its first units
+ * work units, from when it could start on the first. A worker calculates its
+ * units in turn, at its rate once that is measured - and no unit is expected
+ * sooner than the time a work unit is sized to take
+ */
+static double getExpectedTime(const Client *worker, size_t rows, size_t units)
+{
+    double expected = (worker->rate > 0.0) ? (double) rows / worker->rate : 0.0;
+
+    return (expected < WORK_UNIT_TIME * (double) units) ? WORK_UNIT_TIME * (double) units : expected;
+}
+
+
+static double getElapsed(const struct timespec *start, const struct timespec *end)
+{
+    return (double) (end->tv_sec - start->tv_sec) + (double) (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+/* Close a worker's connection and return the number of its work units put back
+ * in the queue. Closing the socket also removes it from the epoll instance
+ */
+static size_t closeClient(NetworkCTX *network, int i, Queue *rows)
+{
+    Client *worker = &(network->workers[i]);
+    size_t units = 0;
+
+    logMessage(INFO, "Closing connection with socket %d", worker->s);
+    logCompression(worker);
+
+    close(worker->s);
+    worker->s = -1;
+
+    /* Every unit the worker had in flight goes back in the queue, unless its
+     * rows are already in or another copy of it is still out
+     */
+    for (size_t j = 0; j < worker->unitCount; ++j)
+    {
+        const WorkUnit *unit = &(worker->units[j]);
+
+        if (unit->stale || ((unit->copy || unit->copied) && keepCopy(network, i, unit)))
+            continue;
+
+        pushToQueue(rows, unit->first, unit->count);
+        ++units;
+    }
+
+    worker->unitCount = 0;
+    worker->requests = 0;
+    
+    freeClientReceiveBuffer(worker);
+    free(worker->out);
+    worker->out = NULL;
+
+    if (--network->connected == 0)
+        logMessage(WARNING, "Premature disconnect from all worker machines");
+
+    return units;
+}
+
+
+/* Copy the oldest overdue work units to workers left idle by the empty queue,
+ * looking at most every SPECULATION_INTERVAL. Whichever copy of a unit comes
+ * in first is kept, and the other is discarded when it arrives. Return the
+ * number of work units put back in the queue by workers closed on failure, and
+ * set idle if any worker is still waiting for rows
+ */
+static size_t copyRows(NetworkCTX *network, const Window *window, struct timespec *checked, bool *idle)
+{
+    struct timespec now;
+    Overdue *overdue;
+    size_t count, next = 0, units = 0;
+
+    *idle = false;
+
+    for (int i = 0; i < network->n && !*idle; ++i)
+        *idle = network->workers[i].s >= 0 && network->workers[i].requests > 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (!*idle || getElapsed(checked, &now) * 1e3 < SPECULATION_INTERVAL)
+        return 0;
+
+    *checked = now;
+    overdue = findOverdueUnits(&count, network, &now);
+
+    if (!overdue)
+        return 0;
+
+    for (int i = 0; i < network->n && next < count; ++i)
+    {
+        Client *worker = &(network->workers[i]);
+        int ret = 0;
+
+        if (worker->s < 0 || worker->requests == 0)
+            continue;
+
+        for (size_t k = next; k < count && worker->requests > 0 && !ret; ++k)
+        {
+            WorkUnit *unit = overdue[k].unit;
+
+            /* Not its own units, nor those of a worker closed since */
+            if (unit->copied || overdue[k].worker == i || network->workers[overdue[k].worker].s < 0)
+                continue;
+
+            ret = sendUnit(worker, window->blocks[0]->rowSize, unit->first, unit->count, unit->job);
+
+            if (!ret)
+            {
+                logMessage(INFO, "Copying overdue rows %zu to %zu of socket %d to idle socket %d",
+                           unit->first, unit->first + unit->count - 1,
+                           network->workers[overdue[k].worker].s, worker->s);
+
+                unit->copied = true;
+                worker->units[worker->unitCount - 1].copy = true;
+                network->copies++;
+            }
+        }
+
+        while (next < count && overdue[next].unit->copied)
+            ++next;
+
+        if (ret || flushClient(network, worker))
+            units += closeClient(network, i, window->rows);
+    }
+
+    free(overdue);
+
+    *idle = false;
+
+    for (int i = 0; i < network->n && !*idle; ++i)
+        *idle = network->workers[i].s >= 0 && network->workers[i].requests > 0;
+
+    return units;
+}
+
+
+/* List the work units out with workers for longer than network->speculate
+ * times their expected time, oldest first. Units already copied, or copies
+ * themselves, are not listed. Return NULL if there are none
+ */
+static Overdue * findOverdueUnits(size_t *count, NetworkCTX *network, const struct timespec *now)
+{
+    Overdue *overdue = malloc((size_t) network->n * WORK_UNITS_MAX * sizeof(*overdue));
+
+    *count = 0;
+
+    if (!overdue)
+    {
+        logMessage(ERROR, "Memory allocation failed");
+        return NULL;
+    }
+
+    for (int k = 0; k < network->n; ++k)
+    {
+        Client *worker = &(network->workers[k]);
+        double elapsed;
+        size_t rows = 0;
+
+        if (worker->s < 0 || worker->unitCount == 0)
+            continue;
+
+        elapsed = getUnitTime(worker, &(worker->units[0]), now);
+
+        for (size_t j = 0; j < worker->unitCount; ++j)
+        {
+            WorkUnit *unit = &(worker->units[j]);
+
+            /* Stale units are still calculated, so they count as ahead of the rest */
+            rows += unit->count;
+
+            if (unit->stale || unit->copy || unit->copied)
+                continue;
+
+            if (elapsed > network->speculate * getExpectedTime(worker, rows, j + 1))
+            {
+                overdue[*count].unit = unit;
+                overdue[*count].worker = k;
+                ++(*count);
+            }
+        }
+    }
+
+    if (*count == 0)
+    {
+        free(overdue);
+        return NULL;
+    }
+
+    qsort(overdue, *count, sizeof(*overdue), compareOverdue);
+
+    return overdue;
+}
+
+
+/* Order overdue work units by when they were allocated */
+static int compareOverdue(const void *a, const void *b)
+{
+    const struct timespec *x = &(((const Overdue *) a)->unit->sent);
+    const struct timespec *y = &(((const Overdue *) b)->unit->sent);
+
+    if (x->tv_sec != y->tv_sec)
+        return (x->tv_sec < y->tv_sec) ? -1 : 1;
+    else if (x->tv_nsec != y->tv_nsec)
+        return (x->tv_nsec < y->tv_nsec) ? -1 : 1;
+
+    return 0;
+}
+
+
+/* Once a copied work unit is in from worker i, mark the other copy stale so
+ * that its rows are discarded when they arrive, and count a speculative win if
+ * the copy came in first
+ */
+static void settleCopies(NetworkCTX *network, int i, const WorkUnit *unit)
+{
+    for (int k = 0; k < network->n; ++k)
+    {
+        Client *worker = &(network->workers[k]);
+
+        if (k == i || worker->s < 0)
+            continue;
+
+        for (size_t j = 0; j < worker->unitCount; ++j)
+        {
+            WorkUnit *other = &(worker->units[j]);
+
+            if (!other->stale && other->first == unit->first && other->count == unit->count)
+                markStale(worker, j);
+        }
+    }
+
+    if (unit->copy)
+    {
+        network->copyWins++;
+        logMessage(INFO, "Copy of rows %zu to %zu from socket %d came in first",
+                   unit->first, unit->first + unit->count - 1, network->workers[i].s);
+    }
+}
+
+
+/* Find the other copy of a work unit of worker i that is still out. It becomes
+ * an ordinary work unit, so need not be requeued with worker i's others
+ */
+static bool keepCopy(NetworkCTX *network, int i, const WorkUnit *unit)
+{
+    for (int k = 0; k < network->n; ++k)
+    {
+        Client *worker = &(network->workers[k]);
+
+        if (k == i || worker->s < 0)
+            continue;
+
+        for (size_t j = 0; j < worker->unitCount; ++j)
+        {
+            WorkUnit *other = &(worker->units[j]);
+
+            if (!other->stale && other->first == unit->first && other->count == unit->count)
+            {
+                other->copy = false;
+                other->copied = false;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+
+/* Requeue the rows of work units out far longer than expected, looking at most
+ * every RECLAIM_INTERVAL. The units are marked stale rather than the worker
+ * closed, so a worker that was only held up carries on once its late rows are
+ * discarded, while one that has hung or been cut off holds nothing back. A
+ * unit with a copy still out is left to the copy. Return the number of work
+ * units requeued
+ */
+static size_t reclaimRows(NetworkCTX *network, struct timespec *checked, Queue *rows)
+{
+    struct timespec now;
+    size_t units = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (getElapsed(checked, &now) * 1e3 < RECLAIM_INTERVAL)
+        return 0;
+
+    *checked = now;
+
+    for (int i = 0; i < network->n; ++i)
+    {
+        Client *worker = &(network->workers[i]);
+        double elapsed;
+        size_t unitRows = 0;
+
+        if (worker->s < 0 || worker->unitCount == 0)
+            continue;
+
+        elapsed = getUnitTime(worker, &(worker->units[0]), &now);
+
+        for (size_t j = 0; j < worker->unitCount; ++j)
+        {
+            WorkUnit *unit = &(worker->units[j]);
+            double limit;
+
+            unitRows += unit->count;
+
+            if (unit->stale)
+                continue;
+
+            limit = RECLAIM_FACTOR * getExpectedTime(worker, unitRows, j + 1);
+
+            if (limit < network->timeout)
+                limit = network->timeout;
+
+            /* Later units are expected later still */
+            if (elapsed <= limit)
+                break;
+
+            logMessage(WARNING, "Rows %zu to %zu have been out with socket %d for %.1f seconds, requeueing them",
+                       unit->first, unit->first + unit->count - 1, worker->s, elapsed);
+
+            markStale(worker, j);
+
+            if ((unit->copy || unit->copied) && keepCopy(network, i, unit))
+                continue;
+
+            pushToQueue(rows, unit->first, unit->count);
+            ++units;
+        }
+    }
+
+    return units;
+}
+
+
+/* Calculate each work unit the listener assigns the master's own threads, and
+ * wake the listener once it is done
+ */
+static void * runLocalWorker(void *arg)
+{
+    LocalWorker *local = arg;
+    const char byte = 0;
+
+    pthread_mutex_lock(&(local->lock));
+
+    while (1)
+    {
+        WorkUnit unit;
+        char *dest;
+        int ret;
+
+        while (!local->assigned && !local->stop)
+            pthread_cond_wait(&(local->cond), &(local->lock));
+
+        if (!local->assigned)
+            break;
+
+        unit = local->client.units[0];
+        dest = local->dest;
+
+        pthread_mutex_unlock(&(local->lock));
+        ret = local->render(local->arg, dest, unit.first, unit.count);
+        pthread_mutex_lock(&(local->lock));
+
+        local->ret = ret;
+        local->assigned = false;
+        local->finished = true;
+        pthread_cond_broadcast(&(local->cond));
+
+        while (write(local->wake[1], &byte, 1) < 0 && errno == EINTR);
+    }
+
+    pthread_mutex_unlock(&(local->lock));
+
+    return NULL;
+}
+
+
+/* Assign the master's own threads the next rows in the queue if they are idle */
+static void allocateLocalRows(NetworkCTX *network, const Window *window)
+{
+    LocalWorker *local = network->local;
+    const Block *block;
+    WorkUnit *unit;
+    size_t first, n;
+
+    /* A calculated unit still holds its place until it is collected */
+    if (!local || local->client.unitCount > 0
+        || popFromQueue(&first, &n, window->rows, getWorkUnitSize(network, &(local->client), window->rows)))
+        return;
+
+    block = window->blocks[findBlock(window, first)];
+
+    unit = &(local->client.units[0]);
+    unit->first = first;
+    unit->count = n;
+    unit->job = (uint32_t) block->id;
+    clock_gettime(CLOCK_MONOTONIC, &(unit->sent));
+    unit->copy = false;
+    unit->copied = false;
+    unit->stale = false;
+
+    local->client.unitCount = 1;
+
+    logMessage(DEBUG, "Allocating rows %zu to %zu to the master's threads", first, first + n - 1);
+
+    pthread_mutex_lock(&(local->lock));
+    local->dest = block->array + (first - block->id * block->rows) * block->rowSize;
+    local->assigned = true;
+    pthread_cond_broadcast(&(local->cond));
+    pthread_mutex_unlock(&(local->lock));
+}
+
+
+/* Collect the work unit of the master's own threads if it has been calculated.
+ * Return 1 once the oldest block is complete, or -1 if the rows were put back
+ * in the queue
+ */
+static int collectLocalRows(NetworkCTX *network, Window *window)
+{
+    LocalWorker *local = network->local;
+    WorkUnit unit = local->client.units[0];
+    char byte;
+    int ret;
+
+    /* Empty the pipe - it may still hold the wake-up of a unit collected when
+     * the render was cut short
+     */
+    while (read(local->wake[0], &byte, 1) > 0);
+
+    pthread_mutex_lock(&(local->lock));
+
+    if (!local->finished)
+    {
+        pthread_mutex_unlock(&(local->lock));
+        return 0;
+    }
+
+    local->finished = false;
+    ret = local->ret;
+
+    pthread_mutex_unlock(&(local->lock));
+
+    local->client.unitCount = 0;
+
+    /* Cut short by a cancellation */
+    if (ret)
+    {
+        pushToQueue(window->rows, unit.first, unit.count);
+        return -1;
+    }
+
+    updateRate(&(local->client), &unit);
+
+    logMessage(INFO, "Rows %zu to %zu calculated by the master wrote to array", unit.first, unit.first + unit.count - 1);
+
+    return completeRows(window, &unit);
+}
+
+
+/* Wait for the master's own threads to finish their work unit and collect it,
+ * so that they are not still writing to the block once the listener returns
+ */
+static void finishLocalRows(NetworkCTX *network, Window *window)
+{
+    LocalWorker *local = network->local;
+
+    if (!local || local->client.unitCount == 0)
+        return;
+
+    pthread_mutex_lock(&(local->lock));
+
+    while (local->assigned)
+        pthread_cond_wait(&(local->cond), &(local->lock));
+
+    pthread_mutex_unlock(&(local->lock));
+
+    collectLocalRows(network, window);
+}
+
+
+/* Find the block of the window that an image row belongs to (-1 if none) */
+static int findBlock(const Window *window, size_t row)
+{
+    for (size_t j = 0; j < window->n; ++j)
+    {
+        if (isInBlock(window->blocks[j], row))
+            return (int) j;
+    }
+
+    return -1;
+}
+
+
+static bool isInBlock(const Block *block, size_t row)
+{
+    size_t first = block->id * block->rows;
+
+    return row >= first && row - first < ((block->remainder) ? block->remainderRows : block->rows);
+}
+
+
+/* Mark the work units of a worker that belong to a block stale. The worker
+ * still returns them, so they hold their place until they are discarded
+ */
+static void forgetUnits(Client *worker, const Block *block)
+{
+    for (size_t j = 0; j < worker->unitCount; ++j)
+    {
+        if (isInBlock(block, worker->units[j].first))
+            markStale(worker, j);
+    }
+}
+
+
+/* Create and allocate memory to the queue object */
+static Queue * createQueue(size_t n)
+{
+    Queue *q = malloc(sizeof(*q));
+
+    if (!q)
+        return NULL;
+
+    /* Runs never overlap, so there are at most as many as there are rows */
+    q->queue = malloc(n * sizeof(*(q->queue)));
+
+    if (!q->queue)
+    {
+        free(q);
+        return NULL;
+    }
+
+    q->size = n;
+    q->n = 0;
+    q->rows = 0;
+    q->lost = false;
+
+    return q;
+}
+
+
+/* Queue the runs of rows of a block that are yet to be calculated, behind the
+ * runs already queued. The top of the queue is handed out first, so the runs
+ * are placed last first below the others
+ */
+static int queueBlock(Queue *q, const Block *block)
+{
+    size_t rows = (block->remainder) ? block->remainderRows : block->rows;
+    size_t blockOffset = block->id * block->rows;
+    size_t runs = 0, k = 0;
+
+    /* Rows restored from a checkpoint are not sent out again */
+    for (size_t y = 0; y < rows; ++y)
+    {
+        if (!block->rowComplete[y] && (y == 0 || block->rowComplete[y - 1]))
+            ++runs;
+    }
+
+    if (q->n + runs > q->size)
+        return 1;
+
+    memmove(q->queue + runs, q->queue, q->n * sizeof(*(q->queue)));
+
+    for (size_t end = rows; end > 0;)
+    {
+        size_t start;
+
+        if (block->rowComplete[end - 1])
+        {
+            --end;
+            continue;
+        }
+
+        for (start = end - 1; start > 0 && !block->rowComplete[start - 1]; --start);
+
+        q->queue[k].first = blockOffset + start;
+        q->queue[k].n = end - start;
+        q->rows += end - start;
+        ++k;
+
+        end = start;
+    }
+
+    q->n += runs;
+
+    return 0;
+}
+
+
+/* Remove the runs of rows of a block from the queue */
+static void dropBlock(Queue *q, const Block *block)
+{
+    size_t n = 0;
+
+    for (size_t k = 0; k < q->n; ++k)
+    {
+        if (isInBlock(block, q->queue[k].first))
+            q->rows -= q->queue[k].n;
+        else
+            q->queue[n++] = q->queue[k];
+    }
+
+    q->n = n;
+}
+
+
+/* Add a run of n rows to the queue. The queue has room for a run per row of
+ * the window, so it is only ever full if a row has been queued twice. Rows
+ * that do not fit are lost, and the listener abandons the render rather than
+ * leave a hole in the image
+ */
+static void pushToQueue(Queue *q, size_t first, size_t n)
+{
+    if (q->n == q->size)
+    {
+        logMessage(ERROR, "Work queue full - rows %zu to %zu could not be requeued", first, first + n - 1);
+        q->lost = true;
+        return;
+    }
+
+    q->queue[q->n].first = first;
+    q->queue[q->n].n = n;
+    q->n++;
+    q->rows += n;
+}
+
+
+/* Remove up to max rows from the start of the run at the top of the queue */
+static int popFromQueue(size_t *first, size_t *n, Queue *q, size_t max)
+{
+    Range *top;
+
+    if (q->n == 0)
+        return 1;
+
+    top = &(q->queue[q->n - 1]);
+
+    *first = top->first;
+    *n = (top->n < max) ? top->n : max;
+
+    top->first += *n;
+    top->n -= *n;
+    q->rows -= *n;
+
+    if (top->n == 0)
+        q->n--;
 
     return 0;
 }
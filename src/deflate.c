@@ -0,0 +1,886 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deflate.h"
+
+
+/* LZ77 window and match lengths allowed by the deflate format */
+#define WINDOW_SIZE 32768
+#define WINDOW_MASK (WINDOW_SIZE - 1)
+#define MATCH_MIN 3
+#define MATCH_MAX 258
+
+#define HASH_BITS 15
+#define HASH_SIZE (1 << HASH_BITS)
+
+/* Alphabet sizes */
+#define LITLEN_CODES 286
+#define FIXED_LITLEN_CODES 288      /* The fixed code also assigns the two unused symbols */
+#define DIST_CODES 30
+#define CODELEN_CODES 19
+
+#define END_OF_BLOCK 256
+#define LENGTH_CODE_BASE 257
+
+/* Longest codes of the literal/length and distance alphabets, and of the
+ * alphabet the code lengths are sent in
+ */
+#define CODE_LEN_MAX 15
+#define CODELEN_LEN_MAX 7
+
+/* Deflate block types */
+#define BLOCK_STORED 0
+#define BLOCK_FIXED 1
+#define BLOCK_DYNAMIC 2
+
+#define STORED_LEN_MAX 65535
+
+
+typedef struct HuffmanCode
+{
+    unsigned char lengths[FIXED_LITLEN_CODES];
+    uint16_t codes[FIXED_LITLEN_CODES];      /* Bit-reversed, as deflate sends codes most significant bit first */
+} HuffmanCode;
+
+
+/* Match candidates tried at each position */
+static const unsigned int CHAIN_MAX = 32;
+
+/* Match length that ends the search early */
+static const size_t NICE_MATCH = 128;
+
+/* Match length beyond which the next position is not tried for a longer one */
+static const size_t LAZY_MATCH = 32;
+
+/* Symbols in each deflate block. Each block gets its own Huffman codes */
+static const size_t BLOCK_SYMBOLS_MAX = 16384;
+
+/* Adler-32 modulus, and the most bytes that can be summed before reducing */
+static const uint32_t ADLER_BASE = 65521;
+static const size_t ADLER_NMAX = 5552;
+
+/* Extra bits of each length code and distance code */
+static const unsigned char LENGTH_EXTRA[LITLEN_CODES - LENGTH_CODE_BASE] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const unsigned char DIST_EXTRA[DIST_CODES] =
+{
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* Order the code length code lengths are sent in */
+static const unsigned char CODELEN_ORDER[CODELEN_CODES] =
+{
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+
+static size_t findMatch(const Deflater *d, const unsigned char *in, size_t n, size_t pos, size_t *dist);
+static void insertHash(Deflater *d, const unsigned char *in, size_t pos);
+static uint32_t hash(const unsigned char *p);
+static int flushBlock(Deflater *d, const unsigned char *in, size_t start, size_t end);
+static size_t encodeCodeLengths(unsigned char *symbols, unsigned char *extra, uint32_t *freq,
+                                const unsigned char *lengths, size_t n);
+static size_t dataBits(const HuffmanCode *litlen, const HuffmanCode *dist, const uint32_t *litlenFreq,
+                       const uint32_t *distFreq);
+static void writeSymbols(Deflater *d, const HuffmanCode *litlen, const HuffmanCode *dist);
+static void writeStored(Deflater *d, const unsigned char *in, size_t n);
+static void buildLengths(unsigned char *lengths, const uint32_t *freq, size_t n, unsigned int limit);
+static void buildCodes(HuffmanCode *code, size_t n);
+static void buildFixedCodes(HuffmanCode *litlen, HuffmanCode *dist);
+static unsigned int lengthCode(size_t length, uint32_t *extra);
+static unsigned int distCode(size_t dist, uint32_t *extra);
+static unsigned int floorLog2(size_t x);
+static int reserveOutput(Deflater *d, size_t n);
+static void putBits(Deflater *d, uint32_t value, unsigned int n);
+static void alignBits(Deflater *d);
+
+
+/* Create a deflate compressor and its buffers */
+Deflater * createDeflater(void)
+{
+    Deflater *d = malloc(sizeof(*d));
+
+    if (!d)
+        return NULL;
+
+    d->head = malloc(HASH_SIZE * sizeof(*(d->head)));
+    d->prev = malloc(WINDOW_SIZE * sizeof(*(d->prev)));
+    d->symbols = malloc(BLOCK_SYMBOLS_MAX * sizeof(*(d->symbols)));
+    d->symbolCount = 0;
+    d->out = NULL;
+    d->length = 0;
+    d->size = 0;
+    d->bits = 0;
+    d->bitCount = 0;
+
+    if (!d->head || !d->prev || !d->symbols)
+    {
+        freeDeflater(d);
+        return NULL;
+    }
+
+    return d;
+}
+
+
+/* Compress n bytes onto the end of the output as non-final deflate blocks,
+ * ending with a sync flush (an empty stored block) so the output is byte
+ * aligned. Matches never reach back before the start of the input, so the
+ * output of separate calls can be concatenated into one deflate stream
+ */
+int deflateSync(Deflater *d, const unsigned char *in, size_t n)
+{
+    size_t pos = 0;
+
+    /* Input covered by symbols so far, and by symbols of earlier blocks */
+    size_t emitted = 0, blockStart = 0;
+
+    /* Match found at the previous position, held back in case the current
+     * position has a longer one
+     */
+    size_t prevLength = 0, prevDist = 0;
+    bool pending = false;
+
+    memset(d->head, 0, HASH_SIZE * sizeof(*(d->head)));
+    d->symbolCount = 0;
+
+    while (pos < n)
+    {
+        size_t length = 0, dist = 0;
+
+        if (n - pos >= MATCH_MIN)
+        {
+            if (!pending || prevLength < LAZY_MATCH)
+                length = findMatch(d, in, n, pos, &dist);
+
+            insertHash(d, in, pos);
+        }
+
+        if (pending && prevLength >= MATCH_MIN && prevLength >= length)
+        {
+            size_t end = pos - 1 + prevLength;
+
+            d->symbols[d->symbolCount++] = (DeflateSymbol) {(uint16_t) prevLength, (uint16_t) prevDist};
+            emitted += prevLength;
+
+            /* Hash the rest of the positions the match covers */
+            for (++pos; pos < end; ++pos)
+            {
+                if (n - pos >= MATCH_MIN)
+                    insertHash(d, in, pos);
+            }
+
+            pending = false;
+        }
+        else
+        {
+            if (pending)
+            {
+                d->symbols[d->symbolCount++] = (DeflateSymbol) {in[pos - 1], 0};
+                ++emitted;
+            }
+
+            prevLength = length;
+            prevDist = dist;
+            pending = true;
+            ++pos;
+        }
+
+        if (d->symbolCount >= BLOCK_SYMBOLS_MAX)
+        {
+            if (flushBlock(d, in, blockStart, emitted))
+                return 1;
+
+            blockStart = emitted;
+        }
+    }
+
+    /* The last byte can only be a literal */
+    if (pending)
+        d->symbols[d->symbolCount++] = (DeflateSymbol) {in[n - 1], 0};
+
+    if (d->symbolCount > 0 && flushBlock(d, in, blockStart, n))
+        return 1;
+
+    if (reserveOutput(d, 8))
+        return 1;
+
+    putBits(d, BLOCK_STORED, 3);
+    alignBits(d);
+
+    d->out[d->length++] = 0x00;
+    d->out[d->length++] = 0x00;
+    d->out[d->length++] = 0xFF;
+    d->out[d->length++] = 0xFF;
+
+    return 0;
+}
+
+
+/* Free the compressor */
+void freeDeflater(Deflater *d)
+{
+    if (d)
+    {
+        free(d->head);
+        free(d->prev);
+        free(d->symbols);
+        free(d->out);
+        free(d);
+    }
+}
+
+
+/* Update an Adler-32 checksum */
+uint32_t adler32(uint32_t adler, const unsigned char *data, size_t n)
+{
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+
+    while (n > 0)
+    {
+        size_t k = (n < ADLER_NMAX) ? n : ADLER_NMAX;
+
+        n -= k;
+
+        while (k--)
+        {
+            a += *data++;
+            b += a;
+        }
+
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+
+    return (b << 16) | a;
+}
+
+
+/* Get the Adler-32 of two pieces of data from their separate checksums and the
+ * length of the second piece
+ */
+uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t n2)
+{
+    uint32_t rem = (uint32_t) (n2 % ADLER_BASE);
+    uint32_t a = adler1 & 0xFFFF;
+    uint32_t b = (uint32_t) (((uint64_t) rem * a) % ADLER_BASE);
+
+    a += (adler2 & 0xFFFF) + ADLER_BASE - 1;
+    b += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - rem;
+
+    if (a >= ADLER_BASE)
+        a -= ADLER_BASE;
+
+    if (a >= ADLER_BASE)
+        a -= ADLER_BASE;
+
+    if (b >= 2 * ADLER_BASE)
+        b -= 2 * ADLER_BASE;
+
+    if (b >= ADLER_BASE)
+        b -= ADLER_BASE;
+
+    return (b << 16) | a;
+}
+
+
+/* Find the longest earlier match for the data at pos in the window */
+static size_t findMatch(const Deflater *d, const unsigned char *in, size_t n, size_t pos, size_t *dist)
+{
+    size_t limit = (n - pos < MATCH_MAX) ? n - pos : MATCH_MAX;
+    size_t best = 0;
+    size_t candidate = d->head[hash(in + pos)];
+
+    for (unsigned int chain = CHAIN_MAX; candidate && chain > 0; --chain)
+    {
+        size_t match = candidate - 1;
+        size_t next;
+
+        /* Positions in each chain only get older */
+        if (pos - match > WINDOW_SIZE)
+            break;
+
+        /* Only a candidate that differs from the best match at its end can
+         * beat it
+         */
+        if (in[match + best] == in[pos + best])
+        {
+            size_t length = 0;
+
+            while (length < limit && in[match + length] == in[pos + length])
+                ++length;
+
+            if (length > best)
+            {
+                best = length;
+                *dist = pos - match;
+
+                if (best >= limit || best >= NICE_MATCH)
+                    break;
+            }
+        }
+
+        next = d->prev[match & WINDOW_MASK];
+
+        if (next >= candidate)
+            break;
+
+        candidate = next;
+    }
+
+    return (best >= MATCH_MIN) ? best : 0;
+}
+
+
+/* Add a position to the chain of its hash */
+static void insertHash(Deflater *d, const unsigned char *in, size_t pos)
+{
+    uint32_t h = hash(in + pos);
+
+    d->prev[pos & WINDOW_MASK] = d->head[h];
+    d->head[h] = pos + 1;
+}
+
+
+/* Hash the three bytes at p */
+static uint32_t hash(const unsigned char *p)
+{
+    uint32_t x = (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16;
+
+    return (uint32_t) (x * 2654435761U) >> (32 - HASH_BITS);
+}
+
+
+/* Write the buffered symbols, covering input bytes start to end, as whichever
+ * of a dynamic, fixed, or stored block is smallest
+ */
+static int flushBlock(Deflater *d, const unsigned char *in, size_t start, size_t end)
+{
+    uint32_t litlenFreq[LITLEN_CODES] = {0};
+    uint32_t distFreq[DIST_CODES] = {0};
+    uint32_t codelenFreq[CODELEN_CODES] = {0};
+
+    HuffmanCode litlen, dist, codelen, fixedLitlen, fixedDist;
+
+    unsigned char lengths[LITLEN_CODES + DIST_CODES];
+    unsigned char rle[LITLEN_CODES + DIST_CODES];
+    unsigned char rleExtra[LITLEN_CODES + DIST_CODES];
+    size_t rleCount;
+
+    size_t hlit = LITLEN_CODES, hdist = DIST_CODES, hclen = CODELEN_CODES;
+    size_t dynamicBits, fixedBits, storedBits;
+    size_t storedBlocks = (end - start + STORED_LEN_MAX - 1) / STORED_LEN_MAX;
+
+    for (size_t i = 0; i < d->symbolCount; ++i)
+    {
+        const DeflateSymbol *s = &(d->symbols[i]);
+        uint32_t extra;
+
+        if (s->dist)
+        {
+            ++litlenFreq[lengthCode(s->litlen, &extra)];
+            ++distFreq[distCode(s->dist, &extra)];
+        }
+        else
+        {
+            ++litlenFreq[s->litlen];
+        }
+    }
+
+    litlenFreq[END_OF_BLOCK] = 1;
+
+    buildLengths(litlen.lengths, litlenFreq, LITLEN_CODES, CODE_LEN_MAX);
+    buildLengths(dist.lengths, distFreq, DIST_CODES, CODE_LEN_MAX);
+
+    while (hlit > LENGTH_CODE_BASE && !litlen.lengths[hlit - 1])
+        --hlit;
+
+    while (hdist > 1 && !dist.lengths[hdist - 1])
+        --hdist;
+
+    /* Both code length lists are sent as one run-length encoded list */
+    memcpy(lengths, litlen.lengths, hlit);
+    memcpy(lengths + hlit, dist.lengths, hdist);
+
+    rleCount = encodeCodeLengths(rle, rleExtra, codelenFreq, lengths, hlit + hdist);
+    buildLengths(codelen.lengths, codelenFreq, CODELEN_CODES, CODELEN_LEN_MAX);
+
+    while (hclen > 4 && !codelen.lengths[CODELEN_ORDER[hclen - 1]])
+        --hclen;
+
+    dynamicBits = 3 + 5 + 5 + 4 + 3 * hclen + dataBits(&litlen, &dist, litlenFreq, distFreq);
+
+    for (unsigned int i = 0; i < CODELEN_CODES; ++i)
+        dynamicBits += codelenFreq[i] * codelen.lengths[i];
+
+    dynamicBits += 2 * codelenFreq[16] + 3 * codelenFreq[17] + 7 * codelenFreq[18];
+
+    buildFixedCodes(&fixedLitlen, &fixedDist);
+    fixedBits = 3 + dataBits(&fixedLitlen, &fixedDist, litlenFreq, distFreq);
+
+    /* Each stored block header is padded to a byte, followed by LEN and NLEN */
+    storedBits = storedBlocks * (3 + 7 + 32) + 8 * (end - start);
+
+    if (storedBits < dynamicBits && storedBits < fixedBits)
+    {
+        if (reserveOutput(d, storedBits / 8 + 8))
+            return 1;
+
+        writeStored(d, in + start, end - start);
+    }
+    else if (fixedBits <= dynamicBits)
+    {
+        if (reserveOutput(d, fixedBits / 8 + 8))
+            return 1;
+
+        putBits(d, 0, 1);
+        putBits(d, BLOCK_FIXED, 2);
+        writeSymbols(d, &fixedLitlen, &fixedDist);
+    }
+    else
+    {
+        if (reserveOutput(d, dynamicBits / 8 + 8))
+            return 1;
+
+        buildCodes(&litlen, hlit);
+        buildCodes(&dist, hdist);
+        buildCodes(&codelen, CODELEN_CODES);
+
+        putBits(d, 0, 1);
+        putBits(d, BLOCK_DYNAMIC, 2);
+        putBits(d, (uint32_t) (hlit - LENGTH_CODE_BASE), 5);
+        putBits(d, (uint32_t) (hdist - 1), 5);
+        putBits(d, (uint32_t) (hclen - 4), 4);
+
+        for (size_t i = 0; i < hclen; ++i)
+            putBits(d, codelen.lengths[CODELEN_ORDER[i]], 3);
+
+        for (size_t i = 0; i < rleCount; ++i)
+        {
+            putBits(d, codelen.codes[rle[i]], codelen.lengths[rle[i]]);
+
+            if (rle[i] == 16)
+                putBits(d, rleExtra[i], 2);
+            else if (rle[i] == 17)
+                putBits(d, rleExtra[i], 3);
+            else if (rle[i] == 18)
+                putBits(d, rleExtra[i], 7);
+        }
+
+        writeSymbols(d, &litlen, &dist);
+    }
+
+    d->symbolCount = 0;
+
+    return 0;
+}
+
+
+/* Run-length encode a list of code lengths into the code length alphabet,
+ * counting the frequency of each symbol. Returns the number of symbols
+ */
+static size_t encodeCodeLengths(unsigned char *symbols, unsigned char *extra, uint32_t *freq,
+                                const unsigned char *lengths, size_t n)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < n;)
+    {
+        unsigned char length = lengths[i];
+        size_t run = 1;
+
+        while (i + run < n && lengths[i + run] == length)
+            ++run;
+
+        if (length == 0)
+        {
+            /* Runs of 11 to 138 zeros, then of 3 to 10 */
+            while (run >= 11)
+            {
+                size_t r = (run < 138) ? run : 138;
+
+                symbols[count] = 18;
+                extra[count++] = (unsigned char) (r - 11);
+                run -= r;
+                i += r;
+            }
+
+            if (run >= 3)
+            {
+                symbols[count] = 17;
+                extra[count++] = (unsigned char) (run - 3);
+                i += run;
+                run = 0;
+            }
+        }
+        else
+        {
+            /* The length itself, then repeats of it 3 to 6 at a time */
+            symbols[count] = length;
+            extra[count++] = 0;
+            ++i;
+            --run;
+
+            while (run >= 3)
+            {
+                size_t r = (run < 6) ? run : 6;
+
+                symbols[count] = 16;
+                extra[count++] = (unsigned char) (r - 3);
+                run -= r;
+                i += r;
+            }
+        }
+
+        for (; run > 0; --run, ++i)
+        {
+            symbols[count] = length;
+            extra[count++] = 0;
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i)
+        ++freq[symbols[i]];
+
+    return count;
+}
+
+
+/* Size in bits of the block's symbols with the given codes */
+static size_t dataBits(const HuffmanCode *litlen, const HuffmanCode *dist, const uint32_t *litlenFreq,
+                       const uint32_t *distFreq)
+{
+    size_t bits = 0;
+
+    for (unsigned int i = 0; i < LITLEN_CODES; ++i)
+    {
+        size_t length = litlen->lengths[i];
+
+        if (i > LENGTH_CODE_BASE - 1)
+            length += LENGTH_EXTRA[i - LENGTH_CODE_BASE];
+
+        bits += litlenFreq[i] * length;
+    }
+
+    for (unsigned int i = 0; i < DIST_CODES; ++i)
+        bits += distFreq[i] * (size_t) (dist->lengths[i] + DIST_EXTRA[i]);
+
+    return bits;
+}
+
+
+/* Write the buffered symbols and the end of block code */
+static void writeSymbols(Deflater *d, const HuffmanCode *litlen, const HuffmanCode *dist)
+{
+    for (size_t i = 0; i < d->symbolCount; ++i)
+    {
+        const DeflateSymbol *s = &(d->symbols[i]);
+
+        if (s->dist)
+        {
+            uint32_t extra;
+            unsigned int code = lengthCode(s->litlen, &extra);
+
+            putBits(d, litlen->codes[code], litlen->lengths[code]);
+            putBits(d, extra, LENGTH_EXTRA[code - LENGTH_CODE_BASE]);
+
+            code = distCode(s->dist, &extra);
+
+            putBits(d, dist->codes[code], dist->lengths[code]);
+            putBits(d, extra, DIST_EXTRA[code]);
+        }
+        else
+        {
+            putBits(d, litlen->codes[s->litlen], litlen->lengths[s->litlen]);
+        }
+    }
+
+    putBits(d, litlen->codes[END_OF_BLOCK], litlen->lengths[END_OF_BLOCK]);
+}
+
+
+/* Write data uncompressed, as many stored blocks as it takes */
+static void writeStored(Deflater *d, const unsigned char *in, size_t n)
+{
+    do
+    {
+        size_t length = (n < STORED_LEN_MAX) ? n : STORED_LEN_MAX;
+
+        putBits(d, BLOCK_STORED, 3);
+        alignBits(d);
+
+        d->out[d->length++] = (unsigned char) (length & 0xFF);
+        d->out[d->length++] = (unsigned char) (length >> 8);
+        d->out[d->length++] = (unsigned char) (~length & 0xFF);
+        d->out[d->length++] = (unsigned char) ((~length >> 8) & 0xFF);
+
+        memcpy(d->out + d->length, in, length);
+        d->length += length;
+
+        in += length;
+        n -= length;
+    } while (n > 0);
+}
+
+
+/* Get the Huffman code lengths of an alphabet from its symbol frequencies,
+ * limited to a maximum length. If the optimal code is too long, the
+ * frequencies are flattened and the code rebuilt until it fits. At least two
+ * symbols are always given a code, as a code of one symbol is incomplete
+ */
+static void buildLengths(unsigned char *lengths, const uint32_t *freq, size_t n, unsigned int limit)
+{
+    uint16_t leaves[LITLEN_CODES];
+    uint32_t weight[2 * LITLEN_CODES];
+    uint16_t parent[2 * LITLEN_CODES];
+    unsigned char depth[2 * LITLEN_CODES];
+    size_t count = 0;
+
+    memset(lengths, 0, n);
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (freq[i])
+            leaves[count++] = (uint16_t) i;
+    }
+
+    for (size_t i = 0; count < 2; ++i)
+    {
+        if (!freq[i])
+            leaves[count++] = (uint16_t) i;
+    }
+
+    /* Sort the symbols by frequency, counting any added above as used once */
+    for (size_t i = 1; i < count; ++i)
+    {
+        uint16_t leaf = leaves[i];
+        uint32_t f = (freq[leaf]) ? freq[leaf] : 1;
+        size_t j = i;
+
+        for (; j > 0 && ((freq[leaves[j - 1]]) ? freq[leaves[j - 1]] : 1) > f; --j)
+            leaves[j] = leaves[j - 1];
+
+        leaves[j] = leaf;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+        weight[i] = (freq[leaves[i]]) ? freq[leaves[i]] : 1;
+
+    while (1)
+    {
+        size_t root = 2 * count - 2;
+        size_t nextLeaf = 0, nextNode = count;
+        unsigned int maxDepth = 0;
+
+        /* Leaves are taken in order of weight, and the merged nodes are made
+         * in order of weight, so the two lightest are always at the front of
+         * one list or the other
+         */
+        for (size_t node = count; node <= root; ++node)
+        {
+            size_t pair[2];
+
+            for (int k = 0; k < 2; ++k)
+            {
+                if (nextLeaf < count && (nextNode >= node || weight[nextLeaf] <= weight[nextNode]))
+                    pair[k] = nextLeaf++;
+                else
+                    pair[k] = nextNode++;
+            }
+
+            weight[node] = weight[pair[0]] + weight[pair[1]];
+            parent[pair[0]] = parent[pair[1]] = (uint16_t) node;
+        }
+
+        /* Parents are always made after their children */
+        depth[root] = 0;
+
+        for (size_t node = root; node-- > 0;)
+        {
+            depth[node] = (unsigned char) (depth[parent[node]] + 1);
+
+            if (node < count && depth[node] > maxDepth)
+                maxDepth = depth[node];
+        }
+
+        if (maxDepth <= limit)
+            break;
+
+        for (size_t i = 0; i < count; ++i)
+            weight[i] = (weight[i] >> 1) | 1;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+        lengths[leaves[i]] = depth[i];
+}
+
+
+/* Assign canonical codes to the first n symbols from their code lengths */
+static void buildCodes(HuffmanCode *code, size_t n)
+{
+    unsigned int count[CODE_LEN_MAX + 1] = {0};
+    uint32_t next[CODE_LEN_MAX + 1];
+    uint32_t c = 0;
+
+    for (size_t i = 0; i < n; ++i)
+        ++count[code->lengths[i]];
+
+    count[0] = 0;
+
+    for (unsigned int bits = 1; bits <= CODE_LEN_MAX; ++bits)
+    {
+        c = (c + count[bits - 1]) << 1;
+        next[bits] = c;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        unsigned int length = code->lengths[i];
+        uint32_t value, reversed = 0;
+
+        if (!length)
+            continue;
+
+        value = next[length]++;
+
+        for (unsigned int bit = 0; bit < length; ++bit)
+            reversed |= ((value >> bit) & 1) << (length - 1 - bit);
+
+        code->codes[i] = (uint16_t) reversed;
+    }
+}
+
+
+/* Get the fixed codes of the deflate format */
+static void buildFixedCodes(HuffmanCode *litlen, HuffmanCode *dist)
+{
+    for (unsigned int i = 0; i < FIXED_LITLEN_CODES; ++i)
+    {
+        if (i < 144)
+            litlen->lengths[i] = 8;
+        else if (i < 256)
+            litlen->lengths[i] = 9;
+        else if (i < 280)
+            litlen->lengths[i] = 7;
+        else
+            litlen->lengths[i] = 8;
+    }
+
+    memset(dist->lengths, 5, DIST_CODES);
+
+    buildCodes(litlen, FIXED_LITLEN_CODES);
+    buildCodes(dist, DIST_CODES);
+}
+
+
+/* Get the code and extra bits value of a match length */
+static unsigned int lengthCode(size_t length, uint32_t *extra)
+{
+    size_t l = length - MATCH_MIN;
+    unsigned int bits;
+
+    if (length == MATCH_MAX)
+    {
+        *extra = 0;
+        return LITLEN_CODES - 1;
+    }
+
+    if (l < 8)
+    {
+        *extra = 0;
+        return LENGTH_CODE_BASE + (unsigned int) l;
+    }
+
+    bits = floorLog2(l);
+    *extra = (uint32_t) (l & ((1U << (bits - 2)) - 1));
+
+    return LENGTH_CODE_BASE + 4 * (bits - 1) + (unsigned int) ((l >> (bits - 2)) & 3);
+}
+
+
+/* Get the code and extra bits value of a match distance */
+static unsigned int distCode(size_t dist, uint32_t *extra)
+{
+    size_t d = dist - 1;
+    unsigned int bits;
+
+    if (d < 4)
+    {
+        *extra = 0;
+        return (unsigned int) d;
+    }
+
+    bits = floorLog2(d);
+    *extra = (uint32_t) (d & ((1U << (bits - 1)) - 1));
+
+    return 2 * bits + (unsigned int) ((d >> (bits - 1)) & 1);
+}
+
+
+/* Position of the highest set bit */
+static unsigned int floorLog2(size_t x)
+{
+    unsigned int bits = 0;
+
+    while (x >>= 1)
+        ++bits;
+
+    return bits;
+}
+
+
+/* Make room for n more bytes of output */
+static int reserveOutput(Deflater *d, size_t n)
+{
+    size_t size = (d->size) ? d->size : 4096;
+    unsigned char *out;
+
+    if (d->length + n <= d->size)
+        return 0;
+
+    while (size < d->length + n)
+        size *= 2;
+
+    out = realloc(d->out, size);
+
+    if (!out)
+        return 1;
+
+    d->out = out;
+    d->size = size;
+
+    return 0;
+}
+
+
+/* Append n bits, least significant first, to the output */
+static void putBits(Deflater *d, uint32_t value, unsigned int n)
+{
+    d->bits |= (uint64_t) value << d->bitCount;
+    d->bitCount += n;
+
+    while (d->bitCount >= 8)
+    {
+        d->out[d->length++] = (unsigned char) (d->bits & 0xFF);
+        d->bits >>= 8;
+        d->bitCount -= 8;
+    }
+}
+
+
+/* Pad the output to a whole byte */
+static void alignBits(Deflater *d)
+{
+    if (d->bitCount > 0)
+        d->out[d->length++] = (unsigned char) (d->bits & 0xFF);
+
+    d->bits = 0;
+    d->bitCount = 0;
+}
@@ -1,7 +1,10 @@
 #include <complex.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <pthread.h>
 
@@ -10,9 +13,11 @@
 #include "function.h"
 
 #include "array.h"
+#include "cancellation.h"
 #include "colour.h"
 #include "mandelbrot_parameters.h"
 #include "parameters.h"
+#include "raw.h"
 
 #ifdef MP_PREC
 #include <mpfr.h>
@@ -37,13 +42,17 @@ static long double complex juliaExt(unsigned long *n, long double complex z, lon
 static void juliaMP(unsigned long *n, mpc_t z, mpfr_t norm, mpc_t c, unsigned long max);
 #endif
 
+static char * getPixel(char *row, size_t x, size_t nmemb, BitDepth depth);
+static bool bandComplete(const Block *block, size_t y, size_t rows);
+static void fillCell(const Block *block, const char *sample, size_t x, size_t y, size_t rows);
 
-void * generateFractalRow(void *threadInfo)
+
+void * generateFractal(void *threadInfo)
 {
     Thread *t = threadInfo;
 
     /*
-     * Because the loop may run for millions of iterations, all relevant struct
+     * Because the loops may run for billions of iterations, all relevant struct
      * members are cached before use.
      */
 
@@ -62,7 +71,7 @@ void * generateFractalRow(void *threadInfo)
     ColourScheme *colour = &(p->colour);
     BitDepth colourDepth = colour->depth;
 
-    /* Real value at top-left of plot */
+    /* Values at top-left of plot */
     double reMin = creal(p->minimum.c);
     double imMax = cimag(p->maximum.c);
 
@@ -70,66 +79,136 @@ void * generateFractalRow(void *threadInfo)
     double pxWidth = (p->width > 1) ? (creal(p->maximum.c) - creal(p->minimum.c)) / (p->width - 1) : 0.0;
     double pxHeight = (p->height > 1) ? (cimag(p->maximum.c) - cimag(p->minimum.c)) / (p->height - 1) : 0.0;
 
-    /* Row array */
+    /* Image array */
+    char *px;
+    char *array = t->block->array;
+    size_t rows = (t->block->remainder) ? t->block->remainderRows : t->block->rows;
     size_t columns = p->width;
     size_t nmemb = t->block->memSize;
 
-    char *px = t->block->array + t->tid * nmemb;
+    size_t rowSize = t->block->rowSize;
+
+    /* Offset of block from start ('top-left') of image array */
+    size_t blockOffset = t->block->id * t->block->rows;
+
+    /* Row segments - each work unit is one contiguous run of columns */
+    size_t segments, segmentWidth;
+    getRowSegments(&segments, &segmentWidth, t->block, tCount);
 
-    logMessage(DEBUG, "Thread %u: Generating row plot", t->tid);
+    /* Spacing of samples - greater than one in the coarse passes of a
+     * progressive or cancelled render
+     */
+    unsigned int stride = t->block->stride;
+    bool refining = t->block->refining;
+    size_t units = (rows + stride - 1) / stride * segments;
 
-    /* Number of bits into current byte (if bit depth < CHAR_BIT) */
-    int bitOffset;
+    /* Coarse samples are mapped here before being copied to their cells */
+    char sample[RAW_PIXEL_SIZE] = {0};
 
-    /* Set complex value to start of the row */
-    complex c = reMin + pxWidth * t->tid + (imMax - t->block->id * pxHeight) * I;
+    /* Iteration counts and squared magnitudes of the segment being calculated
+     * at full resolution, which are coloured together once it is complete
+     */
+    unsigned long *counts = malloc(segmentWidth * sizeof(*counts));
+    double *norms = malloc(segmentWidth * sizeof(*norms));
 
-    /* Iterate over the row - offset by thread ID to ensure each thread gets a unique column */
-    for (size_t x = t->tid; x < columns; x += tCount, c += pxWidth * tCount)
+    if (!counts || !norms)
     {
-        complex z;
-        unsigned long n;
+        logMessage(ERROR, "Thread %u: Memory allocation failed", t->tid);
+        free(counts);
+        free(norms);
+        pthread_exit(NULL);
+    }
+
+    logMessage(DEBUG, "Thread %u: Generating plot", t->tid);
 
-        /* Run fractal function on c */
-        switch (type)
+    /* Offset by thread ID to ensure each thread gets a unique row segment */
+    for (size_t i = t->tid; i < units; i += tCount, advanceProgress(t))
+    {
+        size_t y = i / segments * stride;
+        size_t xStart = (i % segments) * segmentWidth;
+        size_t xEnd = (xStart + segmentWidth < columns) ? xStart + segmentWidth : columns;
+
+        /* Refining passes skip the samples of the preceding pass, which lie
+         * on every other column of every other row
+         */
+        size_t xStep = (refining && y % (2 * stride) == 0) ? 2 * stride : stride;
+        size_t x0 = (xStep > stride) ? xStart + stride : xStart;
+
+        /* Stop between work units once the render has been cancelled. The
+         * first coarse pass always runs to completion so the image has no gaps
+         */
+        if ((stride == 1 || refining) && renderCancelled())
+            break;
+
+        if (bandComplete(t->block, y, rows))
+            continue;
+
+        /* Imaginary value of the row, from its row in the image so that it
+         * does not depend on how the image is divided into blocks
+         */
+        double im = imMax - (blockOffset + y) * pxHeight;
+
+        /* Iterate over the segment */
+        for (size_t x = x0; x < xEnd; x += xStep)
         {
-            case PLOT_JULIA:
-                z = julia(&n, c, constant, nMax);
-                break;
-            case PLOT_MANDELBROT:
-                z = mandelbrot(&n, c, nMax);
-                break;
-            default:
-                pthread_exit(NULL);
-        }
+            /* Derived from the column rather than accumulated, so each pixel
+             * has the same value whichever pass calculates it
+             */
+            complex c = reMin + x * pxWidth + im * I;
+            complex z;
+            unsigned long n;
 
-        /* Map iteration count to RGB colour value */
-        mapColour(px, n, z, bitOffset, nMax, colour);
+            /* Run fractal function on c */
+            switch (type)
+            {
+                case PLOT_JULIA:
+                    z = julia(&n, c, constant, nMax);
+                    break;
+                case PLOT_MANDELBROT:
+                    z = mandelbrot(&n, c, nMax);
+                    break;
+                default:
+                    free(counts);
+                    free(norms);
+                    pthread_exit(NULL);
+            }
 
-        /* Increment pixel pointer */
-        if (colourDepth >= CHAR_BIT || colourDepth == BIT_DEPTH_ASCII)
-        {
-            px += nmemb * tCount;
+            if (stride > 1 || refining)
+            {
+                /* Coarse pass - the sample stands in for its whole cell */
+                mapColour(sample, n, z, 0, nMax, colour);
+                fillCell(t->block, sample, x, y, rows);
+                continue;
+            }
+
+            /* Full-resolution pass - every column of the segment is calculated */
+            counts[x - xStart] = n;
+            norms[x - xStart] = dotProduct(z);
         }
-        else if (++bitOffset == CHAR_BIT)
+
+        if (stride == 1 && !refining)
         {
-            px += nmemb * tCount;
-            bitOffset = 0;
+            /* Map iteration counts to colour values */
+            px = getPixel(array + y * rowSize, xStart, nmemb, colourDepth);
+            mapColourRun(px, counts, norms, xEnd - xStart, nMax, colour);
         }
     }
 
-    logMessage(DEBUG, "Thread %u: Row plot generated - exiting", t->tid);
+    free(counts);
+    free(norms);
+
+    logMessage(DEBUG, "Thread %u: Plot generated - exiting", t->tid);
     
     pthread_exit(NULL);
 }
 
 
-void * generateFractalRowExt(void *threadInfo)
+void * generateFractalExt(void *threadInfo)
 {
     Thread *t = threadInfo;
 
     /*
-     * Because the loop may run for millions of iterations, all relevant struct
+     * Because the loops may run for billions of iterations, all relevant struct
      * members are cached before use.
      */
 
@@ -148,75 +227,144 @@ void * generateFractalRowExt(void *threadInfo)
     ColourScheme *colour = &(p->colour);
     BitDepth colourDepth = colour->depth;
 
-    /* Real value at top-left of plot */
+    /* Values at top-left of plot */
     long double reMin = creall(p->minimum.lc);
     long double imMax = cimagl(p->maximum.lc);
-
+    
     /* Pixel dimensions */
     long double pxWidth = (p->width > 1) ? (creall(p->maximum.lc) - creall(p->minimum.lc)) / (p->width - 1) : 0.0L;
     long double pxHeight = (p->height > 1) ? (cimagl(p->maximum.lc) - cimagl(p->minimum.lc)) / (p->height - 1) : 0.0L;
 
-    /* Row array */
+    /* Image array */
+    char *px;
+    char *array = t->block->array;
+    size_t rows = (t->block->remainder) ? t->block->remainderRows : t->block->rows;
     size_t columns = p->width;
     size_t nmemb = t->block->memSize;
+    size_t rowSize = t->block->rowSize;
+
+    /* Offset of block from start ('top-left') of image array */
+    size_t blockOffset = t->block->id * t->block->rows;
 
-    char *px = t->block->array + t->tid * nmemb;
+    /* Row segments - each work unit is one contiguous run of columns */
+    size_t segments, segmentWidth;
+    getRowSegments(&segments, &segmentWidth, t->block, tCount);
 
-    logMessage(DEBUG, "Thread %u: Generating row plot", t->tid);
+    /* Spacing of samples - greater than one in the coarse passes of a
+     * progressive or cancelled render
+     */
+    unsigned int stride = t->block->stride;
+    bool refining = t->block->refining;
+    size_t units = (rows + stride - 1) / stride * segments;
 
-    /* Number of bits into current byte (if bit depth < CHAR_BIT) */
-    int bitOffset;
+    /* Coarse samples are mapped here before being copied to their cells */
+    char sample[RAW_PIXEL_SIZE] = {0};
 
-    /* Set complex value to start of the row */
-    long double complex c = reMin + pxWidth * t->tid + (imMax - t->block->id * pxHeight) * I;
+    /* Iteration counts and squared magnitudes of the segment being calculated
+     * at full resolution, which are coloured together once it is complete
+     */
+    unsigned long *counts = malloc(segmentWidth * sizeof(*counts));
+    double *norms = malloc(segmentWidth * sizeof(*norms));
 
-    /* Iterate over the row - offset by thread ID to ensure each thread gets a unique column */
-    for (size_t x = t->tid; x < columns; x += tCount, c += pxWidth * tCount)
+    if (!counts || !norms)
     {
-        long double complex z;
-        unsigned long n;
+        logMessage(ERROR, "Thread %u: Memory allocation failed", t->tid);
+        free(counts);
+        free(norms);
+        pthread_exit(NULL);
+    }
+
+    logMessage(DEBUG, "Thread %u: Generating plot", t->tid);
 
-        /* Run fractal function on c */
-        switch (type)
+    /* Offset by thread ID to ensure each thread gets a unique row segment */
+    for (size_t i = t->tid; i < units; i += tCount, advanceProgress(t))
+    {
+        size_t y = i / segments * stride;
+        size_t xStart = (i % segments) * segmentWidth;
+        size_t xEnd = (xStart + segmentWidth < columns) ? xStart + segmentWidth : columns;
+
+        /* Refining passes skip the samples of the preceding pass, which lie
+         * on every other column of every other row
+         */
+        size_t xStep = (refining && y % (2 * stride) == 0) ? 2 * stride : stride;
+        size_t x0 = (xStep > stride) ? xStart + stride : xStart;
+
+        /* Stop between work units once the render has been cancelled. The
+         * first coarse pass always runs to completion so the image has no gaps
+         */
+        if ((stride == 1 || refining) && renderCancelled())
+            break;
+
+        if (bandComplete(t->block, y, rows))
+            continue;
+
+        /* Imaginary value of the row, from its row in the image so that it
+         * does not depend on how the image is divided into blocks
+         */
+        long double im = imMax - (blockOffset + y) * pxHeight;
+
+        /* Iterate over the segment */
+        for (size_t x = x0; x < xEnd; x += xStep)
         {
-            case PLOT_JULIA:
-                z = juliaExt(&n, c, constant, nMax);
-                break;
-            case PLOT_MANDELBROT:
-                z = mandelbrotExt(&n, c, nMax);
-                break;
-            default:
-                pthread_exit(NULL);
-        }
+            /* Derived from the column rather than accumulated, so each pixel
+             * has the same value whichever pass calculates it
+             */
+            long double complex c = reMin + x * pxWidth + im * I;
+            long double complex z;
+            unsigned long n;
 
-        /* Map iteration count to RGB colour value */
-        mapColourExt(px, n, z, bitOffset, nMax, colour);
+            /* Run fractal function on c */
+            switch (type)
+            {
+                case PLOT_JULIA:
+                    z = juliaExt(&n, c, constant, nMax);
+                    break;
+                case PLOT_MANDELBROT:
+                    z = mandelbrotExt(&n, c, nMax);
+                    break;
+                default:
+                    free(counts);
+                    free(norms);
+                    pthread_exit(NULL);
+            }
 
-        /* Increment pixel pointer */
-        if (colourDepth >= CHAR_BIT || colourDepth == BIT_DEPTH_ASCII)
-        {
-            px += nmemb * tCount;
+            if (stride > 1 || refining)
+            {
+                /* Coarse pass - the sample stands in for its whole cell */
+                mapColourExt(sample, n, z, 0, nMax, colour);
+                fillCell(t->block, sample, x, y, rows);
+                continue;
+            }
+
+            /* Full-resolution pass - every column of the segment is calculated */
+            counts[x - xStart] = n;
+            norms[x - xStart] = (double) dotProductExt(z);
         }
-        else if (++bitOffset == CHAR_BIT)
+
+        if (stride == 1 && !refining)
         {
-            px += nmemb * tCount;
-            bitOffset = 0;
+            /* Map iteration counts to colour values */
+            px = getPixel(array + y * rowSize, xStart, nmemb, colourDepth);
+            mapColourRun(px, counts, norms, xEnd - xStart, nMax, colour);
         }
     }
 
-    logMessage(DEBUG, "Thread %u: Row plot generated - exiting", t->tid);
+    free(counts);
+    free(norms);
+
+    logMessage(DEBUG, "Thread %u: Plot generated - exiting", t->tid);
     
     pthread_exit(NULL);
 }
 
 
 #ifdef MP_PREC
-void * generateFractalRowMP(void *threadInfo)
+void * generateFractalMP(void *threadInfo)
 {
     Thread *t = threadInfo;
 
     /*
-     * Because the loop may run for millions of iterations, all relevant struct
+     * Because the loops may run for billions of iterations, all relevant struct
      * members are cached before use.
      */
 
@@ -245,6 +393,15 @@ void * generateFractalRowMP(void *threadInfo)
     mpfr_set(reMin, mpc_realref(p->minimum.mpc), MP_REAL_RND);
     mpfr_set(imMax, mpc_imagref(p->maximum.mpc), MP_IMAG_RND);
 
+    /* Image array */
+    char *px;
+    char *array = t->block->array;
+    size_t rows = (t->block->remainder) ? t->block->remainderRows : t->block->rows;
+    size_t columns = p->width;
+    size_t nmemb = t->block->memSize;
+
+    size_t rowSize = t->block->rowSize;
+
     /* Width value */
     mpfr_t pxWidth;
     mpfr_init2(pxWidth, mpSignificandSize);
@@ -285,276 +442,231 @@ void * generateFractalRowMP(void *threadInfo)
         mpfr_set_d(pxHeight, 0.0, MP_IMAG_RND);
     }
 
-    /* Row array */
-    size_t columns = p->width;
-    size_t nmemb = t->block->memSize;
+    /* Offset of block from start ('top-left') of image array */
+    size_t blockOffset = t->block->id * t->block->rows;
 
-    char *px = t->block->array + t->tid * nmemb;
+    /* Spacing of samples - greater than one in the coarse passes of a
+     * progressive or cancelled render
+     */
+    unsigned int stride = t->block->stride;
+    bool refining = t->block->refining;
 
-    /* Real offset into the row */
-    mpfr_t real;
+    /* Real and imaginary values of a pixel */
+    mpfr_t real, imag;
     mpfr_init2(real, mpSignificandSize);
-
-    mpfr_mul_ui(real, pxWidth, t->tid, MP_REAL_RND);
-    mpfr_add(real, reMin, real, MP_REAL_RND);
-
-    /* Imaginary value of the row */
-    mpfr_t imag;
     mpfr_init2(imag, mpSignificandSize);
-    mpfr_set_uj(imag, (uintmax_t) t->block->id, MP_IMAG_RND);
-
-    mpfr_mul(imag, imag, pxHeight, MP_IMAG_RND);
-    mpfr_sub(imag, imMax, imag, MP_IMAG_RND);
-
-    mpc_t c;
-    mpc_init2(c, mpSignificandSize);
-    mpc_set_fr_fr(c, real, imag, MP_COMPLEX_RND);
-
-    mpfr_t increment;
-    mpfr_init2(increment, mpSignificandSize);
-
-    mpfr_mul_ui(increment, pxWidth, tCount, MP_REAL_RND);
-
-    logMessage(DEBUG, "Thread %u: Generating row plot", t->tid);
-
-    /* Number of bits into current byte (if bit depth < CHAR_BIT) */
-    int bitOffset;
 
     /* Calculation variables */
-    mpc_t z;
+    mpc_t z, c;
     mpc_init2(z, mpSignificandSize);
+    mpc_init2(c, mpSignificandSize);
 
     mpfr_t norm;
     mpfr_init2(norm, mpSignificandSize);
 
-    /* Iterate over the row - offset by thread ID to ensure each thread gets a unique column */
-    for (size_t x = t->tid; x < columns; x += tCount, mpc_add_fr(c, c, increment, MP_REAL_RND))
-    {
-        unsigned long n;
-
-        /* Run fractal function on c */
-        switch (type)
-        {
-            case PLOT_JULIA:
-                juliaMP(&n, c, norm, constant, nMax);
-                break;
-            case PLOT_MANDELBROT:
-                mandelbrotMP(&n, z, norm, c, nMax);
-                break;
-            default:
-                mpfr_clears(reMin, imMax, pxWidth, pxHeight, real, imag, increment, norm, NULL);
-                mpc_clear(constant);
-                mpc_clear(z);
-                mpc_clear(c);
-                pthread_exit(NULL);
-        }
-
-        /* Map iteration count to RGB colour value */
-        mapColourMP(px, n, norm, bitOffset, nMax, colour);
+    /* Row segments - each work unit is one contiguous run of columns */
+    size_t segments, segmentWidth;
+    getRowSegments(&segments, &segmentWidth, t->block, tCount);
 
-        /* Increment pixel pointer */
-        if (colourDepth >= CHAR_BIT || colourDepth == BIT_DEPTH_ASCII)
-        {
-            px += nmemb * tCount;
-        }
-        else if (++bitOffset == CHAR_BIT)
-        {
-            px += nmemb * tCount;
-            bitOffset = 0;
-        }
-    }
+    size_t units = (rows + stride - 1) / stride * segments;
 
-    mpfr_clears(reMin, imMax, pxWidth, pxHeight, real, imag, increment, norm, NULL);
-    mpc_clear(constant);
-    mpc_clear(z);
-    mpc_clear(c);
+    /* Coarse samples are mapped here before being copied to their cells */
+    char sample[RAW_PIXEL_SIZE] = {0};
 
-    logMessage(DEBUG, "Thread %u: Row plot generated - exiting", t->tid);
-    
-    pthread_exit(NULL);
-}
-#endif
-
-
-void * generateFractal(void *threadInfo)
-{
-    Thread *t = threadInfo;
-
-    /*
-     * Because the loops may run for billions of iterations, all relevant struct
-     * members are cached before use.
+    /* Iteration counts and squared magnitudes of the segment being calculated
+     * at full resolution, which are coloured together once it is complete
      */
+    unsigned long *counts = malloc(segmentWidth * sizeof(*counts));
+    double *norms = malloc(segmentWidth * sizeof(*norms));
 
-    unsigned int tCount = t->tCount;
-
-    /* Plot parameters */
-    PlotCTX *p = t->block->parameters;
-
-    /* Julia set constant */
-    complex constant = p->c.c;
-
-    /* Maximum iteration count */
-    unsigned long nMax = p->iterations;
-
-    PlotType type = p->type;
-    ColourScheme *colour = &(p->colour);
-    BitDepth colourDepth = colour->depth;
-
-    /* Values at top-left of plot */
-    double reMin = creal(p->minimum.c);
-    double imMax = cimag(p->maximum.c);
-
-    /* Pixel dimensions */
-    double pxWidth = (p->width > 1) ? (creal(p->maximum.c) - creal(p->minimum.c)) / (p->width - 1) : 0.0;
-    double pxHeight = (p->height > 1) ? (cimag(p->maximum.c) - cimag(p->minimum.c)) / (p->height - 1) : 0.0;
-
-    /* Image array */
-    char *px;
-    char *array = t->block->array;
-    size_t rows = (t->block->remainder) ? t->block->remainderRows : t->block->rows;
-    size_t columns = p->width;
-    size_t nmemb = t->block->memSize;
-
-    size_t rowSize = t->block->rowSize;
-
-    /* Offset of block from start ('top-left') of image array */
-    size_t blockOffset = t->block->id * t->block->rows;
-    double rowOffset = imMax - blockOffset * pxHeight;
-
-    logMessage(INFO, "Thread %u: Generating plot", t->tid);
-
-    /* Offset by thread ID to ensure each thread gets a unique row */
-    for (size_t y = t->tid; y < rows; y += tCount)
+    if (!counts || !norms)
     {
-        /* Number of bits into current byte (if bit depth < CHAR_BIT) */
-        int bitOffset = 0;
-
-        /* Set complex value to start of the row */
-        complex c = reMin + (rowOffset - y * pxHeight) * I;
+        logMessage(ERROR, "Thread %u: Memory allocation failed", t->tid);
+        free(counts);
+        free(norms);
+        mpfr_clears(reMin, imMax, pxWidth, pxHeight, real, imag, norm, NULL);
+        mpc_clear(constant);
+        mpc_clear(z);
+        mpc_clear(c);
+        pthread_exit(NULL);
+    }
 
-        /* Set pixel pointer to start of the row */
-        px = array + y * rowSize;
+    logMessage(DEBUG, "Thread %u: Generating plot", t->tid);
 
-        /* Iterate over the row */
-        for (size_t x = 0; x < columns; ++x, c += pxWidth)
+    /* Offset by thread ID to ensure each thread gets a unique row segment */
+    for (size_t i = t->tid; i < units; i += tCount, advanceProgress(t))
+    {
+        size_t y = i / segments * stride;
+        size_t xStart = (i % segments) * segmentWidth;
+        size_t xEnd = (xStart + segmentWidth < columns) ? xStart + segmentWidth : columns;
+
+        /* Refining passes skip the samples of the preceding pass, which lie
+         * on every other column of every other row
+         */
+        size_t xStep = (refining && y % (2 * stride) == 0) ? 2 * stride : stride;
+        size_t x0 = (xStep > stride) ? xStart + stride : xStart;
+
+        /* Stop between work units once the render has been cancelled. The
+         * first coarse pass always runs to completion so the image has no gaps
+         */
+        if ((stride == 1 || refining) && renderCancelled())
+            break;
+
+        if (bandComplete(t->block, y, rows))
+            continue;
+
+        /* Imaginary value of the row, from its row in the image so that it
+         * does not depend on how the image is divided into blocks
+         */
+        mpfr_set_uj(imag, (uintmax_t) (blockOffset + y), MP_IMAG_RND);
+        mpfr_mul(imag, imag, pxHeight, MP_IMAG_RND);
+        mpfr_sub(imag, imMax, imag, MP_IMAG_RND);
+
+        /* Iterate over the segment */
+        for (size_t x = x0; x < xEnd; x += xStep)
         {
-            complex z;
             unsigned long n;
 
+            /* Derived from the column rather than accumulated, so each pixel
+             * has the same value whichever pass calculates it
+             */
+            mpfr_set_uj(real, (uintmax_t) x, MP_REAL_RND);
+            mpfr_mul(real, real, pxWidth, MP_REAL_RND);
+            mpfr_add(real, reMin, real, MP_REAL_RND);
+
+            mpc_set_fr_fr(c, real, imag, MP_COMPLEX_RND);
+
             /* Run fractal function on c */
             switch (type)
             {
                 case PLOT_JULIA:
-                    z = julia(&n, c, constant, nMax);
+                    juliaMP(&n, c, norm, constant, nMax);
                     break;
                 case PLOT_MANDELBROT:
-                    z = mandelbrot(&n, c, nMax);
+                    mandelbrotMP(&n, z, norm, c, nMax);
                     break;
                 default:
+                    mpfr_clears(reMin, imMax, pxWidth, pxHeight, real, imag, norm, NULL);
+                    mpc_clear(constant);
+                    mpc_clear(z);
+                    mpc_clear(c);
+                    free(counts);
+                    free(norms);
                     pthread_exit(NULL);
             }
 
-            /* Map iteration count to RGB colour value */
-            mapColour(px, n, z, bitOffset, nMax, colour);
-
-            /* Increment pixel pointer */
-            if (colourDepth >= CHAR_BIT || colourDepth == BIT_DEPTH_ASCII)
-            {
-                px += nmemb;
-            }
-            else if (++bitOffset == CHAR_BIT)
+            if (stride > 1 || refining)
             {
-                px += nmemb;
-                bitOffset = 0;
+                /* Coarse pass - the sample stands in for its whole cell */
+                mapColourMP(sample, n, norm, 0, nMax, colour);
+                fillCell(t->block, sample, x, y, rows);
+                continue;
             }
+
+            /* Full-resolution pass - every column of the segment is calculated */
+            counts[x - xStart] = n;
+            norms[x - xStart] = mpfr_get_d(norm, MP_REAL_RND);
+        }
+
+        if (stride == 1 && !refining)
+        {
+            /* Map iteration counts to colour values */
+            px = getPixel(array + y * rowSize, xStart, nmemb, colourDepth);
+            mapColourRun(px, counts, norms, xEnd - xStart, nMax, colour);
         }
     }
 
-    logMessage(INFO, "Thread %u: Plot generated - exiting", t->tid);
+    free(counts);
+    free(norms);
+
+    mpfr_clears(reMin, imMax, pxWidth, pxHeight, real, imag, norm, NULL);
+    mpc_clear(constant);
+    mpc_clear(z);
+    mpc_clear(c);
+
+    logMessage(DEBUG, "Thread %u: Plot generated - exiting", t->tid);
     
     pthread_exit(NULL);
 }
+#endif
 
 
-void * generateFractalExt(void *threadInfo)
+/* Colour raw iteration data. The work is divided exactly as for a plot, but
+ * each pixel is read from the mapped data rather than calculated
+ */
+void * recolourFractal(void *threadInfo)
 {
     Thread *t = threadInfo;
 
-    /*
-     * Because the loops may run for billions of iterations, all relevant struct
-     * members are cached before use.
-     */
-
     unsigned int tCount = t->tCount;
 
     /* Plot parameters */
     PlotCTX *p = t->block->parameters;
 
-    /* Julia set constant */
-    long double complex constant = p->c.lc;
-
-    /* Maximum iteration count */
-    unsigned long nMax = p->iterations;
-
-    PlotType type = p->type;
     ColourScheme *colour = &(p->colour);
     BitDepth colourDepth = colour->depth;
 
-    /* Values at top-left of plot */
-    long double reMin = creall(p->minimum.lc);
-    long double imMax = cimagl(p->maximum.lc);
-    
-    /* Pixel dimensions */
-    long double pxWidth = (p->width > 1) ? (creall(p->maximum.lc) - creall(p->minimum.lc)) / (p->width - 1) : 0.0L;
-    long double pxHeight = (p->height > 1) ? (cimagl(p->maximum.lc) - cimagl(p->minimum.lc)) / (p->height - 1) : 0.0L;
-
     /* Image array */
     char *px;
     char *array = t->block->array;
     size_t rows = (t->block->remainder) ? t->block->remainderRows : t->block->rows;
     size_t columns = p->width;
     size_t nmemb = t->block->memSize;
+
     size_t rowSize = t->block->rowSize;
 
-    /* Offset of block from start ('top-left') of image array */
-    size_t blockOffset = t->block->id * t->block->rows;
-    long double rowOffset = imMax - blockOffset * pxHeight;
+    /* Raw iteration data of the first row of the block */
+    size_t sourceRowSize = columns * RAW_PIXEL_SIZE;
+    const char *source = p->source + p->sourceOffset + t->block->id * t->block->rows * sourceRowSize;
+
+    /* Row segments - each work unit is one contiguous run of columns */
+    size_t segments, segmentWidth;
+    getRowSegments(&segments, &segmentWidth, t->block, tCount);
+
+    unsigned int stride = t->block->stride;
+    bool refining = t->block->refining;
+    size_t units = (rows + stride - 1) / stride * segments;
 
-    logMessage(INFO, "Thread %u: Generating plot", t->tid);
+    /* Coarse samples are mapped here before being copied to their cells */
+    char sample[RAW_PIXEL_SIZE] = {0};
 
-    /* Offset by thread ID to ensure each thread gets a unique row */
-    for (size_t y = t->tid; y < rows; y += tCount)
+    logMessage(DEBUG, "Thread %u: Recolouring plot", t->tid);
+
+    for (size_t i = t->tid; i < units; i += tCount, advanceProgress(t))
     {
+        size_t y = i / segments * stride;
+        size_t xStart = (i % segments) * segmentWidth;
+        size_t xEnd = (xStart + segmentWidth < columns) ? xStart + segmentWidth : columns;
+
+        size_t xStep = (refining && y % (2 * stride) == 0) ? 2 * stride : stride;
+        size_t x0 = (xStep > stride) ? xStart + stride : xStart;
+
+        if ((stride == 1 || refining) && renderCancelled())
+            break;
+
+        if (bandComplete(t->block, y, rows))
+            continue;
+
         /* Number of bits into current byte (if bit depth < CHAR_BIT) */
         int bitOffset = 0;
 
-        /* Set complex value to start of the row */
-        long double complex c = reMin + (rowOffset - y * pxHeight) * I;
-
-        /* Set pixel pointer to start of the row */
-        px = array + y * rowSize;
+        px = getPixel(array + y * rowSize, xStart, nmemb, colourDepth);
 
-        /* Iterate over the row */
-        for (size_t x = 0; x < columns; ++x, c += pxWidth)
+        for (size_t x = x0; x < xEnd; x += xStep)
         {
-            long double complex z;
-            unsigned long n;
+            double n;
+            EscapeStatus status;
 
-            /* Run fractal function on c */
-            switch (type)
+            decodeRawPixel(&n, &status, source + y * sourceRowSize + x * RAW_PIXEL_SIZE);
+
+            if (stride > 1 || refining)
             {
-                case PLOT_JULIA:
-                    z = juliaExt(&n, c, constant, nMax);
-                    break;
-                case PLOT_MANDELBROT:
-                    z = mandelbrotExt(&n, c, nMax);
-                    break;
-                default:
-                    pthread_exit(NULL);
+                mapSmoothedColour(sample, n, status, 0, colour);
+                fillCell(t->block, sample, x, y, rows);
+                continue;
             }
 
-            /* Map iteration count to RGB colour value */
-            mapColourExt(px, n, z, bitOffset, nMax, colour);
+            mapSmoothedColour(px, n, status, bitOffset, colour);
 
             /* Increment pixel pointer */
             if (colourDepth >= CHAR_BIT || colourDepth == BIT_DEPTH_ASCII)
@@ -569,182 +681,70 @@ void * generateFractalExt(void *threadInfo)
         }
     }
 
-    logMessage(INFO, "Thread %u: Plot generated - exiting", t->tid);
-    
+    logMessage(DEBUG, "Thread %u: Plot recoloured - exiting", t->tid);
+
     pthread_exit(NULL);
 }
 
 
-#ifdef MP_PREC
-void * generateFractalMP(void *threadInfo)
+/* Get pointer to the byte containing pixel x of a row */
+static char * getPixel(char *row, size_t x, size_t nmemb, BitDepth depth)
 {
-    Thread *t = threadInfo;
-
-    /*
-     * Because the loops may run for billions of iterations, all relevant struct
-     * members are cached before use.
-     */
-
-    unsigned int tCount = t->tCount;
-
-    /* Plot parameters */
-    PlotCTX *p = t->block->parameters;
-
-    /* Julia set constant */
-    mpc_t constant;
-    mpc_init2(constant, mpSignificandSize);
-    mpc_set(constant, p->c.mpc, MP_COMPLEX_RND);
-
-    /* Maximum iteration count */
-    unsigned long nMax = p->iterations;
-
-    PlotType type = p->type;
-    ColourScheme *colour = &(p->colour);
-    BitDepth colourDepth = colour->depth;
-
-    /* Values at top-left of plot */
-    mpfr_t reMin, imMax;
-    mpfr_init2(reMin, mpSignificandSize);
-    mpfr_init2(imMax, mpSignificandSize);
-
-    mpfr_set(reMin, mpc_realref(p->minimum.mpc), MP_REAL_RND);
-    mpfr_set(imMax, mpc_imagref(p->maximum.mpc), MP_IMAG_RND);
-
-    /* Image array */
-    char *px;
-    char *array = t->block->array;
-    size_t rows = (t->block->remainder) ? t->block->remainderRows : t->block->rows;
-    size_t columns = p->width;
-    size_t nmemb = t->block->memSize;
-
-    size_t rowSize = t->block->rowSize;
-
-    /* Width value */
-    mpfr_t pxWidth;
-    mpfr_init2(pxWidth, mpSignificandSize);
-
-    if (p->width > 1)
-    {
-        mpfr_t width;
-        mpfr_init2(width, mpSignificandSize);
-
-        mpfr_set_uj(width, (uintmax_t) (p->width - 1), MP_REAL_RND);
-        mpfr_sub(pxWidth, mpc_realref(p->maximum.mpc), mpc_realref(p->minimum.mpc), MP_REAL_RND);
-        mpfr_div(pxWidth, pxWidth, width, MP_REAL_RND);
-
-        mpfr_clear(width);
-    }
-    else
-    {
-        mpfr_set_d(pxWidth, 0.0, MP_REAL_RND);
-    }
-
-    /* Height value */
-    mpfr_t pxHeight;
-    mpfr_init2(pxHeight, mpSignificandSize);
-
-    if (p->height > 1)
-    {
-        mpfr_t height;
-        mpfr_init2(height, mpSignificandSize);
+    return (depth == BIT_DEPTH_1) ? row + x / CHAR_BIT : row + x * nmemb;
+}
 
-        mpfr_set_uj(height, (uintmax_t) (p->height - 1), MP_IMAG_RND);
-        mpfr_sub(pxHeight, mpc_imagref(p->maximum.mpc), mpc_imagref(p->minimum.mpc), MP_IMAG_RND);
-        mpfr_div(pxHeight, pxHeight, height, MP_IMAG_RND);
 
-        mpfr_clear(height);
-    }
-    else
+/* Whether every row of the band starting at row y was completed in full */
+static bool bandComplete(const Block *block, size_t y, size_t rows)
+{
+    for (size_t end = (y + block->stride < rows) ? y + block->stride : rows; y < end; ++y)
     {
-        mpfr_set_d(pxHeight, 0.0, MP_IMAG_RND);
+        if (!block->rowComplete[y])
+            return false;
     }
 
-    /* Offset of block from start ('top-left') of image array */
-    mpfr_t blockOffset, rowOffset;
-    mpfr_init2(blockOffset, mpSignificandSize);
-    mpfr_init2(rowOffset, mpSignificandSize);
-
-    mpfr_set_uj(blockOffset, (uintmax_t) (t->block->id * t->block->rows + t->tid), MP_IMAG_RND);
-    mpfr_mul(blockOffset, blockOffset, pxHeight, MP_IMAG_RND);
-    mpfr_sub(rowOffset, imMax, blockOffset, MP_IMAG_RND);
-
-    mpfr_clear(blockOffset);
-
-    /* Calculation variables */
-    mpc_t z, c;
-    mpc_init2(z, mpSignificandSize);
-    mpc_init2(c, mpSignificandSize);
+    return true;
+}
 
-    /* Rather than calculate row im-value as rowOffset - y * pxHeight, just subtract pxHeight * tCount each time */
-    mpfr_mul_ui(pxHeight, pxHeight, (unsigned long) tCount, MP_IMAG_RND);
 
-    mpfr_t norm;
-    mpfr_init2(norm, mpSignificandSize);
+/* Copy a coarse sample to every pixel of its stride-by-stride cell (clipped to
+ * the block) that lies in an incomplete row
+ */
+static void fillCell(const Block *block, const char *sample, size_t x, size_t y, size_t rows)
+{
+    BitDepth depth = block->parameters->colour.depth;
+    size_t columns = block->parameters->width;
+    size_t nmemb = block->memSize;
 
-    logMessage(INFO, "Thread %u: Generating plot", t->tid);
+    size_t xEnd = (x + block->stride < columns) ? x + block->stride : columns;
+    size_t yEnd = (y + block->stride < rows) ? y + block->stride : rows;
 
-    /* Offset by thread ID to ensure each thread gets a unique row */
-    for (size_t y = t->tid; y < rows; y += tCount)
+    for (; y < yEnd; ++y)
     {
-        /* Number of bits into current byte (if bit depth < CHAR_BIT) */
-        int bitOffset = 0;
-
-        /* Set complex value to start of the row */
-        mpc_set_fr_fr(c, reMin, rowOffset, MP_COMPLEX_RND);
+        char *row = block->array + y * block->rowSize;
 
-        /* Set pixel pointer to start of the row */
-        px = array + y * rowSize;
+        if (block->rowComplete[y])
+            continue;
 
-        /* Iterate over the row */
-        for (size_t x = 0; x < columns; ++x, mpc_add_fr(c, c, pxWidth, MP_REAL_RND))
+        for (size_t xx = x; xx < xEnd; ++xx)
         {
-            unsigned long n;
-
-            /* Run fractal function on c */
-            switch (type)
+            if (depth == BIT_DEPTH_1)
             {
-                case PLOT_JULIA:
-                    juliaMP(&n, c, norm, constant, nMax);
-                    break;
-                case PLOT_MANDELBROT:
-                    mandelbrotMP(&n, z, norm, c, nMax);
-                    break;
-                default:
-                    mpfr_clears(reMin, imMax, pxWidth, pxHeight, rowOffset, norm, NULL);
-                    mpc_clear(constant);
-                    mpc_clear(z);
-                    mpc_clear(c);
-                    pthread_exit(NULL);
-            }
+                /* The sample was mapped at offset 0, the most significant bit */
+                char mask = (char) (1 << ((CHAR_BIT - 1) - xx % CHAR_BIT));
 
-            /* Map iteration count to RGB colour value */
-            mapColourMP(px, n, norm, bitOffset, nMax, colour);
-
-            /* Increment pixel pointer */
-            if (colourDepth >= CHAR_BIT || colourDepth == BIT_DEPTH_ASCII)
-            {
-                px += nmemb;
+                if (*sample & (1 << (CHAR_BIT - 1)))
+                    row[xx / CHAR_BIT] |= mask;
+                else
+                    row[xx / CHAR_BIT] &= ~mask;
             }
-            else if (++bitOffset == CHAR_BIT)
+            else
             {
-                px += nmemb;
-                bitOffset = 0;
+                memcpy(row + xx * nmemb, sample, nmemb);
             }
         }
-
-        mpfr_sub(rowOffset, rowOffset, pxHeight, MP_IMAG_RND);
     }
-
-    mpfr_clears(reMin, imMax, pxWidth, pxHeight, rowOffset, norm, NULL);
-    mpc_clear(constant);
-    mpc_clear(z);
-    mpc_clear(c);
-
-    logMessage(INFO, "Thread %u: Plot generated - exiting", t->tid);
-    
-    pthread_exit(NULL);
 }
-#endif
 
 
 static double dotProduct(complex z)
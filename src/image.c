@@ -1,9 +1,12 @@
+#include <limits.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <pthread.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "libgroot/include/log.h"
@@ -12,12 +15,19 @@
 #include "image.h"
 
 #include "array.h"
+#include "cancellation.h"
+#include "checkpoint.h"
 #include "connection_handler.h"
 #include "ext_precision.h"
 #include "function.h"
 #include "parameters.h"
+#include "png.h"
 #include "program_ctx.h"
+#include "pyramid.h"
+#include "raw.h"
 #include "request_handler.h"
+#include "row_codec.h"
+#include "tiff.h"
 
 
 #define IMAGE_HEADER_LEN_MAX 128
@@ -32,15 +42,101 @@ const unsigned int THREAD_COUNT_MIN = 1;
 const unsigned int THREAD_COUNT_MAX = 512;
 
 
-static void blockToImage(const Block *block);
+/* Sample spacing of the first pass of a progressive render, and of the pass
+ * that fills in rows left by a cancelled render
+ */
+static const unsigned int COARSE_STRIDE = 8;
+
+/* Sample spacing of the render that histogram colouring takes its distribution
+ * from, and the most samples it takes across or down the plot
+ */
+const unsigned int HISTOGRAM_STRIDE = 8;
+static const size_t HISTOGRAM_SAMPLES_MAX = 512;
 
 
-/* Create image file and write header */
-int initialiseImage(PlotCTX *p)
+/* A worker's work units, calculated into one block while the rows of the other
+ * are sent to the master
+ */
+typedef struct RowSender
+{
+    pthread_t pid;
+    bool running;                /* Whether the sending thread was started */
+    int s;                       /* Socket connected to the master */
+    size_t maxRows;              /* Most rows requested in a work unit */
+    Block *blocks[2];
+    Frame jobs[2];               /* Allocations of the rows in each block */
+    bool full[2];                /* Whether each block holds rows yet to be sent */
+    bool stop;                   /* Exit once no rows are left to send */
+    int ret;                     /* Error from sending, or 0 */
+    RowPacker *packer;           /* Packs rows before they are sent (NULL to send them as they are) */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} RowSender;
+
+/* The master's own threads, and a view of the rows of the master's block they
+ * calculate each work unit in
+ */
+typedef struct LocalRenderer
+{
+    Block *block;
+    Thread *threads;
+    void * (*genFractal)(void *);
+} LocalRenderer;
+
+
+static int writeImageHeader(FILE *f, const PlotCTX *p);
+static int verifyImageHeader(PlotCTX *p);
+static int mapImage(PlotCTX *p);
+static int getFractalFunction(void * (**genFractal)(void *), const PlotCTX *p);
+static int renderBlock(Thread *threads, void * (*genFractal)(void *), Journal *journal, size_t *completed);
+static int renderProgressive(Thread *threads, void * (*genFractal)(void *), Journal *journal, size_t *completed);
+static int renderPass(Thread *threads, void * (*genFractal)(void *));
+static int renderFallback(Thread *threads, void * (*genFractal)(void *));
+static int reportCoverage(size_t completed, size_t rows);
+static bool isResumable(const PlotCTX *p);
+static bool isEncoded(const PlotCTX *p);
+static void moveBlock(Block *block, size_t id);
+static void skipBlock(const Block *block);
+static void blockToImage(const Block *block);
+static void flushMappedBlock(const Block *block, size_t n);
+static int samplePlot(double *samples, size_t *n, const PlotCTX *p, const ProgramCTX *ctx, size_t columns,
+                      size_t rows);
+static void sampleSource(double *samples, size_t *n, const PlotCTX *p, size_t columns, size_t rows);
+static int createRowSender(RowSender *sender, PlotCTX *p, int s, bool compress);
+static void freeRowSender(RowSender *sender);
+static void * sendRows(void *arg);
+static int createLocalRenderer(LocalRenderer *renderer, PlotCTX *p, unsigned int n, void * (*genFractal)(void *));
+static int renderLocalRows(void *arg, char *dest, size_t first, size_t n);
+static void freeLocalRenderer(LocalRenderer *renderer);
+
+
+/* Create image file and write header. A resumed image is reopened instead,
+ * after checking that its header matches
+ */
+int initialiseImage(PlotCTX *p, const ProgramCTX *ctx)
 {
+    bool mapOutput = ctx->mapOutput;
+
+    if (ctx->resume && !isResumable(p))
+    {
+        logMessage(ERROR, "Only PNM images and raw iteration data can be resumed");
+        return 1;
+    }
+
+    /* Encoded output cannot be written in place */
+    if (mapOutput && isEncoded(p))
+    {
+        logMessage(WARNING, "PNG, TIFF, and DZI images cannot be mapped, writing normally");
+        mapOutput = false;
+    }
+
     logMessage(DEBUG, "Opening image file \'%s\'", p->plotFilepath);
 
-    p->file = fopen(p->plotFilepath, "wb");
+    /* A shared writable mapping needs the file open for reading too */
+    if (ctx->resume)
+        p->file = fopen(p->plotFilepath, "r+b");
+    else
+        p->file = fopen(p->plotFilepath, (mapOutput) ? "w+b" : "wb");
 
     if (!p->file)
     {
@@ -50,36 +146,46 @@ int initialiseImage(PlotCTX *p)
 
     logMessage(DEBUG, "Image file successfully opened");
 
-    if (p->output == OUTPUT_PNM)
+    if (p->output == OUTPUT_PNG)
     {
-        char header[IMAGE_HEADER_LEN_MAX];
-
-        logMessage(DEBUG, "Writing header to image");
+        /* PNG rows are compressed on as many threads as they are calculated */
+        p->png = createPNGEncoder(p->file, p->width, p->height, p->colour.depth,
+                                  p->colour.palette, p->colour.paletteSize,
+                                  (ctx->threads) ? ctx->threads : getThreadCount());
 
-        /* Write PNM file header */
-        switch (p->colour.depth)
-        {
-            case BIT_DEPTH_1:
-                /* PBM file */
-                snprintf(header, sizeof(header), "P4 %zu %zu ", p->width, p->height);
-                break;
-            case BIT_DEPTH_8:
-                /* PGM file */
-                snprintf(header, sizeof(header), "P5 %zu %zu 255 ", p->width, p->height);
-                break;
-            case BIT_DEPTH_24:
-                /* PPM file */
-                snprintf(header, sizeof(header), "P6 %zu %zu 255 ", p->width, p->height);
-                break;
-            default:
-                logMessage(ERROR, "Could not determine bit depth");
-                return 1;
-        }
+        if (!p->png)
+            return 1;
+    }
+    else if (p->output == OUTPUT_TIFF)
+    {
+        /* Tiles are encoded and written on as many threads as rows are
+         * calculated
+         */
+        p->tiff = createTIFFWriter(p->file, p, (ctx->threads) ? ctx->threads : getThreadCount());
 
-        fprintf(p->file, "%s", header);
+        if (!p->tiff)
+            return 1;
+    }
+    else if (p->output == OUTPUT_DZI)
+    {
+        /* The file is the pyramid's descriptor, written once it is complete */
+        p->pyramid = createPyramid(p->file, p, (ctx->threads) ? ctx->threads : getThreadCount());
 
-        logMessage(DEBUG, "Header \'%s\' successfully wrote to image", header);
+        if (!p->pyramid)
+            return 1;
     }
+    else if (ctx->resume)
+    {
+        if (verifyImageHeader(p))
+            return 1;
+    }
+    else if (writeImageHeader(p->file, p))
+    {
+        return 1;
+    }
+
+    if (mapOutput && mapImage(p))
+        return 1;
 
     return 0;
 }
@@ -94,27 +200,27 @@ int imageOutput(PlotCTX *p, ProgramCTX *ctx)
     /* Image block object */
     Block *block;
 
+    /* Record of the rows in the image file */
+    Journal *journal = NULL;
+
+    /* Rows calculated in full */
+    size_t completedRows = 0;
+
+    int ret;
+
+    /* An encoded image is only written once, so it is not rendered
+     * progressively
+     */
+    bool progressive = ctx->progressive && !isEncoded(p);
+
     /* Pointer to fractal generation function */
     void * (*genFractal)(void *);
 
-    switch (p->precision)
-    {
-        case STD_PRECISION:
-            genFractal = generateFractal;
-            break;
-        case EXT_PRECISION:
-            genFractal = generateFractalExt;
-            break;
-        
-        #ifdef MP_PREC
-        case MUL_PRECISION:
-            genFractal = generateFractalMP;
-            break;
-        #endif
-        
-        default:
-            return 1;
-    }
+    if (getFractalFunction(&genFractal, p))
+        return 1;
+
+    if (ctx->progressive && !progressive)
+        logMessage(WARNING, "Progressive rendering is not supported for PNG, TIFF, and DZI images, rendering in full");
 
     block = createBlock();
 
@@ -141,6 +247,18 @@ int imageOutput(PlotCTX *p, ProgramCTX *ctx)
         return 1;
     }
 
+    if (isResumable(p))
+    {
+        journal = openJournal(p, ctx->resume);
+
+        if (!journal)
+        {
+            freeBlock(block);
+            freeThreads(threads);
+            return 1;
+        }
+    }
+
     /* Because image dimensions can lead to billions of pixels, the plot array
      * may not be able to be stored in one whole memory chunk. Therefore, as per
      * the preceding functions, a block size is determined. A block is a section
@@ -170,43 +288,42 @@ int imageOutput(PlotCTX *p, ProgramCTX *ctx)
                    block->id,
                    (block->remainder) ? block->remainderRows : block->rows);
 
-        /* Create threads to significantly decrease execution time */
-        for (unsigned int i = 0; i < threads->tCount; ++i)
-        {
-            Thread *t = &(threads[i]);
+        /* Calculate straight into the block's region of a mapped image */
+        if (block->map)
+            block->array = block->map + block->id * block->blockSize;
 
-            logMessage(INFO, "Spawning thread %u", t->tid);
-    
-            if (pthread_create(&(t->pid), NULL, genFractal, t))
-            {
-                logMessage(ERROR, "Thread could not be created");
-                freeBlock(block);
-                freeThreads(threads);
-                return 1;
-            }
-        }
+        size_t rows = (block->remainder) ? block->remainderRows : block->rows;
+        size_t restoredRows;
 
-        logMessage(INFO, "All threads successfully created");
-        
-        /* Wait for threads to exit */
-        for (unsigned int i = 0; i < threads->tCount; ++i)
+        if (restoreBlock(&restoredRows, journal, block))
         {
-            Thread *t = &(threads[i]);
+            closeJournal(journal, false);
+            freeBlock(block);
+            freeThreads(threads);
+            return 1;
+        }
 
-            if (pthread_join(t->pid, NULL))
-            {
-                logMessage(ERROR, "Thread %u could not be harvested", t->tid);
-                freeBlock(block);
-                freeThreads(threads);
-                return 1;
-            }
-                
-            logMessage(INFO, "Thread %u joined", t->tid);
+        /* The block is already in the image from an earlier run */
+        if (restoredRows == rows)
+        {
+            completedRows += rows;
+            skipBlock(block);
+            continue;
         }
 
-        logMessage(INFO, "All threads successfully destroyed");
+        ret = (progressive)
+              ? renderProgressive(threads, genFractal, journal, &completedRows)
+              : renderBlock(threads, genFractal, journal, &completedRows);
 
-        blockToImage(block);
+        if (ret)
+        {
+            closeJournal(journal, false);
+            freeBlock(block);
+            freeThreads(threads);
+            return 1;
+        }
+
+        checkpointBlock(journal, block);
     }
 
     logMessage(DEBUG, "Freeing memory");
@@ -214,28 +331,93 @@ int imageOutput(PlotCTX *p, ProgramCTX *ctx)
     freeBlock(block);
     freeThreads(threads);
 
-    return 0;
+    ret = reportCoverage(completedRows, p->height);
+    closeJournal(journal, ret == 0);
+
+    return ret;
 }
 
 
 /* Initialise plot array, run function, then write to file */
 int imageOutputMaster(PlotCTX *p, NetworkCTX *network, ProgramCTX *ctx)
 {
-    /* Image block object */
-    Block *block = createBlock();
+    /* Local processing threads - only created if the render is cancelled */
+    Thread *threads = NULL;
 
-    if (!block)
+    /* Image block objects, taken in turn by the blocks of the window */
+    Block *blocks[WINDOW_BLOCKS] = {NULL};
+
+    /* Blocks whose rows are being handed out to the workers, and how many */
+    Window *window = NULL;
+    unsigned int windowBlocks = WINDOW_BLOCKS;
+
+    /* Record of the rows in the image file */
+    Journal *journal;
+
+    /* The master's own threads, if it calculates rows alongside the workers */
+    LocalRenderer local = {.block = NULL, .threads = NULL, .genFractal = NULL};
+
+    /* Rows of each block object restored from the image */
+    size_t restoredRows[WINDOW_BLOCKS];
+
+    /* Rows calculated in full */
+    size_t completedRows = 0;
+
+    /* Number of blocks in the image, and the next to be opened */
+    size_t blockCount, next = 0;
+
+    int ret = 0;
+
+    /* Pointer to fractal generation function */
+    void * (*genFractal)(void *);
+
+    if (getFractalFunction(&genFractal, p))
         return 1;
 
-    /* Set values in the Block object and allocate memory for the image array in
-     * manageable chunks (the "blocks")
+    if (ctx->progressive)
+        logMessage(WARNING, "Progressive rendering is not supported by the master, rendering in full");
+
+    for (unsigned int k = 0; k < WINDOW_BLOCKS && !ret; ++k)
+    {
+        blocks[k] = createBlock();
+        ret = (blocks[k]) ? 0 : 1;
+    }
+
+    /* Set values in the Block objects and allocate memory for the image arrays
+     * in manageable chunks (the "blocks"), which share the memory limit
      */
-    if (initialiseBlock(block, p, ctx->mem))
+    if (ret || initialiseBlocks(blocks, &windowBlocks, p, ctx->mem))
     {
-        freeBlock(block);
+        for (unsigned int k = 0; k < WINDOW_BLOCKS; ++k)
+            freeBlock(blocks[k]);
+
+        return 1;
+    }
+
+    if (windowBlocks < WINDOW_BLOCKS)
+        logMessage(WARNING, "Memory limit only holds one block at a time, so workers wait at the end of each block");
+
+    /* The master always writes to a file */
+    journal = (isResumable(p)) ? openJournal(p, ctx->resume) : NULL;
+
+    if ((isResumable(p) && !journal) || !(window = createWindow(blocks[0], journal)))
+    {
+        closeJournal(journal, false);
+
+        for (unsigned int k = 0; k < WINDOW_BLOCKS; ++k)
+            freeBlock(blocks[k]);
+
         return 1;
     }
 
+    /* The listener hands the master's threads work units as it does a worker */
+    if (network->localThreads
+        && (createLocalRenderer(&local, p, network->localThreads, genFractal)
+            || startLocalWorker(network, renderLocalRows, &local, local.block->remainderRows)))
+    {
+        ret = 1;
+    }
+
     /* Because image dimensions can lead to billions of pixels, the plot array
      * may not be able to be stored in one whole memory chunk. Therefore, as per
      * the preceding functions, a block size is determined. A block is a section
@@ -243,38 +425,101 @@ int imageOutputMaster(PlotCTX *p, NetworkCTX *network, ProgramCTX *ctx)
      * Once all threads have finished, the block gets written to the image file
      * and the cycle continues. The array may not divide evenly into blocks, so
      * the reminader rows are calculated prior and stored in the block context
-     * structure
+     * structure.
+     *
+     * The rows of the next block are queued for the workers before those of
+     * the last are all in, so that the workers carry on while the last block is
+     * finished and written
      */
-    for (block->id = 0; block->id <= block->bCount; ++(block->id))
+    blockCount = blocks[0]->bCount + ((blocks[0]->remainderRows) ? 1 : 0);
+
+    for (size_t id = 0; id < blockCount && !ret; ++id)
     {
-        if (block->id == block->bCount)
+        Block *block = blocks[id % windowBlocks];
+        size_t rows;
+
+        for (; next < blockCount && next < id + windowBlocks; ++next)
         {
-            /* If there are no remainder rows */
-            if (!(block->remainderRows))
-                break;
+            Block *opened = blocks[next % windowBlocks];
 
-            /* If there are remaining rows */
-            block->remainder = true;
+            moveBlock(opened, next);
+
+            /* Only the rows missing from the image are queued for the workers */
+            if (restoreBlock(&restoredRows[next % windowBlocks], journal, opened) || openBlock(window, opened))
+            {
+                ret = 1;
+                break;
+            }
         }
-        else
+
+        if (ret)
+            break;
+
+        rows = (block->remainder) ? block->remainderRows : block->rows;
+
+        logMessage(INFO, "Working on block %zu (%zu rows)", block->id, rows);
+
+        if (restoredRows[id % windowBlocks] == rows)
         {
-            block->remainder = false;
+            completedRows += rows;
+            skipBlock(block);
+            closeBlock(network, window);
+            continue;
         }
 
-        logMessage(INFO, "Working on block %u (%zu rows)",
-                   block->id,
-                   (block->remainder) ? block->remainderRows : block->rows);
+        ret = listener(network, window);
 
-        if (listener(network, block))
+        if (ret == 2)
         {
-            freeBlock(block);
-            return 1;
+            /* Fill in the rows the workers did not return */
+            if (!threads)
+                threads = createThreads(block, ctx->threads);
+
+            if (!threads)
+                break;
+
+            /* The block objects take turns */
+            for (unsigned int i = 0; i < threads->tCount; ++i)
+                threads[i].block = block;
+
+            if (renderFallback(threads, genFractal))
+                break;
+
+            for (size_t y = 0; y < rows; ++y)
+            {
+                if (block->rowComplete[y])
+                    ++completedRows;
+            }
+
+            ret = 0;
+        }
+        else if (ret)
+        {
+            break;
+        }
+        else
+        {
+            completedRows += rows;
         }
 
         blockToImage(block);
+        checkpointBlock(journal, block);
+        closeBlock(network, window);
     }
 
-    freeBlock(block);
+    stopLocalWorker(network);
+    freeLocalRenderer(&local);
+    freeWindow(window);
+    freeThreads(threads);
+
+    for (unsigned int k = 0; k < WINDOW_BLOCKS; ++k)
+        freeBlock(blocks[k]);
+
+    if (ret)
+    {
+        closeJournal(journal, false);
+        return 1;
+    }
 
     logMessage(INFO, "Closing connections with workers");
 
@@ -285,166 +530,182 @@ int imageOutputMaster(PlotCTX *p, NetworkCTX *network, ProgramCTX *ctx)
         if (s < 0)
             continue;
 
+        logCompression(&(network->workers[i]));
+
         close(s);
         network->workers[i].s = -1;
         freeClientReceiveBuffer(&(network->workers[i]));
     }
 
-    return 0;
+    logSpeculation(network);
+
+    ret = reportCoverage(completedRows, p->height);
+    closeJournal(journal, ret == 0);
+
+    return ret;
 }
 
 
-/* Initialise plot array, run function, then write to file */
+/* Calculate the rows the master allocates and send them back. The worker keeps
+ * network->units work units requested, so that the next allocation is waiting
+ * as soon as a unit is calculated, and each unit is sent on another thread
+ * while the next is calculated
+ */
 int imageRowOutput(PlotCTX *p, NetworkCTX *network, ProgramCTX *ctx)
 {
     /* Processing threads */
     Thread *threads;
 
-    /* Image block object */
-    Block *block;
-
-    /* Pointer to fractal row generation function */
-    void * (*genFractalRow)(void *);
+    /* Double-buffered work units and the thread sending them */
+    RowSender sender;
 
-    switch (p->precision)
-    {
-        case STD_PRECISION:
-            genFractalRow = generateFractalRow;
-            break;
-        case EXT_PRECISION:
-            genFractalRow = generateFractalRowExt;
-            break;
-        
-        #ifdef MP_PREC
-        case MUL_PRECISION:
-            genFractalRow = generateFractalRowMP;
-            break;
-        #endif
-        
-        default:
-            return 1;
-    }
+    /* Pointer to fractal generation function */
+    void * (*genFractal)(void *);
 
-    block = createBlock();
+    unsigned int k = 0;
+    int ret = 0;
 
-    if (!block)
+    if (getFractalFunction(&genFractal, p))
         return 1;
 
-    /* Set values in the Block object and allocate memory for the image array as
-     * a single row of the image
-     */
-    if (initialiseBlockAsRow(block, p))
+    if (createRowSender(&sender, p, network->s, network->compress))
     {
-        freeBlock(block);
+        close(network->s);
         return 1;
     }
 
     /* Create a list of processing threads. The most optimised solution is one
      * thread per processing core.
      */
-    threads = createThreads(block, ctx->threads);
+    threads = createThreads(sender.blocks[0], ctx->threads);
 
     if (!threads)
     {
-        freeBlock(block);
+        close(network->s);
+        freeRowSender(&sender);
         return 1;
     }
 
-    while (1)
-    {
-        int ret = requestRowNumber(&(block->id), network->s, p);
+    for (unsigned int i = 0; i < network->units && !ret; ++i)
+        ret = requestRows(network->s, sender.maxRows);
 
-        if (ret == -3)
-        {
-            /* Parsing error */
-            continue;
-        }
-        else if (ret == -2)
+    if (!ret)
+    {
+        if (pthread_create(&(sender.pid), NULL, sendRows, &sender))
         {
-            /* Safe shutdown */
-            break;
+            logMessage(ERROR, "Thread could not be created");
+            ret = -1;
         }
-        else if (ret)
+        else
         {
-            close(network->s);
-            freeBlock(block);
-            freeThreads(threads);
-            return 1;  
+            sender.running = true;
         }
+    }
 
-        logMessage(INFO, "Working on row %zu", block->id);
+    while (!ret)
+    {
+        Frame job;
+        Block *block = sender.blocks[k];
 
-        /* Create threads to significantly decrease execution time */
-        for (unsigned int i = 0; i < threads->tCount; ++i)
-        {
-            Thread *t = &(threads[i]);
-            logMessage(DEBUG, "Spawning thread %u", t->tid);
-    
-            if (pthread_create(&(t->pid), NULL, genFractalRow, t))
-            {
-                logMessage(ERROR, "Thread could not be created");
-                close(network->s);
-                freeBlock(block);
-                freeThreads(threads);
-                return 1;
-            }
-        }
+        /* Wait for the block's last rows to be sent */
+        pthread_mutex_lock(&(sender.lock));
 
-        logMessage(DEBUG, "All threads successfully created");
-        
-        /* Wait for threads to exit */
-        for (unsigned int i = 0; i < threads->tCount; ++i)
-        {
-            Thread *t = &(threads[i]);
+        while (sender.full[k] && !sender.ret)
+            pthread_cond_wait(&(sender.cond), &(sender.lock));
 
-            if (pthread_join(t->pid, NULL))
-            {
-                logMessage(ERROR, "Thread %u could not be harvested", t->tid);
-                close(network->s);
-                freeBlock(block);
-                freeThreads(threads);
-                return 1;
-            }
-                
-            logMessage(DEBUG, "Thread %u joined", t->tid);
-        }
+        ret = sender.ret;
+        pthread_mutex_unlock(&(sender.lock));
 
-        logMessage(DEBUG, "All threads successfully destroyed");
+        if (ret)
+            break;
 
-        ret = sendRowData(network->s, block->array, block->rowSize);
+        ret = readAllocation(&job, network->s, p, sender.maxRows);
 
-        if (ret == -3)
-        {
-            /* Parsing error */
-            continue;
-        }
-        else if (ret == -2)
-        {
-            /* Safe shutdown */
+        if (ret)
             break;
-        }
-        else if (ret)
+
+        setBlockRows(block, (size_t) job.firstRow, (size_t) job.rowCount);
+
+        for (unsigned int i = 0; i < threads->tCount; ++i)
+            threads[i].block = block;
+
+        logMessage(INFO, "Working on rows %zu to %zu", block->id, block->id + block->remainderRows - 1);
+
+        if (renderPass(threads, genFractal))
         {
-            close(network->s);
-            freeBlock(block);
-            freeThreads(threads);
-            return 1;
+            ret = -1;
+            break;
         }
+
+        /* Hand the rows to the sending thread */
+        pthread_mutex_lock(&(sender.lock));
+        sender.jobs[k] = job;
+        sender.full[k] = true;
+        pthread_cond_broadcast(&(sender.cond));
+        pthread_mutex_unlock(&(sender.lock));
+
+        k ^= 1;
+    }
+
+    /* The sending thread finishes sending what it has before exiting */
+    if (sender.running)
+    {
+        pthread_mutex_lock(&(sender.lock));
+        sender.stop = true;
+        pthread_cond_broadcast(&(sender.cond));
+        pthread_mutex_unlock(&(sender.lock));
+
+        pthread_join(sender.pid, NULL);
     }
 
     logMessage(DEBUG, "Freeing memory");
 
     close(network->s);
-    freeBlock(block);
+    freeRowSender(&sender);
     freeThreads(threads);
 
-    return 0;
+    /* The master closing the connection is a safe shutdown */
+    return (ret == -2) ? 0 : 1;
 }
 
 
 /* Close image file */
 int closeImage(PlotCTX *p)
 {
+    int ret = 0;
+
+    if (p->png)
+    {
+        ret = finishPNG(p->png);
+        freePNGEncoder(p->png);
+        p->png = NULL;
+    }
+
+    if (p->tiff)
+    {
+        ret = finishTIFF(p->tiff);
+        freeTIFFWriter(p->tiff);
+        p->tiff = NULL;
+    }
+
+    if (p->pyramid)
+    {
+        ret = finishPyramid(p->pyramid);
+        freePyramid(p->pyramid);
+        p->pyramid = NULL;
+    }
+
+    if (p->map)
+    {
+        logMessage(DEBUG, "Unmapping image file");
+
+        if (msync(p->map, p->mapSize, MS_SYNC))
+            logMessage(WARNING, "Mapped image could not be written back");
+
+        munmap(p->map, p->mapSize);
+        p->map = NULL;
+    }
+
     logMessage(DEBUG, "Closing image file");
 
     if (fclose(p->file))
@@ -458,16 +719,623 @@ int closeImage(PlotCTX *p)
 
     logMessage(DEBUG, "Image file closed");
 
+    return ret;
+}
+
+
+/* Give the colour scheme the distribution of the plot's smoothed iteration
+ * counts for histogram colouring. It is taken from a render of the plot at a
+ * fraction of its resolution, so that the image itself is still calculated in
+ * a single pass of its blocks, and by workers that never see the whole plot
+ */
+int equaliseColours(PlotCTX *p, const ProgramCTX *ctx)
+{
+    double *samples;
+    size_t n = 0;
+    size_t columns = (p->width + HISTOGRAM_STRIDE - 1) / HISTOGRAM_STRIDE;
+    size_t rows = (p->height + HISTOGRAM_STRIDE - 1) / HISTOGRAM_STRIDE;
+
+    if (p->colour.depth != BIT_DEPTH_24 && !p->colour.palette)
+    {
+        logMessage(WARNING, "Only true colour schemes can be histogram-coloured, colouring normally");
+        return 0;
+    }
+
+    if (columns > HISTOGRAM_SAMPLES_MAX)
+        columns = HISTOGRAM_SAMPLES_MAX;
+
+    if (rows > HISTOGRAM_SAMPLES_MAX)
+        rows = HISTOGRAM_SAMPLES_MAX;
+
+    logMessage(INFO, "Sampling the plot at %zux%zu for histogram colouring", columns, rows);
+
+    samples = malloc(columns * rows * sizeof(*samples));
+
+    if (!samples)
+    {
+        logMessage(ERROR, "Memory allocation failed");
+        return 1;
+    }
+
+    /* Raw iteration data being recoloured is sampled directly */
+    if (p->source)
+    {
+        sampleSource(samples, &n, p, columns, rows);
+    }
+    else if (samplePlot(samples, &n, p, ctx, columns, rows))
+    {
+        free(samples);
+        return 1;
+    }
+
+    if (n == 0)
+    {
+        logMessage(WARNING, "No sampled point escaped, colouring normally");
+        free(samples);
+        return 0;
+    }
+
+    if (initialiseHistogram(&(p->colour), samples, n))
+    {
+        logMessage(ERROR, "Could not create histogram");
+        free(samples);
+        return 1;
+    }
+
+    logMessage(DEBUG, "Histogram of %zu escaped samples spans smoothed iteration counts %g to %g",
+               n, p->colour.histogram[0], p->colour.histogram[p->colour.histogramSize - 1]);
+
+    free(samples);
+
+    return 0;
+}
+
+
+/* Write the header of the image file */
+static int writeImageHeader(FILE *f, const PlotCTX *p)
+{
+    if (p->output == OUTPUT_PNM)
+    {
+        char header[IMAGE_HEADER_LEN_MAX];
+
+        logMessage(DEBUG, "Writing header to image");
+
+        /* Write PNM file header */
+        switch (p->colour.depth)
+        {
+            case BIT_DEPTH_1:
+                /* PBM file */
+                snprintf(header, sizeof(header), "P4 %zu %zu ", p->width, p->height);
+                break;
+            case BIT_DEPTH_8:
+                /* PGM file */
+                snprintf(header, sizeof(header), "P5 %zu %zu 255 ", p->width, p->height);
+                break;
+            case BIT_DEPTH_24:
+                /* PPM file */
+                snprintf(header, sizeof(header), "P6 %zu %zu 255 ", p->width, p->height);
+                break;
+            default:
+                logMessage(ERROR, "Could not determine bit depth");
+                return 1;
+        }
+
+        fprintf(f, "%s", header);
+
+        logMessage(DEBUG, "Header \'%s\' successfully wrote to image", header);
+    }
+    else if (p->output == OUTPUT_RAW)
+    {
+        return writeRawHeader(f, p);
+    }
+
+    return 0;
+}
+
+
+/* Check that a partial image being resumed starts with the header this plot
+ * would write, leaving the file positioned at its pixel data
+ */
+static int verifyImageHeader(PlotCTX *p)
+{
+    char *expected = NULL;
+    size_t n = 0;
+    char *header;
+    FILE *stream = open_memstream(&expected, &n);
+
+    if (!stream)
+        return 1;
+
+    if (writeImageHeader(stream, p) || fclose(stream))
+    {
+        free(expected);
+        return 1;
+    }
+
+    header = malloc(n);
+
+    if (!header || fread(header, 1, n, p->file) != n || memcmp(header, expected, n))
+    {
+        logMessage(ERROR, "Image \'%s\' does not match the plot being resumed", p->plotFilepath);
+        free(header);
+        free(expected);
+        return 1;
+    }
+
+    free(header);
+    free(expected);
+
+    /* Switch the stream from reading to writing */
+    return fseek(p->file, (long) n, SEEK_SET);
+}
+
+
+/* Size the image file to hold every pixel and map it into memory, so that
+ * blocks are calculated in place rather than copied into the file
+ */
+static int mapImage(PlotCTX *p)
+{
+    long header;
+    int fd = fileno(p->file);
+
+    size_t rowSize = (p->width * p->colour.depth + CHAR_BIT - 1) / CHAR_BIT;
+
+    if (fflush(p->file) || (header = ftell(p->file)) < 0)
+    {
+        logMessage(ERROR, "Could not get image header size");
+        return 1;
+    }
+
+    p->mapOffset = (size_t) header;
+    p->mapSize = p->mapOffset + p->height * rowSize;
+
+    logMessage(DEBUG, "Mapping %zu bytes of image file", p->mapSize);
+
+    if (ftruncate(fd, (off_t) p->mapSize))
+    {
+        logMessage(ERROR, "Image file could not be resized to %zu bytes", p->mapSize);
+        return 1;
+    }
+
+    p->map = mmap(NULL, p->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (p->map == MAP_FAILED)
+    {
+        p->map = NULL;
+        logMessage(ERROR, "Image file could not be mapped into memory");
+        return 1;
+    }
+
+    /* Pixels are written front to back, one block at a time */
+    posix_madvise(p->map, p->mapSize, POSIX_MADV_SEQUENTIAL);
+
+    logMessage(DEBUG, "Image file mapped");
+
+    return 0;
+}
+
+
+/* Get the fractal generation function for the precision mode */
+static int getFractalFunction(void * (**genFractal)(void *), const PlotCTX *p)
+{
+    /* Raw iteration data only needs colouring */
+    if (p->source)
+    {
+        *genFractal = recolourFractal;
+        return 0;
+    }
+
+    switch (p->precision)
+    {
+        case STD_PRECISION:
+            *genFractal = generateFractal;
+            break;
+        case EXT_PRECISION:
+            *genFractal = generateFractalExt;
+            break;
+        
+        #ifdef MP_PREC
+        case MUL_PRECISION:
+            *genFractal = generateFractalMP;
+            break;
+        #endif
+        
+        default:
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/* Render the block in full and write it to the image. Its rows are
+ * checkpointed as they are completed
+ */
+static int renderBlock(Thread *threads, void * (*genFractal)(void *), Journal *journal, size_t *completed)
+{
+    Block *block = threads->block;
+    Checkpointer *checkpointer = startCheckpoints(journal, threads);
+    int ret = renderPass(threads, genFractal);
+
+    stopCheckpoints(checkpointer);
+
+    if (ret)
+        return 1;
+
+    if (!renderCancelled())
+    {
+        size_t rows = (block->remainder) ? block->remainderRows : block->rows;
+
+        memset(block->rowComplete, true, rows * sizeof(*(block->rowComplete)));
+        *completed += rows;
+    }
+    else
+    {
+        /* Keep the rows finished before cancellation and fill in the rest at a
+         * lower resolution
+         */
+        *completed += getCompletedRows(block, threads);
+
+        if (renderFallback(threads, genFractal))
+            return 1;
+    }
+
+    blockToImage(block);
+
+    return 0;
+}
+
+
+/* Render the block in passes of halving sample spacing, each calculating only
+ * the samples that are new to it. The block is written to the image after
+ * every pass, overwriting the last, so a usable image is available early. Rows
+ * are checkpointed as the full-resolution pass completes them
+ */
+static int renderProgressive(Thread *threads, void * (*genFractal)(void *), Journal *journal, size_t *completed)
+{
+    Block *block = threads->block;
+    FILE *f = block->parameters->file;
+    size_t rows = (block->remainder) ? block->remainderRows : block->rows;
+
+    /* Position of the block in the image (-1 if the stream is not seekable) */
+    long offset = ftell(f);
+
+    for (unsigned int stride = COARSE_STRIDE; stride > 0; stride /= 2)
+    {
+        Checkpointer *checkpointer;
+        int ret;
+
+        logMessage(INFO, "Rendering block %zu at 1/%u resolution", block->id, stride);
+
+        block->stride = stride;
+        block->refining = (stride < COARSE_STRIDE);
+
+        checkpointer = (stride == 1) ? startCheckpoints(journal, threads) : NULL;
+        ret = renderPass(threads, genFractal);
+        stopCheckpoints(checkpointer);
+
+        /* Segments depend on the pass, so count completed rows before reset */
+        if (!ret && stride == 1)
+        {
+            if (renderCancelled())
+            {
+                *completed += getCompletedRows(block, threads);
+            }
+            else
+            {
+                memset(block->rowComplete, true, rows * sizeof(*(block->rowComplete)));
+                *completed += rows;
+            }
+        }
+
+        block->stride = 1;
+        block->refining = false;
+
+        if (ret)
+            return 1;
+
+        if (stride < COARSE_STRIDE)
+        {
+            if (offset >= 0)
+            {
+                fseek(f, offset, SEEK_SET);
+            }
+            else if (block->parameters->output == OUTPUT_TERMINAL && isatty(fileno(f)))
+            {
+                /* Redraw over the previous pass */
+                fprintf(f, "\033[%zuA", rows);
+            }
+        }
+
+        blockToImage(block);
+        fflush(f);
+
+        /* The image already holds the last completed pass */
+        if (renderCancelled())
+            break;
+    }
+
+    return 0;
+}
+
+
+/* Run the processing threads over their block and wait for them to finish */
+static int renderPass(Thread *threads, void * (*genFractal)(void *))
+{
+    resetProgress(threads);
+
+    /* Create threads to significantly decrease execution time */
+    for (unsigned int i = 0; i < threads->tCount; ++i)
+    {
+        Thread *t = &(threads[i]);
+
+        logMessage(INFO, "Spawning thread %u", t->tid);
+
+        if (pthread_create(&(t->pid), NULL, genFractal, t))
+        {
+            logMessage(ERROR, "Thread could not be created");
+            return 1;
+        }
+    }
+
+    logMessage(INFO, "All threads successfully created");
+    
+    /* Wait for threads to exit */
+    for (unsigned int i = 0; i < threads->tCount; ++i)
+    {
+        Thread *t = &(threads[i]);
+
+        if (pthread_join(t->pid, NULL))
+        {
+            logMessage(ERROR, "Thread %u could not be harvested", t->tid);
+            return 1;
+        }
+            
+        logMessage(INFO, "Thread %u joined", t->tid);
+    }
+
+    logMessage(INFO, "All threads successfully destroyed");
+
+    return 0;
+}
+
+
+/* Sample the incomplete rows of the block (as marked in its rowComplete list)
+ * at a lower resolution so the image has no gaps
+ */
+static int renderFallback(Thread *threads, void * (*genFractal)(void *))
+{
+    Block *block = threads->block;
+    int ret;
+
+    logMessage(INFO, "Filling incomplete rows of block %zu at 1/%u resolution", block->id, COARSE_STRIDE);
+
+    block->stride = COARSE_STRIDE;
+    ret = renderPass(threads, genFractal);
+    block->stride = 1;
+
+    return ret;
+}
+
+
+/* Log how much of the image was calculated in full. Returns 2 if the render
+ * was cut short
+ */
+static int reportCoverage(size_t completed, size_t rows)
+{
+    if (completed >= rows)
+        return 0;
+
+    logMessage(WARNING, "Render incomplete - %zu of %zu rows calculated in full (%.1f%%)",
+               completed, rows, 100.0 * (double) completed / (double) rows);
+
+    return 2;
+}
+
+
+/* Whether the image can be resumed from a checkpoint journal - only when its
+ * rows are stored uncompressed in a file
+ */
+static bool isResumable(const PlotCTX *p)
+{
+    return p->output == OUTPUT_PNM || p->output == OUTPUT_RAW;
+}
+
+
+/* Whether the image is encoded as it is written, so that each block can only
+ * be written once, and not in place
+ */
+static bool isEncoded(const PlotCTX *p)
+{
+    return p->output == OUTPUT_PNG || p->output == OUTPUT_TIFF || p->output == OUTPUT_DZI;
+}
+
+
+/* Point a block object at a block of the image */
+static void moveBlock(Block *block, size_t id)
+{
+    block->id = id;
+    block->remainder = (id == block->bCount);
+
+    /* Calculate straight into the block's region of a mapped image */
+    if (block->map)
+        block->array = block->map + id * block->blockSize;
+}
+
+
+/* Move past a block that is already in the image file */
+static void skipBlock(const Block *block)
+{
+    size_t n = (block->remainder) ? block->remainderBlockSize : block->blockSize;
+
+    logMessage(INFO, "Block %zu already in image", block->id);
+
+    if (!block->map)
+        fseek(block->parameters->file, (long) n, SEEK_CUR);
+}
+
+
+/* Render the plot as raw iteration data at columns by rows, and collect the
+ * smoothed iteration counts of the points that escape
+ */
+static int samplePlot(double *samples, size_t *n, const PlotCTX *p, const ProgramCTX *ctx, size_t columns,
+                      size_t rows)
+{
+    /* The same range of the plot, without any of its output */
+    PlotCTX sample = *p;
+
+    Thread *threads;
+    Block *block;
+
+    void * (*genFractal)(void *);
+
+    sample.output = OUTPUT_RAW;
+    sample.file = NULL;
+    sample.map = NULL;
+    sample.png = NULL;
+    sample.tiff = NULL;
+    sample.pyramid = NULL;
+    sample.width = columns;
+    sample.height = rows;
+    sample.colour.palette = NULL;
+    sample.colour.paletteSize = 0;
+    sample.colour.histogram = NULL;
+    sample.colour.histogramSize = 0;
+
+    if (initialiseColourScheme(&(sample.colour), COLOUR_SCHEME_TYPE_RAW) || getFractalFunction(&genFractal, &sample))
+        return 1;
+
+    block = createBlock();
+
+    if (!block)
+        return 1;
+
+    if (initialiseBlock(block, &sample, ctx->mem))
+    {
+        freeBlock(block);
+        return 1;
+    }
+
+    threads = createThreads(block, ctx->threads);
+
+    if (!threads)
+    {
+        freeBlock(block);
+        return 1;
+    }
+
+    for (block->id = 0; block->id <= block->bCount; ++(block->id))
+    {
+        size_t blockRows;
+
+        if (block->id == block->bCount)
+        {
+            if (!(block->remainderRows))
+                break;
+
+            block->remainder = true;
+        }
+
+        blockRows = (block->remainder) ? block->remainderRows : block->rows;
+        memset(block->rowComplete, false, blockRows * sizeof(*(block->rowComplete)));
+
+        if (renderPass(threads, genFractal))
+        {
+            freeBlock(block);
+            freeThreads(threads);
+            return 1;
+        }
+
+        for (size_t i = 0; i < blockRows * columns; ++i)
+        {
+            EscapeStatus status;
+
+            decodeRawPixel(&(samples[*n]), &status, block->array + i * RAW_PIXEL_SIZE);
+
+            if (status == ESCAPED)
+                ++(*n);
+        }
+    }
+
+    freeBlock(block);
+    freeThreads(threads);
+
     return 0;
 }
 
 
+/* Collect the smoothed iteration counts of the escaped points of an evenly
+ * spaced columns by rows grid of the raw iteration data being recoloured
+ */
+static void sampleSource(double *samples, size_t *n, const PlotCTX *p, size_t columns, size_t rows)
+{
+    const char *source = p->source + p->sourceOffset;
+
+    for (size_t y = 0; y < rows; ++y)
+    {
+        const char *row = source + y * p->height / rows * p->width * RAW_PIXEL_SIZE;
+
+        for (size_t x = 0; x < columns; ++x)
+        {
+            EscapeStatus status;
+
+            decodeRawPixel(&(samples[*n]), &status, row + x * p->width / columns * RAW_PIXEL_SIZE);
+
+            if (status == ESCAPED)
+                ++(*n);
+        }
+    }
+}
+
+
 /* Write block to image file */
 static void blockToImage(const Block *block)
 {
     FILE *f = block->parameters->file;
     size_t n = (block->remainder) ? block->remainderBlockSize : block->blockSize;
 
+    if (block->map)
+    {
+        flushMappedBlock(block, n);
+        return;
+    }
+
+    if (block->parameters->png)
+    {
+        size_t rows = (block->remainder) ? block->remainderRows : block->rows;
+
+        logMessage(INFO, "Compressing %zu rows into PNG image", rows);
+
+        if (writePNGRows(block->parameters->png, block->array, rows))
+            logMessage(ERROR, "Block could not be written to PNG image");
+
+        return;
+    }
+
+    if (block->parameters->tiff)
+    {
+        size_t rows = (block->remainder) ? block->remainderRows : block->rows;
+
+        logMessage(INFO, "Writing the tiles of %zu rows to TIFF image", rows);
+
+        if (writeTIFFTiles(block->parameters->tiff, block->array, block->id * block->rows, rows))
+            logMessage(ERROR, "Block could not be written to TIFF image");
+
+        return;
+    }
+
+    if (block->parameters->pyramid)
+    {
+        size_t rows = (block->remainder) ? block->remainderRows : block->rows;
+
+        logMessage(INFO, "Adding %zu rows to image pyramid", rows);
+
+        if (writePyramidRows(block->parameters->pyramid, block->array, rows))
+            logMessage(ERROR, "Block could not be written to image pyramid");
+
+        return;
+    }
+
     logMessage(INFO, "Writing %zu bytes to image file", n);
 
     if (block->parameters->colour.depth != BIT_DEPTH_ASCII)
@@ -489,4 +1357,200 @@ static void blockToImage(const Block *block)
     }
 
     logMessage(INFO, "Block successfully wrote to file");
-}
\ No newline at end of file
+}
+
+
+/* Start writing back a block of a mapped image, which is already in place in
+ * the file, and advise that its pages will not be needed again so the page
+ * cache does not fill with finished parts of the image
+ */
+static void flushMappedBlock(const Block *block, size_t n)
+{
+    PlotCTX *p = block->parameters;
+    size_t pageSize = (size_t) sysconf(_SC_PAGE_SIZE);
+
+    /* The mapping is page-aligned, so round the start of the region down */
+    size_t start = (size_t) (block->array - p->map);
+    size_t end = start + n;
+
+    start -= start % pageSize;
+
+    logMessage(INFO, "Writing back %zu bytes of mapped image", n);
+
+    if (msync(p->map + start, end - start, MS_ASYNC))
+        logMessage(WARNING, "Mapped image could not be written back");
+
+    posix_madvise(p->map + start, end - start, POSIX_MADV_DONTNEED);
+}
+
+
+/* Allocate the blocks that work units are calculated into and sent from */
+static int createRowSender(RowSender *sender, PlotCTX *p, int s, bool compress)
+{
+    size_t maxRows = (p->height < WORK_UNIT_ROWS_MAX) ? p->height : WORK_UNIT_ROWS_MAX;
+
+    sender->s = s;
+    sender->running = false;
+    sender->stop = false;
+    sender->ret = 0;
+    sender->packer = NULL;
+
+    if (compress)
+    {
+        logMessage(INFO, "Master asked for packed rows");
+
+        sender->packer = createRowPacker();
+
+        if (!sender->packer)
+            return 1;
+    }
+
+    for (unsigned int k = 0; k < 2; ++k)
+    {
+        sender->full[k] = false;
+        sender->blocks[k] = createBlock();
+
+        /* Set values in the Block object and allocate memory for the image
+         * array as the largest run of rows the master may send
+         */
+        if (!sender->blocks[k] || initialiseBlockAsRows(sender->blocks[k], p, maxRows, WORK_UNIT_SIZE_MAX))
+        {
+            freeBlock(sender->blocks[0]);
+
+            if (k)
+                freeBlock(sender->blocks[1]);
+
+            freeRowPacker(sender->packer);
+            return 1;
+        }
+    }
+
+    sender->maxRows = sender->blocks[0]->remainderRows;
+
+    pthread_mutex_init(&(sender->lock), NULL);
+    pthread_cond_init(&(sender->cond), NULL);
+
+    return 0;
+}
+
+
+static void freeRowSender(RowSender *sender)
+{
+    freeBlock(sender->blocks[0]);
+    freeBlock(sender->blocks[1]);
+    freeRowPacker(sender->packer);
+
+    pthread_mutex_destroy(&(sender->lock));
+    pthread_cond_destroy(&(sender->cond));
+}
+
+
+/* Send each calculated work unit to the master in turn, followed by a request
+ * for the unit to replace it. Rows that do not pack any smaller are sent as they
+ * are
+ */
+static void * sendRows(void *arg)
+{
+    RowSender *sender = arg;
+    unsigned int k = 0;
+
+    while (1)
+    {
+        int ret;
+        Block *block;
+
+        pthread_mutex_lock(&(sender->lock));
+
+        while (!sender->full[k] && !sender->stop)
+            pthread_cond_wait(&(sender->cond), &(sender->lock));
+
+        if (!sender->full[k])
+        {
+            pthread_mutex_unlock(&(sender->lock));
+            break;
+        }
+
+        pthread_mutex_unlock(&(sender->lock));
+
+        block = sender->blocks[k];
+
+        if (sender->packer
+            && !packRows(sender->packer, (const unsigned char *) block->array, block->remainderBlockSize, block->memSize))
+        {
+            ret = sendPackedRowData(sender->s, &(sender->jobs[k]), sender->packer->out, sender->packer->length);
+        }
+        else
+        {
+            ret = sendRowData(sender->s, &(sender->jobs[k]), block->array, block->remainderBlockSize);
+        }
+
+        if (!ret)
+            ret = requestRows(sender->s, sender->maxRows);
+
+        pthread_mutex_lock(&(sender->lock));
+        sender->full[k] = false;
+        sender->ret = ret;
+        pthread_cond_broadcast(&(sender->cond));
+        pthread_mutex_unlock(&(sender->lock));
+
+        if (ret)
+            break;
+
+        k ^= 1;
+    }
+
+    return NULL;
+}
+
+
+/* Create the master's own threads and a view for the largest work unit */
+static int createLocalRenderer(LocalRenderer *renderer, PlotCTX *p, unsigned int n, void * (*genFractal)(void *))
+{
+    logMessage(INFO, "Calculating rows on %u threads of the master", n);
+
+    renderer->genFractal = genFractal;
+    renderer->block = createBlock();
+
+    if (!renderer->block || initialiseBlockAsRowView(renderer->block, p, WORK_UNIT_ROWS_MAX, WORK_UNIT_SIZE_MAX))
+        return 1;
+
+    renderer->threads = createThreads(renderer->block, n);
+
+    return (renderer->threads) ? 0 : 1;
+}
+
+
+/* Calculate a work unit allocated to the master's own threads straight into
+ * its rows of the master's block. Rows cut short by a cancellation are left
+ * to be put back in the queue
+ */
+static int renderLocalRows(void *arg, char *dest, size_t first, size_t n)
+{
+    LocalRenderer *renderer = arg;
+    Block *block = renderer->block;
+
+    setBlockRows(block, first, n);
+    block->array = dest;
+
+    logMessage(INFO, "Master working on rows %zu to %zu", first, first + n - 1);
+
+    if (renderPass(renderer->threads, renderer->genFractal) || renderCancelled())
+        return 1;
+
+    return 0;
+}
+
+
+static void freeLocalRenderer(LocalRenderer *renderer)
+{
+    /* The view does not own the rows it was last pointed at */
+    if (renderer->block)
+        renderer->block->array = NULL;
+
+    freeBlock(renderer->block);
+    freeThreads(renderer->threads);
+
+    renderer->block = NULL;
+    renderer->threads = NULL;
+}
+
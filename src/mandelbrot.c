@@ -15,14 +15,18 @@
 
 #include "arg_ranges.h"
 #include "array.h"
+#include "cancellation.h"
 #include "connection_handler.h"
 #include "ext_precision.h"
 #include "getopt_error.h"
 #include "image.h"
 #include "mandelbrot_parameters.h"
 #include "parameters.h"
+#include "png.h"
 #include "process_options.h"
 #include "program_ctx.h"
+#include "pyramid.h"
+#include "tiff.h"
 
 #ifdef MP_PREC
 #include <mpfr.h>
@@ -39,6 +43,9 @@
 #define COMPLEX_STR_LEN_MAX 32
 #define PRECISION_STR_LEN_MAX 32
 
+/* Exit status when the render was cancelled and the image written in part */
+#define EXIT_PARTIAL 3
+
 
 static LogLevel LOG_LEVEL_DEFAULT = INFO;
 
@@ -97,7 +104,9 @@ int main(int argc, char **argv)
     if (network->mode != LAN_WORKER)
     {
         /* Will allocate memory of p. Requires freePlotCTX(p) later */
-        p = processPlotOptions(argc, argv);
+        p = (ctx->recolour)
+            ? processRecolourOptions(ctx->recolourFilepath, argc, argv)
+            : processPlotOptions(argc, argv);
 
         if (validatePlotParameters(p))
         {
@@ -107,6 +116,16 @@ int main(int argc, char **argv)
             closeLog();
             return EXIT_FAILURE;
         }
+
+        /* Workers receive the distribution with the rest of the parameters */
+        if (ctx->histogram && equaliseColours(p, ctx))
+        {
+            freeProgramCTX(ctx);
+            freeNetworkCTX(network);
+            freePlotCTX(p);
+            closeLog();
+            return EXIT_FAILURE;
+        }
     }
 
     logMessage(INFO, "Initialising network");
@@ -131,7 +150,7 @@ int main(int argc, char **argv)
     /* Open image file and write header (if PNM) */
     if (p->output != OUTPUT_TERMINAL && network->mode != LAN_WORKER)
     {
-        if (initialiseImage(p))
+        if (initialiseImage(p, ctx))
         { 
             freePlotCTX(p);
             freeNetworkCTX(network);
@@ -141,6 +160,19 @@ int main(int argc, char **argv)
         }
     }
     
+    /* Workers are stopped by their master closing the connection */
+    if (network->mode != LAN_WORKER && initialiseCancellation(ctx->deadline))
+    {
+        if (p->output != OUTPUT_TERMINAL)
+            closeImage(p);
+
+        freePlotCTX(p);
+        freeNetworkCTX(network);
+        freeProgramCTX(ctx);
+        closeLog();
+        return EXIT_FAILURE;
+    }
+
     /* Produce plot */
     switch (network->mode)
     {
@@ -160,7 +192,8 @@ int main(int argc, char **argv)
 
     freeProgramCTX(ctx);
 
-    if (ret)
+    /* A cancelled render still has its image written */
+    if (ret && ret != 2)
     {
         freePlotCTX(p);
         freeNetworkCTX(network);
@@ -184,7 +217,7 @@ int main(int argc, char **argv)
     if (closeLog())
         return EXIT_FAILURE;
 
-    return EXIT_SUCCESS;
+    return (ret == 2) ? EXIT_PARTIAL : EXIT_SUCCESS;
 }
 
 
@@ -228,17 +261,60 @@ static int usage(void)
            "                                  Greyscale schemes are 8-bit\n"
            "                                  Coloured schemes are full 24-bit\n");
     printf("  -o FILE                       Output file name (default = \'%s\')\n", PLOT_FILEPATH_DEFAULT);
-    printf("  -r WIDTH,  --width=WIDTH      The width of the image file in pixels\n"
-           "                                  If using a 1-bit colour scheme, WIDTH must be a multiple of %u to allow "
-           "for\n"
-           "                                  bit-width pixels\n", (unsigned int) CHAR_BIT);
+    printf("  -r WIDTH,  --width=WIDTH      The width of the image file in pixels\n");
     printf("  -s HEIGHT, --height=HEIGHT    The height of the image file in pixels\n");
     printf("  -t                            Output to stdout (or, with -o, text file) using ASCII characters as "
            "shading\n");
+    printf("             --raw              Output the smoothed iteration count and escape flag of each pixel instead "
+           "of colours\n"
+           "                                  The raw iteration data can be coloured later with \'--recolour\'\n");
+    printf("             --png              Output a PNG image (the default if FILE ends in \'%s\')\n"
+           "                                  The image is compressed in parallel, one strip per thread\n",
+           PNG_EXTENSION);
+    printf("             --tiff[=CODEC]     Output a tiled BigTIFF image (the default if FILE ends in \'%s\' or \'%s\')\n"
+           "                                  CODEC compresses each tile - \'none\' (default), \'packbits\', or "
+           "\'deflate\'\n"
+           "                                  The tiles of each block are written in parallel, in any order\n",
+           TIFF_EXTENSION, TIFF_EXTENSION_LONG);
+    printf("             --dzi              Output a Deep Zoom image pyramid (the default if FILE ends in \'%s\')\n"
+           "                                  FILE is the descriptor; the PNG tiles of each level go in FILE_files/\n",
+           DZI_EXTENSION);
+    printf("             --indexed[=BITS]   Store a true colour image as BITS-bit indices into a palette of its colour "
+           "scheme\n"
+           "                                  BITS is 8 (default) or 16; PNG images only take 8-bit indices\n"
+           "                                  Only PNG and TIFF images can be indexed\n");
+    printf("             --histogram        Spread the colours of a true colour scheme evenly over the iteration counts "
+           "of the plot\n"
+           "                                  Their distribution is taken from a render at 1/%u resolution first\n",
+           HISTOGRAM_STRIDE);
+    printf("             --recolour=FILE    Colour the raw iteration data in FILE rather than calculating a plot\n"
+           "                                  The plot parameters are taken from FILE; only output options apply\n");
+    printf("             --deadline=SECS    Stop rendering after SECS seconds and write the rows completed so far\n"
+           "                                  Unfinished rows are filled in at reduced resolution, as on SIGINT/SIGTERM"
+           "\n"
+           "                                  The program then exits with status %d\n", EXIT_PARTIAL);
+    printf("             --progressive      Render in passes of 1/8, 1/4, 1/2, then full resolution, writing the image\n"
+           "                                  after each pass. Each pass only calculates pixels new to it\n");
+    printf("             --resume           Continue an interrupted render of the same plot into the same file\n"
+           "                                  Only the rows missing from its checkpoint journal are calculated\n");
     printf("Distributed computing setup:\n");
     printf("  -g ADDR,   --worker=ADDR      Have computer work for a master at the respective IP address\n");
     printf("  -G COUNT,  --master=COUNT     Setup computer as a network master, expecting COUNT workers to connect\n");
     printf("  -p PORT                       Communicate over the given port (default = %" PRIu16 ")\n", PORT_DEFAULT);
+    printf("             --prefetch=COUNT   Have a worker keep COUNT work units requested from its master (default = %u)\n"
+           "                                  The next rows are then ready as soon as the last are calculated\n",
+           WORK_UNITS_DEFAULT);
+    printf("             --compress         Have workers pack the rows they send to the master, where it makes them smaller\n");
+    printf("                                  Worth it when the master's network link, not the workers, limits the render\n");
+    printf("             --local=COUNT      Have the master calculate rows on COUNT threads of its own alongside its workers\n"
+           "                                  (default = 0, only the workers calculate rows)\n");
+    printf("             --speculate=FACTOR Once the master runs out of rows, copy a worker's rows to an idle worker when\n"
+           "                                  they are FACTOR times overdue, keeping whichever comes back first\n"
+           "                                  (default = %.0f, 0 never copies rows)\n",
+           SPECULATION_DEFAULT);
+    printf("             --timeout=SECS     Requeue a worker's rows once they are out ten times longer than its speed\n"
+           "                                  suggests, and at least SECS seconds (default = %.0f, 0 never requeues)\n",
+           TIMEOUT_DEFAULT);
     printf("Plot type:\n");
     printf("  -j CONST,  --julia=CONST      Plot Julia set with specified constant parameter\n");
     printf("Plot parameters:\n");
@@ -285,8 +361,10 @@ static int usage(void)
            "                                  The extended floating-point type will be used for calculations\n"
            "                                  This will increase precision at high zoom but may be slower\n",
            (size_t) LDBL_MANT_DIG, (size_t) DBL_MANT_DIG);
-    printf("  -z MEM,    --memory=MEM       Limit memory usage to MEM megabytes (default = %u%% of free RAM)\n",
+    printf("  -z MEM,    --memory=MEM       Limit memory usage to MEM megabytes (default = %u%% of available RAM)\n",
            FREE_MEMORY_ALLOCATION);
+    printf("             --mmap             Map the image file into memory and calculate pixels in place\n"
+           "                                  The image may be larger than RAM; MEM then bounds how much is resident\n");
     printf("Log settings:\n");
     printf("             --log              Output log to file\n"
            "                                  Without \'--log-file\', file defaults to %s\n"
@@ -356,11 +434,23 @@ static void programParameters(const ProgramCTX *ctx)
                "    Verbosity   = %s\n"
                "    Log level   = %s\n"
                "    Log file    = %s\n"
-               "    Time format = %s",
+               "    Time format = %s\n"
+               "    Deadline    = %g s\n"
+               "    Progressive = %s\n"
+               "    Histogram   = %s\n"
+               "    Mapped      = %s\n"
+               "    Resume      = %s\n"
+               "    Recolour    = %s",
                (getLogVerbosity()) ? "VERBOSE" : "QUIET",
                level,
                (ctx && ctx->logToFile) ? ctx->logFilepath : "-",
-               timeFormat);
+               timeFormat,
+               (ctx) ? ctx->deadline : 0.0,
+               (ctx && ctx->progressive) ? "YES" : "NO",
+               (ctx && ctx->histogram) ? "YES" : "NO",
+               (ctx && ctx->mapOutput) ? "YES" : "NO",
+               (ctx && ctx->resume) ? "YES" : "NO",
+               (ctx && ctx->recolour) ? ctx->recolourFilepath : "-");
 }
 
 
@@ -396,7 +486,7 @@ static void plotParameters(const PlotCTX *p)
     /* Convert bit depth integer to string */
     if (p->colour.depth > 0)
     {
-        snprintf(depthStr, sizeof(depthStr), "(%d-bit)", p->colour.depth);
+        snprintf(depthStr, sizeof(depthStr), (p->colour.palette) ? "(%d-bit indexed)" : "(%d-bit)", p->colour.depth);
     }
     else if (p->colour.depth == 0)
     {
@@ -505,7 +595,7 @@ static void plotParameters(const PlotCTX *p)
                "    Dimensions  = %zu px * %zu px\n"
                "    Colour      = %s %s",
                outputStr,
-               (p->output == OUTPUT_PNM) ? p->plotFilepath : "-",
+               (p->output != OUTPUT_TERMINAL) ? p->plotFilepath : "-",
                p->width,
                p->height,
                colourStr,
@@ -607,16 +697,5 @@ static int validatePlotParameters(PlotCTX *p)
             return 1;
     }
 
-    /* 
-     * Minimum addressable data size is CHAR_BIT, therefore bit depths below
-     * CHAR_BIT must have pixels calculated in groups of CHAR_BIT size
-     */
-    if (p->colour.depth < CHAR_BIT && p->width % CHAR_BIT != 0)
-    {
-        p->width = p->width + CHAR_BIT - (p->width % CHAR_BIT);
-        logMessage(WARNING, "For %u-bit pixel colour schemes, the width must be a multiple of %u. Width set to %zu",
-                   (unsigned int) p->colour.depth, (unsigned int) CHAR_BIT, p->width);
-    }
-
     return 0;
 }
\ No newline at end of file
@@ -7,10 +7,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/mman.h>
+
 #include "parameters.h"
 
 #include "colour.h"
 #include "ext_precision.h"
+#include "png.h"
+#include "pyramid.h"
+#include "tiff.h"
 
 #ifdef MP_PREC
 #include <mpc.h>
@@ -129,6 +134,16 @@ PlotCTX * createPlotCTX(PrecisionMode precision)
         return NULL;
 
     p->precision = precision;
+    p->map = NULL;
+    p->source = NULL;
+    p->png = NULL;
+    p->tiff = NULL;
+    p->tiffCodec = TIFF_CODEC_NONE;
+    p->pyramid = NULL;
+    p->colour.palette = NULL;
+    p->colour.paletteSize = 0;
+    p->colour.histogram = NULL;
+    p->colour.histogramSize = 0;
 
     #ifdef MP_PREC
     if (p->precision == MUL_PRECISION)
@@ -157,6 +172,31 @@ int initialisePlotCTX(PlotCTX *p, PlotType plot, OutputType output)
         case OUTPUT_TERMINAL:
             ret = initialiseTerminalOutputParameters(p);
             break;
+        case OUTPUT_RAW:
+            /* Raw iteration data is an image of smoothed iteration counts */
+            ret = initialiseImageOutputParameters(p)
+                  || initialiseColourScheme(&(p->colour), COLOUR_SCHEME_TYPE_RAW);
+            p->output = OUTPUT_RAW;
+            break;
+        case OUTPUT_PNG:
+            ret = initialiseImageOutputParameters(p);
+            p->output = OUTPUT_PNG;
+            strncpy(p->plotFilepath, PLOT_FILEPATH_DEFAULT_PNG, sizeof(p->plotFilepath));
+            p->plotFilepath[sizeof(p->plotFilepath) - 1] = '\0';
+            break;
+        case OUTPUT_TIFF:
+            ret = initialiseImageOutputParameters(p);
+            p->output = OUTPUT_TIFF;
+            p->tiffCodec = TIFF_CODEC_NONE;
+            strncpy(p->plotFilepath, PLOT_FILEPATH_DEFAULT_TIFF, sizeof(p->plotFilepath));
+            p->plotFilepath[sizeof(p->plotFilepath) - 1] = '\0';
+            break;
+        case OUTPUT_DZI:
+            ret = initialiseImageOutputParameters(p);
+            p->output = OUTPUT_DZI;
+            strncpy(p->plotFilepath, PLOT_FILEPATH_DEFAULT_DZI, sizeof(p->plotFilepath));
+            p->plotFilepath[sizeof(p->plotFilepath) - 1] = '\0';
+            break;
         default:
             return 1;
     }
@@ -178,6 +218,39 @@ void freePlotCTX(PlotCTX *p)
             freeMP(p);
         #endif
 
+        if (p->map)
+        {
+            munmap(p->map, p->mapSize);
+            p->map = NULL;
+        }
+
+        if (p->source)
+        {
+            munmap(p->source, p->sourceSize);
+            p->source = NULL;
+        }
+
+        if (p->png)
+        {
+            freePNGEncoder(p->png);
+            p->png = NULL;
+        }
+
+        if (p->tiff)
+        {
+            freeTIFFWriter(p->tiff);
+            p->tiff = NULL;
+        }
+
+        if (p->pyramid)
+        {
+            freePyramid(p->pyramid);
+            p->pyramid = NULL;
+        }
+
+        freePalette(&(p->colour));
+        freeHistogram(&(p->colour));
+
         if (p->file)
         {
             fclose(p->file);
@@ -245,6 +318,18 @@ int getOutputString(char *dest, const PlotCTX *p, size_t n)
         case OUTPUT_TERMINAL:
             type = "Terminal output";
             break;
+        case OUTPUT_RAW:
+            type = "Raw iteration data";
+            break;
+        case OUTPUT_PNG:
+            type = "Portable Network Graphics (.png)";
+            break;
+        case OUTPUT_TIFF:
+            type = "Tiled BigTIFF (.tif)";
+            break;
+        case OUTPUT_DZI:
+            type = "Deep Zoom image pyramid (.dzi)";
+            break;
         default:
             return 1;
     }
@@ -0,0 +1,615 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "libgroot/include/log.h"
+
+#include "png.h"
+
+#include "colour.h"
+#include "deflate.h"
+
+
+#define PNG_SIGNATURE "\x89PNG\r\n\x1A\n"
+#define PNG_SIGNATURE_LEN 8
+
+#define IHDR_LEN 13
+
+/* Largest image dimension */
+#define PNG_DIMENSION_MAX 0x7FFFFFFF
+
+/* PNG colour types */
+#define COLOUR_TYPE_GREY 0
+#define COLOUR_TYPE_RGB 2
+#define COLOUR_TYPE_PALETTE 3
+
+/* Most entries a palette can hold */
+#define PALETTE_LEN_MAX 256
+
+/* Row filter types */
+#define FILTER_NONE 0
+#define FILTER_SUB 1
+#define FILTER_UP 2
+#define FILTER_AVERAGE 3
+#define FILTER_PAETH 4
+#define FILTER_TYPES 5
+
+
+/* Largest IDAT chunk written */
+static const size_t IDAT_LEN_MAX = (size_t) 1 << 30;
+
+static const uint32_t CRC_INIT = 0xFFFFFFFF;
+static const uint32_t CRC_POLYNOMIAL = 0xEDB88320;
+
+/* zlib stream header - deflate with a 32 KiB window, fast compression */
+static const unsigned char ZLIB_HEADER[] = {0x78, 0x5E};
+
+/* Final deflate block (fixed codes, holding only the end of block code) */
+static const unsigned char DEFLATE_FINAL_BLOCK[] = {0x03, 0x00};
+
+/* CRC-32 of every byte value, calculated by the first encoder */
+static uint32_t crcTable[256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+
+static void * compressStrip(void *strip);
+static void filterRow(unsigned char *out, const unsigned char *row, const unsigned char *prior, size_t n,
+                      size_t bpp, unsigned char *scratch);
+static void applyFilter(unsigned char *out, unsigned int type, const unsigned char *row,
+                        const unsigned char *prior, size_t n, size_t bpp);
+static unsigned char paethPredictor(unsigned char a, unsigned char b, unsigned char c);
+static int writeChunk(FILE *file, const char *type, const unsigned char *data, size_t n);
+static int writeChunkWithCRC(FILE *file, const char *type, const unsigned char *data, size_t n, uint32_t crc);
+static void initialiseCRCTable(void);
+static uint32_t updateCRC(uint32_t crc, const unsigned char *data, size_t n);
+static void putUint32(unsigned char *dest, uint32_t x);
+
+
+/* Create an encoder that compresses each batch of rows in parallel strips, and
+ * write the PNG signature and header chunks. If a palette is given, 8-bit
+ * pixels are indices into it
+ */
+PNGEncoder * createPNGEncoder(FILE *file, size_t width, size_t height, BitDepth depth, const RGB *palette,
+                              size_t paletteSize, unsigned int threads)
+{
+    PNGEncoder *png;
+    unsigned char ihdr[IHDR_LEN];
+    unsigned char bitDepth, colourType;
+
+    if (palette && (depth != BIT_DEPTH_8 || paletteSize > PALETTE_LEN_MAX))
+    {
+        logMessage(ERROR, "Palette cannot be written to a PNG image");
+        return NULL;
+    }
+
+    switch (depth)
+    {
+        case BIT_DEPTH_1:
+            /* PBM pixels are set for black, so they index a palette */
+            bitDepth = 1;
+            colourType = COLOUR_TYPE_PALETTE;
+            break;
+        case BIT_DEPTH_8:
+            bitDepth = 8;
+            colourType = (palette) ? COLOUR_TYPE_PALETTE : COLOUR_TYPE_GREY;
+            break;
+        case BIT_DEPTH_24:
+            bitDepth = 8;
+            colourType = COLOUR_TYPE_RGB;
+            break;
+        default:
+            logMessage(ERROR, "Colour scheme cannot be written as a PNG image");
+            return NULL;
+    }
+
+    if (width > PNG_DIMENSION_MAX || height > PNG_DIMENSION_MAX)
+    {
+        logMessage(ERROR, "Image dimensions exceed the PNG maximum of %lu pixels", (unsigned long) PNG_DIMENSION_MAX);
+        return NULL;
+    }
+
+    png = malloc(sizeof(*png));
+
+    if (!png)
+        return NULL;
+
+    png->file = file;
+    png->width = width;
+    png->height = height;
+    png->rowSize = (width * depth + CHAR_BIT - 1) / CHAR_BIT;
+    png->bpp = (depth < CHAR_BIT) ? 1 : depth / CHAR_BIT;
+    png->adaptive = !palette;
+    png->stripCount = (threads > 0) ? threads : 1;
+    png->strips = calloc(png->stripCount, sizeof(*(png->strips)));
+    png->prior = calloc(png->rowSize, 1);
+    png->adler = ADLER32_INIT;
+    png->rows = 0;
+    png->failed = false;
+
+    if (!png->strips || !png->prior)
+    {
+        logMessage(ERROR, "Memory allocation failed");
+        freePNGEncoder(png);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < png->stripCount; ++i)
+    {
+        PNGStrip *strip = &(png->strips[i]);
+
+        strip->png = png;
+        strip->scratch = malloc(FILTER_TYPES * png->rowSize);
+        strip->deflater = createDeflater();
+
+        if (!strip->scratch || !strip->deflater)
+        {
+            logMessage(ERROR, "Memory allocation failed");
+            freePNGEncoder(png);
+            return NULL;
+        }
+    }
+
+    pthread_once(&crcTableOnce, initialiseCRCTable);
+
+    logMessage(DEBUG, "Writing PNG header");
+
+    putUint32(ihdr, (uint32_t) width);
+    putUint32(ihdr + 4, (uint32_t) height);
+    ihdr[8] = bitDepth;
+    ihdr[9] = colourType;
+    ihdr[10] = 0; /* Deflate compression */
+    ihdr[11] = 0; /* Adaptive filtering */
+    ihdr[12] = 0; /* No interlacing */
+
+    fwrite(PNG_SIGNATURE, 1, PNG_SIGNATURE_LEN, file);
+
+    if (writeChunk(file, "IHDR", ihdr, sizeof(ihdr)))
+    {
+        logMessage(ERROR, "Could not write PNG header");
+        freePNGEncoder(png);
+        return NULL;
+    }
+
+    if (colourType == COLOUR_TYPE_PALETTE)
+    {
+        /* White, then black, unless the colour scheme has its own palette */
+        unsigned char plte[3 * PALETTE_LEN_MAX] = {0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00};
+        size_t entries = 2;
+
+        if (palette)
+        {
+            for (size_t i = 0; i < paletteSize; ++i)
+            {
+                plte[3 * i] = palette[i].r;
+                plte[3 * i + 1] = palette[i].g;
+                plte[3 * i + 2] = palette[i].b;
+            }
+
+            entries = paletteSize;
+        }
+
+        if (writeChunk(file, "PLTE", plte, 3 * entries))
+        {
+            logMessage(ERROR, "Could not write PNG palette");
+            freePNGEncoder(png);
+            return NULL;
+        }
+    }
+
+    /* The image data is a single zlib stream spread over the IDAT chunks */
+    if (writeChunk(file, "IDAT", ZLIB_HEADER, sizeof(ZLIB_HEADER)))
+    {
+        logMessage(ERROR, "Could not write PNG image data");
+        freePNGEncoder(png);
+        return NULL;
+    }
+
+    return png;
+}
+
+
+/* Filter and compress the next n rows of the image and write them as IDAT
+ * chunks. The rows are split into one strip per thread, and each strip is
+ * compressed on its own and ended with a sync flush so the strips join into
+ * one deflate stream. Their Adler-32 checksums are combined for the stream
+ * trailer
+ */
+int writePNGRows(PNGEncoder *png, const char *rows, size_t n)
+{
+    unsigned int strips = (n < png->stripCount) ? (unsigned int) n : png->stripCount;
+    unsigned int created = 0;
+
+    const unsigned char *row = (const unsigned char *) rows;
+    const unsigned char *prior = png->prior;
+
+    if (png->failed)
+        return 1;
+
+    if (!n)
+        return 0;
+
+    for (unsigned int i = 0; i < strips; ++i)
+    {
+        PNGStrip *strip = &(png->strips[i]);
+
+        strip->rows = row;
+        strip->prior = prior;
+        strip->n = n / strips + (i < n % strips);
+        strip->ret = 1;
+
+        row += strip->n * png->rowSize;
+        prior = row - png->rowSize;
+    }
+
+    /* A single strip is compressed on the calling thread */
+    if (strips == 1)
+        compressStrip(png->strips);
+
+    for (; strips > 1 && created < strips; ++created)
+    {
+        PNGStrip *strip = &(png->strips[created]);
+
+        if (pthread_create(&(strip->pid), NULL, compressStrip, strip))
+        {
+            logMessage(ERROR, "Thread could not be created");
+            png->failed = true;
+            break;
+        }
+    }
+
+    for (unsigned int i = 0; i < created; ++i)
+    {
+        if (pthread_join(png->strips[i].pid, NULL))
+        {
+            logMessage(ERROR, "Thread could not be harvested");
+            png->failed = true;
+        }
+    }
+
+    if (png->failed)
+        return 1;
+
+    for (unsigned int i = 0; i < strips; ++i)
+    {
+        PNGStrip *strip = &(png->strips[i]);
+        const unsigned char *data = strip->deflater->out;
+        size_t remaining = strip->deflater->length;
+
+        if (strip->ret)
+        {
+            logMessage(ERROR, "Could not compress PNG image data");
+            png->failed = true;
+            return 1;
+        }
+
+        for (size_t k = 0; k < strip->crcCount; ++k)
+        {
+            size_t length = (remaining < IDAT_LEN_MAX) ? remaining : IDAT_LEN_MAX;
+
+            if (writeChunkWithCRC(png->file, "IDAT", data, length, strip->crc[k]))
+            {
+                logMessage(ERROR, "Could not write PNG image data");
+                png->failed = true;
+                return 1;
+            }
+
+            data += length;
+            remaining -= length;
+        }
+
+        png->adler = adler32Combine(png->adler, strip->adler, strip->n * (png->rowSize + 1));
+    }
+
+    memcpy(png->prior, (const unsigned char *) rows + (n - 1) * png->rowSize, png->rowSize);
+    png->rows += n;
+
+    return 0;
+}
+
+
+/* End the zlib stream and the PNG image */
+int finishPNG(PNGEncoder *png)
+{
+    unsigned char trailer[sizeof(DEFLATE_FINAL_BLOCK) + 4];
+
+    if (png->failed)
+        return 1;
+
+    if (png->rows != png->height)
+        logMessage(WARNING, "PNG image ended after %zu of %zu rows", png->rows, png->height);
+
+    memcpy(trailer, DEFLATE_FINAL_BLOCK, sizeof(DEFLATE_FINAL_BLOCK));
+    putUint32(trailer + sizeof(DEFLATE_FINAL_BLOCK), png->adler);
+
+    if (writeChunk(png->file, "IDAT", trailer, sizeof(trailer)) || writeChunk(png->file, "IEND", NULL, 0))
+    {
+        logMessage(ERROR, "Could not write end of PNG image");
+        png->failed = true;
+        return 1;
+    }
+
+    logMessage(DEBUG, "PNG image complete");
+
+    return 0;
+}
+
+
+/* Free the encoder and its strip buffers */
+void freePNGEncoder(PNGEncoder *png)
+{
+    if (png)
+    {
+        if (png->strips)
+        {
+            for (unsigned int i = 0; i < png->stripCount; ++i)
+            {
+                free(png->strips[i].filtered);
+                free(png->strips[i].scratch);
+                free(png->strips[i].crc);
+                freeDeflater(png->strips[i].deflater);
+            }
+
+            free(png->strips);
+        }
+
+        free(png->prior);
+        free(png);
+    }
+}
+
+
+/* Memory the encoder uses for each row held at once, on top of the row itself
+ * - the filtered copy and its compressed output
+ */
+size_t getPNGRowCost(size_t rowSize)
+{
+    return 2 * (rowSize + 1);
+}
+
+
+/* Thread function to filter a strip of rows, take its checksum, and compress
+ * it
+ */
+static void * compressStrip(void *strip)
+{
+    PNGStrip *s = strip;
+    const PNGEncoder *png = s->png;
+
+    size_t filteredRowSize = png->rowSize + 1;
+    size_t size = s->n * filteredRowSize;
+
+    const unsigned char *data;
+    size_t remaining;
+
+    if (size > s->filteredSize)
+    {
+        unsigned char *filtered = realloc(s->filtered, size);
+
+        if (!filtered)
+            return NULL;
+
+        s->filtered = filtered;
+        s->filteredSize = size;
+    }
+
+    for (size_t y = 0; y < s->n; ++y)
+    {
+        const unsigned char *row = s->rows + y * png->rowSize;
+        const unsigned char *prior = (y > 0) ? row - png->rowSize : s->prior;
+
+        if (png->adaptive)
+        {
+            filterRow(s->filtered + y * filteredRowSize, row, prior, png->rowSize, png->bpp, s->scratch);
+        }
+        else
+        {
+            s->filtered[y * filteredRowSize] = FILTER_NONE;
+            memcpy(s->filtered + y * filteredRowSize + 1, row, png->rowSize);
+        }
+    }
+
+    s->adler = adler32(ADLER32_INIT, s->filtered, size);
+
+    s->deflater->length = 0;
+
+    if (deflateSync(s->deflater, s->filtered, size))
+        return NULL;
+
+    /* The chunk CRCs are taken here too, so the writer only has to copy */
+    s->crcCount = (s->deflater->length + IDAT_LEN_MAX - 1) / IDAT_LEN_MAX;
+
+    if (s->crcCount)
+    {
+        uint32_t *crc = realloc(s->crc, s->crcCount * sizeof(*crc));
+
+        if (!crc)
+            return NULL;
+
+        s->crc = crc;
+    }
+
+    data = s->deflater->out;
+    remaining = s->deflater->length;
+
+    for (size_t k = 0; k < s->crcCount; ++k)
+    {
+        size_t length = (remaining < IDAT_LEN_MAX) ? remaining : IDAT_LEN_MAX;
+
+        s->crc[k] = updateCRC(updateCRC(CRC_INIT, (const unsigned char *) "IDAT", 4), data, length) ^ CRC_INIT;
+
+        data += length;
+        remaining -= length;
+    }
+
+    s->ret = 0;
+
+    return NULL;
+}
+
+
+/* Filter a row with whichever filter type gives the smallest sum of absolute
+ * differences, writing the filter type byte then the filtered row
+ */
+static void filterRow(unsigned char *out, const unsigned char *row, const unsigned char *prior, size_t n,
+                      size_t bpp, unsigned char *scratch)
+{
+    unsigned int best = FILTER_NONE;
+    size_t bestSum = SIZE_MAX;
+
+    for (unsigned int type = FILTER_NONE; type < FILTER_TYPES; ++type)
+    {
+        unsigned char *filtered = scratch + type * n;
+        size_t sum = 0;
+
+        applyFilter(filtered, type, row, prior, n, bpp);
+
+        /* Filtered bytes are treated as signed */
+        for (size_t i = 0; i < n; ++i)
+            sum += (filtered[i] < 128) ? filtered[i] : 256 - filtered[i];
+
+        if (sum < bestSum)
+        {
+            best = type;
+            bestSum = sum;
+        }
+    }
+
+    out[0] = (unsigned char) best;
+    memcpy(out + 1, scratch + best * n, n);
+}
+
+
+/* Filter a row. Bytes before the start of the row count as zero */
+static void applyFilter(unsigned char *out, unsigned int type, const unsigned char *row,
+                        const unsigned char *prior, size_t n, size_t bpp)
+{
+    size_t lead = (bpp < n) ? bpp : n;
+
+    switch (type)
+    {
+        case FILTER_SUB:
+            memcpy(out, row, lead);
+
+            for (size_t i = lead; i < n; ++i)
+                out[i] = (unsigned char) (row[i] - row[i - bpp]);
+
+            break;
+        case FILTER_UP:
+            for (size_t i = 0; i < n; ++i)
+                out[i] = (unsigned char) (row[i] - prior[i]);
+
+            break;
+        case FILTER_AVERAGE:
+            for (size_t i = 0; i < lead; ++i)
+                out[i] = (unsigned char) (row[i] - prior[i] / 2);
+
+            for (size_t i = lead; i < n; ++i)
+                out[i] = (unsigned char) (row[i] - ((unsigned int) row[i - bpp] + prior[i]) / 2);
+
+            break;
+        case FILTER_PAETH:
+            for (size_t i = 0; i < lead; ++i)
+                out[i] = (unsigned char) (row[i] - prior[i]);
+
+            for (size_t i = lead; i < n; ++i)
+                out[i] = (unsigned char) (row[i] - paethPredictor(row[i - bpp], prior[i], prior[i - bpp]));
+
+            break;
+        case FILTER_NONE:
+        default:
+            memcpy(out, row, n);
+            break;
+    }
+}
+
+
+/* Whichever of the left, above, and upper-left bytes is closest to their
+ * linear prediction
+ */
+static unsigned char paethPredictor(unsigned char a, unsigned char b, unsigned char c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    else if (pb <= pc)
+        return b;
+
+    return c;
+}
+
+
+/* Write a chunk, calculating its CRC */
+static int writeChunk(FILE *file, const char *type, const unsigned char *data, size_t n)
+{
+    uint32_t crc = updateCRC(CRC_INIT, (const unsigned char *) type, 4);
+
+    if (n)
+        crc = updateCRC(crc, data, n);
+
+    return writeChunkWithCRC(file, type, data, n, crc ^ CRC_INIT);
+}
+
+
+/* Write a chunk with a CRC calculated beforehand */
+static int writeChunkWithCRC(FILE *file, const char *type, const unsigned char *data, size_t n, uint32_t crc)
+{
+    unsigned char length[4], check[4];
+
+    putUint32(length, (uint32_t) n);
+    putUint32(check, crc);
+
+    fwrite(length, 1, sizeof(length), file);
+    fwrite(type, 1, 4, file);
+
+    if (n)
+        fwrite(data, 1, n, file);
+
+    fwrite(check, 1, sizeof(check), file);
+
+    return ferror(file) != 0;
+}
+
+
+/* Calculate the CRC-32 of every byte value */
+static void initialiseCRCTable(void)
+{
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t c = i;
+
+        for (int k = 0; k < 8; ++k)
+            c = (c & 1) ? CRC_POLYNOMIAL ^ (c >> 1) : c >> 1;
+
+        crcTable[i] = c;
+    }
+}
+
+
+/* Update a running CRC-32 (before the final inversion) */
+static uint32_t updateCRC(uint32_t crc, const unsigned char *data, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+
+/* Write a 32-bit integer in network byte order */
+static void putUint32(unsigned char *dest, uint32_t x)
+{
+    dest[0] = (unsigned char) (x >> 24);
+    dest[1] = (unsigned char) (x >> 16);
+    dest[2] = (unsigned char) (x >> 8);
+    dest[3] = (unsigned char) x;
+}
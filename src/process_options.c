@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -14,12 +15,17 @@
 #include "process_options.h"
 
 #include "arg_ranges.h"
+#include "cancellation.h"
 #include "connection_handler.h"
 #include "getopt_error.h"
 #include "image.h"
 #include "parameters.h"
+#include "png.h"
 #include "process_args.h"
 #include "program_ctx.h"
+#include "pyramid.h"
+#include "raw.h"
+#include "tiff.h"
 
 #ifdef MP_PREC
 #include <mpfr.h>
@@ -43,8 +49,14 @@ static const struct option LONG_OPTIONS[] =
     #endif
 
     {"colour", required_argument, NULL, 'c'},     /* Colour scheme of PPM image */
+    {"deadline", required_argument, NULL, 'd'},   /* Stop rendering after a number of seconds */
     {"worker", required_argument, NULL, 'g'},     /* Initialise as a worker for distributed computation */
     {"master", required_argument, NULL, 'G'},     /* Initialise as a master for distributed computation */
+    {"prefetch", required_argument, NULL, 'F'},   /* Work units a worker keeps requested from its master */
+    {"compress", no_argument, NULL, 'C'},         /* Have workers pack the rows they send */
+    {"local", required_argument, NULL, 'L'},      /* Threads the master calculates rows on itself */
+    {"speculate", required_argument, NULL, 'S'},  /* Copy overdue work units to idle workers */
+    {"timeout", required_argument, NULL, 'O'},    /* Requeue work units out far longer than expected */
     {"iterations", required_argument, NULL, 'i'}, /* Maximum iteration count of function */
     {"julia", required_argument, NULL, 'j'},      /* Plot a Julia set with specified constant */
     {"log", no_argument, NULL, 'k'},              /* Output log to file */
@@ -52,12 +64,22 @@ static const struct option LONG_OPTIONS[] =
     {"log-level", required_argument, NULL, 'l'},  /* Minimum log level to output */
     {"min", required_argument, NULL, 'm'},        /* Range of complex numbers to plot */
     {"max", required_argument, NULL, 'M'},
+    {"progressive", no_argument, NULL, 'R'},      /* Render in passes of increasing resolution */
     {"width", required_argument, NULL, 'r'},      /* Width and height of image */
     {"height", required_argument, NULL, 's'},
     {"threads", required_argument, NULL, 'T'},    /* Specify thread count */
     {"centre", required_argument, NULL, 'x'},     /* Centre coordinate and magnification of plot */
     {"extended", no_argument, NULL, 'X'},         /* Use extended precision */
     {"memory", required_argument, NULL, 'z'},     /* Maximum memory usage in MB */
+    {"mmap", no_argument, NULL, 'Y'},             /* Calculate the image in place in the mapped file */
+    {"resume", no_argument, NULL, 'e'},           /* Continue an interrupted render from its checkpoint */
+    {"raw", no_argument, NULL, 'w'},              /* Output raw iteration data instead of an image */
+    {"png", no_argument, NULL, 'n'},              /* Output a PNG image */
+    {"tiff", optional_argument, NULL, 'f'},       /* Output a tiled BigTIFF image */
+    {"dzi", no_argument, NULL, 'y'},              /* Output a Deep Zoom image pyramid */
+    {"indexed", optional_argument, NULL, 'I'},    /* Store palette indices instead of colours */
+    {"histogram", no_argument, NULL, 'H'},        /* Spread colours evenly over the plot's iteration counts */
+    {"recolour", required_argument, NULL, 'u'},   /* Colour raw iteration data instead of calculating a plot */
     {"help", no_argument, NULL, 'h'},             /* Display help message and exit */
     {0, 0, 0, 0}
 };
@@ -67,9 +89,12 @@ static int parsePrecisionMode(PrecisionMode *precision, int argc, char **argv);
 static int parseGlobalOptions(ProgramCTX *ctx, int argc, char **argv);
 static NetworkCTX * parseNetworkOptions(int argc, char **argv);
 static int parseDiscreteOptions(PlotCTX *p, int argc, char **argv);
+static int parsePalette(PlotCTX *p, unsigned int bits);
 static int parseContinuousOptions(PlotCTX *p, int argc, char **argv);
 static PlotType parsePlotType(int argc, char **argv);
 static OutputType parseOutputType(int argc, char **argv);
+static const char * getLongOptionName(int val);
+static bool hasExtension(const char *filepath, const char *extension);
 static int parseMagnification(PlotCTX *p, int argc, char **argv);
 
 
@@ -122,6 +147,22 @@ int processProgramOptions(ProgramCTX *ctx, NetworkCTX **network, int argc, char
     if (!(*network))
         return -1;
 
+    /* Raw iteration data is only recoloured locally */
+    if (ctx->recolour && (*network)->mode != LAN_NONE)
+    {
+        fprintf(stderr, "%s: --recolour: Option cannot be used for distributed computation\n", programName);
+        getoptErrorMessage(OPT_NONE, NULL);
+        return -1;
+    }
+
+    /* Workers do not write an image to resume */
+    if (ctx->resume && (*network)->mode == LAN_WORKER)
+    {
+        fprintf(stderr, "%s: --resume: Option cannot be used by a worker\n", programName);
+        getoptErrorMessage(OPT_NONE, NULL);
+        return -1;
+    }
+
     return 0;
 }
 
@@ -152,6 +193,44 @@ PlotCTX * processPlotOptions(int argc, char **argv)
 }
 
 
+/* The plot parameters of a recolour come from the raw iteration data. Only
+ * the output options apply
+ */
+PlotCTX * processRecolourOptions(const char *filepath, int argc, char **argv)
+{
+    PlotCTX *p;
+    OutputType output = parseOutputType(argc, argv);
+
+    if (output == OUTPUT_NONE)
+        return NULL;
+
+    if (output == OUTPUT_RAW)
+    {
+        fprintf(stderr, "%s: --recolour: Option mutually exclusive with --raw\n", programName);
+        getoptErrorMessage(OPT_NONE, NULL);
+        return NULL;
+    }
+
+    /* The header holds the plot range as long doubles */
+    p = createPlotCTX(EXT_PRECISION);
+
+    if (initialisePlotCTX(p, PLOT_MANDELBROT, output))
+        return NULL;
+
+    if (parseDiscreteOptions(p, argc, argv))
+        return NULL;
+
+    if (openRawFile(p, filepath))
+    {
+        fprintf(stderr, "%s: --recolour: Could not read raw iteration data from \'%s\'\n", programName, filepath);
+        getoptErrorMessage(OPT_NONE, NULL);
+        return NULL;
+    }
+
+    return p;
+}
+
+
 /* Do one getopt pass to set the precision (default is standard precision) */
 static int parsePrecisionMode(PrecisionMode *precision, int argc, char **argv)
 {
@@ -278,6 +357,9 @@ static int parseGlobalOptions(ProgramCTX *ctx, int argc, char **argv)
         {
             char *endptr;
 
+            case 'd': /* Stop rendering after a number of seconds */
+                argError = floatArg(&ctx->deadline, optarg, DEADLINE_MIN, DEADLINE_MAX);
+                break;
             case 'k': /* Output log to file */
                 ctx->logToFile = true;
                 if (!vFlag)
@@ -296,6 +378,23 @@ static int parseGlobalOptions(ProgramCTX *ctx, int argc, char **argv)
                 argError = uLongArg(&tempUL, optarg, LOG_LEVEL_MIN, LOG_LEVEL_MAX);
                 setLogLevel((LogLevel) tempUL);
                 break;
+            case 'Y': /* Calculate the image in place in the mapped file */
+                ctx->mapOutput = true;
+                break;
+            case 'R': /* Render in passes of increasing resolution */
+                ctx->progressive = true;
+                break;
+            case 'H': /* Spread colours evenly over the plot's iteration counts */
+                ctx->histogram = true;
+                break;
+            case 'e': /* Continue an interrupted render from its checkpoint */
+                ctx->resume = true;
+                break;
+            case 'u': /* Colour raw iteration data instead of calculating a plot */
+                ctx->recolour = true;
+                strncpy(ctx->recolourFilepath, optarg, sizeof(ctx->recolourFilepath));
+                ctx->recolourFilepath[sizeof(ctx->recolourFilepath) - 1] = '\0';
+                break;
             case 'T': /* Specify thread count */
                 argError = uLongArg(&tempUL, optarg, THREAD_COUNT_MIN, THREAD_COUNT_MAX);
                 ctx->threads = (unsigned int) tempUL;
@@ -362,6 +461,11 @@ static NetworkCTX * parseNetworkOptions(int argc, char **argv)
 
     NetworkCTX *network = NULL;
     LANStatus mode = LAN_NONE;
+    unsigned int units = WORK_UNITS_DEFAULT;
+    bool compress = false;
+    unsigned int localThreads = 0;
+    double speculate = SPECULATION_DEFAULT;
+    double timeout = TIMEOUT_DEFAULT;
 
     struct sockaddr_in addr =
     {
@@ -420,6 +524,23 @@ static NetworkCTX * parseNetworkOptions(int argc, char **argv)
                 argError = uLongArg(&tempUL, optarg, PORT_MIN, PORT_MAX);
                 addr.sin_port = htons((uint16_t) tempUL);
                 break;
+            case 'F': /* Work units a worker keeps requested from its master */
+                argError = uLongArg(&tempUL, optarg, WORK_UNITS_MIN, WORK_UNITS_MAX);
+                units = (unsigned int) tempUL;
+                break;
+            case 'C': /* Have workers pack the rows they send */
+                compress = true;
+                break;
+            case 'L': /* Threads the master calculates rows on itself */
+                argError = uLongArg(&tempUL, optarg, 0, THREAD_COUNT_MAX);
+                localThreads = (unsigned int) tempUL;
+                break;
+            case 'S': /* Copy overdue work units to idle workers */
+                argError = floatArg(&speculate, optarg, SPECULATION_MIN, SPECULATION_MAX);
+                break;
+            case 'O': /* Requeue work units out far longer than expected */
+                argError = floatArg(&timeout, optarg, TIMEOUT_MIN, TIMEOUT_MAX);
+                break;
             default:
                 break;
         }
@@ -446,6 +567,11 @@ static NetworkCTX * parseNetworkOptions(int argc, char **argv)
 
     network->mode = mode;
     network->addr = addr;
+    network->units = units;
+    network->compress = compress;
+    network->localThreads = localThreads;
+    network->speculate = speculate;
+    network->timeout = timeout;
 
     return network;
 }
@@ -454,6 +580,8 @@ static NetworkCTX * parseNetworkOptions(int argc, char **argv)
 /* Get image parameters that are independent of the precision mode */
 static int parseDiscreteOptions(PlotCTX *p, int argc, char **argv)
 {
+    unsigned int paletteBits = 0;
+
     optind = 0;
     while ((opt = getopt_long(argc, argv, GETOPT_STRING, LONG_OPTIONS, NULL)) != -1)
     {
@@ -466,10 +594,20 @@ static int parseDiscreteOptions(PlotCTX *p, int argc, char **argv)
             case 'c': /* Colour scheme of PPM image */
                 /* No enum value is negative or extends beyond ULONG_MAX (defined in colour.h) */
                 argError = uLongArg(&tempUL, optarg, 0UL, ULONG_MAX);
+
+                /* Raw iteration data is coloured when it is recoloured */
+                if (p->output == OUTPUT_RAW)
+                {
+                    logMessage(WARNING, "Colour scheme is not used for raw iteration data");
+                    break;
+                }
+
                 p->colour.scheme = tempUL;
 
-                /* Will return 1 if enum value of out range */
-                if (initialiseColourScheme(&p->colour, p->colour.scheme))
+                /* Will return 1 if enum value of out range (the raw scheme is
+                 * not selectable)
+                 */
+                if (tempUL > (unsigned long) COLOUR_SCHEME_MAX || initialiseColourScheme(&p->colour, p->colour.scheme))
                 {
                     fprintf(stderr, "%s: -%c: Invalid colour scheme\n", programName, opt);
                     argError = PARSE_ERANGE;
@@ -482,6 +620,14 @@ static int parseDiscreteOptions(PlotCTX *p, int argc, char **argv)
             case 'o': /* Output image filename */
                 strncpy(p->plotFilepath, optarg, sizeof(p->plotFilepath));
                 p->plotFilepath[sizeof(p->plotFilepath) - 1] = '\0';
+                break;
+            case 'f': /* Compression of each TIFF tile */
+                if (optarg && getTIFFCodec(&p->tiffCodec, optarg))
+                {
+                    fprintf(stderr, "%s: --tiff: Invalid tile compression\n", programName);
+                    argError = PARSE_ERANGE;
+                }
+
                 break;
             case 'r': /* Width of image */
                 argError = uIntMaxArg(&tempUIntMax, optarg, WIDTH_MIN, WIDTH_MAX);
@@ -491,6 +637,23 @@ static int parseDiscreteOptions(PlotCTX *p, int argc, char **argv)
                 argError = uIntMaxArg(&tempUIntMax, optarg, HEIGHT_MIN, HEIGHT_MAX);
                 p->height = (size_t) tempUIntMax;
                 break;
+            case 'I': /* Bits per palette index of an indexed image */
+                paletteBits = BIT_DEPTH_8;
+
+                if (!optarg)
+                    break;
+
+                argError = uLongArg(&tempUL, optarg, 0UL, ULONG_MAX);
+
+                if (argError == PARSE_SUCCESS && tempUL != BIT_DEPTH_8 && tempUL != BIT_DEPTH_16)
+                {
+                    fprintf(stderr, "%s: --indexed: Palette indices must be %u or %u bits\n", programName,
+                            (unsigned int) BIT_DEPTH_8, (unsigned int) BIT_DEPTH_16);
+                    argError = PARSE_ERANGE;
+                }
+
+                paletteBits = (unsigned int) tempUL;
+                break;
             default:
                 break;
         }
@@ -507,6 +670,47 @@ static int parseDiscreteOptions(PlotCTX *p, int argc, char **argv)
         }
     }
 
+    /* The palette is sampled from the colour scheme, so it can only be built
+     * once the scheme is known
+     */
+    if (paletteBits)
+        return parsePalette(p, paletteBits);
+
+    return 0;
+}
+
+
+/* Store the image as indices into a palette of its colour scheme, if its
+ * output format can hold a palette of that size
+ */
+static int parsePalette(PlotCTX *p, unsigned int bits)
+{
+    if (p->colour.depth != BIT_DEPTH_24)
+    {
+        logMessage(WARNING, "Only true colour schemes can be indexed, storing pixels as they are");
+        return 0;
+    }
+
+    if (p->output != OUTPUT_PNG && p->output != OUTPUT_TIFF)
+    {
+        fprintf(stderr, "%s: --indexed: Only PNG and TIFF images can be indexed\n", programName);
+        getoptErrorMessage(OPT_NONE, NULL);
+        return -1;
+    }
+
+    if (p->output == OUTPUT_PNG && bits != BIT_DEPTH_8)
+    {
+        fprintf(stderr, "%s: --indexed: PNG palettes hold at most 256 colours\n", programName);
+        getoptErrorMessage(OPT_NONE, NULL);
+        return -1;
+    }
+
+    if (initialisePalette(&(p->colour), bits))
+    {
+        logMessage(ERROR, "Could not create palette");
+        return -1;
+    }
+
     return 0;
 }
 
@@ -649,7 +853,13 @@ static PlotType parsePlotType(int argc, char **argv)
 static OutputType parseOutputType(int argc, char **argv)
 {
     OutputType output = OUTPUT_PNM;
-    bool oFlag = false, tFlag = false;
+    bool eFlag = false, oFlag = false, tFlag = false;
+
+    /* Option of the output format asked for (0 if none) */
+    int format = 0;
+
+    /* Output format given by the extension of the output filename */
+    OutputType filepathOutput = OUTPUT_PNM;
 
     optind = 0;
     while ((opt = getopt_long(argc, argv, GETOPT_STRING, LONG_OPTIONS, NULL)) != -1)
@@ -664,6 +874,45 @@ static OutputType parseOutputType(int argc, char **argv)
             }
 
             oFlag = true;
+
+            if (hasExtension(optarg, PNG_EXTENSION))
+                filepathOutput = OUTPUT_PNG;
+            else if (hasExtension(optarg, TIFF_EXTENSION) || hasExtension(optarg, TIFF_EXTENSION_LONG))
+                filepathOutput = OUTPUT_TIFF;
+            else if (hasExtension(optarg, DZI_EXTENSION))
+                filepathOutput = OUTPUT_DZI;
+            else
+                filepathOutput = OUTPUT_PNM;
+        }
+        else if (opt == 'w' || opt == 'n' || opt == 'f' || opt == 'y') /* Output raw iteration data or a format */
+        {
+            if (tFlag)
+            {
+                fprintf(stderr, "%s: --%s: Option mutually exclusive with -%c\n", programName,
+                        getLongOptionName(opt), 't');
+                getoptErrorMessage(OPT_NONE, NULL);
+                return OUTPUT_NONE;
+            }
+            else if (format && format != opt)
+            {
+                fprintf(stderr, "%s: --%s: Option mutually exclusive with --%s\n", programName,
+                        getLongOptionName(opt), getLongOptionName(format));
+                getoptErrorMessage(OPT_NONE, NULL);
+                return OUTPUT_NONE;
+            }
+
+            format = opt;
+        }
+        else if (opt == 'e') /* Continue an interrupted render */
+        {
+            if (tFlag)
+            {
+                fprintf(stderr, "%s: --resume: Option mutually exclusive with -%c\n", programName, 't');
+                getoptErrorMessage(OPT_NONE, NULL);
+                return OUTPUT_NONE;
+            }
+
+            eFlag = true;
         }
         else if (opt == 't') /* Output plot to stdout */
         {
@@ -673,16 +922,85 @@ static OutputType parseOutputType(int argc, char **argv)
                 getoptErrorMessage(OPT_NONE, NULL);
                 return OUTPUT_NONE;
             }
+            else if (format)
+            {
+                fprintf(stderr, "%s: -%c: Option mutually exclusive with --%s\n", programName, opt,
+                        getLongOptionName(format));
+                getoptErrorMessage(OPT_NONE, NULL);
+                return OUTPUT_NONE;
+            }
+            else if (eFlag)
+            {
+                fprintf(stderr, "%s: -%c: Option mutually exclusive with --resume\n", programName, opt);
+                getoptErrorMessage(OPT_NONE, NULL);
+                return OUTPUT_NONE;
+            }
 
             tFlag = true;
             output = OUTPUT_TERMINAL;
         }
     }
 
+    /* An image is in the format asked for, or else the one its filename says */
+    switch (format)
+    {
+        case 'w':
+            output = OUTPUT_RAW;
+            break;
+        case 'n':
+            output = OUTPUT_PNG;
+            break;
+        case 'f':
+            output = OUTPUT_TIFF;
+            break;
+        case 'y':
+            output = OUTPUT_DZI;
+            break;
+        default:
+            if (output == OUTPUT_PNM)
+                output = filepathOutput;
+
+            break;
+    }
+
     return output;
 }
 
 
+/* Get the long name of an option */
+static const char * getLongOptionName(int val)
+{
+    for (const struct option *o = LONG_OPTIONS; o->name; ++o)
+    {
+        if (o->val == val)
+            return o->name;
+    }
+
+    return "";
+}
+
+
+/* Whether a filepath ends with an extension (ignoring case) */
+static bool hasExtension(const char *filepath, const char *extension)
+{
+    size_t length = strlen(filepath);
+    size_t extensionLength = strlen(extension);
+
+    if (length < extensionLength)
+        return false;
+
+    filepath += length - extensionLength;
+
+    for (size_t i = 0; i < extensionLength; ++i)
+    {
+        if (tolower((unsigned char) filepath[i]) != tolower((unsigned char) extension[i]))
+            return false;
+    }
+
+    return true;
+}
+
+
 /* Do one getopt pass to set the image centre and magnification amount */
 static int parseMagnification(PlotCTX *p, int argc, char **argv)
 {
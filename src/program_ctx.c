@@ -23,6 +23,14 @@ int initialiseProgramCTX(ProgramCTX *ctx)
 
     ctx->mem = 0;
     ctx->threads = 0;
+    ctx->deadline = 0.0;
+    ctx->progressive = false;
+    ctx->histogram = false;
+    ctx->mapOutput = false;
+    ctx->resume = false;
+
+    ctx->recolourFilepath[0] = '\0';
+    ctx->recolour = false;
 
     return 0;
 }
@@ -0,0 +1,481 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "libgroot/include/log.h"
+
+#include "pyramid.h"
+
+#include "colour.h"
+#include "parameters.h"
+#include "png.h"
+
+
+/* Longest path of a tile, past the base path */
+#define TILE_PATH_SUFFIX_LEN_MAX 96
+
+#define DZI_FORMAT "png"
+
+
+static int addRow(Pyramid *pyramid, unsigned int level);
+static void reduceRows(unsigned char *out, const unsigned char *above, const unsigned char *below,
+                       const PyramidLevel *source, size_t width);
+static int writeTileRow(Pyramid *pyramid, const PyramidLevel *level);
+static void * writeTiles(void *thread);
+static int writeTile(PyramidThread *t, size_t column);
+static int makeDirectory(const char *path);
+static int getBit(const unsigned char *row, size_t x);
+
+
+/* Create the directory tree of a Deep Zoom pyramid and the buffers of each
+ * level. The full image is level n, and each level below it is half the size
+ * of the one above (rounded up), down to a single pixel at level 0
+ */
+Pyramid * createPyramid(FILE *file, const PlotCTX *p, unsigned int threads)
+{
+    Pyramid *pyramid;
+    size_t length = strlen(p->plotFilepath);
+    size_t extensionLength = strlen(DZI_EXTENSION);
+    size_t largest = (p->width > p->height) ? p->width : p->height;
+    size_t tileBytes = 0;
+    size_t buffered = 0;
+    char *path;
+
+    if (p->colour.depth != BIT_DEPTH_1 && p->colour.depth != BIT_DEPTH_8 && p->colour.depth != BIT_DEPTH_24)
+    {
+        logMessage(ERROR, "Colour scheme cannot be written as an image pyramid");
+        return NULL;
+    }
+
+    pyramid = malloc(sizeof(*pyramid));
+
+    if (!pyramid)
+        return NULL;
+
+    pyramid->file = file;
+    pyramid->width = p->width;
+    pyramid->height = p->height;
+    pyramid->levelCount = 1;
+    pyramid->threadCount = (threads > 0) ? threads : 1;
+    pyramid->failed = false;
+
+    while (((size_t) 1 << (pyramid->levelCount - 1)) < largest)
+        ++(pyramid->levelCount);
+
+    /* The tiles go in a directory named after the descriptor */
+    if (length >= extensionLength && !strcmp(p->plotFilepath + length - extensionLength, DZI_EXTENSION))
+        length -= extensionLength;
+
+    pyramid->base = malloc(length + 1);
+    pyramid->levels = calloc(pyramid->levelCount, sizeof(*(pyramid->levels)));
+    pyramid->threads = calloc(pyramid->threadCount, sizeof(*(pyramid->threads)));
+    path = malloc(length + TILE_PATH_SUFFIX_LEN_MAX);
+
+    if (!pyramid->base || !pyramid->levels || !pyramid->threads || !path)
+    {
+        logMessage(ERROR, "Memory allocation failed");
+        free(path);
+        freePyramid(pyramid);
+        return NULL;
+    }
+
+    memcpy(pyramid->base, p->plotFilepath, length);
+    pyramid->base[length] = '\0';
+
+    snprintf(path, length + TILE_PATH_SUFFIX_LEN_MAX, "%s_files", pyramid->base);
+
+    if (makeDirectory(path))
+    {
+        free(path);
+        freePyramid(pyramid);
+        return NULL;
+    }
+
+    for (unsigned int i = pyramid->levelCount; i-- > 0;)
+    {
+        PyramidLevel *level = &(pyramid->levels[i]);
+        size_t scale = (size_t) 1 << (pyramid->levelCount - 1 - i);
+        size_t rows;
+
+        level->level = i;
+        level->width = (p->width + scale - 1) / scale;
+        level->height = (p->height + scale - 1) / scale;
+
+        /* Reduced levels of a 1-bit image are greyscale, so that detail too
+         * fine for a level is shaded rather than lost
+         */
+        level->depth = (i == pyramid->levelCount - 1 || p->colour.depth != BIT_DEPTH_1)
+                       ? p->colour.depth
+                       : BIT_DEPTH_8;
+
+        level->rowSize = (level->width * level->depth + CHAR_BIT - 1) / CHAR_BIT;
+        level->rowCount = 0;
+        level->rowsAdded = 0;
+
+        rows = (level->height < DZI_TILE_SIZE) ? level->height : DZI_TILE_SIZE;
+        level->rows = malloc(rows * level->rowSize);
+        buffered += rows * level->rowSize;
+
+        if (DZI_TILE_SIZE * DZI_TILE_SIZE * level->depth / CHAR_BIT > tileBytes)
+            tileBytes = DZI_TILE_SIZE * DZI_TILE_SIZE * level->depth / CHAR_BIT;
+
+        snprintf(path, length + TILE_PATH_SUFFIX_LEN_MAX, "%s_files/%u", pyramid->base, i);
+
+        if (!level->rows || makeDirectory(path))
+        {
+            logMessage(ERROR, "Could not create level %u of the image pyramid", i);
+            free(path);
+            freePyramid(pyramid);
+            return NULL;
+        }
+    }
+
+    free(path);
+
+    for (unsigned int i = 0; i < pyramid->threadCount; ++i)
+    {
+        PyramidThread *t = &(pyramid->threads[i]);
+
+        t->tid = i;
+        t->pyramid = pyramid;
+        t->tile = malloc(tileBytes);
+
+        if (!t->tile)
+        {
+            logMessage(ERROR, "Memory allocation failed");
+            freePyramid(pyramid);
+            return NULL;
+        }
+    }
+
+    logMessage(INFO, "Image pyramid has %u levels, buffering %zu bytes of rows", pyramid->levelCount, buffered);
+
+    return pyramid;
+}
+
+
+/* Add the next n rows of the full image to the pyramid. Each level writes its
+ * tiles as soon as it has a full row of them, and every pair of its rows is
+ * reduced into a row of the level below
+ */
+int writePyramidRows(Pyramid *pyramid, const char *rows, size_t n)
+{
+    unsigned int top = pyramid->levelCount - 1;
+    PyramidLevel *level = &(pyramid->levels[top]);
+
+    if (pyramid->failed)
+        return 1;
+
+    for (size_t i = 0; i < n; ++i, rows += level->rowSize)
+    {
+        memcpy(level->rows + level->rowCount * level->rowSize, rows, level->rowSize);
+
+        if (addRow(pyramid, top))
+        {
+            pyramid->failed = true;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Write the Deep Zoom descriptor. It is written last, so that a viewer never
+ * opens a pyramid with tiles missing
+ */
+int finishPyramid(Pyramid *pyramid)
+{
+    const PyramidLevel *top = &(pyramid->levels[pyramid->levelCount - 1]);
+
+    if (pyramid->failed)
+        return 1;
+
+    if (top->rowsAdded != top->height)
+    {
+        logMessage(WARNING, "Image pyramid ended after %zu of %zu rows", top->rowsAdded, top->height);
+        return 1;
+    }
+
+    fprintf(pyramid->file,
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"" DZI_FORMAT "\" Overlap=\"0\" "
+            "TileSize=\"%u\">\n"
+            "  <Size Width=\"%zu\" Height=\"%zu\"/>\n"
+            "</Image>\n",
+            DZI_TILE_SIZE, pyramid->width, pyramid->height);
+
+    if (ferror(pyramid->file))
+    {
+        logMessage(ERROR, "Could not write image pyramid descriptor");
+        pyramid->failed = true;
+        return 1;
+    }
+
+    logMessage(DEBUG, "Image pyramid complete");
+
+    return 0;
+}
+
+
+/* Free the pyramid and its buffers */
+void freePyramid(Pyramid *pyramid)
+{
+    if (pyramid)
+    {
+        if (pyramid->levels)
+        {
+            for (unsigned int i = 0; i < pyramid->levelCount; ++i)
+                free(pyramid->levels[i].rows);
+
+            free(pyramid->levels);
+        }
+
+        if (pyramid->threads)
+        {
+            for (unsigned int i = 0; i < pyramid->threadCount; ++i)
+                free(pyramid->threads[i].tile);
+
+            free(pyramid->threads);
+        }
+
+        free(pyramid->base);
+        free(pyramid);
+    }
+}
+
+
+/* Take in the row placed after the rows a level holds. A row that completes a
+ * pair is reduced with the one above it into the next level down (the last row
+ * of a level with an odd height is reduced on its own). As tiles are an even
+ * number of rows high, both rows of a pair are always held at once
+ */
+static int addRow(Pyramid *pyramid, unsigned int level)
+{
+    PyramidLevel *l = &(pyramid->levels[level]);
+    const unsigned char *row = l->rows + l->rowCount * l->rowSize;
+
+    ++(l->rowCount);
+    ++(l->rowsAdded);
+
+    if (level > 0 && (l->rowsAdded % 2 == 0 || l->rowsAdded == l->height))
+    {
+        PyramidLevel *below = &(pyramid->levels[level - 1]);
+        const unsigned char *above = (l->rowsAdded % 2 == 0) ? row - l->rowSize : row;
+
+        reduceRows(below->rows + below->rowCount * below->rowSize, above, row, l, below->width);
+
+        if (addRow(pyramid, level - 1))
+            return 1;
+    }
+
+    if (l->rowCount == DZI_TILE_SIZE || l->rowsAdded == l->height)
+    {
+        if (writeTileRow(pyramid, l))
+            return 1;
+
+        l->rowCount = 0;
+    }
+
+    return 0;
+}
+
+
+/* Average each 2x2 square of pixels of a pair of rows into one pixel. A 1-bit
+ * source is averaged into greyscale
+ */
+static void reduceRows(unsigned char *out, const unsigned char *above, const unsigned char *below,
+                       const PyramidLevel *source, size_t width)
+{
+    size_t last = source->width - 1;
+
+    if (source->depth == BIT_DEPTH_1)
+    {
+        for (size_t x = 0; x < width; ++x)
+        {
+            size_t x0 = 2 * x;
+            size_t x1 = (x0 < last) ? x0 + 1 : last;
+
+            /* Set bits are black */
+            int black = getBit(above, x0) + getBit(above, x1) + getBit(below, x0) + getBit(below, x1);
+
+            out[x] = (unsigned char) ((UCHAR_MAX * (4 - black) + 2) / 4);
+        }
+
+        return;
+    }
+
+    size_t bpp = source->depth / CHAR_BIT;
+
+    for (size_t x = 0; x < width; ++x)
+    {
+        size_t x0 = 2 * x * bpp;
+        size_t x1 = (2 * x < last) ? x0 + bpp : x0;
+
+        for (size_t c = 0; c < bpp; ++c)
+        {
+            unsigned int sum = (unsigned int) above[x0 + c] + above[x1 + c] + below[x0 + c] + below[x1 + c];
+
+            out[x * bpp + c] = (unsigned char) ((sum + 2) / 4);
+        }
+    }
+}
+
+
+/* Write the tiles of the rows a level holds, shared between the threads */
+static int writeTileRow(Pyramid *pyramid, const PyramidLevel *level)
+{
+    size_t tiles = (level->width + DZI_TILE_SIZE - 1) / DZI_TILE_SIZE;
+    unsigned int created = 0;
+    int ret = 0;
+
+    pyramid->current = level;
+    pyramid->active = (tiles < pyramid->threadCount) ? (unsigned int) tiles : pyramid->threadCount;
+
+    /* A single tile is written on the calling thread */
+    if (pyramid->active == 1)
+    {
+        writeTiles(pyramid->threads);
+        return pyramid->threads->ret;
+    }
+
+    for (; created < pyramid->active; ++created)
+    {
+        PyramidThread *t = &(pyramid->threads[created]);
+
+        if (pthread_create(&(t->pid), NULL, writeTiles, t))
+        {
+            logMessage(ERROR, "Thread could not be created");
+            ret = 1;
+            break;
+        }
+    }
+
+    for (unsigned int i = 0; i < created; ++i)
+    {
+        PyramidThread *t = &(pyramid->threads[i]);
+
+        if (pthread_join(t->pid, NULL))
+        {
+            logMessage(ERROR, "Thread could not be harvested");
+            ret = 1;
+        }
+        else if (t->ret)
+        {
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
+
+
+/* Thread function - write every tile of the current row of tiles whose
+ * column, offset by the thread ID, is a multiple of the active thread count
+ */
+static void * writeTiles(void *thread)
+{
+    PyramidThread *t = thread;
+    const PyramidLevel *level = t->pyramid->current;
+    size_t tiles = (level->width + DZI_TILE_SIZE - 1) / DZI_TILE_SIZE;
+
+    t->ret = 1;
+
+    for (size_t i = t->tid; i < tiles; i += t->pyramid->active)
+    {
+        if (writeTile(t, i))
+            return NULL;
+    }
+
+    t->ret = 0;
+
+    return NULL;
+}
+
+
+/* Write one tile of the current row of tiles as a PNG image. Tiles on the
+ * right and bottom edges are cut to the size of the image
+ */
+static int writeTile(PyramidThread *t, size_t column)
+{
+    const Pyramid *pyramid = t->pyramid;
+    const PyramidLevel *level = pyramid->current;
+
+    size_t x = column * DZI_TILE_SIZE;
+    size_t width = (level->width - x < DZI_TILE_SIZE) ? level->width - x : DZI_TILE_SIZE;
+    size_t row = (level->rowsAdded - 1) / DZI_TILE_SIZE;
+
+    /* Tiles start on a whole byte, as the width of a 1-bit image is a multiple
+     * of CHAR_BIT
+     */
+    size_t offset = x * level->depth / CHAR_BIT;
+    size_t tileRowSize = (width * level->depth + CHAR_BIT - 1) / CHAR_BIT;
+
+    size_t length = strlen(pyramid->base) + TILE_PATH_SUFFIX_LEN_MAX;
+    char *path = malloc(length);
+    PNGEncoder *png;
+    FILE *f;
+    int ret;
+
+    if (!path)
+        return 1;
+
+    for (size_t y = 0; y < level->rowCount; ++y)
+        memcpy(t->tile + y * tileRowSize, level->rows + y * level->rowSize + offset, tileRowSize);
+
+    snprintf(path, length, "%s_files/%u/%zu_%zu." DZI_FORMAT, pyramid->base, level->level, column, row);
+
+    f = fopen(path, "wb");
+
+    if (!f)
+    {
+        logMessage(ERROR, "Tile \'%s\' could not be opened", path);
+        free(path);
+        return 1;
+    }
+
+    png = createPNGEncoder(f, width, level->rowCount, level->depth, NULL, 0, 1);
+
+    ret = !png
+          || writePNGRows(png, (const char *) t->tile, level->rowCount)
+          || finishPNG(png);
+
+    freePNGEncoder(png);
+
+    if (fclose(f) || ret)
+    {
+        logMessage(ERROR, "Tile \'%s\' could not be written", path);
+        ret = 1;
+    }
+
+    free(path);
+
+    return ret;
+}
+
+
+/* Create a directory, which may already exist */
+static int makeDirectory(const char *path)
+{
+    if (mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO) && errno != EEXIST)
+    {
+        logMessage(ERROR, "Directory \'%s\' could not be created", path);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Get a pixel of a 1-bit row */
+static int getBit(const unsigned char *row, size_t x)
+{
+    return (row[x / CHAR_BIT] >> (CHAR_BIT - 1 - x % CHAR_BIT)) & 1;
+}
@@ -0,0 +1,203 @@
+#include <complex.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libgroot/include/log.h"
+
+#include "raw.h"
+
+#include "colour.h"
+#include "ext_precision.h"
+#include "parameters.h"
+
+#ifdef MP_PREC
+#include <mpfr.h>
+#include <mpc.h>
+#endif
+
+
+/* First line of the header, including the format version */
+#define RAW_MAGIC "MBRAW 1"
+
+#define RAW_PLOT_STR_LEN_MAX 16
+
+
+static int getRawParameters(long double complex *minimum, long double complex *maximum, long double complex *c,
+                            const PlotCTX *p);
+
+
+/* Write the header of a raw iteration data file. The header is text: the magic
+ * line, then the plot type, dimensions and iteration count, then the minimum,
+ * maximum, and Julia set constant as hexadecimal floating-points. The pixels
+ * follow the newline ending the header, in native byte order
+ */
+int writeRawHeader(FILE *file, const PlotCTX *p)
+{
+    long double complex minimum, maximum, c;
+
+    logMessage(DEBUG, "Writing raw iteration data header");
+
+    if (getRawParameters(&minimum, &maximum, &c, p))
+    {
+        logMessage(ERROR, "Could not determine plot parameters for the raw header");
+        return 1;
+    }
+
+    fprintf(file, RAW_MAGIC "\n%s %zu %zu %lu\n%La %La %La %La %La %La\n",
+            (p->type == PLOT_JULIA) ? "julia" : "mandelbrot", p->width, p->height, p->iterations,
+            creall(minimum), cimagl(minimum), creall(maximum), cimagl(maximum), creall(c), cimagl(c));
+
+    if (ferror(file))
+    {
+        logMessage(ERROR, "Could not write raw iteration data header");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Map a raw iteration data file to recolour and take the plot parameters from
+ * its header. The colour scheme must already be set
+ */
+int openRawFile(PlotCTX *p, const char *filepath)
+{
+    FILE *file;
+    struct stat fileStat;
+
+    char plot[RAW_PLOT_STR_LEN_MAX];
+    size_t width, height;
+    unsigned long iterations;
+    long double minRe, minIm, maxRe, maxIm, cRe, cIm;
+    long offset;
+
+    logMessage(DEBUG, "Opening raw iteration data file \'%s\'", filepath);
+
+    file = fopen(filepath, "rb");
+
+    if (!file)
+    {
+        logMessage(ERROR, "File \'%s\' could not be opened", filepath);
+        return 1;
+    }
+
+    if (fscanf(file, RAW_MAGIC " %15s %zu %zu %lu %La %La %La %La %La %La",
+               plot, &width, &height, &iterations, &minRe, &minIm, &maxRe, &maxIm, &cRe, &cIm) != 10
+        || fgetc(file) != '\n'
+        || (strcmp(plot, "julia") && strcmp(plot, "mandelbrot")))
+    {
+        logMessage(ERROR, "File \'%s\' is not raw iteration data", filepath);
+        fclose(file);
+        return 1;
+    }
+
+    offset = ftell(file);
+
+    if (offset < 0 || fstat(fileno(file), &fileStat) || fileStat.st_size < offset)
+    {
+        logMessage(ERROR, "Could not get size of \'%s\'", filepath);
+        fclose(file);
+        return 1;
+    }
+
+    if (!width || !height || width > ((size_t) fileStat.st_size - (size_t) offset) / RAW_PIXEL_SIZE / height)
+    {
+        logMessage(ERROR, "Raw iteration data in \'%s\' is truncated", filepath);
+        fclose(file);
+        return 1;
+    }
+
+    p->sourceSize = (size_t) fileStat.st_size;
+    p->sourceOffset = (size_t) offset;
+    p->source = mmap(NULL, p->sourceSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+
+    /* The mapping remains valid once the file is closed */
+    fclose(file);
+
+    if (p->source == MAP_FAILED)
+    {
+        p->source = NULL;
+        logMessage(ERROR, "File \'%s\' could not be mapped into memory", filepath);
+        return 1;
+    }
+
+    /* Every row is read once, in order */
+    posix_madvise(p->source, p->sourceSize, POSIX_MADV_SEQUENTIAL);
+
+    p->type = (strcmp(plot, "julia")) ? PLOT_MANDELBROT : PLOT_JULIA;
+    p->width = width;
+    p->height = height;
+    p->iterations = iterations;
+    p->minimum.lc = minRe + minIm * I;
+    p->maximum.lc = maxRe + maxIm * I;
+    p->c.lc = cRe + cIm * I;
+
+    logMessage(DEBUG, "Raw iteration data mapped (%zu bytes, %zu-byte header)", p->sourceSize, p->sourceOffset);
+
+    return 0;
+}
+
+
+/* Store a smoothed iteration count and escape flag as raw iteration data */
+void encodeRawPixel(char *pixel, double n, EscapeStatus status)
+{
+    float value = (float) n;
+
+    /* Pixels are not aligned to the size of a float */
+    memcpy(pixel, &value, sizeof(value));
+    pixel[sizeof(value)] = (status == ESCAPED) ? 1 : 0;
+}
+
+
+/* Load a smoothed iteration count and escape flag from raw iteration data */
+void decodeRawPixel(double *n, EscapeStatus *status, const char *pixel)
+{
+    float value;
+
+    memcpy(&value, pixel, sizeof(value));
+    *n = value;
+    *status = (pixel[sizeof(value)]) ? ESCAPED : UNESCAPED;
+}
+
+
+/* Get the plot range and constant as long doubles, whatever the precision */
+static int getRawParameters(long double complex *minimum, long double complex *maximum, long double complex *c,
+                            const PlotCTX *p)
+{
+    switch (p->precision)
+    {
+        case STD_PRECISION:
+            *minimum = p->minimum.c;
+            *maximum = p->maximum.c;
+            *c = p->c.c;
+            break;
+        case EXT_PRECISION:
+            *minimum = p->minimum.lc;
+            *maximum = p->maximum.lc;
+            *c = p->c.lc;
+            break;
+
+        #ifdef MP_PREC
+        case MUL_PRECISION:
+            *minimum = mpfr_get_ld(mpc_realref(p->minimum.mpc), MP_REAL_RND)
+                       + mpfr_get_ld(mpc_imagref(p->minimum.mpc), MP_IMAG_RND) * I;
+            *maximum = mpfr_get_ld(mpc_realref(p->maximum.mpc), MP_REAL_RND)
+                       + mpfr_get_ld(mpc_imagref(p->maximum.mpc), MP_IMAG_RND) * I;
+            *c = mpfr_get_ld(mpc_realref(p->c.mpc), MP_REAL_RND) + mpfr_get_ld(mpc_imagref(p->c.mpc), MP_IMAG_RND) * I;
+            break;
+        #endif
+
+        default:
+            return 1;
+    }
+
+    /* The constant is only set for Julia set plots */
+    if (p->type != PLOT_JULIA)
+        *c = 0.0L;
+
+    return 0;
+}
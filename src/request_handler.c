@@ -1,6 +1,7 @@
 #include <complex.h>
 #include <errno.h>
 #include <float.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -10,6 +11,7 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "libgroot/include/log.h"
 #include "percy/include/parser.h"
@@ -40,10 +42,10 @@
 #endif
 
 
-const char *ROW_REQUEST = "REQ";
-const char *ROW_RESPONSE = "ROW";
-const char *ACK_RESPONSE = "ACK";
-const char *ERR_RESPONSE = "ERR";
+static void packUInt32(unsigned char *dest, uint32_t x);
+static void packUInt64(unsigned char *dest, uint64_t x);
+static uint32_t unpackUInt32(const unsigned char *src);
+static uint64_t unpackUInt64(const unsigned char *src);
 
 
 ssize_t writeSocket(const void *src, int s, size_t n)
@@ -129,6 +131,111 @@ ssize_t readSocket(void *dest, int s, size_t n)
 }
 
 
+/* Write a frame header and its payload to a socket in a single call */
+int sendFrame(int s, const Frame *frame, const void *payload)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+    struct iovec iov[2];
+    int iovCount = (frame->length) ? 2 : 1;
+
+    size_t n = sizeof(header) + (size_t) frame->length;
+    size_t sentBytes = 0;
+
+    packFrameHeader(header, frame);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *) (uintptr_t) payload;
+    iov[1].iov_len = (size_t) frame->length;
+
+    /* A short write leaves the remainder in the iovec array to try again */
+    while (sentBytes < n)
+    {
+        ssize_t ret;
+
+        errno = 0;
+        ret = writev(s, iov, iovCount);
+
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            else if (errno == ECONNRESET || errno == EPIPE)
+            {
+                logMessage(INFO, "Connection with peer closed");
+                return -2;
+            }
+            else
+            {
+                logMessage(ERROR, "Could not write to connection");
+                return -1;
+            }
+        }
+
+        sentBytes += (size_t) ret;
+
+        for (int i = 0; i < iovCount && ret > 0; ++i)
+        {
+            size_t advance = ((size_t) ret < iov[i].iov_len) ? (size_t) ret : iov[i].iov_len;
+
+            iov[i].iov_base = (char *) iov[i].iov_base + advance;
+            iov[i].iov_len -= advance;
+            ret -= (ssize_t) advance;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Read a frame header. The payload is left on the socket for the caller */
+int readFrame(Frame *frame, int s)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+
+    ssize_t bytes = readSocket(header, s, sizeof(header));
+
+    if (bytes < 0)
+        return -1;
+    else if ((size_t) bytes != sizeof(header))
+        return -2;
+
+    return unpackFrameHeader(frame, header);
+}
+
+
+void packFrameHeader(unsigned char *dest, const Frame *frame)
+{
+    packUInt32(dest, (uint32_t) frame->type);
+    packUInt32(dest + 4, frame->job);
+    packUInt64(dest + 8, frame->firstRow);
+    packUInt64(dest + 16, frame->rowCount);
+    packUInt64(dest + 24, frame->length);
+}
+
+
+int unpackFrameHeader(Frame *frame, const unsigned char *src)
+{
+    uint32_t type = unpackUInt32(src);
+
+    if (type < FRAME_HELLO || type > FRAME_ERROR)
+    {
+        logMessage(ERROR, "Unknown frame type %" PRIu32, type);
+        return -3;
+    }
+
+    frame->type = (FrameType) type;
+    frame->job = unpackUInt32(src + 4);
+    frame->firstRow = unpackUInt64(src + 8);
+    frame->rowCount = unpackUInt64(src + 16);
+    frame->length = unpackUInt64(src + 24);
+
+    return 0;
+}
+
+
 #ifndef MP_PREC
 int serialisePrecision(char *dest, size_t n, PrecisionMode prec)
 {
@@ -186,14 +293,15 @@ int serialisePlotCTX(char *dest, size_t n, const PlotCTX *p)
                        " %.*e+%.*ei"
                        " %lu"
                        " %zu %zu"
-                       " %u",
+                       " %u %u %zu",
                        p->type,
                        SERIALISE_FLT_DIG, creal(p->minimum.c), SERIALISE_FLT_DIG, cimag(p->minimum.c),
                        SERIALISE_FLT_DIG, creal(p->maximum.c), SERIALISE_FLT_DIG, cimag(p->maximum.c),
                        SERIALISE_FLT_DIG, creal(p->c.c), SERIALISE_FLT_DIG, cimag(p->c.c),
                        p->iterations,
                        p->width, p->height,
-                       p->colour.scheme);
+                       p->colour.scheme, (p->colour.palette) ? (unsigned int) p->colour.depth : 0U,
+                       p->colour.histogramSize);
     
     return ret;
 }
@@ -208,14 +316,15 @@ int serialisePlotCTXExt(char *dest, size_t n, const PlotCTX *p)
                        " %.*Le+%.*Lei"
                        " %lu"
                        " %zu %zu"
-                       " %u",
+                       " %u %u %zu",
                        p->type,
                        SERIALISE_FLT_DIG_EXT, creall(p->minimum.lc), SERIALISE_FLT_DIG_EXT, cimagl(p->minimum.lc),
                        SERIALISE_FLT_DIG_EXT, creall(p->maximum.lc), SERIALISE_FLT_DIG_EXT, cimagl(p->maximum.lc),
                        SERIALISE_FLT_DIG_EXT, creall(p->c.lc), SERIALISE_FLT_DIG_EXT, cimagl(p->c.lc),
                        p->iterations,
                        p->width, p->height,
-                       p->colour.scheme);
+                       p->colour.scheme, (p->colour.palette) ? (unsigned int) p->colour.depth : 0U,
+                       p->colour.histogramSize);
     
     return ret;
 }
@@ -245,14 +354,15 @@ int serialisePlotCTXMP(char *dest, size_t n, const PlotCTX *p)
                    " %s"
                    " %lu"
                    " %zu %zu"
-                   " %u",
+                   " %u %u %zu",
                    p->type,
                    min,
                    max,
                    c,
                    p->iterations,
                    p->width, p->height,
-                   p->colour.scheme);
+                   p->colour.scheme, (p->colour.palette) ? (unsigned int) p->colour.depth : 0U,
+                   p->colour.histogramSize);
 
     mpc_free_str(min);
     mpc_free_str(max);
@@ -271,6 +381,8 @@ int deserialisePlotCTX(PlotCTX *p, char *src)
     uintmax_t tempWidth = 0;
     uintmax_t tempHeight = 0;
     unsigned long int tempColourScheme = 0UL;
+    unsigned long int tempPaletteBits = 0UL;
+    unsigned long int tempHistogramSize = 0UL;
 
     if (stringToULong(&tempPlotType, endptr, 0, ULONG_MAX, &endptr, BASE_DEC) != PARSE_EEND
         || stringToComplex(&(p->minimum.c), endptr, CMPLX_MIN, CMPLX_MAX, &endptr) != PARSE_EEND
@@ -279,7 +391,9 @@ int deserialisePlotCTX(PlotCTX *p, char *src)
         || stringToULong(&(p->iterations), endptr, 0, ULONG_MAX, &endptr, BASE_DEC) != PARSE_EEND
         || stringToUIntMax(&tempWidth, endptr, WIDTH_MIN, WIDTH_MAX, &endptr, BASE_DEC) != PARSE_EEND
         || stringToUIntMax(&tempHeight, endptr, HEIGHT_MIN, HEIGHT_MAX, &endptr, BASE_DEC) != PARSE_EEND
-        || stringToULong(&tempColourScheme, endptr, 0UL, ULONG_MAX, &endptr, BASE_DEC) != PARSE_SUCCESS)
+        || stringToULong(&tempColourScheme, endptr, 0UL, ULONG_MAX, &endptr, BASE_DEC) != PARSE_EEND
+        || stringToULong(&tempPaletteBits, endptr, 0UL, ULONG_MAX, &endptr, BASE_DEC) != PARSE_EEND
+        || stringToULong(&tempHistogramSize, endptr, 0UL, ULONG_MAX, &endptr, BASE_DEC) != PARSE_SUCCESS)
     {
         return 1;
     }
@@ -294,8 +408,17 @@ int deserialisePlotCTX(PlotCTX *p, char *src)
     p->output = OUTPUT_NONE;
     p->file = NULL;
 
-    if (initialiseColourScheme(&p->colour, tempColourScheme))
+    if (initialiseColourScheme(&p->colour, tempColourScheme)
+        || (tempPaletteBits && initialisePalette(&p->colour, (unsigned int) tempPaletteBits)))
+    {
         return 1;
+    }
+
+    /* The quantiles themselves follow the parameters */
+    if (tempHistogramSize != 0 && tempHistogramSize != COLOUR_HISTOGRAM_SIZE)
+        return 1;
+
+    p->colour.histogramSize = (size_t) tempHistogramSize;
 
     return 0;
 }
@@ -309,6 +432,8 @@ int deserialisePlotCTXExt(PlotCTX *p, char *src)
     uintmax_t tempWidth = 0;
     uintmax_t tempHeight = 0;
     unsigned long int tempColourScheme = 0UL;
+    unsigned long int tempPaletteBits = 0UL;
+    unsigned long int tempHistogramSize = 0UL;
 
     if (stringToULong(&tempPlotType, endptr, 0, ULONG_MAX, &endptr, BASE_DEC) != PARSE_EEND
         || stringToComplexL(&(p->minimum.lc), endptr, LCMPLX_MIN, LCMPLX_MAX, &endptr) != PARSE_EEND
@@ -317,7 +442,9 @@ int deserialisePlotCTXExt(PlotCTX *p, char *src)
         || stringToULong(&(p->iterations), endptr, ITERATIONS_MIN, ITERATIONS_MAX, &endptr, BASE_DEC) != PARSE_EEND
         || stringToUIntMax(&tempWidth, endptr, WIDTH_MIN, WIDTH_MAX, &endptr, BASE_DEC) != PARSE_EEND
         || stringToUIntMax(&tempHeight, endptr, HEIGHT_MIN, HEIGHT_MAX, &endptr, BASE_DEC) != PARSE_EEND
-        || stringToULong(&tempColourScheme, endptr, 0UL, ULONG_MAX, &endptr, BASE_DEC) != PARSE_SUCCESS)
+        || stringToULong(&tempColourScheme, endptr, 0UL, ULONG_MAX, &endptr, BASE_DEC) != PARSE_EEND
+        || stringToULong(&tempPaletteBits, endptr, 0UL, ULONG_MAX, &endptr, BASE_DEC) != PARSE_EEND
+        || stringToULong(&tempHistogramSize, endptr, 0UL, ULONG_MAX, &endptr, BASE_DEC) != PARSE_SUCCESS)
     {
         return 1;
     }
@@ -332,8 +459,17 @@ int deserialisePlotCTXExt(PlotCTX *p, char *src)
     p->output = OUTPUT_NONE;
     p->file = NULL;
 
-    if (initialiseColourScheme(&p->colour, tempColourScheme))
+    if (initialiseColourScheme(&p->colour, tempColourScheme)
+        || (tempPaletteBits && initialisePalette(&p->colour, (unsigned int) tempPaletteBits)))
+    {
         return 1;
+    }
+
+    /* The quantiles themselves follow the parameters */
+    if (tempHistogramSize != 0 && tempHistogramSize != COLOUR_HISTOGRAM_SIZE)
+        return 1;
+
+    p->colour.histogramSize = (size_t) tempHistogramSize;
 
     return 0;
 }
@@ -348,6 +484,8 @@ int deserialisePlotCTXMP(PlotCTX *p, char *src)
     uintmax_t tempWidth = 0;
     uintmax_t tempHeight = 0;
     unsigned long int tempColourScheme = 0UL;
+    unsigned long int tempPaletteBits = 0UL;
+    unsigned long int tempHistogramSize = 0UL;
 
     if (stringToULong(&tempPlotType, endptr, 0, ULONG_MAX, &endptr, BASE_DEC) != PARSE_EEND
         || mpc_strtoc(p->minimum.mpc, endptr, &endptr, 10, MP_COMPLEX_RND) == -1
@@ -356,7 +494,9 @@ int deserialisePlotCTXMP(PlotCTX *p, char *src)
         || stringToULong(&(p->iterations), endptr, 0, ULONG_MAX, &endptr, BASE_DEC) != PARSE_EEND
         || stringToUIntMax(&tempWidth, endptr, WIDTH_MIN, WIDTH_MAX, &endptr, BASE_DEC) != PARSE_EEND
         || stringToUIntMax(&tempHeight, endptr, HEIGHT_MIN, HEIGHT_MAX, &endptr, BASE_DEC) != PARSE_EEND
-        || stringToULong(&tempColourScheme, endptr, 0UL, ULONG_MAX, &endptr, BASE_DEC) != PARSE_SUCCESS)
+        || stringToULong(&tempColourScheme, endptr, 0UL, ULONG_MAX, &endptr, BASE_DEC) != PARSE_EEND
+        || stringToULong(&tempPaletteBits, endptr, 0UL, ULONG_MAX, &endptr, BASE_DEC) != PARSE_EEND
+        || stringToULong(&tempHistogramSize, endptr, 0UL, ULONG_MAX, &endptr, BASE_DEC) != PARSE_SUCCESS)
     {
         return 1;
     }
@@ -371,83 +511,173 @@ int deserialisePlotCTXMP(PlotCTX *p, char *src)
     p->output = OUTPUT_NONE;
     p->file = NULL;
 
-    if (initialiseColourScheme(&p->colour, tempColourScheme))
+    if (initialiseColourScheme(&p->colour, tempColourScheme)
+        || (tempPaletteBits && initialisePalette(&p->colour, (unsigned int) tempPaletteBits)))
+    {
+        return 1;
+    }
+
+    /* The quantiles themselves follow the parameters */
+    if (tempHistogramSize != 0 && tempHistogramSize != COLOUR_HISTOGRAM_SIZE)
         return 1;
 
+    p->colour.histogramSize = (size_t) tempHistogramSize;
+
     return 0;
 }
 #endif
 
 
-int sendAcknowledgement(int s)
+/* The quantiles of histogram colouring are sent after the plot parameters, in
+ * a message of their own
+ */
+int serialiseHistogram(char *dest, size_t n, const ColourScheme *scheme)
 {
-    ssize_t bytes;
-    char buffer[NETWORK_BUFFER_SIZE] = {'\0'};
+    size_t length = 0;
 
-    strncpy(buffer, ACK_RESPONSE, sizeof(buffer));
-    buffer[sizeof(buffer) - 1] = '\0';
+    for (size_t i = 0; i < scheme->histogramSize; ++i)
+    {
+        int ret = snprintf(dest + length, n - length, "%s%.*e", (i) ? " " : "", SERIALISE_FLT_DIG, scheme->histogram[i]);
 
-    bytes = writeSocket(buffer, s, sizeof(buffer));
+        if (ret < 0 || (size_t) ret >= n - length)
+            return -1;
 
-    if (bytes == 0)
-    {
-        return -2;
+        length += (size_t) ret;
     }
-    else if (bytes < 0)
-    {
-        return -1;
-    }
-    else if ((size_t) bytes != sizeof(buffer))
+
+    return (length > INT_MAX) ? -1 : (int) length;
+}
+
+
+int deserialiseHistogram(ColourScheme *scheme, char *src)
+{
+    char *endptr = src;
+    double quantiles[COLOUR_HISTOGRAM_SIZE];
+
+    if (scheme->histogramSize != COLOUR_HISTOGRAM_SIZE)
+        return 1;
+
+    for (size_t i = 0; i < COLOUR_HISTOGRAM_SIZE; ++i)
     {
-        logMessage(ERROR, "Could not write full request to connection");
-        return -1;
+        ParseErr expected = (i < COLOUR_HISTOGRAM_SIZE - 1) ? PARSE_EEND : PARSE_SUCCESS;
+
+        if (stringToDouble(&(quantiles[i]), endptr, -DBL_MAX, DBL_MAX, &endptr) != expected)
+            return 1;
     }
 
-    return 0;
+    /* The quantiles are sorted, so they are kept as they are */
+    return initialiseHistogram(scheme, quantiles, COLOUR_HISTOGRAM_SIZE);
+}
+
+
+/* Send the protocol version this program speaks and the features it offers */
+int sendHandshake(int s, uint32_t features)
+{
+    unsigned char version[HANDSHAKE_SIZE];
+    Frame frame = {.type = FRAME_HELLO, .job = 0, .firstRow = 0, .rowCount = 0, .length = sizeof(version)};
+
+    packHandshake(version, features);
+
+    return sendFrame(s, &frame, version);
 }
 
 
-int sendError(int s)
+/* Read the peer's handshake and check it speaks the same protocol version */
+int readHandshake(int s, uint32_t *features)
 {
+    unsigned char version[HANDSHAKE_SIZE];
     ssize_t bytes;
-    char buffer[NETWORK_BUFFER_SIZE] = {'\0'};
+    Frame frame;
 
-    strncpy(buffer, ERR_RESPONSE, sizeof(buffer));
-    buffer[sizeof(buffer) - 1] = '\0';
+    int ret = readFrame(&frame, s);
 
-    bytes = writeSocket(buffer, s, sizeof(buffer));
+    if (ret)
+        return ret;
 
-    if (bytes == 0)
+    if (frame.type == FRAME_ERROR)
     {
-        return -2;
+        logMessage(ERROR, "Peer rejected protocol version %u", PROTOCOL_VERSION);
+        return -1;
     }
-    else if (bytes < 0)
+    else if (frame.type != FRAME_HELLO || frame.length != sizeof(version))
     {
-        return -1;
+        logMessage(ERROR, "Expected a handshake from peer");
+        return -3;
     }
-    else if ((size_t) bytes != sizeof(buffer))
+
+    bytes = readSocket(version, s, sizeof(version));
+
+    if (bytes <= 0 || (size_t) bytes != sizeof(version))
+        return (bytes < 0) ? -1 : -2;
+
+    return unpackHandshake(features, version);
+}
+
+
+void packHandshake(unsigned char *dest, uint32_t features)
+{
+    packUInt32(dest, PROTOCOL_VERSION);
+    packUInt32(dest + 4, features);
+}
+
+
+/* Check the protocol version of a handshake payload and read its features */
+int unpackHandshake(uint32_t *features, const unsigned char *src)
+{
+    uint32_t peerVersion = unpackUInt32(src);
+
+    if (peerVersion != PROTOCOL_VERSION)
     {
-        logMessage(ERROR, "Could not write full request to connection");
-        return -1;
+        logMessage(ERROR, "Peer uses protocol version %" PRIu32 ", expected %u", peerVersion, PROTOCOL_VERSION);
+        return -3;
     }
 
+    *features = unpackUInt32(src + 4);
+
     return 0;
 }
 
 
+/* Read the precision mode, plot parameters and histogram from a single frame.
+ * Each is a NUL-terminated string
+ */
 int readParameters(PlotCTX **p, int s)
 {
     ssize_t bytes;
-    char buffer[PARAMETERS_BUFFER_SIZE] = {'\0'};
+    char buffer[PARAMETERS_FRAME_SIZE + 1] = {'\0'};
+    char *plot, *histogram, *end;
 
     PrecisionMode precision;
+    Frame frame;
 
-    logMessage(DEBUG, "Reading precision mode");
-    
-    bytes = readSocket(buffer, s, sizeof(buffer));
+    int ret = readFrame(&frame, s);
+
+    if (ret)
+        return ret;
 
-    if (bytes <= 0 || (size_t) bytes != sizeof(buffer))
-        return (bytes == 0) ? -2 : -1;
+    if (frame.type != FRAME_PARAMETERS || frame.length == 0 || frame.length >= sizeof(buffer))
+    {
+        logMessage(ERROR, "Expected plot parameters from master");
+        return -1;
+    }
+
+    logMessage(DEBUG, "Reading plot parameters");
+
+    bytes = readSocket(buffer, s, (size_t) frame.length);
+
+    if (bytes <= 0 || (uint64_t) bytes != frame.length)
+        return (bytes < 0) ? -1 : -2;
+
+    end = buffer + frame.length;
+    plot = buffer + strlen(buffer) + 1;
+
+    if (plot >= end)
+    {
+        logMessage(ERROR, "Plot parameters missing from frame");
+        return -1;
+    }
+
+    histogram = plot + strlen(plot) + 1;
 
     logMessage(DEBUG, "Deserialising precision mode");
 
@@ -461,15 +691,6 @@ int readParameters(PlotCTX **p, int s)
         return -1;
     }
 
-    logMessage(DEBUG, "Reading plot parameters");
-
-    memset(buffer, '\0', sizeof(buffer));
-
-    bytes = readSocket(buffer, s, sizeof(buffer));
-
-    if (bytes <= 0 || (size_t) bytes != sizeof(buffer))
-        return (bytes == 0) ? -2 : -1;
-
     logMessage(DEBUG, "Creating plot parameters structure");
 
     *p = createPlotCTX(precision);
@@ -485,7 +706,7 @@ int readParameters(PlotCTX **p, int s)
     switch((*p)->precision)
     {
         case STD_PRECISION:
-            if (deserialisePlotCTX(*p, buffer))
+            if (deserialisePlotCTX(*p, plot))
             {
                 logMessage(ERROR, "Could not deserialise plot parameters");
                 freePlotCTX(*p);
@@ -493,7 +714,7 @@ int readParameters(PlotCTX **p, int s)
             }
             break;
         case EXT_PRECISION:
-            if (deserialisePlotCTXExt(*p, buffer))
+            if (deserialisePlotCTXExt(*p, plot))
             {
                 logMessage(ERROR, "Could not deserialise plot parameters");
                 freePlotCTX(*p);
@@ -503,7 +724,7 @@ int readParameters(PlotCTX **p, int s)
 
         #ifdef MP_PREC
         case MUL_PRECISION:
-            if (deserialisePlotCTXMP(*p, buffer))
+            if (deserialisePlotCTXMP(*p, plot))
             {
                 logMessage(ERROR, "Could not deserialise plot parameters");
                 freePlotCTX(*p);
@@ -518,65 +739,61 @@ int readParameters(PlotCTX **p, int s)
             return -1;
     }
 
+    if (!(*p)->colour.histogramSize)
+        return 0;
+
+    logMessage(DEBUG, "Deserialising histogram");
+
+    if (histogram >= end || deserialiseHistogram(&((*p)->colour), histogram))
+    {
+        logMessage(ERROR, "Could not deserialise histogram");
+        freePlotCTX(*p);
+        return -1;
+    }
+
     return 0;
 }
 
 
-int sendParameters(int s, const PlotCTX *p)
+/* Serialise the payload of a FRAME_PARAMETERS frame into dest, which holds
+ * PARAMETERS_FRAME_SIZE bytes. Return its length, or -1 on failure
+ */
+int serialiseParameters(char *dest, const PlotCTX *p)
 {
     int ret;
-    ssize_t bytes;
-    char buffer[PARAMETERS_BUFFER_SIZE] = {'\0'};
+    size_t length;
 
     logMessage(DEBUG, "Serialising precision mode");
 
     #ifndef MP_PREC
-    ret = serialisePrecision(buffer, sizeof(buffer), p->precision);
+    ret = serialisePrecision(dest, PARAMETERS_BUFFER_SIZE, p->precision);
     #else
-    ret = serialisePrecision(buffer, sizeof(buffer), p->precision, mpSignificandSize);
+    ret = serialisePrecision(dest, PARAMETERS_BUFFER_SIZE, p->precision, mpSignificandSize);
     #endif
 
     /* If truncated or error */
-    if (ret < 0 || (size_t) ret >= sizeof(buffer))
+    if (ret < 0 || (size_t) ret >= PARAMETERS_BUFFER_SIZE)
     {
         logMessage(ERROR, "Could not serialise precision mode");
         return -1;
     }
 
-    logMessage(DEBUG, "Sending precision mode");
-
-    bytes = writeSocket(buffer, s, sizeof(buffer));
-
-    if (bytes == 0)
-    {
-        return -2;
-    }
-    else if (bytes < 0)
-    {
-        return -1;
-    }
-    else if ((size_t) bytes != sizeof(buffer))
-    {
-        logMessage(ERROR, "Could not write full request to connection");
-        return -1;
-    }
+    length = (size_t) ret + 1;
 
     logMessage(DEBUG, "Serialising plot parameters");
 
-    memset(buffer, '\0', sizeof(buffer));
-
     switch(p->precision)
     {
         case STD_PRECISION:
-            ret = serialisePlotCTX(buffer, sizeof(buffer), p);
+            ret = serialisePlotCTX(dest + length, PARAMETERS_BUFFER_SIZE, p);
             break;
         case EXT_PRECISION:
-            ret = serialisePlotCTXExt(buffer, sizeof(buffer), p);
+            ret = serialisePlotCTXExt(dest + length, PARAMETERS_BUFFER_SIZE, p);
             break;
 
         #ifdef MP_PREC
         case MUL_PRECISION:
-            ret = serialisePlotCTXMP(buffer, sizeof(buffer), p);
+            ret = serialisePlotCTXMP(dest + length, PARAMETERS_BUFFER_SIZE, p);
             break;
         #endif
 
@@ -585,122 +802,124 @@ int sendParameters(int s, const PlotCTX *p)
             return -1;
     }
 
-    if (ret < 0 || (size_t) ret >= sizeof(buffer))
+    if (ret < 0 || (size_t) ret >= PARAMETERS_BUFFER_SIZE)
     {
         logMessage(ERROR, "Could not serialise plot context structure");
         return -1;
     }
 
-    logMessage(DEBUG, "Sending plot parameters");
+    length += (size_t) ret + 1;
 
-    bytes = writeSocket(buffer, s, sizeof(buffer));
-    
-    if (bytes == 0)
+    if (p->colour.histogram)
     {
-        return -2;
+        logMessage(DEBUG, "Serialising histogram");
+
+        ret = serialiseHistogram(dest + length, PARAMETERS_BUFFER_SIZE, &(p->colour));
+
+        if (ret < 0 || (size_t) ret >= PARAMETERS_BUFFER_SIZE)
+        {
+            logMessage(ERROR, "Could not serialise histogram");
+            return -1;
+        }
+
+        length += (size_t) ret + 1;
     }
-    else if (bytes < 0)
+
+    return (int) length;
+}
+
+
+/* Ask the master for up to max rows to calculate */
+int requestRows(int s, size_t max)
+{
+    Frame request = {.type = FRAME_REQUEST, .job = 0, .firstRow = 0, .rowCount = max, .length = 0};
+
+    return sendFrame(s, &request, NULL);
+}
+
+
+/* Read the master's answer to the oldest request sent with requestRows() */
+int readAllocation(Frame *job, int s, const PlotCTX *p, size_t max)
+{
+    int ret = readFrame(job, s);
+
+    /* A malformed header leaves the stream unreadable */
+    if (ret)
+        return (ret == -3) ? -1 : ret;
+
+    if (job->type != FRAME_ROWS || job->length)
     {
+        logMessage(ERROR, "Expected a row allocation from master");
         return -1;
     }
-    else if ((size_t) bytes != sizeof(buffer))
+    else if (job->rowCount < 1 || job->rowCount > max
+             || job->firstRow >= p->height || job->rowCount > p->height - job->firstRow)
     {
-        logMessage(ERROR, "Could not write full request to connection");
-        return -1;
+        logMessage(ERROR, "Invalid row allocation from master (%" PRIu64 " rows from row %" PRIu64 ")",
+                   job->rowCount, job->firstRow);
+        return -3;
     }
-    
+
     return 0;
 }
 
 
-int requestRowNumber(size_t *n, int s, const PlotCTX *p)
+/* Return the pixels of an allocated row range to the master */
+int sendRowData(int s, const Frame *job, const void *rows, size_t n)
 {
-    ssize_t ret;
+    Frame frame = *job;
 
-    char buffer[NETWORK_BUFFER_SIZE] = {'\0'};
+    frame.type = FRAME_DATA;
+    frame.length = n;
 
-    uintmax_t tempUIntMax = 0;
-    char *endptr;
-
-    /* Send request to master for a new row number */
-    strncpy(buffer, ROW_REQUEST, sizeof(buffer));
-    buffer[sizeof(buffer) - 1] = '\0';
+    return sendFrame(s, &frame, rows);
+}
 
-    ret = writeSocket(buffer, s, sizeof(buffer));
 
-    if (ret == 0)
-    {
-        return -2;
-    }
-    else if (ret < 0 || (size_t) ret != sizeof(buffer))
-    {
-        logMessage(ERROR, "Could not write to socket connection");
-        return -1;
-    }
+/* Return the pixels of an allocated row range as n bytes packed by packRows() */
+int sendPackedRowData(int s, const Frame *job, const void *packed, size_t n)
+{
+    Frame frame = *job;
 
-    /* Read and parse response from master */
-    memset(buffer, '\0', sizeof(buffer));
-    ret = readSocket(buffer, s, sizeof(buffer));
+    frame.type = FRAME_PACKED;
+    frame.length = n;
 
-    if (ret == 0)
-    {
-        return -2;
-    }
-    else if (ret < 0 || (size_t) ret != sizeof(buffer))
-    {
-        logMessage(ERROR, "Error reading from socket connection");
-        return -1;
-    }
+    return sendFrame(s, &frame, packed);
+}
 
-    buffer[sizeof(buffer) - 1] = '\0';
 
-    if (stringToUIntMax(&tempUIntMax, buffer, 0, p->height - 1, &endptr, BASE_DEC) != PARSE_SUCCESS)
-    {
-        logMessage(ERROR, "Error parsing row number \'%s\'", buffer);
-        return -3;
-    }
+/* Store integers most significant byte first */
+static void packUInt32(unsigned char *dest, uint32_t x)
+{
+    for (int i = 3; i >= 0; --i, x >>= 8)
+        dest[i] = (unsigned char) (x & 0xFF);
+}
 
-    *n = (size_t) tempUIntMax;
 
-    return 0;
+static void packUInt64(unsigned char *dest, uint64_t x)
+{
+    for (int i = 7; i >= 0; --i, x >>= 8)
+        dest[i] = (unsigned char) (x & 0xFF);
 }
 
 
-int sendRowData(int s, void *row, size_t n)
+static uint32_t unpackUInt32(const unsigned char *src)
 {
-    ssize_t bytes;
-    char buffer[NETWORK_BUFFER_SIZE] = {'\0'};
+    uint32_t x = 0;
 
-    strncpy(buffer, ROW_RESPONSE, sizeof(buffer));
-    buffer[sizeof(buffer) - 1] = '\0';
+    for (int i = 0; i < 4; ++i)
+        x = (x << 8) | src[i];
 
-    bytes = writeSocket(buffer, s, sizeof(buffer));
+    return x;
+}
 
-    if (bytes == 0)
-    {
-        return -2;
-    }
-    else if (bytes < 0)
-    {
-        return -1;
-    }
-    else if ((size_t) bytes != sizeof(buffer))
-    {
-        logMessage(ERROR, "Could not write full request to connection");
-        return -1;
-    }
 
-    bytes = writeSocket(row, s, n);
+static uint64_t unpackUInt64(const unsigned char *src)
+{
+    uint64_t x = 0;
 
-    if (bytes == 0)
-    {
-        return -2;
-    }
-    else if (bytes < 0 || (size_t) bytes != n)
-    {
-        logMessage(ERROR, "Could not write to socket connection");
-        return -1;
-    }
+    for (int i = 0; i < 8; ++i)
+        x = (x << 8) | src[i];
 
-    return 0;
+    return x;
 }
\ No newline at end of file
@@ -0,0 +1,296 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "row_codec.h"
+
+
+/* Each sequence is a token byte - the number of literal bytes in its high four
+ * bits and the match length less MATCH_MIN in its low four - then any further
+ * literal length bytes, the literals, a two-byte little-endian match offset,
+ * and any further match length bytes. A length nibble of 15 is followed by
+ * bytes that are added to it, up to and including the first that is not 255.
+ * The last sequence has literals only, and ends the input
+ */
+#define MATCH_MIN 4
+#define OFFSET_MAX 65535
+#define NIBBLE_MAX 15
+
+#define HASH_BITS 12
+#define HASH_SIZE (1 << HASH_BITS)
+
+/* Positions skipped grow by one for every this many bytes without a match, so
+ * that incompressible rows are passed over quickly
+ */
+#define SKIP_SHIFT 5
+
+
+static size_t matchLength(const unsigned char *in, size_t n, size_t pos, size_t offset);
+static uint32_t hash(const unsigned char *p);
+static size_t writeSequence(unsigned char *out, size_t max, const unsigned char *literals, size_t literalCount,
+                            size_t offset, size_t length);
+static unsigned char * writeLength(unsigned char *out, size_t length);
+static int readLength(size_t *length, const unsigned char *src, size_t n, size_t *pos, size_t max);
+
+
+/* Create a row packer and its hash table */
+RowPacker * createRowPacker(void)
+{
+    RowPacker *packer = malloc(sizeof(*packer));
+
+    if (!packer)
+        return NULL;
+
+    packer->head = malloc(HASH_SIZE * sizeof(*(packer->head)));
+    packer->out = NULL;
+    packer->length = 0;
+    packer->size = 0;
+
+    if (!packer->head)
+    {
+        freeRowPacker(packer);
+        return NULL;
+    }
+
+    return packer;
+}
+
+
+/* Pack n bytes of rows with pixels of pixelSize bytes. Return 0 if the packed
+ * output is smaller than the input, or 1 if the rows are better sent as they are
+ */
+int packRows(RowPacker *packer, const unsigned char *in, size_t n, size_t pixelSize)
+{
+    size_t pos = 0, anchor = 0, written;
+
+    /* Output that is not smaller than the input is abandoned */
+    size_t max = (n > 0) ? n - 1 : 0;
+
+    packer->length = 0;
+
+    if (packer->size < max)
+    {
+        unsigned char *out = realloc(packer->out, max);
+
+        if (!out)
+            return 1;
+
+        packer->out = out;
+        packer->size = max;
+    }
+
+    memset(packer->head, 0, HASH_SIZE * sizeof(*(packer->head)));
+
+    while (pos + MATCH_MIN <= n)
+    {
+        size_t offset = 0, length = 0;
+
+        /* A run of identical pixels matches itself one pixel back */
+        if (pos >= pixelSize && pixelSize > 0)
+        {
+            offset = pixelSize;
+            length = matchLength(in, n, pos, offset);
+        }
+
+        if (length < MATCH_MIN)
+        {
+            uint32_t h = hash(in + pos);
+            size_t candidate = packer->head[h];
+
+            packer->head[h] = pos + 1;
+            length = 0;
+
+            if (candidate && pos - (candidate - 1) <= OFFSET_MAX)
+            {
+                offset = pos - (candidate - 1);
+                length = matchLength(in, n, pos, offset);
+            }
+        }
+
+        if (length < MATCH_MIN)
+        {
+            pos += 1 + ((pos - anchor) >> SKIP_SHIFT);
+            continue;
+        }
+
+        written = writeSequence(packer->out + packer->length, max - packer->length,
+                                in + anchor, pos - anchor, offset, length);
+
+        if (!written)
+            return 1;
+
+        packer->length += written;
+        pos += length;
+        anchor = pos;
+    }
+
+    written = writeSequence(packer->out + packer->length, max - packer->length, in + anchor, n - anchor, 0, 0);
+
+    if (!written)
+        return 1;
+
+    packer->length += written;
+
+    return 0;
+}
+
+
+void freeRowPacker(RowPacker *packer)
+{
+    if (packer)
+    {
+        free(packer->head);
+        free(packer->out);
+        free(packer);
+    }
+}
+
+
+/* Unpack rows into exactly n bytes at dest. The input comes off the network, so
+ * every length and offset is checked before it is used
+ */
+int unpackRows(unsigned char *dest, size_t n, const unsigned char *src, size_t length)
+{
+    size_t in = 0, out = 0;
+
+    while (in < length)
+    {
+        unsigned int token = src[in++];
+        size_t literalCount = token >> 4;
+        size_t offset, matchCount = (token & NIBBLE_MAX) + MATCH_MIN;
+
+        if (literalCount == NIBBLE_MAX && readLength(&literalCount, src, length, &in, n - out))
+            return 1;
+
+        if (literalCount > length - in || literalCount > n - out)
+            return 1;
+
+        memcpy(dest + out, src + in, literalCount);
+        in += literalCount;
+        out += literalCount;
+
+        /* The last sequence has no match */
+        if (in == length)
+            return (out == n) ? 0 : 1;
+
+        if (length - in < 2)
+            return 1;
+
+        offset = (size_t) src[in] | (size_t) src[in + 1] << 8;
+        in += 2;
+
+        if (matchCount == NIBBLE_MAX + MATCH_MIN && readLength(&matchCount, src, length, &in, n - out))
+            return 1;
+
+        if (offset == 0 || offset > out || matchCount > n - out)
+            return 1;
+
+        /* An overlapping match repeats the bytes it has just written, so it is
+         * copied in pieces no longer than its offset
+         */
+        while (matchCount > 0)
+        {
+            size_t piece = (matchCount < offset) ? matchCount : offset;
+
+            memcpy(dest + out, dest + out - offset, piece);
+            out += piece;
+            matchCount -= piece;
+
+            /* Doubling the offset keeps the pieces of a long run large */
+            offset += piece;
+        }
+    }
+
+    return 1;
+}
+
+
+/* Length of the match at pos with the bytes offset back */
+static size_t matchLength(const unsigned char *in, size_t n, size_t pos, size_t offset)
+{
+    size_t length = 0;
+
+    while (pos + length < n && in[pos + length] == in[pos + length - offset])
+        ++length;
+
+    return length;
+}
+
+
+/* Hash the four bytes at p */
+static uint32_t hash(const unsigned char *p)
+{
+    uint32_t x = (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+
+    return (uint32_t) (x * 2654435761U) >> (32 - HASH_BITS);
+}
+
+
+/* Write a sequence if it fits in max bytes, returning its size (0 if it does
+ * not fit). A length of 0 writes the last sequence, of literals only
+ */
+static size_t writeSequence(unsigned char *out, size_t max, const unsigned char *literals, size_t literalCount,
+                            size_t offset, size_t length)
+{
+    unsigned char *start = out;
+    size_t matchCode = (length) ? length - MATCH_MIN : 0;
+
+    /* Token, offset, and the longest length bytes of the literals and match */
+    size_t worst = 1 + literalCount / 255 + 1 + literalCount + 2 + matchCode / 255 + 1;
+
+    if (worst > max)
+        return 0;
+
+    *out++ = (unsigned char) (((literalCount < NIBBLE_MAX) ? literalCount : NIBBLE_MAX) << 4
+                              | ((matchCode < NIBBLE_MAX) ? matchCode : NIBBLE_MAX));
+
+    if (literalCount >= NIBBLE_MAX)
+        out = writeLength(out, literalCount - NIBBLE_MAX);
+
+    memcpy(out, literals, literalCount);
+    out += literalCount;
+
+    if (length)
+    {
+        *out++ = (unsigned char) (offset & 0xFF);
+        *out++ = (unsigned char) (offset >> 8);
+
+        if (matchCode >= NIBBLE_MAX)
+            out = writeLength(out, matchCode - NIBBLE_MAX);
+    }
+
+    return (size_t) (out - start);
+}
+
+
+static unsigned char * writeLength(unsigned char *out, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *out++ = 255;
+
+    *out++ = (unsigned char) length;
+
+    return out;
+}
+
+
+/* Add the length bytes following a nibble of 15 to length, failing if the
+ * input ends first or the length passes max
+ */
+static int readLength(size_t *length, const unsigned char *src, size_t n, size_t *pos, size_t max)
+{
+    unsigned int byte;
+
+    do
+    {
+        if (*pos >= n || *length > max)
+            return 1;
+
+        byte = src[(*pos)++];
+        *length += byte;
+    }
+    while (byte == 255);
+
+    return 0;
+}
@@ -0,0 +1,770 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "libgroot/include/log.h"
+
+#include "tiff.h"
+
+#include "colour.h"
+#include "deflate.h"
+#include "parameters.h"
+
+
+/* Little-endian BigTIFF header, followed by the offset of the first IFD */
+#define TIFF_HEADER "II\x2B\x00\x08\x00\x00\x00"
+#define TIFF_HEADER_LEN 8
+
+/* Largest image dimension */
+#define TIFF_DIMENSION_MAX 0xFFFFFFFF
+
+/* Field types */
+#define TYPE_SHORT 3
+#define TYPE_LONG 4
+#define TYPE_LONG8 16
+
+/* Tags, in the ascending order they must be written */
+#define TAG_IMAGE_WIDTH 256
+#define TAG_IMAGE_LENGTH 257
+#define TAG_BITS_PER_SAMPLE 258
+#define TAG_COMPRESSION 259
+#define TAG_PHOTOMETRIC 262
+#define TAG_SAMPLES_PER_PIXEL 277
+#define TAG_PLANAR_CONFIGURATION 284
+#define TAG_PREDICTOR 317
+#define TAG_COLOUR_MAP 320
+#define TAG_TILE_WIDTH 322
+#define TAG_TILE_LENGTH 323
+#define TAG_TILE_OFFSETS 324
+#define TAG_TILE_BYTE_COUNTS 325
+
+#define IFD_ENTRIES_MAX 13
+#define IFD_ENTRY_LEN 20
+
+/* Compression values */
+#define COMPRESSION_NONE 1
+#define COMPRESSION_DEFLATE 8
+#define COMPRESSION_PACKBITS 32773
+
+/* Photometric interpretations */
+#define PHOTOMETRIC_WHITE_IS_ZERO 0
+#define PHOTOMETRIC_BLACK_IS_ZERO 1
+#define PHOTOMETRIC_RGB 2
+#define PHOTOMETRIC_PALETTE 3
+
+/* Horizontal differencing, so that gradients compress to runs */
+#define PREDICTOR_HORIZONTAL 2
+
+/* Longest PackBits run */
+#define PACKBITS_RUN_MAX 128
+
+
+/* zlib stream header - deflate with a 32 KiB window, fast compression */
+static const unsigned char ZLIB_HEADER[] = {0x78, 0x5E};
+
+/* Final deflate block (fixed codes, holding only the end of block code) */
+static const unsigned char DEFLATE_FINAL_BLOCK[] = {0x03, 0x00};
+
+
+static void * writeTiles(void *thread);
+static void copyTile(TIFFTileThread *t, size_t tile);
+static void predictTile(TIFFTileThread *t);
+static int storeTile(TIFFTileThread *t, size_t tile);
+static size_t packBits(unsigned char *out, const unsigned char *in, size_t n);
+static uint64_t claimSpace(TIFFWriter *tiff, size_t n);
+static int writeColourMap(const TIFFWriter *tiff, uint64_t offset);
+static unsigned char * putEntry(unsigned char *entry, uint16_t tag, uint16_t type, uint64_t count, uint64_t value);
+static int writeAt(int fd, const unsigned char *data, size_t n, uint64_t offset);
+static void putUint16(unsigned char *dest, uint16_t x);
+static void putUint32(unsigned char *dest, uint32_t x);
+static void putUint64(unsigned char *dest, uint64_t x);
+static void putUint32BE(unsigned char *dest, uint32_t x);
+
+
+/* Create a writer that encodes the tiles of each block in parallel, and write
+ * the BigTIFF header. The IFD and tile tables are only written once every tile
+ * is in place
+ */
+TIFFWriter * createTIFFWriter(FILE *file, const PlotCTX *p, unsigned int threads)
+{
+    TIFFWriter *tiff;
+    unsigned char header[TIFF_HEADER_LEN + sizeof(uint64_t)] = TIFF_HEADER;
+
+    if (p->colour.depth != BIT_DEPTH_1 && p->colour.depth != BIT_DEPTH_8 && p->colour.depth != BIT_DEPTH_24
+        && !(p->colour.depth == BIT_DEPTH_16 && p->colour.palette))
+    {
+        logMessage(ERROR, "Colour scheme cannot be written as a TIFF image");
+        return NULL;
+    }
+
+    if (p->width > TIFF_DIMENSION_MAX || p->height > TIFF_DIMENSION_MAX)
+    {
+        logMessage(ERROR, "Image dimensions exceed the TIFF maximum of %lu pixels", (unsigned long) TIFF_DIMENSION_MAX);
+        return NULL;
+    }
+
+    tiff = malloc(sizeof(*tiff));
+
+    if (!tiff)
+        return NULL;
+
+    tiff->fd = fileno(file);
+    tiff->codec = p->tiffCodec;
+    tiff->width = p->width;
+    tiff->height = p->height;
+    tiff->depth = p->colour.depth;
+    tiff->palette = p->colour.palette;
+    tiff->paletteSize = p->colour.paletteSize;
+    tiff->rowSize = (p->width * p->colour.depth + CHAR_BIT - 1) / CHAR_BIT;
+    tiff->tileRowSize = (TIFF_TILE_SIZE * p->colour.depth) / CHAR_BIT;
+    tiff->tileBytes = TIFF_TILE_SIZE * tiff->tileRowSize;
+    tiff->tilesAcross = (p->width + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+    tiff->tilesDown = (p->height + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+    tiff->offsets = calloc(tiff->tilesAcross * tiff->tilesDown, sizeof(*(tiff->offsets)));
+    tiff->byteCounts = calloc(tiff->tilesAcross * tiff->tilesDown, sizeof(*(tiff->byteCounts)));
+    tiff->end = sizeof(header);
+
+    /* Uncompressed tiles are each given their place after the header */
+    if (tiff->codec == TIFF_CODEC_NONE)
+        tiff->end += (uint64_t) tiff->tilesAcross * tiff->tilesDown * tiff->tileBytes;
+
+    tiff->threadCount = (threads > 0) ? threads : 1;
+    tiff->threads = calloc(tiff->threadCount, sizeof(*(tiff->threads)));
+    tiff->failed = false;
+
+    if (pthread_mutex_init(&(tiff->lock), NULL))
+    {
+        logMessage(ERROR, "Mutex could not be created");
+        free(tiff->offsets);
+        free(tiff->byteCounts);
+        free(tiff->threads);
+        free(tiff);
+        return NULL;
+    }
+
+    if (!tiff->offsets || !tiff->byteCounts || !tiff->threads)
+    {
+        logMessage(ERROR, "Memory allocation failed");
+        freeTIFFWriter(tiff);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < tiff->threadCount; ++i)
+    {
+        TIFFTileThread *t = &(tiff->threads[i]);
+
+        t->tid = i;
+        t->tiff = tiff;
+        t->tile = malloc(tiff->tileBytes);
+
+        if (!t->tile)
+        {
+            logMessage(ERROR, "Memory allocation failed");
+            freeTIFFWriter(tiff);
+            return NULL;
+        }
+
+        /* Each row of a tile is packed separately, and may grow by one header
+         * byte per run of literals
+         */
+        if (tiff->codec == TIFF_CODEC_PACKBITS)
+        {
+            t->packed = malloc(TIFF_TILE_SIZE * (tiff->tileRowSize + (tiff->tileRowSize + PACKBITS_RUN_MAX - 1)
+                                                 / PACKBITS_RUN_MAX));
+
+            if (!t->packed)
+            {
+                logMessage(ERROR, "Memory allocation failed");
+                freeTIFFWriter(tiff);
+                return NULL;
+            }
+        }
+        else if (tiff->codec == TIFF_CODEC_DEFLATE)
+        {
+            t->deflater = createDeflater();
+
+            if (!t->deflater)
+            {
+                logMessage(ERROR, "Memory allocation failed");
+                freeTIFFWriter(tiff);
+                return NULL;
+            }
+        }
+    }
+
+    logMessage(DEBUG, "Writing TIFF header");
+
+    /* The IFD offset is filled in by finishTIFF() */
+    memset(header + TIFF_HEADER_LEN, 0, sizeof(uint64_t));
+
+    if (writeAt(tiff->fd, header, sizeof(header), 0))
+    {
+        logMessage(ERROR, "Could not write TIFF header");
+        freeTIFFWriter(tiff);
+        return NULL;
+    }
+
+    logMessage(DEBUG, "TIFF image has %zu by %zu tiles of %u pixels", tiff->tilesAcross, tiff->tilesDown,
+               TIFF_TILE_SIZE);
+
+    return tiff;
+}
+
+
+/* Encode and write every tile of the next n rows of the image, which must
+ * start on a row of tiles and end on one (or at the bottom of the image). The
+ * tiles are shared between the threads, each writing them straight to their
+ * place in the file as they are finished
+ */
+int writeTIFFTiles(TIFFWriter *tiff, const char *rows, size_t firstRow, size_t n)
+{
+    size_t tiles;
+    unsigned int created = 0;
+
+    if (tiff->failed)
+        return 1;
+
+    if (!n)
+        return 0;
+
+    if (firstRow % TIFF_TILE_SIZE || (firstRow + n < tiff->height && n % TIFF_TILE_SIZE))
+    {
+        logMessage(ERROR, "Rows %zu to %zu do not hold whole rows of TIFF tiles", firstRow, firstRow + n - 1);
+        tiff->failed = true;
+        return 1;
+    }
+
+    tiles = (n + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE * tiff->tilesAcross;
+
+    tiff->rows = (const unsigned char *) rows;
+    tiff->firstRow = firstRow;
+    tiff->rowCount = n;
+    tiff->active = (tiles < tiff->threadCount) ? (unsigned int) tiles : tiff->threadCount;
+
+    for (; created < tiff->active; ++created)
+    {
+        TIFFTileThread *t = &(tiff->threads[created]);
+
+        t->ret = 1;
+
+        if (pthread_create(&(t->pid), NULL, writeTiles, t))
+        {
+            logMessage(ERROR, "Thread could not be created");
+            tiff->failed = true;
+            break;
+        }
+    }
+
+    for (unsigned int i = 0; i < created; ++i)
+    {
+        TIFFTileThread *t = &(tiff->threads[i]);
+
+        if (pthread_join(t->pid, NULL))
+        {
+            logMessage(ERROR, "Thread could not be harvested");
+            tiff->failed = true;
+        }
+        else if (t->ret)
+        {
+            tiff->failed = true;
+        }
+    }
+
+    if (tiff->failed)
+    {
+        logMessage(ERROR, "Could not write TIFF tiles");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Write the tile tables and the IFD after the last tile, then point the
+ * header at the IFD
+ */
+int finishTIFF(TIFFWriter *tiff)
+{
+    size_t tiles = tiff->tilesAcross * tiff->tilesDown;
+    unsigned char *table = NULL;
+    unsigned char ifd[sizeof(uint64_t) + IFD_ENTRIES_MAX * IFD_ENTRY_LEN + sizeof(uint64_t)];
+    unsigned char *entry = ifd + sizeof(uint64_t);
+    unsigned char ifdOffset[sizeof(uint64_t)];
+
+    uint16_t samples = (tiff->depth == BIT_DEPTH_24) ? 3 : 1;
+    uint16_t bits = (uint16_t) (tiff->depth / samples);
+    uint16_t compression, photometric;
+
+    /* Tables of more than one tile are stored outside of the IFD, followed by
+     * the colour map of an indexed image
+     */
+    uint64_t offsetTable = tiff->end + tiff->end % 2;
+    uint64_t byteCountTable = offsetTable + tiles * sizeof(uint64_t);
+    uint64_t colourMap = (tiles > 1) ? byteCountTable + tiles * sizeof(uint64_t) : offsetTable;
+    uint64_t position = colourMap + ((tiff->palette) ? 3 * tiff->paletteSize * sizeof(uint16_t) : 0);
+
+    if (tiff->failed)
+        return 1;
+
+    for (size_t i = 0; i < tiles; ++i)
+    {
+        if (!tiff->offsets[i])
+        {
+            logMessage(WARNING, "TIFF image ended with tile %zu unwritten", i);
+            break;
+        }
+    }
+
+    switch (tiff->codec)
+    {
+        case TIFF_CODEC_PACKBITS:
+            compression = COMPRESSION_PACKBITS;
+            break;
+        case TIFF_CODEC_DEFLATE:
+            compression = COMPRESSION_DEFLATE;
+            break;
+        case TIFF_CODEC_NONE:
+        default:
+            compression = COMPRESSION_NONE;
+            break;
+    }
+
+    if (tiff->palette)
+        photometric = PHOTOMETRIC_PALETTE;
+    else if (bits == 1)
+        photometric = PHOTOMETRIC_WHITE_IS_ZERO;
+    else if (samples == 1)
+        photometric = PHOTOMETRIC_BLACK_IS_ZERO;
+    else
+        photometric = PHOTOMETRIC_RGB;
+
+    if (tiles > 1)
+    {
+        table = malloc(2 * tiles * sizeof(uint64_t));
+
+        if (!table)
+        {
+            logMessage(ERROR, "Memory allocation failed");
+            tiff->failed = true;
+            return 1;
+        }
+
+        for (size_t i = 0; i < tiles; ++i)
+        {
+            putUint64(table + i * sizeof(uint64_t), tiff->offsets[i]);
+            putUint64(table + (tiles + i) * sizeof(uint64_t), tiff->byteCounts[i]);
+        }
+
+        if (writeAt(tiff->fd, table, 2 * tiles * sizeof(uint64_t), offsetTable))
+        {
+            logMessage(ERROR, "Could not write TIFF tile tables");
+            free(table);
+            tiff->failed = true;
+            return 1;
+        }
+
+        free(table);
+    }
+
+    if (tiff->palette && writeColourMap(tiff, colourMap))
+    {
+        logMessage(ERROR, "Could not write TIFF colour map");
+        tiff->failed = true;
+        return 1;
+    }
+
+    /* Values of up to eight bytes are held in the entry itself. The three
+     * samples of an RGB pixel are all 8 bits
+     */
+    entry = putEntry(entry, TAG_IMAGE_WIDTH, TYPE_LONG, 1, tiff->width);
+    entry = putEntry(entry, TAG_IMAGE_LENGTH, TYPE_LONG, 1, tiff->height);
+    entry = putEntry(entry, TAG_BITS_PER_SAMPLE, TYPE_SHORT, samples,
+                     (samples == 3) ? bits | (uint64_t) bits << 16 | (uint64_t) bits << 32 : bits);
+    entry = putEntry(entry, TAG_COMPRESSION, TYPE_SHORT, 1, compression);
+    entry = putEntry(entry, TAG_PHOTOMETRIC, TYPE_SHORT, 1, photometric);
+    entry = putEntry(entry, TAG_SAMPLES_PER_PIXEL, TYPE_SHORT, 1, samples);
+    entry = putEntry(entry, TAG_PLANAR_CONFIGURATION, TYPE_SHORT, 1, 1);
+
+    if (tiff->codec == TIFF_CODEC_DEFLATE && tiff->depth >= CHAR_BIT && !tiff->palette)
+        entry = putEntry(entry, TAG_PREDICTOR, TYPE_SHORT, 1, PREDICTOR_HORIZONTAL);
+
+    if (tiff->palette)
+        entry = putEntry(entry, TAG_COLOUR_MAP, TYPE_SHORT, 3 * tiff->paletteSize, colourMap);
+
+    entry = putEntry(entry, TAG_TILE_WIDTH, TYPE_LONG, 1, TIFF_TILE_SIZE);
+    entry = putEntry(entry, TAG_TILE_LENGTH, TYPE_LONG, 1, TIFF_TILE_SIZE);
+    entry = putEntry(entry, TAG_TILE_OFFSETS, TYPE_LONG8, tiles, (tiles > 1) ? offsetTable : tiff->offsets[0]);
+    entry = putEntry(entry, TAG_TILE_BYTE_COUNTS, TYPE_LONG8, tiles, (tiles > 1) ? byteCountTable : tiff->byteCounts[0]);
+
+    /* Entry count, then no next IFD */
+    putUint64(ifd, ((size_t) (entry - ifd) - sizeof(uint64_t)) / IFD_ENTRY_LEN);
+    putUint64(entry, 0);
+    entry += sizeof(uint64_t);
+
+    putUint64(ifdOffset, position);
+
+    if (writeAt(tiff->fd, ifd, (size_t) (entry - ifd), position)
+        || writeAt(tiff->fd, ifdOffset, sizeof(ifdOffset), TIFF_HEADER_LEN))
+    {
+        logMessage(ERROR, "Could not write end of TIFF image");
+        tiff->failed = true;
+        return 1;
+    }
+
+    logMessage(DEBUG, "TIFF image complete");
+
+    return 0;
+}
+
+
+/* Free the writer and its tile buffers */
+void freeTIFFWriter(TIFFWriter *tiff)
+{
+    if (tiff)
+    {
+        if (tiff->threads)
+        {
+            for (unsigned int i = 0; i < tiff->threadCount; ++i)
+            {
+                free(tiff->threads[i].tile);
+                free(tiff->threads[i].packed);
+                freeDeflater(tiff->threads[i].deflater);
+            }
+
+            free(tiff->threads);
+        }
+
+        pthread_mutex_destroy(&(tiff->lock));
+        free(tiff->offsets);
+        free(tiff->byteCounts);
+        free(tiff);
+    }
+}
+
+
+/* Get a tile codec from its name */
+int getTIFFCodec(TIFFCodec *codec, const char *name)
+{
+    if (!strcmp(name, "none"))
+        *codec = TIFF_CODEC_NONE;
+    else if (!strcmp(name, "packbits"))
+        *codec = TIFF_CODEC_PACKBITS;
+    else if (!strcmp(name, "deflate"))
+        *codec = TIFF_CODEC_DEFLATE;
+    else
+        return 1;
+
+    return 0;
+}
+
+
+/* Thread function - write every tile of the current rows whose index, offset
+ * by the thread ID, is a multiple of the thread count
+ */
+static void * writeTiles(void *thread)
+{
+    TIFFTileThread *t = thread;
+    TIFFWriter *tiff = t->tiff;
+
+    size_t first = tiff->firstRow / TIFF_TILE_SIZE * tiff->tilesAcross;
+    size_t end = first + (tiff->rowCount + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE * tiff->tilesAcross;
+
+    for (size_t i = first + t->tid; i < end; i += tiff->active)
+    {
+        copyTile(t, i);
+
+        if (storeTile(t, i))
+            return NULL;
+    }
+
+    t->ret = 0;
+
+    return NULL;
+}
+
+
+/* Copy a tile out of the rows, padding it where it overhangs the image */
+static void copyTile(TIFFTileThread *t, size_t tile)
+{
+    const TIFFWriter *tiff = t->tiff;
+
+    size_t x = (tile % tiff->tilesAcross) * tiff->tileRowSize;
+    size_t y = (tile / tiff->tilesAcross) * TIFF_TILE_SIZE - tiff->firstRow;
+    size_t n = (tiff->rowSize - x < tiff->tileRowSize) ? tiff->rowSize - x : tiff->tileRowSize;
+
+    unsigned char *dest = t->tile;
+
+    for (size_t j = 0; j < TIFF_TILE_SIZE; ++j, dest += tiff->tileRowSize)
+    {
+        if (y + j >= tiff->rowCount)
+        {
+            memset(dest, 0, tiff->tileRowSize);
+            continue;
+        }
+
+        memcpy(dest, tiff->rows + (y + j) * tiff->rowSize + x, n);
+        memset(dest + n, 0, tiff->tileRowSize - n);
+    }
+}
+
+
+/* Replace each sample of the tile with its difference from the sample to its
+ * left
+ */
+static void predictTile(TIFFTileThread *t)
+{
+    size_t rowSize = t->tiff->tileRowSize;
+    size_t bpp = rowSize / TIFF_TILE_SIZE;
+    unsigned char *row = t->tile;
+
+    for (size_t j = 0; j < TIFF_TILE_SIZE; ++j, row += rowSize)
+    {
+        for (size_t i = rowSize - 1; i >= bpp; --i)
+            row[i] = (unsigned char) (row[i] - row[i - bpp]);
+    }
+}
+
+
+/* Encode a tile and write it to the file. Uncompressed tiles have a fixed
+ * place; compressed tiles claim the next free space in the file
+ */
+static int storeTile(TIFFTileThread *t, size_t tile)
+{
+    TIFFWriter *tiff = t->tiff;
+    uint64_t offset;
+    size_t n;
+    int ret;
+
+    switch (tiff->codec)
+    {
+        case TIFF_CODEC_PACKBITS:
+            n = 0;
+
+            for (size_t j = 0; j < TIFF_TILE_SIZE; ++j)
+                n += packBits(t->packed + n, t->tile + j * tiff->tileRowSize, tiff->tileRowSize);
+
+            offset = claimSpace(tiff, n);
+            ret = writeAt(tiff->fd, t->packed, n, offset);
+            break;
+        case TIFF_CODEC_DEFLATE:
+        {
+            unsigned char trailer[sizeof(DEFLATE_FINAL_BLOCK) + sizeof(uint32_t)];
+
+            /* Differences of palette indices are not meaningful */
+            if (tiff->depth >= CHAR_BIT && !tiff->palette)
+                predictTile(t);
+
+            t->deflater->length = 0;
+
+            if (deflateSync(t->deflater, t->tile, tiff->tileBytes))
+                return 1;
+
+            memcpy(trailer, DEFLATE_FINAL_BLOCK, sizeof(DEFLATE_FINAL_BLOCK));
+            putUint32BE(trailer + sizeof(DEFLATE_FINAL_BLOCK), adler32(ADLER32_INIT, t->tile, tiff->tileBytes));
+
+            n = sizeof(ZLIB_HEADER) + t->deflater->length + sizeof(trailer);
+            offset = claimSpace(tiff, n);
+            ret = writeAt(tiff->fd, ZLIB_HEADER, sizeof(ZLIB_HEADER), offset)
+                  || writeAt(tiff->fd, t->deflater->out, t->deflater->length, offset + sizeof(ZLIB_HEADER))
+                  || writeAt(tiff->fd, trailer, sizeof(trailer), offset + n - sizeof(trailer));
+            break;
+        }
+        case TIFF_CODEC_NONE:
+        default:
+            n = tiff->tileBytes;
+            offset = TIFF_HEADER_LEN + sizeof(uint64_t) + (uint64_t) tile * n;
+            ret = writeAt(tiff->fd, t->tile, n, offset);
+            break;
+    }
+
+    if (ret)
+    {
+        logMessage(ERROR, "Could not write TIFF tile %zu", tile);
+        return 1;
+    }
+
+    /* Each tile's entries are only written by the thread that owns it */
+    tiff->offsets[tile] = offset;
+    tiff->byteCounts[tile] = n;
+
+    return 0;
+}
+
+
+/* PackBits-compress a row, returning the compressed size. Repeated bytes are
+ * written as a run; anything else as literals, which end at the next three
+ * repeated bytes
+ */
+static size_t packBits(unsigned char *out, const unsigned char *in, size_t n)
+{
+    size_t length = 0;
+    size_t i = 0;
+
+    while (i < n)
+    {
+        size_t run = 1;
+        size_t start = i;
+
+        while (i + run < n && run < PACKBITS_RUN_MAX && in[i + run] == in[i])
+            ++run;
+
+        if (run > 1)
+        {
+            /* A header of 1 - run, as a signed byte */
+            out[length++] = (unsigned char) (UCHAR_MAX + 2 - run);
+            out[length++] = in[i];
+            i += run;
+            continue;
+        }
+
+        while (i < n && i - start < PACKBITS_RUN_MAX)
+        {
+            if (i + 2 < n && in[i] == in[i + 1] && in[i] == in[i + 2])
+                break;
+
+            ++i;
+        }
+
+        out[length++] = (unsigned char) (i - start - 1);
+        memcpy(out + length, in + start, i - start);
+        length += i - start;
+    }
+
+    return length;
+}
+
+
+/* Claim the next n bytes at the end of the file, keeping tiles word-aligned */
+static uint64_t claimSpace(TIFFWriter *tiff, size_t n)
+{
+    uint64_t offset;
+
+    pthread_mutex_lock(&(tiff->lock));
+
+    offset = tiff->end;
+    tiff->end += n + n % 2;
+
+    pthread_mutex_unlock(&(tiff->lock));
+
+    return offset;
+}
+
+
+/* Write the colour map of an indexed image - the 16-bit red of every index,
+ * then the greens, then the blues
+ */
+static int writeColourMap(const TIFFWriter *tiff, uint64_t offset)
+{
+    size_t n = tiff->paletteSize;
+    unsigned char *map = malloc(3 * n * sizeof(uint16_t));
+    int ret;
+
+    if (!map)
+        return 1;
+
+    /* Scale 8-bit samples so that 0xFF becomes 0xFFFF */
+    for (size_t i = 0; i < n; ++i)
+    {
+        putUint16(map + 2 * i, (uint16_t) (tiff->palette[i].r * 257));
+        putUint16(map + 2 * (n + i), (uint16_t) (tiff->palette[i].g * 257));
+        putUint16(map + 2 * (2 * n + i), (uint16_t) (tiff->palette[i].b * 257));
+    }
+
+    ret = writeAt(tiff->fd, map, 3 * n * sizeof(uint16_t), offset);
+    free(map);
+
+    return ret;
+}
+
+
+/* Write an IFD entry, returning the position of the next */
+static unsigned char * putEntry(unsigned char *entry, uint16_t tag, uint16_t type, uint64_t count, uint64_t value)
+{
+    putUint16(entry, tag);
+    putUint16(entry + 2, type);
+    putUint64(entry + 4, count);
+    memset(entry + 12, 0, sizeof(uint64_t));
+
+    /* Values are left-justified in the entry. Values that do not fit are
+     * given by their offset
+     */
+    if (type == TYPE_SHORT && count == 1)
+        putUint16(entry + 12, (uint16_t) value);
+    else if (type == TYPE_LONG && count == 1)
+        putUint32(entry + 12, (uint32_t) value);
+    else if (type == TYPE_SHORT && count <= sizeof(uint64_t) / sizeof(uint16_t))
+    {
+        for (uint64_t i = 0; i < count; ++i)
+            putUint16(entry + 12 + 2 * i, (uint16_t) (value >> (16 * i)));
+    }
+    else
+        putUint64(entry + 12, value);
+
+    return entry + IFD_ENTRY_LEN;
+}
+
+
+/* Write all of a buffer at an offset of the file, without moving the file
+ * position, so threads can write at once
+ */
+static int writeAt(int fd, const unsigned char *data, size_t n, uint64_t offset)
+{
+    while (n > 0)
+    {
+        ssize_t written = pwrite(fd, data, n, (off_t) offset);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return 1;
+        }
+
+        data += written;
+        n -= (size_t) written;
+        offset += (uint64_t) written;
+    }
+
+    return 0;
+}
+
+
+static void putUint16(unsigned char *dest, uint16_t x)
+{
+    dest[0] = (unsigned char) x;
+    dest[1] = (unsigned char) (x >> 8);
+}
+
+
+static void putUint32(unsigned char *dest, uint32_t x)
+{
+    putUint16(dest, (uint16_t) x);
+    putUint16(dest + 2, (uint16_t) (x >> 16));
+}
+
+
+static void putUint64(unsigned char *dest, uint64_t x)
+{
+    putUint32(dest, (uint32_t) x);
+    putUint32(dest + 4, (uint32_t) (x >> 32));
+}
+
+
+/* zlib checksums are big-endian */
+static void putUint32BE(unsigned char *dest, uint32_t x)
+{
+    dest[0] = (unsigned char) (x >> 24);
+    dest[1] = (unsigned char) (x >> 16);
+    dest[2] = (unsigned char) (x >> 8);
+    dest[3] = (unsigned char) x;
+}
@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+#
+# Round-trip the ColorMap of palette-colour TIFF images through their IFD.
+#
+# A ColorMap holds 3 * 2^BITS SHORT values - far more than fit in an IFD
+# entry - so it has to be written out of line and reached through the entry's
+# offset. The same plot is rendered as an 8-bit indexed PNG and as 8-bit and
+# 16-bit indexed TIFFs, and the colour map and tile indices read back from
+# each TIFF are checked against the PNG's palette and pixels. If tiffinfo is
+# installed, it must also be able to read each TIFF's colour map.
+#
+# Usage: test/tiff_colormap.py [BINARY]     (default ./mandelbrot)
+
+
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import zlib
+
+
+PLOT = ["-r", "300", "-s", "200", "-i", "500"]
+
+TIFF_TYPES = {3: "H", 4: "I", 16: "Q"}
+
+TAG_WIDTH = 256
+TAG_LENGTH = 257
+TAG_BITS_PER_SAMPLE = 258
+TAG_COMPRESSION = 259
+TAG_PHOTOMETRIC = 262
+TAG_COLOUR_MAP = 320
+TAG_TILE_WIDTH = 322
+TAG_TILE_LENGTH = 323
+TAG_TILE_OFFSETS = 324
+TAG_TILE_BYTE_COUNTS = 325
+
+PHOTOMETRIC_PALETTE = 3
+
+
+def fail(message):
+    sys.exit("FAIL: " + message)
+
+
+def render(binary, path, options):
+    command = [binary] + PLOT + options + ["-o", path]
+
+    if subprocess.run(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL).returncode != 0:
+        fail("'%s' failed" % " ".join(command))
+
+
+def read_png(path):
+    """Return the palette and index rows of an 8-bit indexed PNG"""
+    data = open(path, "rb").read()
+    position = 8
+    palette = None
+    compressed = b""
+
+    while position < len(data):
+        length, kind = struct.unpack_from(">I4s", data, position)
+        body = data[position + 8:position + 8 + length]
+
+        if kind == b"IHDR":
+            width, height, depth, colour = struct.unpack_from(">IIBB", body)
+        elif kind == b"PLTE":
+            palette = [tuple(body[i:i + 3]) for i in range(0, length, 3)]
+        elif kind == b"IDAT":
+            compressed += body
+
+        position += length + 12
+
+    if depth != 8 or colour != 3 or palette is None:
+        fail("%s is not an 8-bit indexed PNG" % path)
+
+    raw = zlib.decompress(compressed)
+    rows = []
+
+    for y in range(height):
+        row = raw[y * (width + 1):(y + 1) * (width + 1)]
+
+        # Palette rows are never filtered
+        if row[0] != 0:
+            fail("%s row %d is filtered" % (path, y))
+
+        rows.append(row[1:])
+
+    return palette, rows
+
+
+def read_ifd(data):
+    """Return the tags of a little-endian BigTIFF's first IFD, reading any
+    values too long for their entry through its offset"""
+    if data[:8] != b"II\x2b\x00\x08\x00\x00\x00":
+        fail("not a little-endian BigTIFF")
+
+    ifd = struct.unpack_from("<Q", data, 8)[0]
+    count = struct.unpack_from("<Q", data, ifd)[0]
+    end = ifd + 8 + 20 * count + 8
+    tags = {}
+
+    for k in range(count):
+        entry = ifd + 8 + 20 * k
+        tag, kind, n = struct.unpack_from("<HHQ", data, entry)
+        size = struct.calcsize(TIFF_TYPES[kind]) * n
+        offset = entry + 12
+
+        if size > 8:
+            offset = struct.unpack_from("<Q", data, offset)[0]
+
+            if offset + size > len(data) or (offset < end and offset + size > ifd):
+                fail("tag %d points outside the file or into the IFD" % tag)
+
+        tags[tag] = struct.unpack_from("<%d%s" % (n, TIFF_TYPES[kind]), data, offset)
+
+    return tags
+
+
+def read_tiff(path):
+    """Return the colour map (as RGB triples) and index rows of an indexed
+    TIFF"""
+    data = open(path, "rb").read()
+    tags = read_ifd(data)
+
+    width, height = tags[TAG_WIDTH][0], tags[TAG_LENGTH][0]
+    bits = tags[TAG_BITS_PER_SAMPLE][0]
+    tile_width, tile_length = tags[TAG_TILE_WIDTH][0], tags[TAG_TILE_LENGTH][0]
+    size = bits // 8
+
+    if tags[TAG_PHOTOMETRIC][0] != PHOTOMETRIC_PALETTE:
+        fail("%s is not a palette-colour TIFF" % path)
+
+    colour_map = tags.get(TAG_COLOUR_MAP, ())
+    n = 1 << bits
+
+    if len(colour_map) != 3 * n:
+        fail("%s ColorMap has %d values, not %d" % (path, len(colour_map), 3 * n))
+
+    colours = [(colour_map[i], colour_map[n + i], colour_map[2 * n + i]) for i in range(n)]
+
+    across = (width + tile_width - 1) // tile_width
+    rows = [bytearray(width * size) for y in range(height)]
+
+    for i, (offset, count) in enumerate(zip(tags[TAG_TILE_OFFSETS], tags[TAG_TILE_BYTE_COUNTS])):
+        tile = data[offset:offset + count]
+
+        if tags[TAG_COMPRESSION][0] == 8:
+            tile = zlib.decompress(tile)
+
+        x0, y0 = (i % across) * tile_width, (i // across) * tile_length
+        columns = min(tile_width, width - x0)
+
+        for y in range(y0, min(y0 + tile_length, height)):
+            start = (y - y0) * tile_width * size
+            rows[y][x0 * size:(x0 + columns) * size] = tile[start:start + columns * size]
+
+    return colours, [bytes(row) for row in rows]
+
+
+def check_tiffinfo(path):
+    if not shutil.which("tiffinfo"):
+        return
+
+    result = subprocess.run(["tiffinfo", "-c", path], capture_output=True, text=True)
+
+    if result.returncode != 0 or "Color Map" not in result.stdout:
+        fail("tiffinfo could not read the colour map of %s:\n%s" % (path, result.stderr))
+
+
+def main():
+    binary = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "./mandelbrot")
+
+    with tempfile.TemporaryDirectory() as directory:
+        png = os.path.join(directory, "plot.png")
+        render(binary, png, ["--indexed=8"])
+        palette, indices = read_png(png)
+
+        for codec in ("none", "deflate"):
+            tiff8 = os.path.join(directory, "plot8_%s.tif" % codec)
+            tiff16 = os.path.join(directory, "plot16_%s.tif" % codec)
+
+            render(binary, tiff8, ["--indexed=8", "--tiff=" + codec])
+            render(binary, tiff16, ["--indexed=16", "--tiff=" + codec])
+
+            colours8, rows8 = read_tiff(tiff8)
+            colours16, rows16 = read_tiff(tiff16)
+
+            if colours8 != [tuple(257 * c for c in colour) for colour in palette]:
+                fail("8-bit ColorMap (%s) differs from the PNG palette" % codec)
+
+            if rows8 != indices:
+                fail("8-bit TIFF indices (%s) differ from the PNG" % codec)
+
+            # Both palettes start with the inside colour and the first sample
+            if colours16[:2] != colours8[:2]:
+                fail("16-bit ColorMap (%s) does not start with the 8-bit palette's colours" % codec)
+
+            # Index 0 is the inside of the set in both
+            for row8, row16 in zip(rows8, rows16):
+                inside16 = [index == 0 for index in struct.unpack("<%dH" % (len(row16) // 2), row16)]
+
+                if [index == 0 for index in row8] != inside16:
+                    fail("16-bit TIFF (%s) places the inside of the set differently" % codec)
+
+            check_tiffinfo(tiff8)
+            check_tiffinfo(tiff16)
+
+    print("PASS: TIFF colour maps round-trip")
+
+
+if __name__ == "__main__":
+    main()